@@ -157,6 +157,40 @@ int ct_card_status(ct_handle * h, unsigned int slot, int *status)
 	return 0;
 }
 
+/*
+ * Xid of the last request sent through this handle, for use
+ * with ct_card_abort
+ */
+unsigned int ct_reader_last_xid(ct_handle * h)
+{
+	return h->sock->xid;
+}
+
+/*
+ * Ask the reader to give up on a request in progress. This has to
+ * go through a different handle than the one waiting for the
+ * request. An xid of 0 matches whatever request this process has
+ * in progress on the slot.
+ */
+int ct_card_abort(ct_handle * h, unsigned int slot, unsigned int xid)
+{
+	unsigned char buffer[64];
+	ct_buf_t args, resp;
+	int rc;
+
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_init(&resp, buffer, sizeof(buffer));
+
+	ct_buf_putc(&args, CT_CMD_ABORT);
+	ct_buf_putc(&args, slot);
+
+	if (xid)
+		ct_args_int(&args, CT_TAG_XID, xid);
+
+	rc = ct_socket_call(h->sock, &args, &resp);
+	return rc < 0 ? rc : 0;
+}
+
 /*
  * Reset the card - this is the same as "request icc" without parameters
  */
@@ -327,6 +361,140 @@ int ct_card_write_memory(ct_handle * h, unsigned int slot,
 	return 0;
 }
 
+/*
+ * Stream a range of synchronous card memory in as few calls
+ * as the message size permits.
+ */
+int ct_card_read_memory_stream(ct_handle * h, unsigned int slot,
+			       unsigned short address, void *recv_buf,
+			       size_t recv_len)
+{
+	unsigned char *p = (unsigned char *)recv_buf;
+	unsigned int addr = address;
+	size_t total = 0;
+	int rc;
+
+	if (addr + recv_len > 0x10000)
+		return IFD_ERROR_INVALID_ARG;
+
+	while (total < recv_len) {
+		size_t count = recv_len - total;
+
+		if (count > CT_MEMORY_CHUNK)
+			count = CT_MEMORY_CHUNK;
+
+		rc = ct_card_read_memory(h, slot, addr, p + total, count);
+		if (rc < 0)
+			return rc;
+		if (rc == 0)
+			break;
+
+		addr += rc;
+		total += rc;
+	}
+
+	return total;
+}
+
+/*
+ * Write a range of synchronous card memory. Each message covers
+ * as many whole pages as fit, so the reader can write it without
+ * splitting writes across page boundaries.
+ */
+int ct_card_write_memory_stream(ct_handle * h, unsigned int slot,
+				unsigned short address,
+				const void *send_buf, size_t send_len,
+				int verify)
+{
+	const unsigned char *p = (const unsigned char *)send_buf;
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
+	unsigned int addr = address, crc;
+	size_t total = 0;
+	ct_buf_t args, resp;
+	int rc;
+
+	if (addr + send_len > 0x10000)
+		return IFD_ERROR_INVALID_ARG;
+	if (verify != IFD_MEMORY_VERIFY_PAGE
+	    && verify != IFD_MEMORY_VERIFY_NONE
+	    && verify != IFD_MEMORY_VERIFY_CHECKSUM)
+		return IFD_ERROR_INVALID_ARG;
+
+	while (total < send_len) {
+		size_t count;
+
+		/* Stop at a page boundary */
+		count = CT_MEMORY_CHUNK - (addr & 255);
+		if (count > send_len - total)
+			count = send_len - total;
+
+		ct_buf_init(&args, buffer, sizeof(buffer));
+		ct_buf_init(&resp, buffer, sizeof(buffer));
+
+		ct_buf_putc(&args, CT_CMD_MEMORY_WRITE);
+		ct_buf_putc(&args, slot);
+
+		ct_args_int(&args, CT_TAG_ADDRESS, addr);
+		ct_args_int(&args, CT_TAG_VERIFY,
+			    verify == IFD_MEMORY_VERIFY_PAGE ?
+			    IFD_MEMORY_VERIFY_PAGE : IFD_MEMORY_VERIFY_NONE);
+		ct_args_opaque(&args, CT_TAG_DATA, p + total, count);
+
+		rc = ct_socket_call(h->sock, &args, &resp);
+		if (rc < 0)
+			return rc;
+
+		addr += count;
+		total += count;
+	}
+
+	if (verify == IFD_MEMORY_VERIFY_CHECKSUM) {
+		rc = ct_card_memory_checksum(h, slot, address, send_len, &crc);
+		if (rc < 0)
+			return rc;
+		if (crc != ct_crc16_update(CT_CRC16_INIT, send_buf, send_len))
+			return IFD_ERROR_COMM_ERROR;
+	}
+
+	return total;
+}
+
+/*
+ * Have the reader compute a CRC over a range of synchronous
+ * card memory, so that a write can be verified without
+ * reading the data back.
+ */
+int ct_card_memory_checksum(ct_handle * h, unsigned int slot,
+			    unsigned short address, size_t len,
+			    unsigned int *crc)
+{
+	ct_tlv_parser_t tlv;
+	unsigned char buffer[256];
+	ct_buf_t args, resp;
+	int rc;
+
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_init(&resp, buffer, sizeof(buffer));
+
+	ct_buf_putc(&args, CT_CMD_MEMORY_CHECKSUM);
+	ct_buf_putc(&args, slot);
+
+	ct_args_int(&args, CT_TAG_ADDRESS, address);
+	ct_args_int(&args, CT_TAG_COUNT, len);
+
+	rc = ct_socket_call(h->sock, &args, &resp);
+	if (rc < 0)
+		return rc;
+
+	if ((rc = ct_tlv_parse(&tlv, &resp)) < 0)
+		return rc;
+
+	if (ct_tlv_get_int(&tlv, CT_TAG_CHECKSUM, crc) == 0)
+		return IFD_ERROR_GENERIC;
+
+	return 0;
+}
+
 /*
  * Verify PIN
  */
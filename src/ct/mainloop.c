@@ -100,8 +100,16 @@ void ct_mainloop(void)
 				continue;
 			}
 
+			/* Closed while we were busy with another socket */
+			if (sock->fd < 0) {
+				ct_socket_free(sock);
+				continue;
+			}
+
+			/* No error handler means the socket is done for,
+			 * e.g. when the peer reset the connection */
 			if (pfd[n].revents & POLLERR) {
-				if (sock->error(sock) < 0) {
+				if (!sock->error || sock->error(sock) < 0) {
 					ct_socket_free(sock);
 					continue;
 				}
@@ -122,6 +130,24 @@ void ct_mainloop(void)
 	}
 }
 
+/*
+ * Call func for every socket, until it returns non-zero. This lets
+ * a server look at its other connections while it is busy with
+ * a request.
+ */
+int ct_mainloop_foreach(int (*func) (ct_socket_t *, void *), void *user_data)
+{
+	ct_socket_t *sock, *next;
+	int rc;
+
+	for (sock = sock_head.next; sock; sock = next) {
+		next = sock->next;
+		if ((rc = func(sock, user_data)) != 0)
+			return rc;
+	}
+	return 0;
+}
+
 void ct_mainloop_leave(void)
 {
 	leave_mainloop = 1;
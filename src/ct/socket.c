@@ -9,10 +9,12 @@
 #endif
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -23,6 +25,9 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <limits.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include <openct/logging.h>
 #include <openct/socket.h>
@@ -37,6 +42,34 @@ static inline unsigned int min(unsigned int a, unsigned int b)
 	return (a < b) ? a : b;
 }
 
+/*
+ * Freed sockets are kept for reuse, so that clients coming and
+ * going don't keep the allocator busy
+ */
+#define CT_SOCKET_POOL	8
+static ct_socket_t *sock_pool[CT_SOCKET_POOL];
+static unsigned int sock_pool_len = 0;
+
+/* Clients such as the PC/SC driver use sockets from several
+ * threads */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t sock_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void sock_pool_lock(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&sock_pool_mutex);
+#endif
+}
+
+static void sock_pool_unlock(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&sock_pool_mutex);
+#endif
+}
+
 static int ct_socket_default_recv_cb(ct_socket_t *);
 static int ct_socket_default_send_cb(ct_socket_t *);
 static int ct_socket_getcreds(ct_socket_t *);
@@ -46,12 +79,27 @@ static int ct_socket_getcreds(ct_socket_t *);
  */
 ct_socket_t *ct_socket_new(unsigned int bufsize)
 {
-	ct_socket_t *sock;
+	ct_socket_t *sock = NULL;
 	unsigned char *p;
+	unsigned int n;
 
-	sock = (ct_socket_t *) calloc(1, sizeof(*sock) + 2 * bufsize);
-	if (sock == NULL)
-		return NULL;
+	sock_pool_lock();
+	for (n = 0; n < sock_pool_len; n++) {
+		if (sock_pool[n]->rbuf.size == bufsize) {
+			sock = sock_pool[n];
+			sock_pool[n] = sock_pool[--sock_pool_len];
+			break;
+		}
+	}
+	sock_pool_unlock();
+	if (sock != NULL)
+		memset(sock, 0, sizeof(*sock));
+
+	if (sock == NULL) {
+		sock = (ct_socket_t *) calloc(1, sizeof(*sock) + 2 * bufsize);
+		if (sock == NULL)
+			return NULL;
+	}
 
 	/* Initialize socket buffer */
 	p = (unsigned char *)(sock + 1);
@@ -73,6 +121,12 @@ void ct_socket_free(ct_socket_t * sock)
 	if (sock->close)
 		sock->close(sock);
 	ct_socket_close(sock);
+	sock_pool_lock();
+	if (sock_pool_len < CT_SOCKET_POOL) {
+		sock_pool[sock_pool_len++] = sock;
+		sock = NULL;
+	}
+	sock_pool_unlock();
 	free(sock);
 }
 
@@ -81,6 +135,18 @@ void ct_socket_reuseaddr(int n)
 	ifd_reuse_addr = n;
 }
 
+/*
+ * Our packets are small and the peer usually waits for them;
+ * don't let Nagle hold them back. We coalesce in the send
+ * buffer ourselves.
+ */
+static void ct_socket_nodelay(int fd)
+{
+	int val = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
 /*
  * Make the socket.
  * This code tries to deal with IPv4/IPv6 and AF_UNIX sockets
@@ -130,6 +196,8 @@ static int __ct_socket_make(ct_socket_t * sock, int op,
 		break;
 	case CT_MAKESOCK_CONNECT:
 		if (connect(fd, sa, salen) >= 0) {
+			if (sa->sa_family != AF_UNIX)
+				ct_socket_nodelay(fd);
 			sock->fd = fd;
 			return fd;
 		}
@@ -275,6 +343,8 @@ ct_socket_t *ct_socket_accept(ct_socket_t * sock)
 	}
 
 	svc->use_network_byte_order = sock->use_network_byte_order;
+	if (svc->use_network_byte_order)
+		ct_socket_nodelay(fd);
 	svc->events = POLLIN;
 	svc->fd = fd;
 
@@ -302,6 +372,7 @@ static int ct_socket_getcreds(ct_socket_t * sock)
 	if (getsockopt(sock->fd, SOL_SOCKET, SO_PEERCRED, &creds, &len) < 0)
 		return -1;
 	sock->client_uid = creds.uid;
+	sock->client_id = creds.pid;
 #endif
 	return 0;
 }
@@ -362,6 +433,7 @@ int ct_socket_call(ct_socket_t * sock, ct_buf_t * args, ct_buf_t * resp)
 
 	if ((xid = ifd_xid++) == 0)
 		xid = ifd_xid++;
+	sock->xid = xid;
 
 	/* Build header - note there's no need to convert
 	 * integers to network byte order: everything happens
@@ -407,16 +479,20 @@ int ct_socket_call(ct_socket_t * sock, ct_buf_t * args, ct_buf_t * resp)
 }
 
 /*
- * Put packet into send buffer
+ * Put packet into send buffer. The payload may come in
+ * two pieces, e.g. a channel number and the data that
+ * goes with it.
  */
-int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
+static int ct_socket_queue_packet(ct_socket_t * sock, header_t * hdr,
+				  const void *prefix, size_t plen,
+				  ct_buf_t * data)
 {
 	header_t hcopy;
 	ct_buf_t *bp = &sock->sbuf;
 	size_t count;
 	int rc;
 
-	count = sizeof(*hdr) + (data ? ct_buf_avail(data) : 0);
+	count = sizeof(*hdr) + plen + (data ? ct_buf_avail(data) : 0);
 	if (ct_buf_tailroom(bp) < count) {
 		if ((rc = ct_socket_flsbuf(sock, 1)) < 0)
 			return rc;
@@ -427,7 +503,7 @@ int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
 		}
 	}
 
-	hdr->count = data ? ct_buf_avail(data) : 0;
+	hdr->count = count - sizeof(*hdr);
 
 	hcopy = *hdr;
 	if (sock->use_network_byte_order) {
@@ -436,9 +512,103 @@ int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
 	}
 	ct_buf_put(bp, &hcopy, sizeof(hcopy));
 
-	if (hdr->count)
-		ct_buf_put(bp, ct_buf_head(data), hdr->count);
+	if (plen)
+		ct_buf_put(bp, prefix, plen);
+	if (data && ct_buf_avail(data))
+		ct_buf_put(bp, ct_buf_head(data), ct_buf_avail(data));
+
+	sock->events = POLLOUT;
+	return 0;
+}
+
+int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
+{
+	return ct_socket_queue_packet(sock, hdr, NULL, 0, data);
+}
 
+/*
+ * Pass on a packet we received on another socket. Unless
+ * there's output pending, the payload goes out with a single
+ * non-blocking sendmsg() straight from where it is (usually
+ * the other socket's receive buffer), and only the header is
+ * rewritten. Whatever the socket doesn't take right away is
+ * queued as usual.
+ *
+ * Returns 1 if the packet went out right away, 0 if (some of)
+ * it was queued.
+ */
+int ct_socket_forward_packet(ct_socket_t * sock, header_t * hdr,
+			     const void *prefix, size_t plen,
+			     ct_buf_t * data)
+{
+	struct sigaction act, oact;
+	struct iovec iov[3];
+	struct msghdr msg;
+	header_t hcopy;
+	ct_buf_t *bp = &sock->sbuf;
+	size_t count;
+	unsigned int n, niov = 0;
+	int rc;
+
+	count = sizeof(*hdr) + plen + (data ? ct_buf_avail(data) : 0);
+	if (ct_buf_avail(bp) || count > ct_buf_size(bp))
+		return ct_socket_queue_packet(sock, hdr, prefix, plen, data);
+
+	hdr->count = count - sizeof(*hdr);
+
+	hcopy = *hdr;
+	if (sock->use_network_byte_order) {
+		hcopy.error = ntohs(hcopy.error);
+		hcopy.count = ntohs(hcopy.count);
+	}
+	iov[niov].iov_base = &hcopy;
+	iov[niov++].iov_len = sizeof(hcopy);
+	if (plen) {
+		iov[niov].iov_base = (void *)prefix;
+		iov[niov++].iov_len = plen;
+	}
+	if (data && ct_buf_avail(data)) {
+		iov[niov].iov_base = ct_buf_head(data);
+		iov[niov++].iov_len = ct_buf_avail(data);
+	}
+
+	/* Ignore SIGPIPE while writing to socket */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &act, &oact);
+
+	/* The socket may well be blocking; we must not be */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	do {
+		rc = sendmsg(sock->fd, &msg, MSG_DONTWAIT);
+	} while (rc < 0 && errno == EINTR);
+
+	/* Restore old signal handler */
+	sigaction(SIGPIPE, &oact, NULL);
+
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		rc = 0;
+	if (rc < 0) {
+		if (errno != EPIPE)
+			ct_error("socket send error: %m");
+		return IFD_ERROR_NOT_CONNECTED;
+	}
+	if ((size_t) rc == count)
+		return 1;
+
+	/* Short or no write; queue the rest */
+	ct_buf_clear(bp);
+	for (n = 0; n < niov; n++) {
+		if ((size_t) rc >= iov[n].iov_len) {
+			rc -= iov[n].iov_len;
+			continue;
+		}
+		ct_buf_put(bp, (caddr_t) iov[n].iov_base + rc,
+			   iov[n].iov_len - rc);
+		rc = 0;
+	}
 	sock->events = POLLOUT;
 	return 0;
 }
@@ -646,6 +816,7 @@ static int ct_socket_default_recv_cb(ct_socket_t * sock)
 			/* Do not return an error to a reply */
 			if (header.dest)
 				continue;
+			header.error = rc;
 			ct_buf_clear(&resp);
 		}
 
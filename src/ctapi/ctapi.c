@@ -9,6 +9,9 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <openct/openct.h>
 #include <openct/ifd.h>
 #include <openct/buffer.h>
@@ -41,6 +44,20 @@ static int ctapi_error(ct_buf_t * bp, unsigned int sw)
 
 struct CardTerminal;
 
+/*
+ * The terminals opened on a port share its reader lock. It is
+ * held by the connection of the terminal that opened the port
+ * first, which stays open until the last terminal on the port
+ * is closed, even if its own terminal is closed before.
+ */
+struct CardTerminalPort {
+	unsigned short pn;
+	unsigned int refs;
+	ct_handle *h;
+	ct_lock_handle lock;
+	struct CardTerminalPort *next;
+};
+
 struct CardTerminalFile {
 	unsigned int id;
 	int (*gen) (struct CardTerminal * ct, ct_buf_t * buf, off_t start,
@@ -48,11 +65,12 @@ struct CardTerminalFile {
 	struct CardTerminalFile *dir[20];
 };
 
-static struct CardTerminal {
+struct CardTerminal {
 	unsigned short ctn;
+	unsigned short pn;
 	ct_handle *h;
 	unsigned int slots;
-	ct_lock_handle lock;
+	struct CardTerminalPort *port;
 	unsigned char sync;
 	struct CardTerminalFile mf;
 	struct CardTerminalFile ctcf;
@@ -62,7 +80,171 @@ static struct CardTerminal {
 	struct CardTerminalFile hoststatus;
 	struct CardTerminalFile *cwd;
 	struct CardTerminal *next;
-} *cardTerminals;
+	unsigned int refs;
+	int closed;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
+};
+
+/*
+ * Terminals are hashed by ctn. The table mutex covers the hash
+ * chains, the port list and reference counts, as well as
+ * connecting to and disconnecting from ifdhandler, which isn't
+ * thread safe in libopenct. Each terminal's own mutex serializes
+ * the commands sent to it, so CT_data on different terminals
+ * runs in parallel.
+ */
+#define CTAPI_HASH_SIZE		64
+
+static struct CardTerminal *cardTerminals[CTAPI_HASH_SIZE];
+static struct CardTerminalPort *cardTerminalPorts;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cardTerminals_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void ctapi_lock_table(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&cardTerminals_mutex);
+#endif
+}
+
+static void ctapi_unlock_table(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&cardTerminals_mutex);
+#endif
+}
+
+/*
+ * Find a terminal; call with the table locked
+ */
+static struct CardTerminal *ctapi_find(unsigned short ctn)
+{
+	struct CardTerminal *ct;
+
+	for (ct = cardTerminals[ctn % CTAPI_HASH_SIZE]; ct; ct = ct->next) {
+		if (ct->ctn == ctn)
+			return ct;
+	}
+	return NULL;
+}
+
+/*
+ * Find the port a terminal is to be opened on, and take
+ * its reader lock if it's the first; call with the table
+ * locked
+ */
+static struct CardTerminalPort *ctapi_port_get(unsigned short pn,
+					       ct_handle * h)
+{
+	struct CardTerminalPort *port;
+
+	for (port = cardTerminalPorts; port; port = port->next) {
+		if (port->pn == pn) {
+			port->refs++;
+			return port;
+		}
+	}
+
+	port = (struct CardTerminalPort *)calloc(1, sizeof(*port));
+	if (port == NULL)
+		return NULL;
+	if (ct_card_lock(h, 0, IFD_LOCK_EXCLUSIVE, &port->lock) < 0) {
+		free(port);
+		return NULL;
+	}
+	port->pn = pn;
+	port->refs = 1;
+	port->h = h;
+	port->next = cardTerminalPorts;
+	cardTerminalPorts = port;
+	return port;
+}
+
+/*
+ * Let go of a port; the last terminal on it releases
+ * the reader lock. Call with the table locked.
+ */
+static void ctapi_port_put(struct CardTerminalPort *port)
+{
+	struct CardTerminalPort **link;
+
+	if (--port->refs)
+		return;
+	for (link = &cardTerminalPorts; *link; link = &(*link)->next) {
+		if (*link == port) {
+			*link = port->next;
+			break;
+		}
+	}
+	ct_card_unlock(port->h, 0, port->lock);
+	ct_reader_disconnect(port->h);
+	free(port);
+}
+
+static void ctapi_free(struct CardTerminal *ct)
+{
+	/* The port's connection goes when the port does */
+	if (ct->h != ct->port->h)
+		ct_reader_disconnect(ct->h);
+	ctapi_port_put(ct->port);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&ct->mutex);
+#endif
+	free(ct);
+}
+
+/*
+ * Take a terminal out of the table, and free it unless
+ * someone is still using it, in which case the last
+ * user does. Call with the table locked.
+ */
+static void ctapi_unlink(struct CardTerminal *ct)
+{
+	struct CardTerminal **link;
+
+	for (link = &cardTerminals[ct->ctn % CTAPI_HASH_SIZE]; *link;
+	     link = &(*link)->next) {
+		if (*link == ct) {
+			*link = ct->next;
+			break;
+		}
+	}
+	ct->closed = 1;
+	if (ct->refs == 0)
+		ctapi_free(ct);
+}
+
+/*
+ * Look up a terminal and lock it for a command
+ */
+static struct CardTerminal *ctapi_get(unsigned short ctn)
+{
+	struct CardTerminal *ct;
+
+	ctapi_lock_table();
+	if ((ct = ctapi_find(ctn)) != NULL)
+		ct->refs++;
+	ctapi_unlock_table();
+#ifdef HAVE_PTHREAD
+	if (ct)
+		pthread_mutex_lock(&ct->mutex);
+#endif
+	return ct;
+}
+
+static void ctapi_put(struct CardTerminal *ct)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ct->mutex);
+#endif
+	ctapi_lock_table();
+	if (--ct->refs == 0 && ct->closed)
+		ctapi_free(ct);
+	ctapi_unlock_table();
+}
 
 static int put(ct_buf_t * buf, off_t * start, size_t * length, size_t * size,
 	       const unsigned char *data, size_t data_len)
@@ -203,19 +385,14 @@ static int ctapi_reset(struct CardTerminal *ct, char p1, char p2,
 	unsigned char atr[64];
 	int rc;
 
-	switch (p1) {
-	case CTBCS_UNIT_INTERFACE1:
-	case CTBCS_UNIT_INTERFACE2:
-		rc = ct_card_reset(ct->h, p1 - CTBCS_UNIT_INTERFACE1,
-				   atr, sizeof(atr));
-		break;
-
-	case CTBCS_UNIT_CT:
+	if (p1 == CTBCS_UNIT_CT) {
 		/* Reset is already performed during CT_init() */
 		rc = 0;
-		break;
-
-	default:
+	} else if (p1 >= CTBCS_UNIT_INTERFACE1
+		   && p1 < CTBCS_UNIT_INTERFACE1 + ct->slots) {
+		rc = ct_card_reset(ct->h, p1 - CTBCS_UNIT_INTERFACE1,
+				   atr, sizeof(atr));
+	} else {
 		/* Unknown unit */
 		return ctapi_error(rbuf, CTBCS_SW_BAD_PARAMS);
 	}
@@ -306,7 +483,7 @@ static int ctapi_set_interface_parameter(struct CardTerminal *ct, char p1,
 	unsigned char proto = 0xff;
 	unsigned int slot;
 
-	if ((p1 == 0x00) || (p1 > 2))
+	if ((p1 == 0x00) || (p1 > ct->slots))
 		return ctapi_error(rbuf, CTBCS_SW_BAD_PARAMS);
 	slot = p1 - 1;
 	if (p2 != 0x00)
@@ -366,15 +543,15 @@ static int ctapi_set_interface_parameter(struct CardTerminal *ct, char p1,
 	return ctapi_error(rbuf, CTBCS_SW_BAD_LENGTH);
 }
 
-static int ctapi_status(ct_handle * h, ct_buf_t * rbuf)
+static int ctapi_status(struct CardTerminal *ct, ct_buf_t * rbuf)
 {
 	unsigned int n;
 
-	for (n = 0; n < 2; n++) {
+	for (n = 0; n < ct->slots; n++) {
 		unsigned char c;
 		int status;
 
-		if (ct_card_status(h, n, &status) < 0)
+		if (ct_card_status(ct->h, n, &status) < 0)
 			break;
 
 		c = (status & IFD_CARD_PRESENT)
@@ -444,7 +621,7 @@ static int ctapi_control(struct CardTerminal *ct, const unsigned char *cmd,
 		rc = ctapi_request_icc(ct, cmd[2], cmd[3], &sbuf, &rbuf);
 		break;
 	case (CTBCS_CLA << 8) | CTBCS_INS_STATUS:
-		rc = ctapi_status(ct->h, &rbuf);
+		rc = ctapi_status(ct, &rbuf);
 		break;
 	case (0x00 << 8) | 0xb0:
 		rc = CardTerminalFile_read(ct, &rbuf, (cmd[2] << 8) | cmd[3],
@@ -536,7 +713,8 @@ static int ctapi_transact(struct CardTerminal *ct, int nslot,
 			return ctapi_error(&rbuf, CTBCS_SW_BAD_LENGTH);
 		return ct_buf_avail(&rbuf);
 	} else
-		return ct_card_transact(ct->h, 0, cmd, cmd_len, rsp, rsp_len);
+		return ct_card_transact(ct->h, nslot, cmd, cmd_len, rsp,
+					rsp_len);
 }
 
 /*
@@ -545,24 +723,40 @@ static int ctapi_transact(struct CardTerminal *ct, int nslot,
 char CT_init(unsigned short ctn, unsigned short pn)
 {
 	struct CardTerminal *ct;
-	ct_handle *h;
 	ct_info_t info;
 	int i;
 
 	ct = (struct CardTerminal *)malloc(sizeof(struct CardTerminal));
 	if (ct == NULL)
 		return ERR_MEMORY;
-	if (!(h = ct_reader_connect(pn))) {
+	memset(ct, 0, sizeof(struct CardTerminal));
+
+	ctapi_lock_table();
+	if (ctapi_find(ctn) != NULL) {
+		ctapi_unlock_table();
 		free(ct);
 		return ERR_INVALID;
 	}
-	memset(ct, 0, sizeof(struct CardTerminal));
+	if (ct_reader_info(pn, &info) < 0 || !(ct->h = ct_reader_connect(pn))) {
+		ctapi_unlock_table();
+		free(ct);
+		return ERR_INVALID;
+	}
+
+	/* The first terminal on a port takes the reader lock for
+	 * all of them; this lets a caller open one terminal per
+	 * slot and drive them in parallel. */
+	if (!(ct->port = ctapi_port_get(pn, ct->h))) {
+		ct_reader_disconnect(ct->h);
+		ctapi_unlock_table();
+		free(ct);
+		return ERR_HTSI;
+	}
+
 	ct->ctn = ctn;
-	ct->h = h;
-	ct->next = cardTerminals;
-	cardTerminals = ct;
+	ct->pn = pn;
+	ct->slots = info.ct_slots;
 	ct->cwd = &ct->mf;
-	ct_reader_info(pn, &info);
 	ct->mf.id = 0x3f00;
 	ct->mf.gen = dir;
 	ct->mf.dir[0] = &ct->mf;
@@ -588,48 +782,35 @@ char CT_init(unsigned short ctn, unsigned short pn)
 	ct->hoststatus.id = 0xff11;
 	ct->hoststatus.gen = hoststatus;
 	ct->hoststatus.dir[0] = &ct->hoststatus;
-	if (ct_card_lock(h, 0, IFD_LOCK_EXCLUSIVE, &ct->lock) < 0) {
-		CT_close(ctn);
-		return ERR_HTSI;
-	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&ct->mutex, NULL);
+#endif
+	ct->next = cardTerminals[ctn % CTAPI_HASH_SIZE];
+	cardTerminals[ctn % CTAPI_HASH_SIZE] = ct;
+	ctapi_unlock_table();
 	return OK;
 }
 
 char CT_close(unsigned short ctn)
 {
-    struct CardTerminal *curr = cardTerminals,
-                        *prev = NULL;
-
-    while (curr)
-    {
-        if (curr->ctn == ctn)
-        {
-            if (prev)
-                prev->next = curr->next;
-            else
-                cardTerminals = curr->next;
-
-            free(curr);
-        }
-        else
-        {
-            prev = curr;
-            curr = curr->next;
-        }
-    }
-
-    return OK;
+	struct CardTerminal *ct;
+
+	ctapi_lock_table();
+	if ((ct = ctapi_find(ctn)) != NULL)
+		ctapi_unlink(ct);
+	ctapi_unlock_table();
+	return OK;
 }
 
 char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	     unsigned short lc, unsigned char *cmd, unsigned short *lr,
 	     unsigned char *rsp)
 {
-	struct CardTerminal **ct;
+	struct CardTerminal *ct;
 	int rc;
 
-	for (ct = &cardTerminals; *ct && (*ct)->ctn != ctn; ct = &(*ct)->next) ;
-	if ((*ct) == (struct CardTerminal *)0 || !sad || !dad)
+	if (!sad || !dad || (ct = ctapi_get(ctn)) == NULL)
 		return ERR_INVALID;
 
 #if 0
@@ -639,22 +820,28 @@ char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 
 	switch (*dad) {
 	case CTAPI_DAD_ICC1:
-		rc = ctapi_transact(*ct, 0, cmd, lc, rsp, *lr);
-		break;
-	case CTAPI_DAD_ICC2:
-		rc = ctapi_transact(*ct, 1, cmd, lc, rsp, *lr);
+		rc = ctapi_transact(ct, 0, cmd, lc, rsp, *lr);
 		break;
 	case CTAPI_DAD_CT:
-		rc = ctapi_control(*ct, cmd, lc, rsp, *lr);
+		rc = ctapi_control(ct, cmd, lc, rsp, *lr);
 		break;
 	case CTAPI_DAD_HOST:
 		ct_error("CT-API: host talking to itself - "
 			 "needs professional help?");
-		return ERR_INVALID;
+		rc = ERR_INVALID;
+		break;
 	default:
+		/* ICC2 and up are numbered consecutively */
+		if (*dad >= CTAPI_DAD_ICC2
+		    && *dad - CTAPI_DAD_ICC2 + 1 < ct->slots) {
+			rc = ctapi_transact(ct, *dad - CTAPI_DAD_ICC2 + 1,
+					    cmd, lc, rsp, *lr);
+			break;
+		}
 		ct_error("CT-API: unknown DAD %u", *dad);
-		return ERR_INVALID;
+		rc = ERR_INVALID;
 	}
+	ctapi_put(ct);
 
 	/* Somewhat simplistic error translation */
 	if (rc < 0)
@@ -16,7 +16,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
 
 #define CCID_ERR_ABORTED	0xFF	/* CMD ABORTED */
 #define CCID_ERR_ICC_MUTE	0xFE
@@ -66,6 +69,15 @@
 #define CCID_RESP_ESCAPE	0x83
 #define CCID_RESP_DR_FREQ	0x84
 
+#define CCID_NOTIFY_SLOT_CHANGE	0x50	/* on the interrupt pipe */
+#define CCID_HARDWARE_ERROR	0x51
+
+#define CCID_HWERR_OVERCURRENT	0x01
+
+/* largest interrupt pipe message we accept: bMessageType plus
+ * two bits for each of up to 252 slots */
+#define CCID_INTR_MAX_LEN	64
+
 /* maximum sensical size:
  *  10 bytes ccid header + 4 bytes command header +
  *  1 byte Lc + 255 bytes data + 1 byte Le = 271
@@ -73,6 +85,22 @@
  */
 #define CCID_MAX_MSG_LEN	(271+256)
 
+/* Readers exchanging extended APDUs may take messages of up to
+ * 10 bytes ccid header + 65544 bytes data; we don't go beyond that
+ * whatever dwMaxCCIDMessageLength says */
+#define CCID_MAX_MSG_LIMIT	(10+65544)
+
+/* wLevelParameter of PC_to_RDR_XfrBlock and bChainParameter of
+ * RDR_to_PC_DataBlock, for extended APDU level exchange */
+#define CCID_CHAIN_SINGLE	0x00	/* begins and ends in this block */
+#define CCID_CHAIN_BEGIN	0x01	/* begins, continues in the next */
+#define CCID_CHAIN_END		0x02	/* continues and ends here */
+#define CCID_CHAIN_MIDDLE	0x03	/* continues, and goes on after */
+#define CCID_CHAIN_MORE		0x10	/* empty, next block expected */
+
+#define CCID_RECV_TIMEOUT	10000	/* ms */
+#define CCID_ABORT_POLL		200	/* ms between looks for an abort */
+
 static int msg_expected[] = {
 	0,
 	CCID_RESP_PARAMS,
@@ -139,6 +167,7 @@ static struct force_parse_device_st {
 #define FLAG_NO_SETPARAM	2
 #define FLAG_AUTO_ACTIVATE	4
 #define FLAG_AUTO_ATRPARSE	8
+#define FLAG_EXT_APDU		16
 
 #define USB_CCID_DESCRIPTOR_LENGTH 54
 struct usb_ccid_descriptor {
@@ -204,25 +233,51 @@ static int ccid_parse_descriptor(struct usb_ccid_descriptor *ret,
 	return 0;
 }
 
+/*
+ * A command sent to the reader whose response we are waiting for.
+ * There can be one per slot.
+ */
+typedef struct ccid_pending {
+	int busy;
+	int done;
+	unsigned char seq;
+	unsigned char *res;
+	size_t res_len;
+	int result;		/* response length, or IFD_ERROR_* */
+} ccid_pending_t;
+
 /*
  * CT status
  */
 typedef struct ccid_status {
 	int reader_type;
 	int usb_interface;
+	int lockfd;		/* advisory lock shared with pcscd, or -1 */
 	int proto_support;
 	int voltage_support;
 	int ifsd;
 	int maxmsg;
 	int flags;
 	unsigned char icc_present[OPENCT_MAX_SLOTS];
+	unsigned char icc_changed[OPENCT_MAX_SLOTS];
+	unsigned char icc_probe[OPENCT_MAX_SLOTS];
 	unsigned char icc_proto[OPENCT_MAX_SLOTS];
 	unsigned char *sbuf[OPENCT_MAX_SLOTS];
 	size_t slen[OPENCT_MAX_SLOTS];
+	size_t ssize[OPENCT_MAX_SLOTS];	/* allocated size of sbuf */
 	unsigned char seq;
+	ccid_pending_t pending[OPENCT_MAX_SLOTS];
+	int outstanding;
+	int max_busy;
+	unsigned char *rbuf;	/* bulk-in, maxmsg bytes */
+	ifd_usb_urb_t *rx_urb;	/* reading into rbuf */
+	int rx_pending;
+	int aborting;
+	unsigned char *cbuf[OPENCT_MAX_SLOTS];	/* command being built */
+	unsigned char *xbuf[OPENCT_MAX_SLOTS];	/* response to it */
 	int support_events;
-	int events_active;
-	ifd_usb_capture_t *event_cap;
+	ifd_usb_urb_t *intr_urb;
+	unsigned char intr_buf[CCID_INTR_MAX_LEN];
 } ccid_status_t;
 
 static int ccid_checkresponse(void *status, int r)
@@ -342,17 +397,210 @@ static int ccid_extract_data(const void *in, size_t inlen, void *out,
 	return len;
 }
 
-static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
-			size_t cmd_len, unsigned char *res, size_t res_len)
+/*
+ * Message buffers are sized after the reader's dwMaxCCIDMessageLength
+ */
+static int ccid_alloc_buffers(ccid_status_t * st)
 {
+	st->rbuf = (unsigned char *)malloc(st->maxmsg + 1);
+	if (!st->rbuf) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+	return 0;
+}
+
+/*
+ * Free the message buffers, including those of the slots
+ */
+static void ccid_free_buffers(ccid_status_t * st)
+{
+	int i;
+
+	free(st->rbuf);
+	st->rbuf = NULL;
+	for (i = 0; i < OPENCT_MAX_SLOTS; i++) {
+		free(st->sbuf[i]);
+		st->sbuf[i] = NULL;
+		st->ssize[i] = st->slen[i] = 0;
+		free(st->cbuf[i]);
+		free(st->xbuf[i]);
+		st->cbuf[i] = st->xbuf[i] = NULL;
+	}
+}
+
+/*
+ * Commands for different slots may be in progress at the same
+ * time, so each slot builds its commands and receives the
+ * responses in buffers of its own. They are allocated when the
+ * slot is first used.
+ */
+static int ccid_slot_buffers(ccid_status_t * st, int slot)
+{
+	if (slot < 0 || slot >= OPENCT_MAX_SLOTS)
+		return IFD_ERROR_INVALID_SLOT;
+	if (st->cbuf[slot])
+		return 0;
+
+	st->cbuf[slot] = (unsigned char *)malloc(st->maxmsg + 1);
+	st->xbuf[slot] = (unsigned char *)malloc(st->maxmsg + 1);
+	if (!st->cbuf[slot] || !st->xbuf[slot]) {
+		ct_error("out of memory");
+		free(st->cbuf[slot]);
+		free(st->xbuf[slot]);
+		st->cbuf[slot] = st->xbuf[slot] = NULL;
+		return IFD_ERROR_NO_MEMORY;
+	}
+	return 0;
+}
+
+/*
+ * Outstanding commands
+ *
+ * A reader may work on up to bMaxCCIDBusySlots slots at the same
+ * time, one command per slot. Responses come back on the bulk-in
+ * pipe in whatever order the reader finishes them; each is matched
+ * to its command by bSlot and bSeq and copied to the buffer of
+ * whoever waits for it.
+ */
+static void ccid_dispatch(ifd_reader_t * reader, unsigned char *buf,
+			  int len)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ccid_pending_t *pe;
+	int slot = buf[CCID_OFFSET_SLOT];
 	int rc;
-	size_t req_len;
 
-	if (!cmd_len || !res_len) {
-		ct_error("missing parameters to ccid_command");
-		return IFD_ERROR_INVALID_ARG;
+	if (slot >= OPENCT_MAX_SLOTS
+	    || !(pe = &st->pending[slot])->busy || pe->done
+	    || pe->seq != buf[CCID_OFFSET_SEQ]) {
+		ifd_debug(1, "dropping response for slot %d seq %d",
+			  slot, buf[CCID_OFFSET_SEQ]);
+		return;
+	}
+
+	rc = ccid_checkresponse(buf, len);
+	if (rc == -300)
+		return;		/* time extension, keep waiting */
+	if (rc >= 0) {
+		if ((size_t) len > pe->res_len) {
+			rc = IFD_ERROR_BUFFER_TOO_SMALL;
+		} else {
+			memcpy(pe->res, buf, len);
+			rc = len;
+		}
+	}
+	pe->result = rc;
+	pe->done = 1;
+	st->outstanding--;
+}
+
+/*
+ * On USB, the bulk-in transfer stays queued while we look whether
+ * the client still wants the answer. If it doesn't, we return and
+ * leave the transfer to be picked up by the next receive, so no
+ * response is ever lost halfway through.
+ */
+static int ccid_receive_usb(ifd_reader_t * reader, int abortable)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ifd_device_t *dev = reader->device;
+	struct timeval begin;
+	long wait;
+	int rc;
+
+	if (st->rx_urb == NULL) {
+		rc = ifd_usb_submit(dev, IFD_USB_URB_TYPE_BULK,
+				    dev->settings.usb.ep_i, st->rbuf,
+				    st->maxmsg, NULL, NULL, &st->rx_urb);
+		if (rc < 0) {
+			st->rx_urb = NULL;
+			return rc;
+		}
+		st->rx_pending = 1;
+	} else if (!st->rx_pending) {
+		if ((rc = ifd_usb_resubmit(dev, st->rx_urb)) < 0)
+			return rc;
+		st->rx_pending = 1;
 	}
-	req_len = res_len;
+
+	gettimeofday(&begin, NULL);
+	while (1) {
+		if ((wait = CCID_RECV_TIMEOUT - ifd_time_elapsed(&begin)) <= 0) {
+			if (ifd_usb_cancel(dev, st->rx_urb) >= 0)
+				st->rx_pending = 0;
+			return IFD_ERROR_TIMEOUT;
+		}
+		if (abortable && wait > CCID_ABORT_POLL)
+			wait = CCID_ABORT_POLL;
+
+		rc = ifd_usb_wait(dev, st->rx_urb, wait);
+		if (rc != IFD_ERROR_TIMEOUT) {
+			st->rx_pending = 0;
+			return rc;
+		}
+		if (abortable && ifd_check_abort(reader))
+			return IFD_ERROR_USER_ABORT;
+		/* A request served meanwhile may have picked up the
+		 * transfer; it was dispatched, so let the caller look
+		 * whether it was the one he waits for */
+		if (!st->rx_pending)
+			return 0;
+	}
+}
+
+/*
+ * Read one response from the reader and pass it on. Returns 0
+ * without reading anything if someone else got there first.
+ */
+static int ccid_receive(ifd_reader_t * reader, int abortable)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int rc;
+
+	if (ifd_device_type(reader->device) == IFD_DEVICE_TYPE_USB) {
+		if ((rc = ccid_receive_usb(reader, abortable)) <= 0)
+			return rc;
+	} else
+		rc = ifd_device_recv(reader->device, st->rbuf, st->maxmsg,
+				     CCID_RECV_TIMEOUT);
+	if (rc < 0)
+		return rc;
+	if (rc == 0) {
+		ct_error("zero length response from reader?!");
+		return IFD_ERROR_GENERIC;
+	}
+	if (ct_config.debug >= 3)
+		ifd_debug(3, "received:%s", ct_hexdump(st->rbuf, rc));
+	if (rc < 10)
+		return IFD_ERROR_GENERIC;
+
+	ccid_dispatch(reader, st->rbuf, rc);
+	return 0;
+}
+
+static int ccid_submit(ifd_reader_t * reader, const unsigned char *cmd,
+		       size_t cmd_len, unsigned char *res, size_t res_len)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ccid_pending_t *pe;
+	int slot = cmd[CCID_OFFSET_SLOT];
+	int rc;
+
+	if (slot >= OPENCT_MAX_SLOTS)
+		return IFD_ERROR_INVALID_SLOT;
+	pe = &st->pending[slot];
+	if (pe->busy) {
+		ct_error("ccid: slot %d already has a command pending", slot);
+		return IFD_ERROR_GENERIC;
+	}
+
+	/* Don't give the reader more than it can juggle */
+	while (st->outstanding >= st->max_busy) {
+		if ((rc = ccid_receive(reader, 0)) < 0)
+			return rc;
+	}
+
 	if (ct_config.debug >= 3)
 		ifd_debug(3, "sending:%s", ct_hexdump(cmd, cmd_len));
 
@@ -361,34 +609,48 @@ static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
 		ifd_debug(1, "ifd_device_send failed %d", rc);
 		return rc;
 	}
-	while (1) {
-		rc = ifd_device_recv(reader->device, res, req_len, 10000);
-		if (rc < 0)
+
+	pe->busy = 1;
+	pe->done = 0;
+	pe->seq = cmd[CCID_OFFSET_SEQ];
+	pe->res = res;
+	pe->res_len = res_len;
+	st->outstanding++;
+	return 0;
+}
+
+static int ccid_collect(ifd_reader_t * reader, int slot)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ccid_pending_t *pe = &st->pending[slot];
+	int rc;
+
+	while (!pe->done) {
+		if ((rc = ccid_receive(reader, !st->aborting)) < 0) {
+			/* A late response will be dropped */
+			pe->busy = 0;
+			st->outstanding--;
 			return rc;
-		if (rc == 0) {
-			ct_error("zero length response from reader?!");
-			return IFD_ERROR_GENERIC;
 		}
-		if (ct_config.debug >= 3)
-			ifd_debug(3, "received:%s", ct_hexdump(res, rc));
+	}
+	pe->busy = 0;
+	return pe->result;
+}
 
-		if (rc < 9) {
-			return IFD_ERROR_GENERIC;
-		}
-		if (cmd[CCID_OFFSET_SLOT] == res[CCID_OFFSET_SLOT] &&
-		    cmd[CCID_OFFSET_SEQ] == res[CCID_OFFSET_SEQ]) {
-			res_len = rc;
-			rc = ccid_checkresponse(res, res_len);
-			if (rc == -300) {
-				continue;
-			}
-			if (rc < 0)
-				return rc;
-			break;
-		}
+static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
+			size_t cmd_len, unsigned char *res, size_t res_len)
+{
+	int rc;
 
+	if (!cmd_len || !res_len) {
+		ct_error("missing parameters to ccid_command");
+		return IFD_ERROR_INVALID_ARG;
 	}
-	return res_len;
+
+	rc = ccid_submit(reader, cmd, cmd_len, res, res_len);
+	if (rc < 0)
+		return rc;
+	return ccid_collect(reader, cmd[CCID_OFFSET_SLOT]);
 }
 
 static int ccid_simple_rcommand(ifd_reader_t * reader, int slot, int cmd,
@@ -396,24 +658,23 @@ static int ccid_simple_rcommand(ifd_reader_t * reader, int slot, int cmd,
 {
 	ccid_status_t *st = reader->driver_data;
 	unsigned char cmdbuf[10];
-	unsigned char resbuf[CCID_MAX_MSG_LEN + 1];
 	int r;
 
 	r = ccid_prepare_cmd(reader, cmdbuf, 10, slot, cmd, ctl, NULL, 0);
-	if (r < 0)
+	if (r < 0 || (r = ccid_slot_buffers(st, slot)) < 0)
 		return r;
 
-	r = ccid_command(reader, cmdbuf, 10, resbuf, st->maxmsg);
+	r = ccid_command(reader, cmdbuf, 10, st->xbuf[slot], st->maxmsg);
 	if (r < 0)
 		return r;
-	if (resbuf[0] != msg_expected[cmd - CCID_CMD_FIRST]) {
+	if (st->xbuf[slot][0] != msg_expected[cmd - CCID_CMD_FIRST]) {
 		ct_error("Received a message of type x%02x instead of x%02x",
-			 resbuf[0], msg_expected[cmd - CCID_CMD_FIRST]);
+			 st->xbuf[slot][0], msg_expected[cmd - CCID_CMD_FIRST]);
 		return -1;
 	}
 
 	if (res_len)
-		r = ccid_extract_data(&resbuf, r, res, res_len);
+		r = ccid_extract_data(st->xbuf[slot], r, res, res_len);
 	return r;
 }
 
@@ -421,63 +682,154 @@ static int ccid_simple_wcommand(ifd_reader_t * reader, int slot, int cmd,
 				void *ctl, void *data, size_t data_len)
 {
 	ccid_status_t *st = reader->driver_data;
-	unsigned char cmdbuf[CCID_MAX_MSG_LEN + 1];
-	unsigned char resbuf[CCID_MAX_MSG_LEN + 1];
 	int r;
 
-	r = ccid_prepare_cmd(reader, cmdbuf, st->maxmsg, slot, cmd, ctl, data,
-			     data_len);
+	if ((r = ccid_slot_buffers(st, slot)) < 0)
+		return r;
+	r = ccid_prepare_cmd(reader, st->cbuf[slot], st->maxmsg, slot, cmd,
+			     ctl, data, data_len);
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, cmdbuf, r, resbuf, st->maxmsg);
+	r = ccid_command(reader, st->cbuf[slot], r, st->xbuf[slot],
+			 st->maxmsg);
 	if (r < 0)
 		return r;
-	if (resbuf[0] != msg_expected[cmd - CCID_CMD_FIRST]) {
+	if (st->xbuf[slot][0] != msg_expected[cmd - CCID_CMD_FIRST]) {
 		ct_error("Received a message of type x%02x instead of x%02x",
-			 resbuf[0], msg_expected[cmd - CCID_CMD_FIRST]);
+			 st->xbuf[slot][0], msg_expected[cmd - CCID_CMD_FIRST]);
 		return -1;
 	}
 
 	return r;
 }
 
-#ifdef notyet
+/*
+ * Abort the command in progress on a slot: announce the abort on
+ * the control pipe, then send PC_to_RDR_Abort with the same bSeq.
+ * The response to the aborted command, if it still comes, carries
+ * the old bSeq and is dropped.
+ */
 static int ccid_abort(ifd_reader_t * reader, int slot)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-
 	int r;
-	if (ifd_device_type(reader->device) == IFD_DEVICE_TYPE_USB) {
-		r = ifd_usb_control(reader->device, 0x21
-				    /*USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE */
-				    ,
-				    CCID_REQ_ABORT, st->seq << 8 | slot,
-				    st->usb_interface, NULL, 0, 10000);
-		if (r < 0)
-			return r;
-		r = ccid_simple_wcommand(reader, slot, CCID_CMD_ABORT, NULL,
-					 NULL, 0);
-		return r;
-	} else
-	    if (ifd_device_type(reader->device == IFD_DEVICE_TYPE_PCMCIA_BLOCK))
-	{
+
+	if (ifd_device_type(reader->device) != IFD_DEVICE_TYPE_USB) {
 		/* FIXME */
 		return IFD_ERROR_NOT_SUPPORTED;
 	}
-	return IFD_ERROR_NOT_SUPPORTED;
+
+	if (slot < OPENCT_MAX_SLOTS && st->pending[slot].busy) {
+		st->pending[slot].busy = 0;
+		if (!st->pending[slot].done)
+			st->outstanding--;
+	}
+
+	r = ifd_usb_control(reader->device, 0x21
+			    /*USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE */
+			    ,
+			    CCID_REQ_ABORT, st->seq << 8 | slot,
+			    st->usb_interface, NULL, 0, 10000);
+	if (r < 0)
+		return r;
+
+	st->aborting = 1;
+	r = ccid_simple_wcommand(reader, slot, CCID_CMD_ABORT, NULL, NULL, 0);
+	st->aborting = 0;
+
+	/* The reader won't tell us if it went on with the card;
+	 * have a fresh look at it */
+	st->icc_probe[slot] = 1;
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Extended APDU level exchange. A command that does not fit into
+ * one message goes out in several XfrBlocks, and the reader asks
+ * for each following one with an empty DataBlock. The response may
+ * likewise come in several DataBlocks, each after an empty XfrBlock
+ * asking for more.
+ */
+static int ccid_exchange_chained(ifd_reader_t * reader, int slot,
+				 const void *sbuf, size_t slen,
+				 void *rbuf, size_t rlen)
+{
+	ccid_status_t *st = reader->driver_data;
+	const unsigned char *sp = (const unsigned char *)sbuf;
+	size_t chunk = st->maxmsg - 10, n, got = 0;
+	unsigned char ctlbuf[3];
+	int level, chain, r;
+
+	if ((r = ccid_slot_buffers(st, slot)) < 0)
+		return r;
+
+	ctlbuf[0] = 0;
+	level = slen > chunk ? CCID_CHAIN_BEGIN : CCID_CHAIN_SINGLE;
+	while (1) {
+		n = slen > chunk ? chunk : slen;
+		ctlbuf[1] = level;
+		ctlbuf[2] = 0;
+		r = ccid_prepare_cmd(reader, st->cbuf[slot], st->maxmsg, slot,
+				     CCID_CMD_XFRBLOCK, ctlbuf, sp, n);
+		if (r < 0)
+			return r;
+		r = ccid_command(reader, st->cbuf[slot], r, st->xbuf[slot],
+				 st->maxmsg);
+		if (r < 0)
+			return r;
+		sp += n;
+		slen -= n;
+		if (level == CCID_CHAIN_SINGLE || level == CCID_CHAIN_END)
+			break;
+		if (st->xbuf[slot][9] != CCID_CHAIN_MORE) {
+			ct_error("ccid: reader did not ask for rest of command");
+			return IFD_ERROR_COMM_ERROR;
+		}
+		level = slen > chunk ? CCID_CHAIN_MIDDLE : CCID_CHAIN_END;
+	}
+
+	while (1) {
+		chain = st->xbuf[slot][9];
+		r = ccid_extract_data(st->xbuf[slot], r,
+				      (unsigned char *)rbuf + got, rlen - got);
+		if (r < 0)
+			return r;
+		got += r;
+		if (chain == CCID_CHAIN_SINGLE || chain == CCID_CHAIN_END)
+			break;
+		if (chain != CCID_CHAIN_BEGIN && chain != CCID_CHAIN_MIDDLE) {
+			ct_error("ccid: unexpected chain parameter 0x%02x",
+				 chain);
+			return IFD_ERROR_COMM_ERROR;
+		}
+		ctlbuf[1] = CCID_CHAIN_MORE;
+		r = ccid_prepare_cmd(reader, st->cbuf[slot], st->maxmsg, slot,
+				     CCID_CMD_XFRBLOCK, ctlbuf, NULL, 0);
+		if (r < 0)
+			return r;
+		r = ccid_command(reader, st->cbuf[slot], r, st->xbuf[slot],
+				 st->maxmsg);
+		if (r < 0)
+			return r;
+	}
+	return got;
 }
-#endif
 
 static int ccid_exchange(ifd_reader_t * reader, int slot,
 			 const void *sbuf, size_t slen, void *rbuf, size_t rlen)
 {
 	ccid_status_t *st = reader->driver_data;
-	unsigned char sendbuf[CCID_MAX_MSG_LEN + 1];
-	unsigned char recvbuf[CCID_MAX_MSG_LEN + 1];
 	int r;
 	unsigned char ctlbuf[3], *ctlptr=NULL;
 
+	if (st->flags & FLAG_EXT_APDU)
+		return ccid_exchange_chained(reader, slot, sbuf, slen,
+					     rbuf, rlen);
+
+	if ((r = ccid_slot_buffers(st, slot)) < 0)
+		return r;
+
 	ctlptr=NULL;
 	if (st->reader_type == TYPE_CHAR) {
 		ctlbuf[0] = 0;
@@ -486,15 +838,195 @@ static int ccid_exchange(ifd_reader_t * reader, int slot,
 		ctlptr = ctlbuf;
 	}
 
-	r = ccid_prepare_cmd(reader, sendbuf, st->maxmsg,
+	r = ccid_prepare_cmd(reader, st->cbuf[slot], st->maxmsg,
 			     slot, CCID_CMD_XFRBLOCK, ctlptr, sbuf, slen);
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, &sendbuf[0], r, recvbuf, st->maxmsg);
+	r = ccid_command(reader, st->cbuf[slot], r, st->xbuf[slot],
+			 st->maxmsg);
 	if (r < 0)
 		return r;
-	return ccid_extract_data(&recvbuf, r, rbuf, rlen);
+	return ccid_extract_data(st->xbuf[slot], r, rbuf, rlen);
+}
+
+/*
+ * Interrupt pipe listener
+ *
+ * One interrupt URB stays queued on the notification endpoint for
+ * as long as the reader is open. It is reaped by whoever waits on
+ * the device next - a bulk transfer, the main loop, card_status -
+ * and what it brings in is folded into the per slot state, so that
+ * card_status can answer from memory.
+ */
+static void ccid_intr_complete(ifd_device_t * dev, ifd_usb_urb_t * urb,
+			       int result, void *user_data)
+{
+	ifd_reader_t *reader = (ifd_reader_t *) user_data;
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char *p = st->intr_buf;
+	int slot, bits, present;
+
+	if (result == IFD_ERROR_USER_ABORT)
+		return;		/* cancelled by ccid_close */
+
+	if (result < 0) {
+		ifd_debug(1, "interrupt pipe: %s", ct_strerror(result));
+		/* We may have missed a notification */
+		memset(st->icc_probe, 1, OPENCT_MAX_SLOTS);
+	} else if (result > 0 && p[0] == CCID_NOTIFY_SLOT_CHANGE) {
+		ifd_debug(3, "status received:%s", ct_hexdump(p, result));
+		for (slot = 0; slot < reader->nslots; slot++) {
+			if (1 + (slot / 4) >= result)
+				break;
+			bits = (p[1 + (slot / 4)] >> (2 * (slot % 4))) & 0x3;
+			present = (bits & 1) ? IFD_CARD_PRESENT : 0;
+			if ((bits & 2) || st->icc_present[slot] != present)
+				st->icc_changed[slot] = 1;
+			st->icc_present[slot] = present;
+			st->icc_probe[slot] = 0;
+		}
+	} else if (result >= 4 && p[0] == CCID_HARDWARE_ERROR) {
+		slot = p[1];
+		if (p[3] == CCID_HWERR_OVERCURRENT)
+			ct_error("ccid: overcurrent in slot %d", slot);
+		else
+			ct_error("ccid: hardware error 0x%02x in slot %d",
+				 p[3], slot);
+		/* The reader has shut the card down; anyone using
+		 * it will have to start over */
+		if (slot < reader->nslots) {
+			st->icc_changed[slot] = 1;
+			st->icc_probe[slot] = 1;
+		}
+	}
+
+	if (result == IFD_ERROR_DEVICE_DISCONNECTED
+	    || ifd_usb_resubmit(dev, urb) < 0) {
+		ifd_usb_free_urb(dev, urb);
+		st->intr_urb = NULL;
+		memset(st->icc_probe, 1, OPENCT_MAX_SLOTS);
+	}
+}
+
+static int ccid_listen(ifd_reader_t * reader)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ifd_device_t *dev = reader->device;
+	int r;
+
+	if (!st->support_events || st->intr_urb != NULL)
+		return 0;
+
+	r = ifd_usb_submit(dev, IFD_USB_URB_TYPE_INTERRUPT,
+			   dev->settings.usb.ep_intr,
+			   st->intr_buf, sizeof(st->intr_buf),
+			   ccid_intr_complete, reader, &st->intr_urb);
+	if (r < 0) {
+		ct_error("ccid: cannot listen on interrupt pipe: %s",
+			 ct_strerror(r));
+		st->intr_urb = NULL;
+	}
+	return r;
+}
+
+/*
+ * pcsc-lite's ccid driver may want the same reader. We used to
+ * give it a head start with a fixed sleep whenever pcscd was
+ * installed; now we simply keep trying to claim the interface
+ * until it's free or CCID_CLAIM_TIMEOUT expires.
+ *
+ * If ifdhandler.ccid_lockdir is set, we also take an advisory
+ * lock on a per-device file in that directory and hold it while
+ * the reader is open, so a cooperating process can keep us out.
+ */
+#define CCID_CLAIM_TIMEOUT	5000	/* msec */
+
+typedef struct ccid_claim {
+	ifd_device_t *dev;
+	ifd_device_params_t *params;
+	int lockfd;
+	int locked;
+} ccid_claim_t;
+
+static int ccid_claim_probe(void *arg)
+{
+	ccid_claim_t *c = (ccid_claim_t *) arg;
+	struct flock fl;
+	int rc;
+
+	if (c->lockfd >= 0 && !c->locked) {
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		if (fcntl(c->lockfd, F_SETLK, &fl) < 0)
+			return 0;
+		c->locked = 1;
+	}
+
+	rc = ifd_device_set_parameters(c->dev, c->params);
+	if (rc == IFD_ERROR_DEVICE_BUSY)
+		return 0;
+	return rc < 0 ? rc : 1;
+}
+
+static int ccid_claim(ifd_device_t * dev, ifd_device_params_t * params,
+		      int *lockfd)
+{
+	ccid_claim_t c;
+	char *dir = NULL, path[1024], *s;
+	int rc;
+
+	memset(&c, 0, sizeof(c));
+	c.dev = dev;
+	c.params = params;
+	c.lockfd = -1;
+
+	if (ifd_conf_get_string("ifdhandler.ccid_lockdir", &dir) >= 0 && dir) {
+		/* /dev/bus/usb/001/004 -> dev_bus_usb_001_004 */
+		snprintf(path, sizeof(path), "%s/%s", dir,
+			 dev->name + (dev->name[0] == '/'));
+		for (s = path + strlen(dir) + 1; *s; s++) {
+			if (*s == '/')
+				*s = '_';
+		}
+		if ((c.lockfd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+			ct_error("ccid: unable to open lock file %s: %m", path);
+	}
+
+	rc = ifd_wait_until(ccid_claim_probe, &c, CCID_CLAIM_TIMEOUT);
+	if (rc < 0) {
+		if (rc == IFD_ERROR_TIMEOUT)
+			ct_error("ccid: %s is in use by someone else",
+				 dev->name);
+		if (c.lockfd >= 0)
+			close(c.lockfd);
+		return rc;
+	}
+
+	*lockfd = c.lockfd;
+	return 0;
+}
+
+/*
+ * Give up on a reader that ccid_open_usb has already handed its
+ * driver data and device, so that nothing is left pointing at
+ * either
+ */
+static int ccid_open_failed(ifd_reader_t * reader)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+
+	if (st->rx_urb != NULL)
+		ifd_usb_free_urb(reader->device, st->rx_urb);
+	ccid_free_buffers(st);
+	if (st->lockfd >= 0)
+		close(st->lockfd);
+	free(st);
+	ifd_device_close(reader->device);
+	reader->driver_data = NULL;
+	reader->device = NULL;
+	return -1;
 }
 
 static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
@@ -512,13 +1044,6 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 	unsigned char *p;
 	int support_events = 0;
 
-#define PCSCLITE_FILE "/var/run/pcscd/pcscd.comm"
-	struct stat buf;
-
-	/* give priority to pcsc-lite for CCID devices */
-	if (0 == stat(PCSCLITE_FILE, &buf))
-		sleep(3);
-
 	if (ifd_usb_get_device(dev, &de)) {
 		ct_error("ccid: device descriptor not found");
 		ifd_device_close(dev);
@@ -733,7 +1258,9 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 	}
 
 	st->usb_interface = intf->bInterfaceNumber;
+	st->lockfd = -1;
 	memset(st->icc_present, -1, OPENCT_MAX_SLOTS);
+	memset(st->icc_probe, 1, OPENCT_MAX_SLOTS);
 	st->voltage_support = ccid.bVoltageSupport & 0x7;
 	st->proto_support = ccid.dwProtocols;
 	if ((st->proto_support & 3) == 0) {
@@ -766,6 +1293,8 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 		st->reader_type = TYPE_TPDU;
 	} else if (ccid.dwFeatures & 0x60000) {
 		st->reader_type = TYPE_APDU;
+		if (ccid.dwFeatures & 0x40000)
+			st->flags |= FLAG_EXT_APDU;
 	}
 	if (ccid.dwFeatures & 0x2)
 		st->flags |= FLAG_AUTO_ATRPARSE;
@@ -778,6 +1307,7 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 	if (ccid.dwFeatures & 0x80)
 		st->flags |= FLAG_NO_PTS;
 	st->ifsd = ccid.dwMaxIFSD;
+	st->max_busy = ccid.bMaxCCIDBusySlots ? ccid.bMaxCCIDBusySlots : 1;
 
 	/* must provide AUTO or at least one of 5/3.3/1.8 */
 	if (st->voltage_support == 0) {
@@ -788,20 +1318,32 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 		return -1;
 	}
 
-	if (ccid.dwMaxCCIDMessageLength > CCID_MAX_MSG_LEN) {
-		st->maxmsg = CCID_MAX_MSG_LEN;
+	if (ccid.dwMaxCCIDMessageLength > CCID_MAX_MSG_LIMIT) {
+		st->maxmsg = CCID_MAX_MSG_LIMIT;
 	} else {
 		st->maxmsg = ccid.dwMaxCCIDMessageLength;
 	}
+	if (st->maxmsg <= 10) {
+		/* can't be right, the header alone is 10 bytes */
+		st->maxmsg = CCID_MAX_MSG_LEN;
+	}
+	if (ccid_alloc_buffers(st) < 0) {
+		ccid_free_buffers(st);
+		free(st);
+		ifd_device_close(dev);
+		return IFD_ERROR_NO_MEMORY;
+	}
 
 	reader->driver_data = st;
 	reader->device = dev;
 	reader->nslots = ccid.bMaxSlotIndex + 1;
+	/* Let ifdhandler pass us commands for the other slots while
+	 * one of them waits for its card */
+	if (st->max_busy > 1)
+		reader->flags |= IFD_READER_CONCURRENT;
 
-	if (ifd_device_set_parameters(dev, &params) < 0) {
-		ifd_device_close(dev);
-		return -1;
-	}
+	if (ccid_claim(dev, &params, &st->lockfd) < 0)
+		return ccid_open_failed(reader);
 	if (de.idVendor == 0x08e6 && de.idProduct == 0x3437) {
 		unsigned char settpdu[] = { 0xA0, 0x1 };
 		unsigned char setiso[] = { 0x1F, 0x1 };
@@ -809,15 +1351,13 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 					 settpdu, 2);
 		if (r < 0) {
 			ct_error("ccid: cannot set GemPlus TPDU mode");
-			ifd_device_close(dev);
-			return -1;
+			return ccid_open_failed(reader);
 		}
 		r = ccid_simple_wcommand(reader, 0, CCID_CMD_ESCAPE, NULL,
 					 setiso, 2);
 		if (r < 0) {
 			ct_error("ccid: cannot set GemPlus ISO APDU mode");
-			ifd_device_close(dev);
-			return -1;
+			return ccid_open_failed(reader);
 		}
 		st->reader_type = TYPE_TPDU;
 	}
@@ -830,6 +1370,9 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 
 	st->support_events = support_events;
 
+	/* Without the listener we simply fall back to polling */
+	ccid_listen(reader);
+
 	ifd_debug(3, "Accepted %04x:%04x with features 0x%x and protocols 0x%x events=%d", de.idVendor, de.idProduct, ccid.dwFeatures, ccid.dwProtocols, st->support_events);
 	return 0;
 }
@@ -846,13 +1389,20 @@ static int ccid_open_pcmcia_block(ifd_device_t * dev, ifd_reader_t * reader)
 
 	/* setup fake ccid_status_t based on totally guessed values */
 	memset(st->icc_present, -1, OPENCT_MAX_SLOTS);
+	memset(st->icc_probe, 1, OPENCT_MAX_SLOTS);
 	st->voltage_support = 0x7;
 	st->proto_support = SUPPORT_T0 | SUPPORT_T1;
 	st->reader_type = TYPE_APDU;
 	st->voltage_support |= AUTO_VOLTAGE;
 	st->ifsd = 1;		/* ? */
 	st->maxmsg = CCID_MAX_MSG_LEN;
+	st->max_busy = 1;
 	st->flags = FLAG_AUTO_ATRPARSE | FLAG_NO_PTS;	/*|FLAG_NO_SETPARAM; */
+	if (ccid_alloc_buffers(st) < 0) {
+		ccid_free_buffers(st);
+		free(st);
+		return IFD_ERROR_NO_MEMORY;
+	}
 
 	reader->driver_data = st;
 	reader->device = dev;
@@ -888,14 +1438,34 @@ static int ccid_open(ifd_reader_t * reader, const char *device_name)
 static int ccid_close(ifd_reader_t * reader)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int i;
 	
 	ifd_debug(1, "called.");
 
-	if (st->event_cap != NULL) {
-		ifd_usb_end_capture(reader->device, st->event_cap);
-		st->event_cap = NULL;
+	/* Releasing T=CL sends the PICC a DESELECT, which has to
+	 * happen while we can still talk to the reader */
+	for (i = 0; i < reader->nslots; i++) {
+		ifd_slot_t *slot = &reader->slot[i];
+
+		if (slot->proto && slot->proto->ops->id == IFD_PROTOCOL_TCL) {
+			ifd_protocol_free(slot->proto);
+			slot->proto = NULL;
+		}
 	}
 
+	if (st->intr_urb != NULL) {
+		ifd_usb_free_urb(reader->device, st->intr_urb);
+		st->intr_urb = NULL;
+	}
+	if (st->rx_urb != NULL) {
+		ifd_usb_free_urb(reader->device, st->rx_urb);
+		st->rx_urb = NULL;
+	}
+	ccid_free_buffers(st);
+	if (st->lockfd >= 0)
+		close(st->lockfd);
+	st->lockfd = -1;
+
 	return 0;
 }
 
@@ -911,76 +1481,15 @@ static int ccid_deactivate(ifd_reader_t * reader)
 	return 0;
 }
 
-static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
+/*
+ * Fold the response to a GetSlotStatus into the slot state
+ */
+static int ccid_slot_probed(ifd_reader_t * reader, int slot, int r,
+			    unsigned char *ret)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	int r, stat;
-	unsigned char ret[20];
-	unsigned char cmdbuf[10];
-
-	if (ifd_device_type(reader->device) == IFD_DEVICE_TYPE_USB &&
-	    reader->device->settings.usb.ep_intr) {
-		ifd_usb_capture_t *cap;
-		int any = 0;
-		int i, j, bits;
-
-		if (st->proto_support & SUPPORT_ESCAPE
-		    && slot == reader->nslots - 1) {
-			ifd_debug(1,
-				  "virtual escape slot, setting card present\n");
-			*status = IFD_CARD_PRESENT;
-			return 0;
-		}
+	int stat;
 
-		i = 1 + (slot / 4);
-		j = 2 * (slot % 4);
-		stat = 0;
-
-		r = ifd_usb_begin_capture(reader->device,
-					  IFD_USB_URB_TYPE_INTERRUPT,
-					  reader->device->settings.usb.ep_intr,
-					  8, &cap);
-		if (r < 0) {
-			ct_error("ccid: begin capture: %d", r);
-			return r;
-		}
-		/* read any bufferred interrupt pipe messages */
-		while (1) {
-			r = ifd_usb_capture(reader->device, cap, ret, 8, 100);
-			if (r < 0)
-				break;
-			if (ret[0] != 0x50)
-				continue;
-			ifd_debug(3, "status received:%s", ct_hexdump(ret, r));
-			bits = (ret[i] >> j) & 0x3;
-			if (bits & 2)
-				stat |= IFD_CARD_STATUS_CHANGED;
-			if (bits & 1)
-				stat |= IFD_CARD_PRESENT;
-			else
-				stat &= ~IFD_CARD_PRESENT;
-			any = 1;
-		}
-		ifd_usb_end_capture(reader->device, cap);
-		if (any) {
-			ifd_debug(1, "polled result: %d", stat);
-			st->icc_present[slot] = stat & IFD_CARD_PRESENT;
-			*status = stat;
-			return 0;
-		}
-		if (st->icc_present[slot] != 0xFF) {
-			ifd_debug(1, "cached result: %d",
-				  st->icc_present[slot]);
-			*status = st->icc_present[slot];
-			return 0;
-		}
-	}
-
-	r = ccid_prepare_cmd(reader, cmdbuf, 10, 0, CCID_CMD_GETSLOTSTAT,
-			     NULL, NULL, 0);
-	if (r < 0)
-		return r;
-	r = ccid_command(reader, cmdbuf, 10, ret, 10);
 	if (r == IFD_ERROR_NO_CARD) {
 		stat = 0;
 	}
@@ -1000,19 +1509,175 @@ static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
 
 	ifd_debug(1, "probed result: %d, cached: %d", stat, st->icc_present[slot]);
 
-	*status = stat;
 	if (
 		st->icc_present[slot] == 0xFF ||
 		(stat&IFD_CARD_PRESENT) != (st->icc_present[slot]&IFD_CARD_PRESENT)
 	) {
-		*status |= IFD_CARD_STATUS_CHANGED;
+		st->icc_changed[slot] = 1;
 	}
 	st->icc_present[slot] = stat;
+	st->icc_probe[slot] = 0;
 	return 0;
 }
 
+static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int r;
+	unsigned char ret[20];
+	unsigned char cmdbuf[10];
+
+	if (st->proto_support & SUPPORT_ESCAPE && slot == reader->nslots - 1) {
+		ifd_debug(1, "virtual escape slot, setting card present\n");
+		*status = IFD_CARD_PRESENT;
+		return 0;
+	}
+
+	/* The slot is busy with a command served further up the
+	 * stack; the card was there when it started, and we can't
+	 * ask the reader again before it is done */
+	if (st->pending[slot].busy) {
+		if (st->intr_urb != NULL
+		    && ifd_usb_reap(reader->device) ==
+		    IFD_ERROR_DEVICE_DISCONNECTED)
+			return IFD_ERROR_DEVICE_DISCONNECTED;
+		*status = st->icc_present[slot] & IFD_CARD_PRESENT;
+		if (st->icc_changed[slot])
+			*status |= IFD_CARD_STATUS_CHANGED;
+		st->icc_changed[slot] = 0;
+		ifd_debug(1, "slot busy, cached result: %d", *status);
+		return 0;
+	}
+
+	if (st->intr_urb != NULL) {
+		/* pick up whatever the interrupt pipe delivered */
+		r = ifd_usb_reap(reader->device);
+		if (r == IFD_ERROR_DEVICE_DISCONNECTED)
+			return r;
+		if (st->intr_urb != NULL && !st->icc_probe[slot]) {
+			*status = st->icc_present[slot];
+			if (st->icc_changed[slot])
+				*status |= IFD_CARD_STATUS_CHANGED;
+			st->icc_changed[slot] = 0;
+			ifd_debug(1, "cached result: %d", *status);
+			return 0;
+		}
+	}
+
+	r = ccid_prepare_cmd(reader, cmdbuf, 10, slot, CCID_CMD_GETSLOTSTAT,
+			     NULL, NULL, 0);
+	if (r < 0)
+		return r;
+	r = ccid_command(reader, cmdbuf, 10, ret, 10);
+	if ((r = ccid_slot_probed(reader, slot, r, ret)) < 0)
+		return r;
+
+	*status = st->icc_present[slot];
+	if (st->icc_changed[slot])
+		*status |= IFD_CARD_STATUS_CHANGED;
+	st->icc_changed[slot] = 0;
+	return 0;
+}
+
+/*
+ * Ask all slots we are unsure about at once, as far as the
+ * reader lets us
+ */
+static int ccid_probe_slots(ifd_reader_t * reader)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char cmdbuf[OPENCT_MAX_SLOTS][10];
+	unsigned char ret[OPENCT_MAX_SLOTS][10];
+	int sent[OPENCT_MAX_SLOTS];
+	int slot, r, rc = 0;
+
+	if (st->max_busy < 2)
+		return 0;
+
+	for (slot = 0; slot < reader->nslots; slot++) {
+		sent[slot] = 0;
+		if (!st->icc_probe[slot])
+			continue;
+		if (st->proto_support & SUPPORT_ESCAPE
+		    && slot == reader->nslots - 1)
+			continue;
+		r = ccid_prepare_cmd(reader, cmdbuf[slot], 10, slot,
+				     CCID_CMD_GETSLOTSTAT, NULL, NULL, 0);
+		if (r >= 0)
+			r = ccid_submit(reader, cmdbuf[slot], 10,
+					ret[slot], 10);
+		if (r < 0) {
+			rc = r;
+			break;
+		}
+		sent[slot] = 1;
+	}
+
+	/* Collect everything we sent, even after an error */
+	for (slot = 0; slot < reader->nslots; slot++) {
+		if (!sent[slot])
+			continue;
+		r = ccid_collect(reader, slot);
+		r = ccid_slot_probed(reader, slot, r, ret[slot]);
+		if (r < 0 && rc == 0)
+			rc = r;
+	}
+	return rc;
+}
+
 static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto);
 
+/*
+ * A contactless card behind a TPDU level reader hands us its ATS
+ * instead of an ATR. An ATS starts with its own length (TL); an ATR
+ * starts with TS, which is either 0x3B or 0x3F.
+ */
+static int ccid_is_ats(const unsigned char *buf, size_t len)
+{
+	return len >= 1 && buf[0] == len && buf[0] != 0x3B && buf[0] != 0x3F;
+}
+
+/*
+ * Run ISO 14443-4 on top of the reader's XfrBlock
+ */
+static int ccid_set_tcl(ifd_reader_t * reader, int s,
+			const unsigned char *ats, size_t len)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ifd_slot_t *slot = &reader->slot[s];
+	ifd_protocol_t *p;
+	int r;
+
+	if (st->reader_type != TYPE_TPDU || !ccid_is_ats(ats, len)) {
+		ct_error("%s: no contactless card in slot %d", reader->name, s);
+		return IFD_ERROR_NOT_SUPPORTED;
+	}
+
+	p = ifd_protocol_new(IFD_PROTOCOL_TCL, reader, slot->dad);
+	if (p == NULL) {
+		ct_error("%s: internal error", reader->name);
+		return -1;
+	}
+	if ((r = tcl_parse_ats(p, ats, len)) < 0) {
+		ifd_protocol_free(p);
+		return r;
+	}
+	/* The reader adds and checks the CRC_A, but we can't
+	 * have frames larger than one XfrBlock */
+	if (st->maxmsg - 10 < 256)
+		ifd_protocol_set_parameter(p, IFD_PROTOCOL_TCL_FSD,
+					   st->maxmsg - 10);
+
+	if (slot->proto) {
+		ifd_protocol_free(slot->proto);
+		slot->proto = NULL;
+	}
+	slot->proto = p;
+	st->icc_proto[s] = IFD_PROTOCOL_TCL;
+	ifd_debug(1, "set protocol to T=CL");
+	return 0;
+}
+
 /*
  * Reset
  */
@@ -1067,6 +1732,15 @@ ccid_card_reset(ifd_reader_t * reader, int slot, void *atr, size_t size)
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	memcpy(atr, buffer, n);
 
+	/* Contactless card: select T=CL now, since there's no
+	 * ATR to pick a default protocol from */
+	if (st->reader_type == TYPE_TPDU && ccid_is_ats(buffer, n)) {
+		ifd_debug(1, "slot %d: got ATS%s", slot, ct_hexdump(buffer, n));
+		r = ccid_set_tcl(reader, slot, buffer, n);
+		if (r < 0)
+			return r;
+	}
+
 	return n;
 }
 
@@ -1103,6 +1777,8 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 			return IFD_ERROR_NOT_SUPPORTED;
 		}
 		break;
+	case IFD_PROTOCOL_TCL:
+		return ccid_set_tcl(reader, s, slot->atr, slot->atr_len);
 	case IFD_PROTOCOL_ESCAPE:
 		/* virtual "escape" fallthrough protocol for stacking RFID
 		 * protocol stack on top of openct */
@@ -1316,22 +1992,24 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 static int ccid_escape(ifd_reader_t * reader, int slot, const void *sbuf,
 		       size_t slen, void *rbuf, size_t rlen)
 {
-	unsigned char sendbuf[CCID_MAX_MSG_LEN];
-	unsigned char recvbuf[CCID_MAX_MSG_LEN];
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
 	int r;
 
 	ifd_debug(1, "slot: %d, slen %d, rlen %d", slot, slen, rlen);
 
-	r = ccid_prepare_cmd(reader, sendbuf, sizeof(sendbuf), slot,
+	if ((r = ccid_slot_buffers(st, slot)) < 0)
+		return r;
+	r = ccid_prepare_cmd(reader, st->cbuf[slot], st->maxmsg, slot,
 			     CCID_CMD_ESCAPE, NULL, sbuf, slen);
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, &sendbuf[0], r, recvbuf, sizeof(recvbuf));
+	r = ccid_command(reader, st->cbuf[slot], r, st->xbuf[slot],
+			 st->maxmsg);
 	if (r < 0)
 		return r;
 
-	return ccid_extract_data(&recvbuf, r, rbuf, rlen);
+	return ccid_extract_data(st->xbuf[slot], r, rbuf, rlen);
 }
 
 static int
@@ -1357,19 +2035,20 @@ static int ccid_send(ifd_reader_t * reader, unsigned int dad,
 	unsigned char *apdu;
 
 	ifd_debug(1, "called.");
-	if (st->sbuf[dad]) {
-		free(st->sbuf[dad]);
-		st->sbuf[dad] = NULL;
-		st->slen[dad] = 0;
-	}
+	st->slen[dad] = 0;
 
-	apdu = (unsigned char *)calloc(1, len);
-	if (!apdu) {
-		ct_error("out of memory");
-		return IFD_ERROR_NO_MEMORY;
+	/* The buffer is kept from one APDU to the next, and
+	 * only ever grows */
+	if (len > st->ssize[dad]) {
+		apdu = (unsigned char *)realloc(st->sbuf[dad], len);
+		if (!apdu) {
+			ct_error("out of memory");
+			return IFD_ERROR_NO_MEMORY;
+		}
+		st->sbuf[dad] = apdu;
+		st->ssize[dad] = len;
 	}
-	memcpy(apdu, buffer, len);
-	st->sbuf[dad] = apdu;
+	memcpy(st->sbuf[dad], buffer, len);
 	st->slen[dad] = len;
 	return 0;
 }
@@ -1384,58 +2063,12 @@ static int ccid_recv(ifd_reader_t * reader, unsigned int dad,
 
 	r = ccid_exchange(reader, dad, st->sbuf[dad], st->slen[dad], buffer,
 			  len);
-	if (st->sbuf[dad])
-		free(st->sbuf[dad]);
-	st->sbuf[dad] = NULL;
 	st->slen[dad] = 0;
 	if (r < 0)
 		ifd_debug(3, "failed: %d", r);
 	return r;
 }
 
-static int ccid_before_command(ifd_reader_t * reader)
-{
-	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	int rc;
-
-	ifd_debug(1, "called.");
-
-	if (!st->events_active) {
-		return 0;
-	}
-
-	if (st->event_cap == NULL) {
-		return 0;
-	}
-
-	rc = ifd_usb_end_capture(reader->device, st->event_cap);
-	st->event_cap = NULL;
-
-	return rc;
-}
-
-static int ccid_after_command(ifd_reader_t * reader)
-{
-	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-
-	ifd_debug(1, "called.");
-
-	if (!st->events_active) {
-		return 0;
-	}
-
-	if (st->event_cap != NULL) {
-		return 0;
-	}
-
-	return ifd_usb_begin_capture(
-		reader->device,
-		IFD_USB_URB_TYPE_INTERRUPT,
-		reader->device->settings.usb.ep_intr,
-		8, &st->event_cap
-	);
-}
-
 static int ccid_get_eventfd(ifd_reader_t * reader, short *events)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
@@ -1443,24 +2076,19 @@ static int ccid_get_eventfd(ifd_reader_t * reader, short *events)
 
 	ifd_debug(1, "called.");
 
-	if (!st->support_events) {
+	if (st->intr_urb == NULL) {
 		return -1;
 	}
 
 	fd = ifd_device_get_eventfd(reader->device, events);
 
-	if (fd != -1) {
-		st->events_active = 1;
-	}
-
 	return fd;
 }
 
 static int ccid_event(ifd_reader_t * reader, int *status, size_t status_size)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	unsigned char ret[20];
-	int bytes;
+	int r, slot;
 
 	ifd_debug(1, "called.");
 
@@ -1468,28 +2096,27 @@ static int ccid_event(ifd_reader_t * reader, int *status, size_t status_size)
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	}
 
-	bytes = ifd_usb_capture_event(reader->device, st->event_cap, ret, 8);
-	if (bytes < 0) {
-		return bytes;
+	r = ifd_usb_reap(reader->device);
+	if (r < 0) {
+		return r;
 	}
 
-	if (bytes > 0 && ret[0] == 0x50) {
-		int slot;
-		ifd_debug(3, "status received:%s", ct_hexdump(ret, bytes));
-		for (slot=0;slot<reader->nslots;slot++) {
-			if (1 + (slot / 4) < bytes) {
-				int bits = (ret[1 + (slot / 4)] >> (2 * (slot % 4))) & 0x3;
-				if (bits & 2)
-					status[slot] |= IFD_CARD_STATUS_CHANGED;
-				if (bits & 1)
-					status[slot] |= IFD_CARD_PRESENT;
-				else
-					status[slot] &= ~IFD_CARD_PRESENT;
+	/* Nothing else wakes us up if the listener is gone */
+	if (st->intr_urb == NULL && (r = ccid_listen(reader)) < 0) {
+		return r;
+	}
 
-				ifd_debug(1, "slot %d event result: %08x", slot, status[slot]);
-				st->icc_present[slot] = status[slot] & IFD_CARD_PRESENT;
-			}
+	if ((r = ccid_probe_slots(reader)) < 0) {
+		return r;
+	}
+
+	for (slot = 0; slot < reader->nslots; slot++) {
+		status[slot] = 0;
+		r = ccid_card_status(reader, slot, &status[slot]);
+		if (r < 0) {
+			return r;
 		}
+		ifd_debug(1, "slot %d event result: %08x", slot, status[slot]);
 	}
 
 	return 0;
@@ -1525,8 +2152,7 @@ void ifd_ccid_register(void)
 	ccid_driver.send = ccid_send;
 	ccid_driver.recv = ccid_recv;
 	ccid_driver.escape = ccid_escape;
-	ccid_driver.before_command = ccid_before_command;
-	ccid_driver.after_command = ccid_after_command;
+	ccid_driver.abort = ccid_abort;
 	ccid_driver.get_eventfd = ccid_get_eventfd;
 	ccid_driver.event = ccid_event;
 	ccid_driver.error = ccid_error;
@@ -391,7 +391,7 @@ static int cyberjack_activate(ifd_reader_t *reader)
 		goto cleanup;
 	}
 	
-	ifd_msleep( 100 );
+	/* no need to pause here, cyberjack_recv_t1 waits for the reply */
 	if( (ret=cyberjack_recv_t1( state, 0xe2, read_buffer ))!=4 || memcmp( read_buffer, "\x2e\xe0\x00\xce", 4 )!=0 )  {
 		cyberjack_ct_error(80, "cyberjack: failed to activate 2: no cookie");
 		goto cleanup;
@@ -10,6 +10,8 @@
 #include <unistd.h>
 
 #define EG_TIMEOUT	1000
+#define EG_BUSY_TIMEOUT	180000	/* longest we wait for the token */
+#define EG_RESET_GRACE	100	/* a busy token is reset after this */
 
 #define EGATE_CMD_SEND_APDU	0x80
 #define EGATE_CMD_READ		0x81
@@ -94,15 +96,24 @@ static int eg_card_status(ifd_reader_t * reader, int slot, int *status)
 	return 0;
 }
 
+static int eg_wait_ready(ifd_reader_t * reader, long timeout,
+			 unsigned char *stat);
+
 static int eg_card_reset(ifd_reader_t * reader, int slot, void *atr,
 			 size_t size)
 {
 	ifd_device_t *dev = reader->device;
-	unsigned char buffer[EGATE_ATR_MAXSIZE];
-	int rc, atrlen, stat;
+	unsigned char buffer[EGATE_ATR_MAXSIZE], stat;
+	int rc, atrlen;
 
 	ifd_debug(1, "called.");
-	usleep(100000);
+	/* Give a busy token a moment to finish, but reset it
+	 * anyway if it doesn't; a stuck token is what resets
+	 * are for */
+	rc = eg_wait_ready(reader, EG_RESET_GRACE, &stat);
+	if (rc < 0 && rc != IFD_ERROR_TIMEOUT)
+		return IFD_ERROR_COMM_ERROR;
+
 	/* Reset the device */
 	rc = ifd_usb_control(dev, EGATE_DIR_OUT, EGATE_CMD_RESET,
 			     0, 0, NULL, 0, EG_TIMEOUT * 2);
@@ -112,14 +123,10 @@ static int eg_card_reset(ifd_reader_t * reader, int slot, void *atr,
 		return IFD_ERROR_COMM_ERROR;
 	}
 
-	usleep(100000);
-	rc = ifd_usb_control(reader->device, EGATE_DIR_IN, EGATE_CMD_STATUS,
-			     0, 0, &stat, 1, EG_TIMEOUT);
-	if (rc != 1)
+	if (eg_wait_ready(reader, EG_TIMEOUT * 2, &stat) < 0)
 		return IFD_ERROR_COMM_ERROR;
 
 	/* Fetch the ATR */
-	usleep(100000);
 	rc = ifd_usb_control(dev, EGATE_DIR_IN, EGATE_CMD_READ_ATR,
 			     0, 0, buffer, EGATE_ATR_MAXSIZE, EG_TIMEOUT);
 	if (rc <= 0)
@@ -161,28 +168,55 @@ static int eg_set_protocol(ifd_reader_t * reader, int s, int proto)
 	return 0;
 }
 
-static unsigned char eg_status(ifd_reader_t * reader)
+typedef struct eg_wait {
+	ifd_reader_t *reader;
+	unsigned char stat;
+} eg_wait_t;
+
+static int eg_status_probe(void *arg)
 {
-	int rc;
+	eg_wait_t *w = (eg_wait_t *) arg;
 	unsigned char stat;
+	int rc;
 
-	/* Shouldn't there be a retry counter that prevents the command
-	 * from hanging indefinitely? Are there scenarios where the
-	 * egate would be busy for more than say 180 secs?    --okir
-	 */
-	while (1) {
-		rc = ifd_usb_control(reader->device, EGATE_DIR_IN,
-				     EGATE_CMD_STATUS, 0, 0, &stat, 1,
-				     EG_TIMEOUT);
-		if (rc != 1)
-			return -1;
-		stat &= EGATE_STATUS_MASK;
-		if (stat != EGATE_STATUS_BUSY) {
-			return stat;
-		}
-		usleep(100);
-	}
+	rc = ifd_usb_control(w->reader->device, EGATE_DIR_IN,
+			     EGATE_CMD_STATUS, 0, 0, &stat, 1, EG_TIMEOUT);
+	if (rc != 1)
+		return IFD_ERROR_COMM_ERROR;
+	stat &= EGATE_STATUS_MASK;
+	if (stat == EGATE_STATUS_BUSY)
+		return 0;
+	w->stat = stat;
+	return 1;
+}
 
+/*
+ * Wait for the token to stop being busy, and return its status
+ */
+static int eg_wait_ready(ifd_reader_t * reader, long timeout,
+			 unsigned char *stat)
+{
+	eg_wait_t w;
+	int rc;
+
+	w.reader = reader;
+	if ((rc = ifd_wait_until(eg_status_probe, &w, timeout)) < 0)
+		return rc;
+	*stat = w.stat;
+	return 0;
+}
+
+/*
+ * Same, for commands in progress. We give up after
+ * EG_BUSY_TIMEOUT rather than hang forever.
+ */
+static unsigned char eg_status(ifd_reader_t * reader)
+{
+	unsigned char stat;
+
+	if (eg_wait_ready(reader, EG_BUSY_TIMEOUT, &stat) < 0)
+		return -1;
+	return stat;
 }
 
 /*
@@ -206,7 +240,6 @@ static int eg_transparent(ifd_reader_t * reader, int dad, const void *inbuffer,
 					     EG_TIMEOUT);
 			if (rc < 0)
 				return IFD_ERROR_COMM_ERROR;
-			usleep(100);
 			stat = eg_status(reader);
 			if (stat == EGATE_STATUS_READY) {
 				ifd_debug(2, "reset succeeded");
@@ -27,6 +27,60 @@ typedef struct eut_priv {
 	int head;
 	int tail;
 } eut_priv_t;
+
+/*
+ * A read returns whatever the token has so far, so we keep
+ * reading until the caller's completion test is satisfied
+ */
+typedef struct eut_read {
+	ifd_device_t *dev;
+	unsigned char *buf;
+	int len, size;
+	int want;
+	long timeout;
+	int (*complete) (struct eut_read *);
+} eut_read_t;
+
+static int eutron_read_probe(void *arg)
+{
+	eut_read_t *r = (eut_read_t *) arg;
+	int rc;
+
+	rc = ifd_usb_control(r->dev, EUTRON_IN, EUTRON_CMD_READ, 0, 0,
+			     r->buf + r->len, r->size - r->len, r->timeout);
+	if (rc < 0)
+		return IFD_ERROR_COMM_ERROR;
+	r->len += rc;
+	return r->complete(r);
+}
+
+static int eutron_read_until(eut_read_t * r, long timeout)
+{
+	return ifd_wait_until(eutron_read_probe, r, timeout);
+}
+
+static int eutron_atr_complete(eut_read_t * r)
+{
+	if (ifd_atr_complete(r->buf, r->len))
+		return 1;
+	if (r->len >= r->size)
+		return IFD_ERROR_COMM_ERROR;
+	return 0;
+}
+
+static int eutron_recv_complete(eut_read_t * r)
+{
+	return r->len >= r->want || r->len >= r->size;
+}
+
+static int eutron_pts_complete(eut_read_t * r)
+{
+	if (ifd_pts_complete(r->buf, r->len))
+		return 1;
+	if (r->len >= r->size)
+		return IFD_ERROR_COMM_ERROR;
+	return 0;
+}
 /*
  * Initialize the device
  */
@@ -99,7 +153,8 @@ static int eutron_card_reset(ifd_reader_t * reader, int slot, void *atr,
 {
 	ifd_device_t *dev = reader->device;
 	unsigned char buffer[IFD_MAX_ATR_LEN + 100];
-	int rc, lr, c, atrlen;
+	eut_read_t r;
+	int atrlen;
 
 	if (ifd_usb_control(dev, EUTRON_OUT, 0xa3, 0, 0, NULL, 0, -1) != 0
 	    || ifd_usb_control(dev, EUTRON_OUT, 0xa1, 0, 0, NULL, 0, -1) != 0
@@ -113,27 +168,16 @@ static int eutron_card_reset(ifd_reader_t * reader, int slot, void *atr,
 	    != 0)
 		goto failed;
 
-	for (lr = 0, c = 0; c < 20; c++) {
-		rc = ifd_usb_control(dev, EUTRON_IN, EUTRON_CMD_READ, 0, 0,
-				     &buffer[lr], IFD_MAX_ATR_LEN - lr, 1000);
-
-		if (rc < 0)
-			goto failed;
-		lr += rc;
-
-		rc = ifd_atr_complete(buffer, lr);
-
-		if (rc)
-			break;
-
-		if (lr > IFD_MAX_ATR_LEN)
-			goto failed;
-		usleep(100000);
-	}
-	if (c >= 20)
+	memset(&r, 0, sizeof(r));
+	r.dev = dev;
+	r.buf = buffer;
+	r.size = IFD_MAX_ATR_LEN;
+	r.timeout = 1000;
+	r.complete = eutron_atr_complete;
+	if (eutron_read_until(&r, 2000) < 0)
 		goto failed;
 
-	atrlen = lr;
+	atrlen = r.len;
 	memcpy(atr, buffer, atrlen);
 
 	return atrlen;
@@ -156,8 +200,8 @@ static int eutron_send(ifd_reader_t * reader, unsigned int dad,
 static int eutron_recv(ifd_reader_t * reader, unsigned int dad,
 		       unsigned char *buffer, size_t len, long timeout)
 {
-	int rc, c, rbs;
 	eut_priv_t *priv = reader->driver_data;
+	eut_read_t r;
 
 	ct_debug("eutron_recv: len=%d", len);
 	if (len <= priv->head - priv->tail) {
@@ -175,22 +219,20 @@ static int eutron_recv(ifd_reader_t * reader, unsigned int dad,
 	priv->head -= priv->tail;
 	/* since we set tail=0 here, the rest of the function can ignore it */
 	priv->tail = 0;
-	for (c = 0; c < 30; c++) {
-		rbs = 499 - priv->head;
-		if (rbs == 0)
-			break;
-
-		rc = ifd_usb_control(reader->device, EUTRON_IN, EUTRON_CMD_READ,
-				     0, 0, &priv->readbuffer[priv->head], rbs,
-				     timeout);
-
-		if (rc < 0)
+	memset(&r, 0, sizeof(r));
+	r.dev = reader->device;
+	r.buf = priv->readbuffer;
+	r.len = priv->head;
+	r.size = 499;
+	r.want = len;
+	r.timeout = timeout;
+	r.complete = eutron_recv_complete;
+	if (r.len < r.size) {
+		int rc = eutron_read_until(&r, 3000);
+
+		priv->head = r.len;
+		if (rc == IFD_ERROR_COMM_ERROR)
 			goto failed;
-		priv->head += rc;
-
-		if (priv->head >= len)
-			break;
-		usleep(100000);
 	}
 	if (len > priv->head)
 		return -1;
@@ -211,7 +253,8 @@ static int eutron_set_protocol(ifd_reader_t * reader, int nslot, int proto)
 	ifd_slot_t *slot;
 	ifd_atr_info_t atr_info;
 	unsigned char pts[7], ptsret[7];
-	int ptslen, ptsrlen, r, c, speedparam;
+	int ptslen, ptsrlen, r, speedparam;
+	eut_read_t rd;
 
 	slot = &reader->slot[nslot];
 	if (proto != IFD_PROTOCOL_T0 && proto != IFD_PROTOCOL_T1) {
@@ -243,23 +286,15 @@ static int eutron_set_protocol(ifd_reader_t * reader, int nslot, int proto)
 	if (eutron_send(reader, slot->dad, pts, ptslen) != ptslen)
 		return IFD_ERROR_COMM_ERROR;
 
-	for (ptsrlen = 0, c = 0; c < 20; c++) {
-		r = ifd_usb_control(reader->device, EUTRON_IN, EUTRON_CMD_READ,
-				    0, 0, &ptsret[ptsrlen],
-				    sizeof(ptsret) - ptsrlen, 1000);
-
-		if (r < 0)
-			return IFD_ERROR_COMM_ERROR;
-		ptsrlen += r;
-		if (ifd_pts_complete(ptsret, ptsrlen))
-			break;
-
-		if (ptsrlen >= 7)
-			return IFD_ERROR_COMM_ERROR;
-		usleep(100000);
-	}
-	if (c >= 20)
-		return IFD_ERROR_TIMEOUT;
+	memset(&rd, 0, sizeof(rd));
+	rd.dev = reader->device;
+	rd.buf = ptsret;
+	rd.size = sizeof(ptsret);
+	rd.timeout = 1000;
+	rd.complete = eutron_pts_complete;
+	if ((r = eutron_read_until(&rd, 2000)) < 0)
+		return r;
+	ptsrlen = rd.len;
 
 	r = ifd_verify_pts(&atr_info, proto, ptsret, ptsrlen);
 	if (r < 0) {
@@ -0,0 +1,244 @@
+/*
+ * Driver for readers exported by "ifdproxy export-reader"
+ *
+ * The reader driver and the card protocol run on the exporting
+ * host; we just forward card status, reset and APDUs, each of
+ * which costs exactly one network round trip.
+ *
+ * Use it like this:
+ *
+ *	reader remote {
+ *		driver = remote;
+ *		device = remote:reader0@proxy;
+ *	};
+ */
+
+#include "internal.h"
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openct/socket.h>
+#include "ria.h"
+
+/* How long to wait for the exporting side to answer a
+ * card command; this includes whatever the card needs
+ * (T=1 waiting time extensions, key generation, ...) */
+#define REMOTE_CARD_TIMEOUT	60000
+
+typedef struct remote_priv {
+	char name[2 * RIA_NAME_MAX];
+	unsigned char proto[OPENCT_MAX_SLOTS];
+} remote_priv_t;
+
+/*
+ * Send a slot command to the exporting side
+ */
+static int remote_call(ifd_reader_t * reader, unsigned char cmd, int slot,
+		       const void *args, size_t args_len,
+		       void *res, size_t res_len, long timeout)
+{
+	ria_client_t *clnt = (ria_client_t *) reader->device->user_data;
+	unsigned char buffer[1 + RIA_APDU_MAX];
+
+	if (clnt == NULL)
+		return IFD_ERROR_DEVICE_DISCONNECTED;
+	if (args_len > RIA_APDU_MAX) {
+		ct_error("remote: %u byte command exceeds the limit of "
+			 "%u bytes", (unsigned int)args_len,
+			 (unsigned int)RIA_APDU_MAX);
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	buffer[0] = slot;
+	if (args_len)
+		memcpy(buffer + 1, args, args_len);
+	return ria_command(clnt, cmd, buffer, 1 + args_len,
+			   res, res_len, timeout);
+}
+
+/*
+ * Initialize the reader
+ */
+static int remote_open(ifd_reader_t * reader, const char *device_name)
+{
+	ria_reader_info_t info;
+	remote_priv_t *priv;
+	ifd_device_t *dev;
+	unsigned int n;
+	int rc;
+
+	if (strncmp(device_name, "remote:", 7)) {
+		ct_error("remote: device %s is not a remote device",
+			 device_name);
+		return -1;
+	}
+
+	if (!(dev = ifd_device_open(device_name)))
+		return -1;
+	if (ifd_device_type(dev) != IFD_DEVICE_TYPE_OTHER) {
+		ct_error("remote: %s is a device, not an exported reader",
+			 device_name);
+		ifd_device_close(dev);
+		return -1;
+	}
+
+	rc = ria_command((ria_client_t *) dev->user_data, RIA_READER_INFO,
+			 NULL, 0, &info, sizeof(info), -1);
+	if (rc < (int)sizeof(info)) {
+		ct_error("remote: unable to get reader info: %s",
+			 ct_strerror(rc < 0 ? rc : IFD_ERROR_INVALID_MSG));
+		ifd_device_close(dev);
+		return -1;
+	}
+	if (info.nslots == 0 || info.nslots > OPENCT_MAX_SLOTS) {
+		ct_error("remote: reader has invalid number of slots (%u)",
+			 info.nslots);
+		ifd_device_close(dev);
+		return -1;
+	}
+
+	if (!(priv = (remote_priv_t *) calloc(1, sizeof(*priv)))) {
+		ct_error("out of memory");
+		ifd_device_close(dev);
+		return IFD_ERROR_NO_MEMORY;
+	}
+	memcpy(priv->name, info.name, sizeof(priv->name) - 1);
+	memset(priv->proto, RIA_PROTOCOL_NONE, sizeof(priv->proto));
+
+	reader->name = priv->name;
+	reader->nslots = info.nslots;
+	reader->device = dev;
+	reader->driver_data = priv;
+
+	/* The transparent protocol hands us the slot's DAD;
+	 * make it the slot number */
+	for (n = 0; n < reader->nslots; n++)
+		reader->slot[n].dad = n;
+
+	ifd_debug(1, "remote reader \"%s\", %u slot(s)", priv->name,
+		  reader->nslots);
+	return 0;
+}
+
+static int remote_close(ifd_reader_t * reader)
+{
+	free(reader->driver_data);
+	reader->driver_data = NULL;
+	return 0;
+}
+
+/*
+ * Card status
+ */
+static int remote_card_status(ifd_reader_t * reader, int slot, int *status)
+{
+	uint32_t val;
+	int rc;
+
+	rc = remote_call(reader, RIA_CARD_STATUS, slot, NULL, 0,
+			 &val, sizeof(val), -1);
+	if (rc < 0)
+		return rc;
+	if (rc < (int)sizeof(val))
+		return IFD_ERROR_INVALID_MSG;
+	*status = ntohl(val);
+	return 0;
+}
+
+/*
+ * Reset the card. The exporting side selects the protocol
+ * as part of the reset, and tells us which one it picked.
+ */
+static int remote_card_reset(ifd_reader_t * reader, int slot, void *atr,
+			     size_t size)
+{
+	remote_priv_t *priv = (remote_priv_t *) reader->driver_data;
+	unsigned char buffer[1 + IFD_MAX_ATR_LEN];
+	int rc;
+
+	priv->proto[slot] = RIA_PROTOCOL_NONE;
+	rc = remote_call(reader, RIA_CARD_RESET, slot, NULL, 0,
+			 buffer, sizeof(buffer), REMOTE_CARD_TIMEOUT);
+	if (rc < 0)
+		return rc;
+	if (rc < 1)
+		return IFD_ERROR_INVALID_MSG;
+	if (rc - 1 > (int)size)
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+
+	priv->proto[slot] = buffer[0];
+	memcpy(atr, buffer + 1, rc - 1);
+	return rc - 1;
+}
+
+/*
+ * Select a protocol. Whatever the remote end uses, we talk
+ * to it through the transparent protocol.
+ */
+static int remote_set_protocol(ifd_reader_t * reader, int nslot, int proto)
+{
+	remote_priv_t *priv = (remote_priv_t *) reader->driver_data;
+	ifd_slot_t *slot = &reader->slot[nslot];
+	ifd_protocol_t *p;
+	uint32_t val;
+	int rc;
+
+	/* Don't go back to the remote side just to confirm
+	 * the protocol it selected when resetting the card */
+	if (proto < 0 || proto != priv->proto[nslot]) {
+		val = htonl(proto);
+		rc = remote_call(reader, RIA_CARD_SET_PROTOCOL, nslot,
+				 &val, sizeof(val), NULL, 0, -1);
+		if (rc < 0)
+			return rc;
+		priv->proto[nslot] = proto < 0 ? RIA_PROTOCOL_NONE : proto;
+	}
+
+	if (slot->proto && slot->proto->ops->id == IFD_PROTOCOL_TRANSPARENT)
+		return 0;
+
+	p = ifd_protocol_new(IFD_PROTOCOL_TRANSPARENT, reader, slot->dad);
+	if (p == NULL) {
+		ct_error("%s: internal error", reader->name);
+		return IFD_ERROR_GENERIC;
+	}
+	if (slot->proto) {
+		ifd_protocol_free(slot->proto);
+		slot->proto = NULL;
+	}
+	slot->proto = p;
+	return 0;
+}
+
+/*
+ * Exchange an APDU
+ */
+static int remote_transparent(ifd_reader_t * reader, int dad,
+			      const void *sbuf, size_t slen,
+			      void *rbuf, size_t rlen)
+{
+	return remote_call(reader, RIA_CARD_TRANSACT, dad, sbuf, slen,
+			   rbuf, rlen, REMOTE_CARD_TIMEOUT);
+}
+
+/*
+ * Driver operations
+ */
+static struct ifd_driver_ops remote_driver;
+
+/*
+ * Initialize this module
+ */
+void ifd_remote_register(void)
+{
+	remote_driver.open = remote_open;
+	remote_driver.close = remote_close;
+	remote_driver.card_status = remote_card_status;
+	remote_driver.card_reset = remote_card_reset;
+	remote_driver.set_protocol = remote_set_protocol;
+	remote_driver.transparent = remote_transparent;
+
+	ifd_driver_register("remote", &remote_driver);
+}
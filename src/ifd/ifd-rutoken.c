@@ -72,28 +72,53 @@ static int rutoken_deactivate(ifd_reader_t * reader)
 	return -1;
 }
 
+/*
+ * While busy, the token counts up in the low nibble of the
+ * status byte to show it is still working on the command.
+ */
+typedef struct rutoken_wait {
+	ifd_reader_t *reader;
+	unsigned char status;
+	int progress;
+} rutoken_wait_t;
+
+static int rutoken_status_probe(void *arg)
+{
+	rutoken_wait_t *w = (rutoken_wait_t *) arg;
+	unsigned char status;
+
+	if(ifd_usb_control(w->reader->device, 0xc1, USB_ICC_GET_STATUS,
+				0, 0, &status, 1, 1000) < 0)
+		return -1;
+	if((status & 0xF0) != ICC_STATUS_BUSY_COMMON) {
+		w->status = status;
+		return 1;
+	}
+	if((status & 0x0F) != (w->status & 0x0F))
+		w->progress = 1;
+	w->status = status;
+	return 0;
+}
+
 static int rutoken_getstatus(ifd_reader_t * reader, unsigned char *status)
 {
+	rutoken_wait_t w;
+	int rc;
+
 	if(ifd_usb_control(reader->device, 0xc1, USB_ICC_GET_STATUS, 
 				0, 0, status, 1, 1000) < 0 )
 		return -1;
 	if((*status & 0xF0) == ICC_STATUS_BUSY_COMMON){
-		unsigned char prev_status;
-		int i;
-		for(i = 0; i < 200; i++) { // 2 s  (200 * 10 ms)
-			do {
-				usleep(10000); // 10 ms
-				prev_status = *status;
-				if(ifd_usb_control(reader->device, 0xc1, 
-							USB_ICC_GET_STATUS, 0, 0, 
-							status, 1, 1000) < 0
-				)
-				return -1;
-			if((*status & 0xF0) != ICC_STATUS_BUSY_COMMON)
-					return *status;
-			} while((((prev_status & 0x0F) + 1) & 0x0F) == (*status & 0x0F));
-		}
-		return -1;
+		w.reader = reader;
+		w.status = *status;
+		/* Give up if the token makes no progress for 2 s */
+		do {
+			w.progress = 0;
+			rc = ifd_wait_until(rutoken_status_probe, &w, 2000);
+		} while(rc == IFD_ERROR_TIMEOUT && w.progress);
+		if(rc < 0)
+			return -1;
+		*status = w.status;
 	}
 	return *status;
 }
@@ -237,6 +237,30 @@ static int smph_card_status(ifd_reader_t * reader, int slot, int *status)
   return 0;
 }
 
+/*
+ * Card presence is signalled on CTS, so we can wait for it
+ * to change instead of polling
+ */
+static int smph_get_eventfd(ifd_reader_t * reader, short *events)
+{
+  ifd_device_t *dev = reader->device;
+
+  if (ifd_serial_watch_lines(dev, IFD_SERIAL_LINE_CTS) < 0)
+    return -1;
+  return ifd_device_get_eventfd(dev, events);
+}
+
+static int smph_event(ifd_reader_t * reader, int *status, size_t status_size)
+{
+  int lines;
+
+  if ((lines = ifd_serial_line_event(reader->device)) < 0)
+    return lines;
+
+  status[0] = (lines & IFD_SERIAL_LINE_CTS) ? 0 : IFD_CARD_PRESENT;
+  return 0;
+}
+
 /*
  * Reset the card and get the ATR
  */
@@ -379,6 +403,8 @@ void ifd_smph_register(void)
   phx_driver.activate = smph_activate;
   phx_driver.deactivate = smph_deactivate;
   phx_driver.card_status = smph_card_status;
+  phx_driver.get_eventfd = smph_get_eventfd;
+  phx_driver.event = smph_event;
   phx_driver.card_reset = smph_card_reset;
   phx_driver.send = smph_send;
   phx_driver.recv = smph_recv;
@@ -389,6 +415,8 @@ void ifd_smph_register(void)
   smtm_driver.activate = smph_activate;
   smtm_driver.deactivate = smph_deactivate;
   smtm_driver.card_status = smph_card_status;
+  smtm_driver.get_eventfd = smph_get_eventfd;
+  smtm_driver.event = smph_event;
   smtm_driver.card_reset = smph_card_reset;
   smtm_driver.send = smph_send;
   smtm_driver.recv = smph_recv;
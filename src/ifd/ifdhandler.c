@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
@@ -28,6 +30,9 @@
 #include <openct/socket.h>
 #include <openct/device.h>
 #include <openct/server.h>
+#include <openct/protocol.h>
+#include <openct/tlv.h>
+#include <openct/error.h>
 
 #include "ifdhandler.h"
 
@@ -38,6 +43,26 @@ static int opt_info = 0;
 static int opt_poll = 0;
 static const char *opt_reader = NULL;
 
+/*
+ * Requests being processed, so that a CT_CMD_ABORT arriving in the
+ * meantime can be matched against them.
+ *
+ * While a driver waits for a slow card, it asks us whether the
+ * client has given up. We use the occasion to serve other clients
+ * whose requests don't need the busy slot; they run to completion
+ * on top of the request that is waiting. So this is a stack, and
+ * only its top entry is actually running.
+ */
+#define IFDHANDLER_MAX_NESTED	(OPENCT_MAX_SLOTS + 1)
+
+static struct {
+	ct_socket_t *sock;
+	uint32_t xid;
+	unsigned char unit;
+	int aborted;
+} inflight[IFDHANDLER_MAX_NESTED];
+static unsigned int ninflight;
+
 static void usage(int exval);
 static void version(void);
 static void ifdhandler_run(ifd_reader_t *);
@@ -48,6 +73,7 @@ static int ifdhandler_error(ct_socket_t *);
 static int ifdhandler_recv(ct_socket_t *);
 static int ifdhandler_send(ct_socket_t *);
 static void ifdhandler_close(ct_socket_t *);
+static int ifdhandler_check_abort(ifd_reader_t *);
 static void print_info(void);
 
 int main(int argc, char **argv)
@@ -175,6 +201,7 @@ int main(int argc, char **argv)
 	}
 
 	ifd_device_set_hotplug(reader->device, opt_hotplug);
+	reader->check_abort = ifdhandler_check_abort;
 
 	reader->status = status;
 	strncpy(status->ct_name, reader->name, sizeof(status->ct_name) - 1);
@@ -247,6 +274,7 @@ static void ifdhandler_run(ifd_reader_t * reader)
 		ifd_debug(1, "events active for reader %s", reader->name);
 		sock->error = ifdhandler_error;
 		sock->send = ifdhandler_event;
+		sock->recv = ifdhandler_event;
 		ifd_before_command(reader);
 		ifd_poll(reader);
 		ifd_after_command(reader);
@@ -309,8 +337,17 @@ static int ifdhandler_error(ct_socket_t * sock)
 static int ifdhandler_event(ct_socket_t * sock)
 {
 	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
+	int rc;
 
-	if (ifd_event(reader) < 0) {
+	rc = ifd_event(reader);
+	if (rc == IFD_ERROR_NOT_SUPPORTED) {
+		/* The event source went away; fall back to polling */
+		ifd_debug(1, "events inactive for reader %s", reader->name);
+		sock->fd = 0x7FFFFFFF;
+		sock->poll = ifdhandler_poll_presence;
+		return 0;
+	}
+	if (rc < 0) {
 		exit_on_device_disconnect(reader);
 	}
 
@@ -343,11 +380,20 @@ static int ifdhandler_recv(ct_socket_t * sock)
 	char buffer[CT_SOCKET_BUFSIZ + 64];
 	header_t header;
 	ct_buf_t args, resp;
-	int rc;
-
-	/* Error or client closed connection? */
-	if ((rc = ct_socket_filbuf(sock, -1)) <= 0)
+	unsigned char unit;
+	int rc, aborted;
+
+	/* Don't block: a request served while another one waited
+	 * for the card may have drained the socket since the main
+	 * loop polled it */
+	rc = ct_socket_filbuf(sock, 0);
+	if (rc == IFD_ERROR_TIMEOUT) {
+		if (!ct_buf_avail(&sock->rbuf))
+			return 0;
+	} else if (rc <= 0) {
+		/* Error or client closed connection */
 		return -1;
+	}
 
 	/* If request is incomplete, go back
 	 * and wait for more
@@ -358,8 +404,33 @@ static int ifdhandler_recv(ct_socket_t * sock)
 	ct_buf_init(&resp, buffer, sizeof(buffer));
 
 	reader = (ifd_reader_t *) sock->user_data;
+
+	if (ninflight == IFDHANDLER_MAX_NESTED) {
+		ct_error("too many nested requests");
+		return -1;
+	}
+	unit = ct_buf_avail(&args) >= 2 ?
+	    ((unsigned char *)ct_buf_head(&args))[1] : 0xFF;
+	inflight[ninflight].sock = sock;
+	inflight[ninflight].xid = header.xid;
+	inflight[ninflight].unit = unit;
+	inflight[ninflight].aborted = 0;
+	ninflight++;
+
 	header.error = ifdhandler_process(sock, reader, &args, &resp);
 
+	ninflight--;
+	aborted = inflight[ninflight].aborted;
+	memset(&inflight[ninflight], 0, sizeof(inflight[0]));
+
+	/* Clean up only now, so that drivers no longer see the abort */
+	if (aborted) {
+		ifd_debug(1, "request %u aborted", header.xid);
+		if (unit < reader->nslots)
+			ifd_card_abort(reader, unit);
+		header.error = IFD_ERROR_USER_ABORT;
+	}
+
 	if (header.error)
 		ct_buf_clear(&resp);
 
@@ -372,6 +443,177 @@ static int ifdhandler_recv(ct_socket_t * sock)
 	return 0;
 }
 
+/*
+ * Peek at the header and the first bytes of the next packet
+ * waiting on a client connection, without taking it off the
+ * socket. Returns the number of bytes of the packet body that
+ * are in buf.
+ */
+static int ifdhandler_peek(ct_socket_t * sock, unsigned char *buf,
+			   size_t size, header_t * hdr)
+{
+	int n;
+
+	if (sock->recv != ifdhandler_recv || ct_buf_avail(&sock->rbuf))
+		return -1;
+
+	n = recv(sock->fd, buf, size, MSG_PEEK | MSG_DONTWAIT);
+	if (n < (int)sizeof(*hdr) + 2)
+		return -1;
+	memcpy(hdr, buf, sizeof(*hdr));
+	if (sock->use_network_byte_order)
+		hdr->count = ntohs(hdr->count);
+	if (hdr->count < 2)
+		return -1;
+	return n - sizeof(*hdr);
+}
+
+/*
+ * See whether the next packet waiting on a client connection
+ * is an abort for a request in progress. It is only peeked at,
+ * and answered in due course like any other request.
+ */
+static int ifdhandler_peek_abort(ct_socket_t * sock, void *user_data)
+{
+	unsigned char buf[sizeof(header_t) + 64], *body;
+	header_t hdr;
+	ct_buf_t data;
+	ct_tlv_parser_t args;
+	unsigned int xid = 0, i;
+	int n;
+
+	n = ifdhandler_peek(sock, buf, sizeof(buf), &hdr);
+	if (n < 0 || n < hdr.count)
+		return 0;
+	body = buf + sizeof(hdr);
+	if (body[0] != CT_CMD_ABORT)
+		return 0;
+
+	ct_buf_set(&data, body + 2, hdr.count - 2);
+	memset(&args, 0, sizeof(args));
+	if (ct_tlv_parse(&args, &data) < 0)
+		return 0;
+	ct_tlv_get_int(&args, CT_TAG_XID, &xid);
+
+	for (i = 0; i < ninflight; i++) {
+		if (inflight[i].aborted || inflight[i].unit != body[1]
+		    || sock->client_id != inflight[i].sock->client_id
+		    || sock->client_uid != inflight[i].sock->client_uid)
+			continue;
+		if (xid && xid != inflight[i].xid)
+			continue;
+		inflight[i].aborted = 1;
+	}
+	return 0;
+}
+
+/*
+ * Can this request run now, on top of those in progress?
+ * Locking is mere bookkeeping, and so is the reader status.
+ * Anything else needs a driver that copes with commands for
+ * several slots at the same time, and a slot that is not busy;
+ * except for the card status, which such drivers answer from
+ * what they know while a command is running.
+ */
+static int ifdhandler_can_nest(ifd_reader_t * reader, unsigned char cmd,
+			       unsigned char unit)
+{
+	unsigned int i;
+
+	switch (cmd) {
+	case CT_CMD_LOCK:
+	case CT_CMD_UNLOCK:
+	case CT_CMD_ABORT:
+		return 1;
+	case CT_CMD_STATUS:
+		return unit == CT_UNIT_READER
+		    || (reader->flags & IFD_READER_CONCURRENT);
+	}
+
+	if (!(reader->flags & IFD_READER_CONCURRENT)
+	    || unit >= reader->nslots)
+		return 0;
+	for (i = 0; i < ninflight; i++) {
+		if (inflight[i].unit == unit)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Serve a client while another request waits for the card
+ */
+static int ifdhandler_serve_nested(ct_socket_t * sock, void *user_data)
+{
+	ifd_reader_t *reader = (ifd_reader_t *) user_data;
+	unsigned char buf[sizeof(header_t) + 2];
+	header_t hdr;
+	unsigned int i;
+
+	if (ninflight == IFDHANDLER_MAX_NESTED)
+		return 1;
+
+	/* A client waiting for an answer doesn't send anything
+	 * but aborts, which are taken care of */
+	for (i = 0; i < ninflight; i++) {
+		if (inflight[i].sock == sock)
+			return 0;
+	}
+
+	if (ifdhandler_peek(sock, buf, sizeof(buf), &hdr) < 0
+	    || !ifdhandler_can_nest(reader, buf[sizeof(hdr)],
+				    buf[sizeof(hdr) + 1]))
+		return 0;
+
+	/* Release the client's locks right away; the main loop
+	 * frees the socket once we're back */
+	if (ifdhandler_recv(sock) < 0 || ifdhandler_send(sock) < 0) {
+		ifdhandler_unlock_all(sock);
+		ct_socket_close(sock);
+	}
+	return 0;
+}
+
+/*
+ * Has the client gone away while we work on its request?
+ */
+static int ifdhandler_hungup(ct_socket_t * sock)
+{
+	struct pollfd pfd;
+	char c;
+
+	pfd.fd = sock->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (pfd.revents & (POLLHUP | POLLERR))
+		return 1;
+	return (pfd.revents & POLLIN)
+	    && recv(sock->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/*
+ * Called by drivers while they wait for the card
+ */
+static int ifdhandler_check_abort(ifd_reader_t * reader)
+{
+	unsigned int i;
+
+	if (ninflight == 0)
+		return 0;
+	for (i = 0; i < ninflight; i++) {
+		if (!inflight[i].aborted
+		    && ifdhandler_hungup(inflight[i].sock)) {
+			ifd_debug(1, "client gone, aborting request %u",
+				  inflight[i].xid);
+			inflight[i].aborted = 1;
+		}
+	}
+	ct_mainloop_foreach(ifdhandler_peek_abort, NULL);
+	ct_mainloop_foreach(ifdhandler_serve_nested, reader);
+	return inflight[ninflight - 1].aborted;
+}
+
 /*
  * Transmit data to client
  */
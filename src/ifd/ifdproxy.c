@@ -43,6 +43,7 @@ static const char *opt_user = NULL;
 static int get_ports(void);
 static int run_server(int, char **);
 static int run_client(int, char **);
+static int run_reader_client(int, char **);
 static int list_devices(int, char **);
 static void usage(int);
 static void version(void);
@@ -96,6 +97,8 @@ int main(int argc, char **argv)
 		run_server(argc - optind, argv + optind);
 	} else if (!strcmp(command, "export")) {
 		return run_client(argc - optind, argv + optind);
+	} else if (!strcmp(command, "export-reader")) {
+		return run_reader_client(argc - optind, argv + optind);
 	} else if (!strcmp(command, "list")) {
 		list_devices(argc - optind, argv + optind);
 	} else if (!strcmp(command, "version")) {
@@ -204,29 +207,61 @@ static int run_server(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Export one or more devices. With several, they all
+ * share one connection to the proxy.
+ */
 static int run_client(int argc, char **argv)
 {
-	const char *name, *device, *address;
-	ria_client_t *ria;
-	int rc;
+	const char *address;
+	int n;
 
 	/* Initialize IFD library */
 	if (ifd_init())
 		return 1;
 
-	if (argc != 2 && argc != 3)
+	if (argc < 2)
 		usage(1);
-	name = argv[0];
-	device = argv[1];
-	address = argc == 3 ? argv[2] : opt_device_port;
+	address = opt_device_port;
+	if (argc & 1)
+		address = argv[--argc];
 
-	ria = ria_export_device(address, device);
+	for (n = 0; n < argc; n += 2)
+		ria_export_device(argv[n], argv[n + 1]);
+	ria_export_start(address);
 
-	ifd_debug(1, "About to register device as \"%s\"", name);
-	if ((rc = ria_register_device(ria, name)) < 0) {
-		ct_error("Unable to register device: %s\n", ct_strerror(rc));
-		exit(1);
-	}
+	enter_jail();
+	if (!opt_foreground)
+		background_process();
+
+	ct_mainloop();
+	return 0;
+}
+
+/*
+ * Export readers at the command level; the driver runs
+ * here, and the peer only sees status, reset and APDUs.
+ */
+static int run_reader_client(int argc, char **argv)
+{
+	const char *address;
+	int n;
+
+	/* Initialize IFD library */
+	if (ifd_init())
+		return 1;
+
+	if (argc < 3)
+		usage(1);
+	address = opt_device_port;
+	if (argc % 3 == 1)
+		address = argv[--argc];
+	else if (argc % 3 != 0)
+		usage(1);
+
+	for (n = 0; n < argc; n += 3)
+		ria_export_reader(argv[n], argv[n + 1], argv[n + 2]);
+	ria_export_start(address);
 
 	enter_jail();
 	if (!opt_foreground)
@@ -238,10 +273,11 @@ static int run_client(int argc, char **argv)
 
 static int list_devices(int argc, char **argv)
 {
-	unsigned char buffer[8192];
+	unsigned char buffer[RIA_LIST_MAX * sizeof(ria_device_t)];
 	ria_device_t *info;
 	ria_client_t *clnt;
-	unsigned int n, count;
+	unsigned int n, count, total = 0;
+	uint32_t start;
 	int rc;
 
 	if (argc == 1)
@@ -251,27 +287,31 @@ static int list_devices(int argc, char **argv)
 
 	if (!(clnt = ria_connect(opt_server_port)))
 		exit(1);
-	rc = ria_command(clnt, RIA_MGR_LIST, NULL, 0, buffer, sizeof(buffer),
-			 -1);
-	if (rc < 0) {
-		ct_error("Failed to list exported devices: %s",
-			 ct_strerror(rc));
-		ria_free(clnt);
-		return 1;
-	}
 
-	count = rc / sizeof(ria_device_t);
-	if (count == 0) {
-		printf("No exported devices\n");
-		ria_free(clnt);
-		return 0;
-	}
+	do {
+		start = htonl(total);
+		rc = ria_command(clnt, RIA_MGR_LIST, &start, sizeof(start),
+				 buffer, sizeof(buffer), -1);
+		if (rc < 0) {
+			ct_error("Failed to list exported devices: %s",
+				 ct_strerror(rc));
+			ria_free(clnt);
+			return 1;
+		}
 
-	printf("Exported devices\n");
-	for (info = (ria_device_t *) buffer, n = 0; n < count; info++, n++) {
-		printf("  %-16s %-30s %s\n",
-		       info->handle, info->address, info->name);
-	}
+		count = rc / sizeof(ria_device_t);
+		if (count && total == 0)
+			printf("Exported devices\n");
+		for (info = (ria_device_t *) buffer, n = 0; n < count;
+		     info++, n++) {
+			printf("  %-16s %-30s %s\n",
+			       info->handle, info->address, info->name);
+		}
+		total += count;
+	} while (count == RIA_LIST_MAX);
+
+	if (total == 0)
+		printf("No exported devices\n");
 
 	ria_free(clnt);
 	return 0;
@@ -288,7 +328,9 @@ static void usage(int exval)
 	fprintf(exval ? stderr : stdout,
 		"Usage:\n"
 		"ifdproxy server [-dF]\n"
-		"ifdproxy export [-dF] name device address\n"
+		"ifdproxy export [-dF] name device [name device ...] address\n"
+		"ifdproxy export-reader [-dF] name driver device "
+		"[name driver device ...] address\n"
 		"ifdproxy list [-dF] address\n" "ifdproxy version\n");
 	exit(exval);
 }
@@ -44,6 +44,7 @@ int ifd_init(void)
 	ifd_rutoken_register();
 	/* ifd_wbeiuu_register();	driver not working yet */
 	ifd_cyberjack_register();	
+	ifd_remote_register();
 	/* ccid last */
 	ifd_ccid_register();
 
@@ -58,6 +59,7 @@ int ifd_init(void)
 	ifd_protocol_register(&ifd_protocol_3wire);
 	ifd_protocol_register(&ifd_protocol_eurochip);
 	ifd_protocol_register(&ifd_protocol_esc);
+	ifd_protocol_register(&ifd_protocol_tcl);
 
 	if (ifd_conf_get_integer("debug", &ival) >= 0 && ival > ct_config.debug)
 		ct_config.debug = ival;
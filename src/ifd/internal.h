@@ -22,6 +22,8 @@
 #include <openct/error.h>
 #include <openct/buffer.h>
 
+typedef struct ifd_serial_watch ifd_serial_watch_t;
+
 struct ifd_device {
 	char *name;
 	int type;
@@ -36,6 +38,7 @@ struct ifd_device {
 	struct ifd_device_ops *ops;
 
 	void *user_data;
+	void *sysdep_data;	/* owned by the sys-* layer */
 
 	/* per-device data may follow */
 
@@ -116,6 +119,7 @@ extern struct ifd_protocol_ops ifd_protocol_2wire;
 extern struct ifd_protocol_ops ifd_protocol_3wire;
 extern struct ifd_protocol_ops ifd_protocol_eurochip;
 extern struct ifd_protocol_ops ifd_protocol_esc;
+extern struct ifd_protocol_ops ifd_protocol_tcl;
 
 extern void ifd_acr30u_register(void);
 extern void ifd_cardman_register(void);
@@ -139,6 +143,7 @@ extern void ifd_towitoko_register(void);
 /* extern void ifd_wbeiuu_register(void); driver not working yet */
 extern void ifd_cyberjack_register(void);
 extern void ifd_rutoken_register(void);
+extern void ifd_remote_register(void);
 
 /* reader.c */
 extern int ifd_error(ifd_reader_t *);
@@ -161,8 +166,11 @@ extern ifd_device_t *ifd_device_new(const char *,
 extern void ifd_device_free(ifd_device_t *);
 
 /* checksum.c */
+#define CSUM_CRC_INIT	0xFFFF
 extern unsigned int csum_lrc_compute(const uint8_t *, size_t, unsigned char *);
 extern unsigned int csum_crc_compute(const uint8_t *, size_t, unsigned char *);
+extern unsigned char csum_lrc_update(unsigned char, const uint8_t *, size_t);
+extern unsigned short csum_crc_update(unsigned short, const uint8_t *, size_t);
 
 /* Internal system dependent device functions */
 extern int ifd_sysdep_usb_poll_presence(ifd_device_t *, struct pollfd *);
@@ -184,8 +192,24 @@ extern int ifd_sysdep_usb_capture_event(ifd_device_t *, ifd_usb_capture_t *,
 extern int ifd_sysdep_usb_capture(ifd_device_t *, ifd_usb_capture_t *, void *,
 				  size_t, long);
 extern int ifd_sysdep_usb_end_capture(ifd_device_t *, ifd_usb_capture_t * cap);
+extern int ifd_sysdep_usb_submit(ifd_device_t *, int, int, void *, size_t,
+				 ifd_usb_urb_complete_t *, void *,
+				 ifd_usb_urb_t **);
+extern int ifd_sysdep_usb_resubmit(ifd_device_t *, ifd_usb_urb_t *);
+extern int ifd_sysdep_usb_reap(ifd_device_t *);
+extern int ifd_sysdep_usb_wait(ifd_device_t *, ifd_usb_urb_t *, long);
+extern int ifd_sysdep_usb_cancel(ifd_device_t *, ifd_usb_urb_t *);
+extern void ifd_sysdep_usb_free_urb(ifd_device_t *, ifd_usb_urb_t *);
 extern int ifd_sysdep_usb_open(const char *device);
+extern void ifd_sysdep_usb_close(ifd_device_t *);
 extern int ifd_sysdep_usb_reset(ifd_device_t *);
+extern int ifd_sysdep_usb_get_descriptors(ifd_device_t *, unsigned char *,
+					  size_t);
+extern int ifd_sysdep_serial_low_latency(ifd_device_t *);
+extern int ifd_sysdep_serial_watch(ifd_device_t *, int,
+				   ifd_serial_watch_t **);
+extern int ifd_sysdep_serial_watch_ack(ifd_serial_watch_t *);
+extern void ifd_sysdep_serial_unwatch(ifd_serial_watch_t *);
 
 /* module.c */
 extern int ifd_load_module(const char *, const char *);
@@ -194,6 +218,7 @@ extern int ifd_load_module(const char *, const char *);
 extern void ifd_revert_bits(unsigned char *, size_t);
 extern unsigned int ifd_count_bits(unsigned int);
 extern long ifd_time_elapsed(struct timeval *);
+extern int ifd_wait_until(int (*)(void *), void *, long);
 #ifndef HAVE_DAEMON
 extern int daemon(int, int);
 #endif
@@ -206,4 +231,7 @@ extern unsigned int ifd_protocols_list(const char **, unsigned int);
 /* proto-t1.c */
 extern int t1_negotiate_ifsd(ifd_protocol_t *, unsigned int, int);
 
+/* proto-tcl.c */
+extern int tcl_parse_ats(ifd_protocol_t *, const unsigned char *, size_t);
+
 #endif				/* IFD_INTERNAL_H */
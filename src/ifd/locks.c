@@ -13,6 +13,7 @@
 
 #include "internal.h"
 #include <stdlib.h>
+#include <string.h>
 #include "ifdhandler.h"
 
 typedef struct ct_lock {
@@ -25,8 +26,15 @@ typedef struct ct_lock {
 } ct_lock_t;
 
 static ct_lock_t *locks;
+static ct_lock_t *free_locks;	/* released, kept for reuse */
 static unsigned int lock_handle = 0;
 
+static void ct_lock_release(ct_lock_t * l)
+{
+	l->next = free_locks;
+	free_locks = l;
+}
+
 /*
  * Try to establish a lock
  */
@@ -41,8 +49,10 @@ int ifdhandler_lock(ct_socket_t * sock, int slot, int type,
 		return rc;
 
 	/* No conflict - grant lock and record this fact */
-	l = (ct_lock_t *) calloc(1, sizeof(*l));
-	if (!l) {
+	if ((l = free_locks) != NULL) {
+		free_locks = l->next;
+		memset(l, 0, sizeof(*l));
+	} else if (!(l = (ct_lock_t *) calloc(1, sizeof(*l)))) {
 		ct_error("out of memory");
 		return IFD_ERROR_NO_MEMORY;
 	}
@@ -99,7 +109,7 @@ int ifdhandler_unlock(ct_socket_t * sock, int slot, ct_lock_handle handle)
 				  l->handle, l->slot, l->uid);
 
 			*lp = l->next;
-			free(l);
+			ct_lock_release(l);
 			return 0;
 		}
 	}
@@ -123,7 +133,7 @@ void ifdhandler_unlock_all(ct_socket_t * sock)
 				  l->exclusive ? "excl" : "shared",
 				  l->handle, l->slot, l->uid);
 			*lp = l->next;
-			free(l);
+			ct_lock_release(l);
 		} else {
 			lp = &l->next;
 		}
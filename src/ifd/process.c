@@ -38,9 +38,11 @@ static struct cmd_name {
 	CT_CMD_CHANGE_PIN, "CT_CMD_CHANGE_PIN"}, {
 	CT_CMD_MEMORY_READ, "CT_CMD_MEMORY_READ"}, {
 	CT_CMD_MEMORY_WRITE, "CT_CMD_MEMORY_WRITE"}, {
+	CT_CMD_MEMORY_CHECKSUM, "CT_CMD_MEMORY_CHECKSUM"}, {
 	CT_CMD_TRANSACT_OLD, "CT_CMD_TRANSACT_OLD"}, {
 	CT_CMD_TRANSACT, "CT_CMD_TRANSACT"}, {
 	CT_CMD_SET_PROTOCOL, "CT_CMD_SET_PROTOCOL"}, {
+	CT_CMD_ABORT, "CT_CMD_ABORT"}, {
 0, NULL},};
 
 static const char *get_cmd_name(unsigned int cmd)
@@ -74,6 +76,8 @@ static int do_memory_read(ifd_reader_t *, int,
 			  ct_tlv_parser_t *, ct_tlv_builder_t *);
 static int do_memory_write(ifd_reader_t *, int,
 			   ct_tlv_parser_t *, ct_tlv_builder_t *);
+static int do_memory_checksum(ifd_reader_t *, int,
+			      ct_tlv_parser_t *, ct_tlv_builder_t *);
 static int do_transact_old(ifd_reader_t *, int, ct_buf_t *, ct_buf_t *);
 static int do_set_protocol(ifd_reader_t *, int,
 			   ct_tlv_parser_t *, ct_tlv_builder_t *);
@@ -154,12 +158,21 @@ int ifdhandler_process(ct_socket_t * sock, ifd_reader_t * reader,
 		rc = do_memory_write(reader, unit, &args, &resp);
 		break;
 
+	case CT_CMD_MEMORY_CHECKSUM:
+		rc = do_memory_checksum(reader, unit, &args, &resp);
+		break;
+
 	case CT_CMD_TRANSACT:
 		rc = do_transact(reader, unit, &args, &resp);
 		break;
 	case CT_CMD_SET_PROTOCOL:
 		rc = do_set_protocol(reader, unit, &args, &resp);
 		break;
+	case CT_CMD_ABORT:
+		/* If the request was still in progress, the driver has
+		 * seen this already; by now there is nothing left to do */
+		rc = 0;
+		break;
 	default:
 		return IFD_ERROR_INVALID_CMD;
 	}
@@ -451,7 +464,7 @@ static int do_memory_write(ifd_reader_t * reader, int unit,
 {
 	unsigned char *data;
 	unsigned int data_len;
-	unsigned int address;
+	unsigned int address, verify;
 	int rc;
 
 	if (unit > reader->nslots)
@@ -461,6 +474,18 @@ static int do_memory_write(ifd_reader_t * reader, int unit,
 	    || !ct_tlv_get_opaque(args, CT_TAG_DATA, &data, &data_len))
 		return IFD_ERROR_MISSING_ARG;
 
+	/* Older clients don't send this, and expect every
+	 * page to be read back */
+	if (ct_tlv_get_int(args, CT_TAG_VERIFY, &verify) == 0)
+		verify = IFD_MEMORY_VERIFY_PAGE;
+
+	/* Only the synchronous protocols know about write verification */
+	if ((unsigned int)unit < reader->nslots && reader->slot[unit].proto
+	    && reader->slot[unit].proto->ops->sync_write)
+		ifd_protocol_set_parameter(reader->slot[unit].proto,
+					   IFD_PROTOCOL_WRITE_VERIFY,
+					   verify == IFD_MEMORY_VERIFY_PAGE);
+
 	rc = ifd_card_write_memory(reader, unit, address, data, data_len);
 	if (rc < 0)
 		return rc;
@@ -471,7 +496,7 @@ static int do_memory_write(ifd_reader_t * reader, int unit,
 static int do_memory_read(ifd_reader_t * reader, int unit,
 			  ct_tlv_parser_t * args, ct_tlv_builder_t * resp)
 {
-	unsigned char data[CT_SOCKET_BUFSIZ];
+	unsigned char data[CT_MEMORY_CHUNK];
 	unsigned int data_len;
 	unsigned int address;
 	int rc;
@@ -493,3 +518,46 @@ static int do_memory_read(ifd_reader_t * reader, int unit,
 	ct_tlv_put_opaque(resp, CT_TAG_DATA, data, rc);
 	return 0;
 }
+
+/*
+ * CRC over a range of synchronous ICC memory. This lets a client
+ * verify what it wrote without shipping it all back.
+ */
+static int do_memory_checksum(ifd_reader_t * reader, int unit,
+			      ct_tlv_parser_t * args, ct_tlv_builder_t * resp)
+{
+	unsigned char data[CT_SOCKET_BUFSIZ];
+	unsigned int address, count;
+	unsigned short crc = CSUM_CRC_INIT;
+	int rc;
+
+	if (unit > reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+
+	if (ct_tlv_get_int(args, CT_TAG_ADDRESS, &address) == 0
+	    || !ct_tlv_get_int(args, CT_TAG_COUNT, &count))
+		return IFD_ERROR_MISSING_ARG;
+
+	if (address + count > 0x10000)
+		return IFD_ERROR_INVALID_ARG;
+
+	while (count) {
+		unsigned int n = count;
+
+		if (n > sizeof(data))
+			n = sizeof(data);
+
+		rc = ifd_card_read_memory(reader, unit, address, data, n);
+		if (rc < 0)
+			return rc;
+		if (rc == 0)
+			return IFD_ERROR_COMM_ERROR;
+
+		crc = csum_crc_update(crc, data, rc);
+		address += rc;
+		count -= rc;
+	}
+
+	ct_tlv_put_int(resp, CT_TAG_CHECKSUM, crc);
+	return 0;
+}
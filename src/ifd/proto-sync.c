@@ -12,8 +12,27 @@
 
 typedef struct {
 	ifd_protocol_t base;
+	int verify;
 } sync_state_t;
 
+/*
+ * The protocol we last detected in each slot. Cards fed to a
+ * reader tend to come in batches of the same type, so we probe
+ * for this one first.
+ */
+static int sync_last_proto[OPENCT_MAX_SLOTS];
+
+/*
+ * Attach protocol
+ */
+static int sync_init(ifd_protocol_t * prot)
+{
+	sync_state_t *sp = (sync_state_t *) prot;
+
+	sp->verify = 1;
+	return 0;
+}
+
 /*
  * Detach protocol
  */
@@ -22,6 +41,39 @@ static void sync_release(ifd_protocol_t * prot)
 	/* NOP */
 }
 
+/*
+ * Get/set parameters
+ */
+static int sync_set_param(ifd_protocol_t * prot, int type, long value)
+{
+	sync_state_t *sp = (sync_state_t *) prot;
+
+	switch (type) {
+	case IFD_PROTOCOL_WRITE_VERIFY:
+		sp->verify = value ? 1 : 0;
+		break;
+	default:
+		ct_error("Unsupported parameter %d", type);
+		return -1;
+	}
+	return 0;
+}
+
+static int sync_get_param(ifd_protocol_t * prot, int type, long *result)
+{
+	sync_state_t *sp = (sync_state_t *) prot;
+
+	switch (type) {
+	case IFD_PROTOCOL_WRITE_VERIFY:
+		*result = sp->verify;
+		break;
+	default:
+		ct_error("Unsupported parameter %d", type);
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Read/write operations
  */
@@ -41,12 +93,14 @@ static int sync_read(ifd_protocol_t * prot, int slot, unsigned short addr,
 static int sync_write(ifd_protocol_t * prot, int slot, unsigned short addr,
 		      const unsigned char *sbuf, size_t slen)
 {
+	sync_state_t *sp = (sync_state_t *) prot;
 	ifd_reader_t *reader = prot->reader;
 	const ifd_driver_t *drv;
 	unsigned int retries = 1;
 	int prot_id;
 
-	if (!(drv = reader->driver) || !drv->ops || !drv->ops->sync_read)
+	if (!(drv = reader->driver) || !drv->ops || !drv->ops->sync_read
+	    || !drv->ops->sync_write)
 		return IFD_ERROR_NOT_SUPPORTED;
 
 	prot_id = prot->ops->id;
@@ -73,16 +127,20 @@ static int sync_write(ifd_protocol_t * prot, int slot, unsigned short addr,
 		if (r < 0)
 			return r;
 
-		/* Verify that data was written correctly */
-		ifd_debug(2, "verifying %u@%04x", count, addr);
-		r = drv->ops->sync_read(reader, slot,
-					prot_id, addr, temp, count);
-
-		if (memcmp(sbuf, temp, count)) {
-			ifd_debug(2, "failed to verify write");
-			if (retries--)
-				continue;
-			return -1;
+		/* Verify that data was written correctly, unless
+		 * the caller wants to verify the whole range
+		 * by other means */
+		if (sp->verify) {
+			ifd_debug(2, "verifying %u@%04x", count, addr);
+			r = drv->ops->sync_read(reader, slot,
+						prot_id, addr, temp, count);
+
+			if (r < 0 || memcmp(sbuf, temp, count)) {
+				ifd_debug(2, "failed to verify write");
+				if (retries--)
+					continue;
+				return -1;
+			}
 		}
 
 		addr += count;
@@ -135,18 +193,40 @@ static ifd_protocol_t *ifd_sync_probe_icc(ifd_reader_t * reader, int slot,
 /*
  * Detect synchronous ICC
  */
+static int sync_probe_order[] = {
+	IFD_PROTOCOL_I2C_SHORT,
+	IFD_PROTOCOL_I2C_LONG,
+	IFD_PROTOCOL_2WIRE,
+	IFD_PROTOCOL_3WIRE,
+};
+
+#define SYNC_NPROBES	(sizeof(sync_probe_order)/sizeof(sync_probe_order[0]))
+
 int ifd_sync_detect_icc(ifd_reader_t * reader, int slot, void *atr, size_t size)
 {
 	ifd_protocol_t *p = NULL;
-	int n;
+	int last, proto, n;
+	unsigned int i;
+
+	if (slot < 0 || slot >= OPENCT_MAX_SLOTS)
+		return IFD_ERROR_INVALID_SLOT;
+
+	/* Try whatever we found last time first */
+	last = sync_last_proto[slot];
+	if (last)
+		p = ifd_sync_probe_icc(reader, slot, last);
+	for (i = 0; p == NULL && i < SYNC_NPROBES; i++) {
+		if ((proto = sync_probe_order[i]) != last)
+			p = ifd_sync_probe_icc(reader, slot, proto);
+	}
+	if (p == NULL)
+		goto failed;
 
-	if ((p = ifd_sync_probe_icc(reader, slot, IFD_PROTOCOL_I2C_SHORT))
-	    || (p = ifd_sync_probe_icc(reader, slot, IFD_PROTOCOL_I2C_LONG))) {
+	proto = p->ops->id;
+	if (proto == IFD_PROTOCOL_I2C_SHORT || proto == IFD_PROTOCOL_I2C_LONG) {
 		/* I2C card. Empty ATR */
 		n = 0;
-	} else if ((p = ifd_sync_probe_icc(reader, slot, IFD_PROTOCOL_2WIRE))
-		   || (p =
-		       ifd_sync_probe_icc(reader, slot, IFD_PROTOCOL_3WIRE))) {
+	} else {
 		/* Try to read the ATR */
 		if (ifd_deactivate(reader) < 0 || ifd_activate(reader) < 0)
 			goto failed;
@@ -154,20 +234,21 @@ int ifd_sync_detect_icc(ifd_reader_t * reader, int slot, void *atr, size_t size)
 					     size);
 		if (n < 0)
 			goto failed;
-	} else {
-		goto failed;
 	}
 
 	reader->slot[slot].proto = p;
+	sync_last_proto[slot] = proto;
 
-	ifd_debug(1, "Detected synchronous card (%s), %satr%s",
-		  p->ops->name, n ? "" : "no ", ct_hexdump(atr, n));
+	ifd_debug(1, "Detected synchronous card (%s%s), %satr%s",
+		  p->ops->name, proto == last ? ", as before" : "",
+		  n ? "" : "no ", ct_hexdump(atr, n));
 
 	return n;
 
       failed:
 	if (p != NULL)
 		ifd_protocol_free(p);
+	sync_last_proto[slot] = 0;
 	return IFD_ERROR_NO_ATR;
 }
 
@@ -178,10 +259,10 @@ struct ifd_protocol_ops ifd_protocol_i2c_short = {
 	IFD_PROTOCOL_I2C_SHORT,	/* id */
 	"I2C short",		/* name */
 	sizeof(sync_state_t),	/* size */
-	NULL,			/* init */
+	sync_init,		/* init */
 	sync_release,		/* release */
-	NULL,			/* set_param */
-	NULL,			/* get_param */
+	sync_set_param,		/* set_param */
+	sync_get_param,		/* get_param */
 	NULL,			/* resynchronize */
 	NULL,			/* transceive */
 	sync_read,		/* sync_read */
@@ -192,10 +273,10 @@ struct ifd_protocol_ops ifd_protocol_i2c_long = {
 	IFD_PROTOCOL_I2C_LONG,	/* id */
 	"I2C long",		/* name */
 	sizeof(sync_state_t),	/* size */
-	NULL,			/* init */
+	sync_init,		/* init */
 	sync_release,		/* release */
-	NULL,			/* set_param */
-	NULL,			/* get_param */
+	sync_set_param,		/* set_param */
+	sync_get_param,		/* get_param */
 	NULL,			/* resynchronize */
 	NULL,			/* transceive */
 	sync_read,		/* sync_read */
@@ -206,10 +287,10 @@ struct ifd_protocol_ops ifd_protocol_2wire = {
 	IFD_PROTOCOL_2WIRE,	/* id */
 	"2Wire",		/* name */
 	sizeof(sync_state_t),	/* size */
-	NULL,			/* init */
+	sync_init,		/* init */
 	sync_release,		/* release */
-	NULL,			/* set_param */
-	NULL,			/* get_param */
+	sync_set_param,		/* set_param */
+	sync_get_param,		/* get_param */
 	NULL,			/* resynchronize */
 	NULL,			/* transceive */
 	sync_read,		/* sync_read */
@@ -220,10 +301,10 @@ struct ifd_protocol_ops ifd_protocol_3wire = {
 	IFD_PROTOCOL_3WIRE,	/* id */
 	"3Wire",		/* name */
 	sizeof(sync_state_t),	/* size */
-	NULL,			/* init */
+	sync_init,		/* init */
 	sync_release,		/* release */
-	NULL,			/* set_param */
-	NULL,			/* get_param */
+	sync_set_param,		/* set_param */
+	sync_get_param,		/* get_param */
 	NULL,			/* resynchronize */
 	NULL,			/* transceive */
 	sync_read,		/* sync_read */
@@ -234,10 +315,10 @@ struct ifd_protocol_ops ifd_protocol_eurochip = {
 	IFD_PROTOCOL_EUROCHIP,	/* id */
 	"Eurochip Countercard",	/* name */
 	sizeof(sync_state_t),	/* size */
-	NULL,			/* init */
+	sync_init,		/* init */
 	sync_release,		/* release */
-	NULL,			/* set_param */
-	NULL,			/* get_param */
+	sync_set_param,		/* set_param */
+	sync_get_param,		/* get_param */
 	NULL,			/* resynchronize */
 	NULL,			/* transceive */
 	sync_read,		/* sync_read */
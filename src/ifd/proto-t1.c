@@ -27,6 +27,13 @@ typedef struct {
 	unsigned int retries;
 	unsigned int rc_bytes;
 
+	/* Error recovery statistics */
+	unsigned int errors;		/* invalid blocks received */
+	unsigned int naks;		/* R-blocks sent to request a repeat */
+	unsigned int retransmits;	/* blocks repeated on request */
+	unsigned int resyncs;		/* S(RESYNCH) requests sent */
+	unsigned int failures;		/* exchanges given up */
+
 	unsigned int (*checksum) (const unsigned char *,
 				  size_t, unsigned char *);
 } t1_state_t;
@@ -57,6 +64,9 @@ typedef struct {
 
 #define T1_BUFFER_SIZE		(3 + 254 + 2)
 
+/* Number of S(RESYNCH) attempts before giving up (ISO 7816-3 rule 6.4) */
+#define T1_MAX_RESYNCS		3
+
 #define NAD 0
 #define PCB 1
 #define LEN 2
@@ -177,6 +187,27 @@ static int t1_get_param(ifd_protocol_t * prot, int type, long *result)
 	case IFD_PROTOCOL_BLOCK_ORIENTED:
 		value = t1->block_oriented;
 		break;
+	case IFD_PROTOCOL_RESET_REQUIRED:
+		value = (t1->state == DEAD);
+		break;
+	case IFD_PROTOCOL_T1_STATE:
+		value = t1->state;
+		break;
+	case IFD_PROTOCOL_T1_STAT_ERRORS:
+		value = t1->errors;
+		break;
+	case IFD_PROTOCOL_T1_STAT_NAKS:
+		value = t1->naks;
+		break;
+	case IFD_PROTOCOL_T1_STAT_RETRANSMITS:
+		value = t1->retransmits;
+		break;
+	case IFD_PROTOCOL_T1_STAT_RESYNCS:
+		value = t1->resyncs;
+		break;
+	case IFD_PROTOCOL_T1_STAT_FAILURES:
+		value = t1->failures;
+		break;
 	default:
 		ct_error("Unsupported parameter %d", type);
 		return -1;
@@ -190,6 +221,14 @@ static int t1_get_param(ifd_protocol_t * prot, int type, long *result)
 
 /*
  * Send an APDU through T=1
+ *
+ * Error recovery follows ISO 7816-3, 11.6.3: an invalid block
+ * (bad EDC, parity error, BWT timeout) is answered with an R-block
+ * for the expected N(R), and a block the ICC rejects is repeated
+ * as is. Only when that fails t1->retries times in a row do we fall
+ * back to S(RESYNCH), which restarts the whole APDU. If resynchronization
+ * fails too, the protocol is marked dead and the caller is expected
+ * to reset the card.
  */
 static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 			 size_t snd_len, void *rcv_buf, size_t rcv_len)
@@ -197,7 +236,8 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 	t1_state_t *t1 = (t1_state_t *) prot;
 	ct_buf_t sbuf, rbuf, tbuf;
 	unsigned char sdata[T1_BUFFER_SIZE], sblk[5];
-	unsigned int slen, retries, resyncs, sent_length = 0;
+	unsigned char last_block[T1_BUFFER_SIZE];
+	unsigned int slen, last_len, retries, resyncs, errors = 0;
 	size_t last_send = 0;
 
 	if (snd_len == 0)
@@ -209,70 +249,98 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 
 	t1->state = SENDING;
 	retries = t1->retries;
-	resyncs = 3;
+	resyncs = T1_MAX_RESYNCS;
 
 	/* Initialize send/recv buffer */
 	ct_buf_set(&sbuf, (void *)snd_buf, snd_len);
 	ct_buf_init(&rbuf, rcv_buf, rcv_len);
 
-	/* Send the first block */
+	/* Send the first block. last_block keeps the last I-block or
+	 * S-request we sent, which is what the ICC asks us to repeat;
+	 * R-blocks and S-responses never go there. */
 	slen = t1_build(t1, sdata, dad, T1_I_BLOCK, &sbuf, &last_send);
+	memcpy(last_block, sdata, slen);
+	last_len = slen;
 
 	while (1) {
-		unsigned char pcb;
+		unsigned char pcb, err;
 		int n;
 
-		retries--;
+		/* The client may have given up on us */
+		if (ifd_check_abort(t1->base.reader)) {
+			ifd_debug(1, "aborted");
+			t1->state = DEAD;
+			return IFD_ERROR_USER_ABORT;
+		}
 
-		if ((n = t1_xcv(t1, sdata, slen, sizeof(sdata))) < 0) {
+		n = t1_xcv(t1, sdata, slen, sizeof(sdata));
+		if (n == IFD_ERROR_TIMEOUT || n == IFD_ERROR_COMM_ERROR) {
+			ifd_debug(1, "no valid block received: %s",
+				  ct_strerror(n));
+			err = T1_OTHER_ERROR;
+			goto bad_block;
+		}
+		if (n < 0) {
 			ifd_debug(1, "fatal: transmit/receive failed");
-			t1->state = DEAD;
 			goto error;
 		}
 
 		if (!t1_verify_checksum(t1, sdata, n)) {
 			ifd_debug(1, "checksum failed");
-			if (retries == 0 || sent_length)
-				goto resync;
-			slen = t1_build(t1, sdata,
-					dad, T1_R_BLOCK | T1_EDC_ERROR,
-					NULL, NULL);
-			continue;
+			err = T1_EDC_ERROR;
+			goto bad_block;
 		}
 
 		pcb = sdata[PCB];
-		switch (t1_block_type(pcb)) {
-		case T1_R_BLOCK:
-			if (T1_IS_ERROR(pcb)) {
-				ifd_debug(1, "received error block, err=%d",
-					  T1_IS_ERROR(pcb));
-				goto resync;
-			}
 
-			if (t1->state == RECEIVING) {
-				slen = t1_build(t1, sdata,
-						dad, T1_R_BLOCK, NULL, NULL);
-				break;
-			}
+		/* While resynchronizing, the only acceptable answer is
+		 * S(RESYNCH response) */
+		if (t1->state == RESYNCH
+		    && pcb != (T1_S_BLOCK | T1_S_RESPONSE | T1_S_RESYNC))
+			goto resync;
 
+		switch (t1_block_type(pcb)) {
+		case T1_R_BLOCK:
 			/* If the card terminal requests the next
 			 * sequence number, it received the previous
 			 * block successfully */
-			if (t1_seq(pcb) != t1->ns) {
+			if (t1->state == SENDING && !T1_IS_ERROR(pcb)
+			    && t1_seq(pcb) != t1->ns) {
 				ct_buf_get(&sbuf, NULL, last_send);
-				sent_length += last_send;
 				last_send = 0;
 				t1->ns ^= 1;
+
+				/* If there's no data available, the ICC
+				 * shouldn't be asking for more */
+				if (ct_buf_avail(&sbuf) == 0)
+					goto resync;
+
+				slen = t1_build(t1, sdata, dad, T1_I_BLOCK,
+						&sbuf, &last_send);
+				memcpy(last_block, sdata, slen);
+				last_len = slen;
+				break;
 			}
 
-			/* If there's no data available, the ICC
-			 * shouldn't be asking for more */
-			if (ct_buf_avail(&sbuf) == 0)
+			/* Otherwise, the ICC did not get our last block
+			 * right - repeat it. While the ICC is sending,
+			 * that's our acknowledgement, which we simply
+			 * build again; otherwise it's the last I-block. */
+			if (T1_IS_ERROR(pcb))
+				ifd_debug(1, "received error block, err=%d",
+					  T1_IS_ERROR(pcb));
+			if (retries == 0)
 				goto resync;
-
-			slen = t1_build(t1, sdata, dad, T1_I_BLOCK,
-					&sbuf, &last_send);
-			break;
+			retries--;
+			t1->retransmits++;
+			if (t1->state == RECEIVING) {
+				slen = t1_build(t1, sdata, dad, T1_R_BLOCK,
+						NULL, NULL);
+			} else {
+				memcpy(sdata, last_block, last_len);
+				slen = last_len;
+			}
+			continue;
 
 		case T1_I_BLOCK:
 			/* The first I-block sent by the ICC indicates
@@ -289,10 +357,8 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 			 * what we expected it to send, reply with
 			 * an R block */
 			if (t1_seq(pcb) != t1->nr) {
-				slen = t1_build(t1, sdata, dad,
-						T1_R_BLOCK | T1_OTHER_ERROR,
-						NULL, NULL);
-				continue;
+				err = T1_OTHER_ERROR;
+				goto bad_block;
 			}
 
 			t1->nr ^= 1;
@@ -309,13 +375,14 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 		case T1_S_BLOCK:
 			if (T1_S_IS_RESPONSE(pcb) && t1->state == RESYNCH) {
 				t1->state = SENDING;
-				sent_length = 0;
 				last_send = 0;
-				resyncs = 3;
 				retries = t1->retries;
+				ct_buf_set(&sbuf, (void *)snd_buf, snd_len);
 				ct_buf_init(&rbuf, rcv_buf, rcv_len);
 				slen = t1_build(t1, sdata, dad, T1_I_BLOCK,
 						&sbuf, &last_send);
+				memcpy(last_block, sdata, slen);
+				last_len = slen;
 				continue;
 			}
 
@@ -362,25 +429,56 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 		retries = t1->retries;
 		continue;
 
+	      bad_block:
+		t1->errors++;
+		errors++;
+		if (!t1->block_oriented)
+			ifd_device_flush(prot->reader->device);
+		if (retries == 0)
+			goto resync;
+		retries--;
+
+		/* An unanswered resynch request is simply repeated */
+		if (t1->state == RESYNCH) {
+			t1->retransmits++;
+			memcpy(sdata, last_block, last_len);
+			slen = last_len;
+			continue;
+		}
+
+		/* Ask the ICC to repeat the block we expected */
+		t1->naks++;
+		slen = t1_build(t1, sdata, dad, T1_R_BLOCK | err, NULL, NULL);
+		continue;
+
 	      resync:
 		/* the number or resyncs is limited, too */
 		if (resyncs == 0)
 			goto error;
 		resyncs--;
+		t1->resyncs++;
 		t1->ns = 0;
 		t1->nr = 0;
+		retries = t1->retries;
 		slen = t1_build(t1, sdata, dad, T1_S_BLOCK | T1_S_RESYNC, NULL,
 				NULL);
+		memcpy(last_block, sdata, slen);
+		last_len = slen;
 		t1->state = RESYNCH;
 		continue;
 	}
 
       done:
+	if (errors)
+		ifd_debug(2, "recovered from %u errors; total %u errors, "
+			  "%u naks, %u retransmits, %u resyncs", errors,
+			  t1->errors, t1->naks, t1->retransmits, t1->resyncs);
 	return ct_buf_avail(&rbuf);
 
       error:
+	t1->failures++;
 	t1->state = DEAD;
-	return -1;
+	return IFD_ERROR_COMM_ERROR;
 }
 
 static int t1_resynchronize(ifd_protocol_t * p, int nad)
@@ -563,18 +661,18 @@ static int t1_xcv(t1_state_t * t1, unsigned char *block, size_t slen,
 		}
 	} else {
 		/* Get the header */
-		if (ifd_recv_response(prot, block, 3, timeout) < 0)
-			return -1;
+		if ((m = ifd_recv_response(prot, block, 3, timeout)) < 0)
+			return m;
 
 		n = block[2] + t1->rc_bytes;
 		if (n + 3 > rmax || block[2] >= 254) {
 			ct_error("receive buffer too small");
-			return -1;
+			return IFD_ERROR_COMM_ERROR;
 		}
 
 		/* Now get the rest */
-		if (ifd_recv_response(prot, block + 3, n, t1->timeout) < 0)
-			return -1;
+		if ((m = ifd_recv_response(prot, block + 3, n, t1->timeout)) < 0)
+			return m;
 
 		n += 3;
 	}
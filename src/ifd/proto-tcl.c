@@ -0,0 +1,592 @@
+/*
+ * Implementation of ISO 14443-4 (T=CL), the block transmission
+ * protocol of proximity cards.
+ *
+ * This assumes that the reader takes care of activation (REQA,
+ * anticollision, RATS) and hands us the ATS; all we do is the
+ * half-duplex block protocol on top. Depending on the reader, the
+ * CRC_A may or may not be part of the frames we see.
+ */
+
+#include "internal.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	ifd_protocol_t base;
+	int state;
+
+	unsigned char bn;	/* current block number */
+	int cid;		/* -1 if we don't send a CID */
+	int use_crc;		/* frames carry CRC_A */
+
+	unsigned int fsc;	/* max frame size the PICC accepts */
+	unsigned int fsd;	/* max frame size we accept */
+	unsigned int fwi;
+
+	unsigned int timeout;
+	unsigned int retries;
+} tcl_state_t;
+
+/* PCB bits */
+#define TCL_I_BLOCK		0x02
+#define TCL_R_BLOCK		0xA2
+#define TCL_S_BLOCK		0xC2
+#define TCL_CHAINING		0x10
+#define TCL_CID_FOLLOWING	0x08
+#define TCL_NAD_FOLLOWING	0x04
+#define TCL_BN(pcb)		((pcb) & 0x01)
+
+/* R block */
+#define TCL_R_NAK		0x10
+
+/* S block */
+#define TCL_S_TYPE(pcb)		((pcb) & 0x30)
+#define TCL_S_DESELECT		0x00
+#define TCL_S_WTX		0x30
+
+/* CRC_A preset, ISO 14443-3 Annex B */
+#define TCL_CRC_A_INIT		0x6363
+
+/* Largest frame defined by ISO 14443-4 (FSCI 0xC) */
+#define TCL_BUFFER_SIZE		4096
+
+/* Maximum WTXM a PICC may request */
+#define TCL_MAX_WTXM		59
+
+/* Defaults if the ATS doesn't say otherwise */
+#define TCL_DEFAULT_FSCI	2
+#define TCL_DEFAULT_FWI		4
+
+enum {
+	ALIVE, DEAD
+};
+
+static unsigned int tcl_block_type(unsigned char);
+static unsigned int tcl_header_len(unsigned char);
+static unsigned int tcl_build(tcl_state_t *, unsigned char *,
+			      unsigned char, ct_buf_t *, size_t *);
+static int tcl_xcv(tcl_state_t *, unsigned char *, size_t, size_t,
+		   unsigned int);
+static void tcl_deselect(tcl_state_t *);
+
+/*
+ * Frame sizes for FSCI/FSDI
+ */
+static unsigned int tcl_frame_size(unsigned int fsi)
+{
+	static const unsigned short fs_table[] = {
+		16, 24, 32, 40, 48, 64, 96, 128, 256,
+		512, 1024, 2048, 4096
+	};
+
+	/* RFU values are to be treated as the largest defined */
+	if (fsi >= sizeof(fs_table) / sizeof(fs_table[0]))
+		fsi = sizeof(fs_table) / sizeof(fs_table[0]) - 1;
+	return fs_table[fsi];
+}
+
+/*
+ * Attach T=CL protocol
+ */
+static int tcl_init(ifd_protocol_t * prot)
+{
+	tcl_state_t *tp = (tcl_state_t *) prot;
+
+	tp->state = ALIVE;
+	tp->bn = 0;
+	tp->cid = -1;
+	tp->use_crc = 0;
+	tp->fsc = tcl_frame_size(TCL_DEFAULT_FSCI);
+	tp->fsd = 256;
+	tp->fwi = TCL_DEFAULT_FWI;
+	tp->timeout = 1000;
+	tp->retries = 2;
+	return 0;
+}
+
+/*
+ * Detach T=CL protocol. This happens when the card is reset or
+ * the reader goes away, so put the PICC to rest first.
+ */
+static void tcl_release(ifd_protocol_t * prot)
+{
+	tcl_deselect((tcl_state_t *) prot);
+}
+
+/*
+ * Get/set parameters for T=CL protocol
+ */
+static int tcl_set_param(ifd_protocol_t * prot, int type, long value)
+{
+	tcl_state_t *tp = (tcl_state_t *) prot;
+
+	switch (type) {
+	case IFD_PROTOCOL_RECV_TIMEOUT:
+		tp->timeout = value;
+		break;
+	case IFD_PROTOCOL_BLOCK_ORIENTED:
+		/* We only do block oriented */
+		if (!value)
+			return -1;
+		break;
+	case IFD_PROTOCOL_TCL_FSC:
+	case IFD_PROTOCOL_TCL_FSD:
+		if (value < 16)
+			return -1;
+		if (value > TCL_BUFFER_SIZE)
+			value = TCL_BUFFER_SIZE;
+		if (type == IFD_PROTOCOL_TCL_FSC)
+			tp->fsc = value;
+		else
+			tp->fsd = value;
+		break;
+	case IFD_PROTOCOL_TCL_FWI:
+		if (value < 0 || value > 14)
+			return -1;
+		tp->fwi = value;
+		break;
+	case IFD_PROTOCOL_TCL_CID:
+		if (value > 14)
+			return -1;
+		tp->cid = value < 0 ? -1 : value;
+		break;
+	case IFD_PROTOCOL_TCL_CRC:
+		tp->use_crc = value ? 1 : 0;
+		break;
+	default:
+		ct_error("Unsupported parameter %d", type);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tcl_get_param(ifd_protocol_t * prot, int type, long *result)
+{
+	tcl_state_t *tp = (tcl_state_t *) prot;
+	long value;
+
+	switch (type) {
+	case IFD_PROTOCOL_RECV_TIMEOUT:
+		value = tp->timeout;
+		break;
+	case IFD_PROTOCOL_BLOCK_ORIENTED:
+		value = 1;
+		break;
+	case IFD_PROTOCOL_RESET_REQUIRED:
+		value = (tp->state == DEAD);
+		break;
+	case IFD_PROTOCOL_TCL_FSC:
+		value = tp->fsc;
+		break;
+	case IFD_PROTOCOL_TCL_FSD:
+		value = tp->fsd;
+		break;
+	case IFD_PROTOCOL_TCL_FWI:
+		value = tp->fwi;
+		break;
+	case IFD_PROTOCOL_TCL_CID:
+		value = tp->cid;
+		break;
+	case IFD_PROTOCOL_TCL_CRC:
+		value = tp->use_crc;
+		break;
+	default:
+		ct_error("Unsupported parameter %d", type);
+		return -1;
+	}
+
+	if (result)
+		*result = value;
+
+	return 0;
+}
+
+/*
+ * Send an APDU through T=CL
+ *
+ * Block numbering follows the PCD rules of ISO 14443-4, 7.5.4: we
+ * toggle our block number whenever the PICC answers with an I-block
+ * or R(ACK) carrying it. An R(ACK) with the other number asks us to
+ * repeat our last I-block. A bad or missing frame is answered with
+ * R(NAK), or with R(ACK) while the PICC is chaining, which makes it
+ * repeat its last block.
+ */
+static int tcl_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
+			  size_t snd_len, void *rcv_buf, size_t rcv_len)
+{
+	tcl_state_t *tp = (tcl_state_t *) prot;
+	ct_buf_t sbuf, rbuf, tbuf;
+	unsigned char sdata[TCL_BUFFER_SIZE];
+	unsigned char last_block[TCL_BUFFER_SIZE];
+	unsigned int slen, last_len, retries, wtxm = 1, hdr;
+	size_t last_send = 0;
+	int receiving = 0;
+
+	if (snd_len == 0)
+		return -1;
+
+	/* we can't talk to a dead card. Reset it! */
+	if (tp->state == DEAD)
+		return -1;
+
+	retries = tp->retries;
+
+	ct_buf_set(&sbuf, (void *)snd_buf, snd_len);
+	ct_buf_init(&rbuf, rcv_buf, rcv_len);
+
+	/* Send the first block; keep a copy in case the
+	 * PICC asks us to repeat it */
+	slen = tcl_build(tp, sdata, TCL_I_BLOCK, &sbuf, &last_send);
+	memcpy(last_block, sdata, slen);
+	last_len = slen;
+
+	while (1) {
+		unsigned char pcb, inf;
+		int n;
+
+		/* The client may have given up on us; a PICC asking
+		 * for one wait time extension after another would
+		 * otherwise keep us here */
+		if (ifd_check_abort(tp->base.reader)) {
+			ifd_debug(1, "aborted");
+			tp->state = DEAD;
+			return IFD_ERROR_USER_ABORT;
+		}
+
+		n = tcl_xcv(tp, sdata, slen, sizeof(sdata), wtxm);
+		wtxm = 1;
+
+		if (n == IFD_ERROR_TIMEOUT || n == IFD_ERROR_COMM_ERROR) {
+			ifd_debug(1, "no valid block received: %s",
+				  ct_strerror(n));
+			goto bad_block;
+		}
+		if (n < 0) {
+			ifd_debug(1, "fatal: transmit/receive failed");
+			goto error;
+		}
+
+		pcb = sdata[0];
+		hdr = tcl_header_len(pcb);
+		if (n < (int)hdr) {
+			ifd_debug(1, "short block");
+			goto bad_block;
+		}
+
+		switch (tcl_block_type(pcb)) {
+		case TCL_I_BLOCK:
+			if (TCL_BN(pcb) != tp->bn) {
+				ifd_debug(1, "I-block out of sequence");
+				goto bad_block;
+			}
+
+			/* The PICC must not answer before it has
+			 * all of our chain */
+			if (!receiving && ct_buf_avail(&sbuf) != last_send) {
+				ifd_debug(1, "I-block while chaining");
+				goto bad_block;
+			}
+
+			receiving = 1;
+			tp->bn ^= 1;
+
+			if (ct_buf_put(&rbuf, sdata + hdr, n - hdr) < 0) {
+				ct_error("T=CL: response too large");
+				return IFD_ERROR_BUFFER_TOO_SMALL;
+			}
+
+			if ((pcb & TCL_CHAINING) == 0)
+				goto done;
+
+			/* Ask for the next block of the chain */
+			slen = tcl_build(tp, sdata, TCL_R_BLOCK, NULL, NULL);
+			break;
+
+		case TCL_R_BLOCK:
+			if (receiving || (pcb & TCL_R_NAK)) {
+				ifd_debug(1, "unexpected R-block");
+				goto bad_block;
+			}
+
+			/* The PICC wants our last I-block again */
+			if (TCL_BN(pcb) != tp->bn) {
+				if (retries == 0)
+					goto error;
+				retries--;
+				memcpy(sdata, last_block, last_len);
+				slen = last_len;
+				continue;
+			}
+
+			/* The PICC acknowledged a chained block */
+			if (!(last_block[0] & TCL_CHAINING)) {
+				ifd_debug(1, "R(ACK) for unchained block");
+				goto bad_block;
+			}
+
+			ct_buf_get(&sbuf, NULL, last_send);
+			tp->bn ^= 1;
+
+			slen = tcl_build(tp, sdata, TCL_I_BLOCK,
+					 &sbuf, &last_send);
+			memcpy(last_block, sdata, slen);
+			last_len = slen;
+			break;
+
+		case TCL_S_BLOCK:
+			if (TCL_S_TYPE(pcb) != TCL_S_WTX || n < (int)hdr + 1) {
+				ifd_debug(1, "unexpected S-block");
+				goto bad_block;
+			}
+
+			/* Confirm the wait time extension; the
+			 * power level indication is ignored */
+			inf = sdata[hdr] & 0x3F;
+			if (inf == 0 || inf > TCL_MAX_WTXM) {
+				ifd_debug(1, "bad WTXM %u", inf);
+				goto bad_block;
+			}
+			ifd_debug(1, "PICC requested wtx=%u", inf);
+			wtxm = inf;
+
+			ct_buf_set(&tbuf, &inf, 1);
+			slen = tcl_build(tp, sdata, TCL_S_BLOCK | TCL_S_WTX,
+					 &tbuf, NULL);
+			break;
+
+		default:
+			ifd_debug(1, "invalid PCB 0x%02x", pcb);
+			goto bad_block;
+		}
+
+		/* Everything went just splendid */
+		retries = tp->retries;
+		continue;
+
+	      bad_block:
+		if (retries == 0)
+			goto error;
+		retries--;
+
+		if (receiving)
+			slen = tcl_build(tp, sdata, TCL_R_BLOCK, NULL, NULL);
+		else
+			slen = tcl_build(tp, sdata, TCL_R_BLOCK | TCL_R_NAK,
+					 NULL, NULL);
+	}
+
+      done:
+	return ct_buf_avail(&rbuf);
+
+      error:
+	tp->state = DEAD;
+	return IFD_ERROR_COMM_ERROR;
+}
+
+static unsigned int tcl_block_type(unsigned char pcb)
+{
+	switch (pcb & 0xC0) {
+	case 0x00:
+		if ((pcb & 0x22) == TCL_I_BLOCK)
+			return TCL_I_BLOCK;
+		break;
+	case 0x80:
+		if ((pcb & 0xE6) == TCL_R_BLOCK)
+			return TCL_R_BLOCK;
+		break;
+	case 0xC0:
+		if ((pcb & 0xC7) == TCL_S_BLOCK)
+			return TCL_S_BLOCK;
+		break;
+	}
+	return 0;
+}
+
+static unsigned int tcl_header_len(unsigned char pcb)
+{
+	unsigned int len = 1;
+
+	if (pcb & TCL_CID_FOLLOWING)
+		len++;
+	if (tcl_block_type(pcb) == TCL_I_BLOCK && (pcb & TCL_NAD_FOLLOWING))
+		len++;
+	return len;
+}
+
+static unsigned int tcl_build(tcl_state_t * tp, unsigned char *block,
+			      unsigned char pcb, ct_buf_t * bp, size_t * lenp)
+{
+	unsigned int len, max, hdr = 1;
+
+	if (tp->cid >= 0) {
+		pcb |= TCL_CID_FOLLOWING;
+		block[hdr++] = tp->cid;
+	}
+
+	/* Put as much into the block as the PICC will take */
+	max = tp->fsc - hdr - (tp->use_crc ? 2 : 0);
+	len = bp ? ct_buf_avail(bp) : 0;
+	if (len > max) {
+		pcb |= TCL_CHAINING;
+		len = max;
+	}
+
+	if (tcl_block_type(pcb) != TCL_S_BLOCK)
+		pcb |= tp->bn;
+
+	block[0] = pcb;
+	if (len)
+		memcpy(block + hdr, ct_buf_head(bp), len);
+	if (lenp)
+		*lenp = len;
+	len += hdr;
+
+	if (tp->use_crc) {
+		unsigned short crc;
+
+		crc = csum_crc_update(TCL_CRC_A_INIT, block, len);
+		block[len++] = crc & 0xFF;
+		block[len++] = crc >> 8;
+	}
+
+	return len;
+}
+
+/*
+ * Send/receive block
+ */
+static int tcl_xcv(tcl_state_t * tp, unsigned char *block, size_t slen,
+		   size_t rmax, unsigned int wtxm)
+{
+	ifd_protocol_t *prot = &tp->base;
+	unsigned long fwt;
+	int n;
+
+	if (ct_config.debug >= 3)
+		ifd_debug(3, "sending %s", ct_hexdump(block, slen));
+
+	n = ifd_send_command(prot, block, slen);
+	if (n < 0)
+		return n;
+
+	if (rmax > tp->fsd)
+		rmax = tp->fsd;
+
+	/* FWT = 256 * 16 / fc * 2^FWI, i.e. about 302us * 2^FWI */
+	fwt = ((302UL << tp->fwi) * wtxm + 999) / 1000;
+
+	n = ifd_recv_response(prot, block, rmax, tp->timeout + fwt);
+	if (n < 0)
+		return n;
+
+	if (ct_config.debug >= 3)
+		ifd_debug(3, "received %s", ct_hexdump(block, n));
+
+	if (tp->use_crc) {
+		unsigned short crc;
+
+		if (n < 3)
+			return IFD_ERROR_COMM_ERROR;
+		n -= 2;
+		crc = csum_crc_update(TCL_CRC_A_INIT, block, n);
+		if (block[n] != (crc & 0xFF) || block[n + 1] != (crc >> 8)) {
+			ifd_debug(1, "CRC_A mismatch");
+			return IFD_ERROR_COMM_ERROR;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Take frame size, frame waiting time and CID support from the ATS
+ */
+int tcl_parse_ats(ifd_protocol_t * proto, const unsigned char *ats,
+		  size_t len)
+{
+	tcl_state_t *tp = (tcl_state_t *) proto;
+	unsigned int tl, t0, fsci = TCL_DEFAULT_FSCI, i = 2;
+
+	if (len < 1 || (tl = ats[0]) > len || tl < 1) {
+		ct_error("T=CL: invalid ATS");
+		return IFD_ERROR_INVALID_ATR;
+	}
+
+	tp->fwi = TCL_DEFAULT_FWI;
+	if (tl > 1) {
+		t0 = ats[1];
+		fsci = t0 & 0x0F;
+
+		/* TA(1) - bit rates, handled by the reader */
+		if (t0 & 0x10)
+			i++;
+		/* TB(1) - FWI and SFGI */
+		if ((t0 & 0x20) && i < tl) {
+			if ((ats[i] >> 4) != 15)
+				tp->fwi = ats[i] >> 4;
+			i++;
+		}
+		/* TC(1) - NAD/CID support */
+		if ((t0 & 0x40) && i < tl && !(ats[i] & 0x02))
+			tp->cid = -1;
+	}
+
+	/* Frames to the PICC are limited by what it can take,
+	 * frames from it by our own FSD */
+	tp->fsc = tcl_frame_size(fsci);
+	if (tp->fsc > TCL_BUFFER_SIZE)
+		tp->fsc = TCL_BUFFER_SIZE;
+
+	ifd_debug(1, "T=CL: fsc=%u fsd=%u fwi=%u", tp->fsc, tp->fsd, tp->fwi);
+	return 0;
+}
+
+/*
+ * Put the PICC into HALT state
+ */
+static void tcl_deselect(tcl_state_t * tp)
+{
+	unsigned char block[8];
+	unsigned int slen, retries = tp->retries + 1;
+	int n;
+
+	if (tp->state == DEAD)
+		return;
+
+	while (retries--) {
+		slen = tcl_build(tp, block, TCL_S_BLOCK | TCL_S_DESELECT,
+				 NULL, NULL);
+
+		n = tcl_xcv(tp, block, slen, sizeof(block), 1);
+		if (n > 0 && tcl_block_type(block[0]) == TCL_S_BLOCK
+		    && TCL_S_TYPE(block[0]) == TCL_S_DESELECT)
+			break;
+
+		/* No use repeating it if the card or reader is gone */
+		if (n < 0 && n != IFD_ERROR_TIMEOUT
+		    && n != IFD_ERROR_COMM_ERROR)
+			break;
+	}
+
+	tp->state = DEAD;
+}
+
+/*
+ * Protocol struct
+ */
+struct ifd_protocol_ops ifd_protocol_tcl = {
+	IFD_PROTOCOL_TCL,	/* id */
+	"T=CL",			/* name */
+	sizeof(tcl_state_t),	/* size */
+	tcl_init,		/* init */
+	tcl_release,		/* release */
+	tcl_set_param,		/* set_param */
+	tcl_get_param,		/* get_param */
+	NULL,			/* resynchronize */
+	tcl_transceive,		/* transceive */
+	NULL,			/* sync_read */
+	NULL,			/* sync_write */
+};
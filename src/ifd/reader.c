@@ -10,7 +10,9 @@
 #include <signal.h>
 #include <time.h>
 
-static int ifd_recv_atr(ifd_device_t *, ct_buf_t *, unsigned int, int);
+static int ifd_recv_atr(ifd_device_t *, unsigned char *, size_t, int);
+static void ifd_slot_status_update(ifd_reader_t *, int, int);
+static void ifd_slot_power_update(ifd_reader_t *, int);
 
 /*
  * Initialize a reader and open the device
@@ -194,6 +196,7 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 
 	slot = &reader->slot[idx];
 	slot->atr_len = 0;
+	ifd_slot_power_update(reader, idx);
 
 	if (slot->proto) {
 		ifd_protocol_free(slot->proto);
@@ -270,9 +273,6 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 		/* If we got just the first byte of the (async) ATR,
 		 * get the rest now */
 		if (count == 1) {
-			ct_buf_t rbuf;
-			unsigned char c;
-			unsigned int num, proto = 0;
 			int revert_bits = 0;
 
 			if (slot->atr[0] == 0x03) {
@@ -280,40 +280,14 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 				slot->atr[0] = 0x3F;
 			}
 
-			ct_buf_init(&rbuf, slot->atr, sizeof(slot->atr));
-			rbuf.tail++;
-
-			if (ifd_recv_atr(dev, &rbuf, 1, revert_bits) < 0)
-				return -1;
-
-			c = rbuf.base[1];
-			while (1) {
-				num = ifd_count_bits(c & 0xF0);
-				if (ifd_recv_atr(dev, &rbuf, num, revert_bits) <
-				    0)
-					return -1;
-
-				if (!(c & 0x80))
-					break;
-
-				c = rbuf.base[rbuf.tail - 1];
-				proto = c & 0xF;
-			}
-
-			/* Historical bytes */
-			c = rbuf.base[1] & 0xF;
-			if (ifd_recv_atr(dev, &rbuf, c, revert_bits) < 0)
-				return -1;
-
-			/* If a protocol other than T0 was specified,
-			 * read check byte */
-			if (proto
-			    && ifd_recv_atr(dev, &rbuf, 1, revert_bits) < 0)
+			n = ifd_recv_atr(dev, slot->atr, sizeof(slot->atr),
+					 revert_bits);
+			if (n < 0)
 				return -1;
 
 			if (slot->atr[0] == 0x3F)
 				parity = IFD_SERIAL_PARITY_TOGGLE(parity);
-			count = rbuf.tail - rbuf.head;
+			count = n;
 		}
 
 		ifd_debug(1, "received atr:%s", ct_hexdump(slot->atr, count));
@@ -325,6 +299,11 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 
 	slot->atr_len = count;
 
+	/* Evidently there's a card; don't wait for the next
+	 * poll to tell clients */
+	if (reader->status)
+		ifd_slot_status_update(reader, idx, IFD_CARD_PRESENT);
+
 	if (count > size)
 		size = count;
 	if (atr)
@@ -340,31 +319,85 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 	return count;
 }
 
-static int ifd_recv_atr(ifd_device_t * dev, ct_buf_t * bp, unsigned int count,
+/*
+ * Receive the remainder of an asynchronous ATR; the initial
+ * character TS is already in atr[0].
+ *
+ * Instead of reading one byte at a time, we always ask the device
+ * for everything we know is still outstanding: after T0 and every
+ * TDi that is the next group of interface bytes, after the last
+ * TDi the historical bytes plus TCK (if a protocol other than T=0
+ * was indicated).
+ *
+ * Character timing follows ISO 7816-3: no more than 9600 etu
+ * between two characters, and no more than 19200 etu for the
+ * whole ATR. If we don't know the etu, fall back to one second
+ * per character.
+ */
+#define IFD_ATR_CHAR_WAIT_ETU		9600
+#define IFD_ATR_MAX_DURATION_ETU	19200
+
+static int ifd_recv_atr(ifd_device_t * dev, unsigned char *atr, size_t size,
 			int revert_bits)
 {
-	unsigned char *buf;
-	unsigned int n;
-
-	if (count > ct_buf_tailroom(bp)) {
-		ct_error("ATR buffer too small");
-		return -1;
+	struct timeval begin;
+	unsigned int len = 1, need = 2, td = 1, tck = 0;
+	long char_wait, atr_wait, wait;
+	unsigned char c;
+
+	if (dev->etu) {
+		char_wait = (IFD_ATR_CHAR_WAIT_ETU * dev->etu + 999) / 1000;
+		atr_wait = (IFD_ATR_MAX_DURATION_ETU * dev->etu + 999) / 1000;
+	} else {
+		char_wait = 1000;
+		atr_wait = 0;
 	}
 
-	buf = (unsigned char *)ct_buf_tail(bp);
-	for (n = 0; n < count; n++) {
-		if (ifd_device_recv(dev, buf + n, 1, 1000) < 0) {
+	gettimeofday(&begin, NULL);
+	while (len < need) {
+		if (need > size) {
+			ct_error("ATR buffer too small");
+			return -1;
+		}
+
+		wait = (need - len) * char_wait;
+		if (atr_wait) {
+			long left = atr_wait - ifd_time_elapsed(&begin);
+
+			if (left <= 0) {
+				ct_error("ATR took longer than %u etu",
+					 IFD_ATR_MAX_DURATION_ETU);
+				return -1;
+			}
+			if (wait > left)
+				wait = left;
+		}
+
+		if (ifd_device_recv(dev, atr + len, need - len, wait) < 0) {
 			ct_error("failed to receive ATR");
 			return -1;
 		}
+		if (revert_bits)
+			ifd_revert_bits(atr + len, need - len);
+		len = need;
+
+		/* If we just received T0 or a TDi, it tells us
+		 * how many more bytes to expect */
+		if (td && td < len) {
+			c = atr[td];
+			if (td > 1 && (c & 0x0F))
+				tck = 1;
+			need = td + 1 + ifd_count_bits(c & 0xF0);
+			if (c & 0x80) {
+				td = need - 1;
+			} else {
+				td = 0;
+				need += (atr[1] & 0x0F) + tck;
+			}
+		}
 	}
 
-	if (revert_bits)
-		ifd_revert_bits(buf, count);
-
-	/* Advance tail pointer */
-	ct_buf_put(bp, NULL, count);
-	return count;
+	return len;
 }
 
 /*
@@ -403,6 +436,7 @@ int ifd_card_eject(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 		   const char *message)
 {
 	const ifd_driver_t *drv = reader->driver;
+	int rc;
 
 	if (idx > reader->nslots) {
 		ct_error("%s: invalid slot number %u", reader->name, idx);
@@ -412,7 +446,13 @@ int ifd_card_eject(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 	if (!drv || !drv->ops || !drv->ops->card_eject)
 		return 0;
 
-	return drv->ops->card_eject(reader, idx, timeout, message);
+	if ((rc = drv->ops->card_eject(reader, idx, timeout, message)) < 0)
+		return rc;
+
+	/* Whatever is left in the slot is powered down */
+	reader->slot[idx].atr_len = 0;
+	ifd_slot_power_update(reader, idx);
+	return rc;
 }
 
 /*
@@ -444,6 +484,8 @@ int ifd_card_command(ifd_reader_t * reader, unsigned int idx, const void *sbuf,
 		     size_t slen, void *rbuf, size_t rlen)
 {
 	ifd_slot_t *slot;
+	long dead;
+	int rc;
 
 	if (idx > reader->nslots)
 		return -1;
@@ -462,8 +504,72 @@ int ifd_card_command(ifd_reader_t * reader, unsigned int idx, const void *sbuf,
 	 * things */
 	slot->next_update = time(NULL) + 1;
 
-	return ifd_protocol_transceive(slot->proto, slot->dad,
-				       sbuf, slen, rbuf, rlen);
+	rc = ifd_protocol_transceive(slot->proto, slot->dad,
+				     sbuf, slen, rbuf, rlen);
+
+	/* If T=1 error recovery (including resynch) failed, the
+	 * last resort is to reset the card. The application loses
+	 * its card state either way; bump the card sequence number
+	 * so it can find out. */
+	if (rc < 0 && rc != IFD_ERROR_USER_ABORT
+	    && slot->proto->ops->id == IFD_PROTOCOL_T1
+	    && ifd_protocol_get_parameter(slot->proto,
+					  IFD_PROTOCOL_RESET_REQUIRED,
+					  &dead) >= 0 && dead) {
+		ct_error("%s: T=1 protocol failure, resetting card",
+			 reader->name);
+		if (ifd_card_reset(reader, idx, NULL, 0) >= 0
+		    && reader->status)
+			ifd_slot_status_update(reader, idx, IFD_CARD_PRESENT |
+					       IFD_CARD_STATUS_CHANGED);
+	}
+
+	return rc;
+}
+
+/*
+ * Has the client given up on the command in progress?
+ * Drivers and protocols may ask while waiting for the card, and
+ * return IFD_ERROR_USER_ABORT if so.
+ */
+int ifd_check_abort(ifd_reader_t * reader)
+{
+	if (reader == NULL || reader->check_abort == NULL)
+		return 0;
+	return reader->check_abort(reader);
+}
+
+/*
+ * Clean up after an aborted command. Readers that can't abort
+ * a command, and protocols left in an unknown state, get the
+ * card reset.
+ */
+int ifd_card_abort(ifd_reader_t * reader, unsigned int idx)
+{
+	const ifd_driver_t *drv = reader->driver;
+	ifd_slot_t *slot;
+	long dead = 0;
+	int rc = IFD_ERROR_NOT_SUPPORTED;
+
+	if (idx >= reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+
+	slot = &reader->slot[idx];
+	if (drv && drv->ops && drv->ops->abort)
+		rc = drv->ops->abort(reader, idx);
+
+	if (slot->proto)
+		ifd_protocol_get_parameter(slot->proto,
+					   IFD_PROTOCOL_RESET_REQUIRED, &dead);
+	if (rc >= 0 && !dead)
+		return rc;
+
+	ct_error("%s: resetting card after abort", reader->name);
+	rc = ifd_card_reset(reader, idx, NULL, 0);
+	if (rc >= 0 && reader->status)
+		ifd_slot_status_update(reader, idx, IFD_CARD_PRESENT |
+				       IFD_CARD_STATUS_CHANGED);
+	return rc;
 }
 
 /*
@@ -606,6 +712,14 @@ static void ifd_slot_status_update(ifd_reader_t *reader, int slot, int status)
 
 	if (!(status & IFD_CARD_PRESENT)) {
 		new_seq = 0;
+		/* Forget the card, even if the driver didn't tell
+		 * us it changed; the next one may come back before
+		 * we poll again */
+		reader->slot[slot].atr_len = 0;
+		if (reader->slot[slot].proto) {
+			ifd_protocol_free(reader->slot[slot].proto);
+			reader->slot[slot].proto = NULL;
+		}
 	}
 	else if (!prev_seq || (status & IFD_CARD_STATUS_CHANGED)) {
 		new_seq = card_seq++;
@@ -617,6 +731,34 @@ static void ifd_slot_status_update(ifd_reader_t *reader, int slot, int status)
 		info->ct_card[slot] = new_seq;
 		ct_status_update(info);
 	}
+
+	ifd_slot_power_update(reader, slot);
+}
+
+/*
+ * Tell clients whether the card in a slot is present and
+ * powered up, i.e. whether they can talk to it right away.
+ * The PC/SC driver answers presence queries from this
+ * without asking us.
+ */
+static void ifd_slot_power_update(ifd_reader_t *reader, int slot)
+{
+	ct_info_t *info = reader->status;
+	unsigned int mask = 1 << slot;
+	int powered;
+
+	if (info == NULL)
+		return;
+
+	powered = info->ct_card[slot] && reader->slot[slot].atr_len;
+	if (!powered == !(info->ct_powered & mask))
+		return;
+
+	if (powered)
+		info->ct_powered |= mask;
+	else
+		info->ct_powered &= ~mask;
+	ct_status_update(info);
 }
 
 void ifd_poll(ifd_reader_t *reader)
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,16 +28,61 @@
 #include "internal.h"
 #include "ria.h"
 
-static int ria_devsock_process(ct_socket_t *, header_t *,
-			       ct_buf_t *, ct_buf_t *);
-static void ria_devsock_close(ct_socket_t *);
+typedef int ria_process_fn_t(ria_client_t *, header_t *,
+			     ct_buf_t *, ct_buf_t *);
+
+static ria_process_fn_t ria_devsock_process;
+static ria_process_fn_t ria_rdrsock_process;
+static int ria_export_process(ct_socket_t *, header_t *,
+			      ct_buf_t *, ct_buf_t *);
+static void ria_export_close(ct_socket_t *);
 static int ria_poll_device(ct_socket_t *, struct pollfd *);
 static void ria_close_device(ct_socket_t *);
+static int ria_poll_reader(ct_socket_t *, struct pollfd *);
+
+#define RIA_RECONNECT_MIN	1
+#define RIA_RECONNECT_MAX	60
+
+/*
+ * Everything this process exports. With more than one
+ * device, they all share one connection to the proxy,
+ * and each packet carries the device's channel number.
+ */
+typedef struct ria_export {
+	char name[RIA_NAME_MAX];
+	ria_client_t *ria;
+	ria_process_fn_t *process;
+	int gone;
+} ria_export_t;
+
+static ria_export_t exports[RIA_MUX_MAX];
+static unsigned int num_exports = 0;
+static const char *export_address;
+static ct_socket_t *export_sock;
+
+static ria_client_t *ria_export_add(const char *name, void *user_data,
+				    ria_process_fn_t * process)
+{
+	ria_export_t *ep;
+
+	if (num_exports == RIA_MUX_MAX) {
+		ct_error("Too many devices, can export at most %u",
+			 RIA_MUX_MAX);
+		exit(1);
+	}
+	ep = &exports[num_exports++];
+	strncpy(ep->name, name, RIA_NAME_MAX - 1);
+	if (!(ep->ria = ria_client_new()))
+		exit(1);
+	ep->ria->user_data = user_data;
+	ep->process = process;
+	return ep->ria;
+}
 
 /*
  * Handle device side of things
  */
-ria_client_t *ria_export_device(const char *address, const char *device)
+int ria_export_device(const char *name, const char *device)
 {
 	ifd_device_t *dev;
 	ria_client_t *ria;
@@ -53,15 +99,7 @@ ria_client_t *ria_export_device(const char *address, const char *device)
 		exit(1);
 	}
 
-	/* Connect to ifd proxy */
-	if (!(ria = ria_connect(address)))
-		exit(1);
-	ria->user_data = dev;
-	ria->sock->process = ria_devsock_process;
-	ria->sock->close = ria_devsock_close;
-	ria->sock->user_data = ria;
-
-	ct_mainloop_add_socket(ria->sock);
+	ria = ria_export_add(name, dev, ria_devsock_process);
 
 	/* Set up the fake socket encapsulating the device */
 	sock = ct_socket_new(0);
@@ -73,36 +111,305 @@ ria_client_t *ria_export_device(const char *address, const char *device)
 	sock->send = NULL;
 	ct_mainloop_add_socket(sock);
 
-	return ria;
+	return 0;
 }
 
-int ria_register_device(ria_client_t * ria, const char *name)
+/*
+ * Export a reader rather than a device. The driver and the
+ * protocol run on this side, and the peer talks to us in terms
+ * of card status, reset and APDUs - one round trip per command
+ * instead of one per T=1 block or status poll.
+ */
+int ria_export_reader(const char *name, const char *driver,
+		      const char *device)
 {
-	ifd_device_t *dev = (ifd_device_t *) ria->user_data;
+	ifd_reader_t *reader;
+	ria_client_t *ria;
+	ct_socket_t *sock;
+
+	/* Open reader */
+	if (!(reader = ifd_open(driver, device))) {
+		ct_error("Unable to open reader %s\n", device);
+		exit(1);
+	}
+
+	if (ifd_activate(reader) < 0) {
+		ct_error("Unable to activate reader %s\n", device);
+		exit(1);
+	}
+
+	ria = ria_export_add(name, reader, ria_rdrsock_process);
+
+	/* Watch for the reader going away */
+	if (reader->device->hotplug) {
+		sock = ct_socket_new(0);
+		sock->fd = 0x7FFFFFFF;
+		sock->user_data = ria;
+		sock->poll = ria_poll_reader;
+		sock->close = ria_close_device;
+		sock->recv = NULL;
+		sock->send = NULL;
+		ct_mainloop_add_socket(sock);
+	}
+
+	return 0;
+}
+
+static int ria_register_device(ria_export_t * ep)
+{
+	ria_client_t *ria = ep->ria;
+	ifd_device_t *dev;
 	ria_device_t devinfo;
 
 	memset(&devinfo, 0, sizeof(devinfo));
-	strncpy(devinfo.name, name, RIA_NAME_MAX - 1);
-	if (dev->type == IFD_DEVICE_TYPE_SERIAL)
-		strcpy(devinfo.type, "serial");
-	else if (dev->type == IFD_DEVICE_TYPE_USB)
-		strcpy(devinfo.type, "usb");
-	else
-		strcpy(devinfo.type, "other");
+	memcpy(devinfo.name, ep->name, RIA_NAME_MAX);
+
+	if (ep->process == ria_rdrsock_process) {
+		strcpy(devinfo.type, "reader");
+	} else {
+		dev = (ifd_device_t *) ria->user_data;
+		if (dev->type == IFD_DEVICE_TYPE_SERIAL)
+			strcpy(devinfo.type, "serial");
+		else if (dev->type == IFD_DEVICE_TYPE_USB)
+			strcpy(devinfo.type, "usb");
+		else
+			strcpy(devinfo.type, "other");
+	}
 
+	ifd_debug(1, "About to register device as \"%s\"", ep->name);
+
+	/* On a multiplexed connection, don't wait for the
+	 * answer; the proxy may already be sending us data
+	 * for the devices registered before this one. */
+	if (ria->channel >= 0)
+		return ria_send(ria, RIA_MGR_REGISTER,
+				&devinfo, sizeof(devinfo));
 	return ria_command(ria, RIA_MGR_REGISTER,
 			   &devinfo, sizeof(devinfo), NULL, 0, -1);
 }
 
-static int ria_devsock_process(ct_socket_t * sock, header_t * hdr,
+/*
+ * Connect to the proxy and register all devices
+ */
+static int ria_export_connect(void)
+{
+	ct_socket_t *sock;
+	ria_client_t *ria;
+	unsigned char ok;
+	unsigned int n;
+	int rc, mux = num_exports > 1;
+
+	if (!(sock = ria_socket_connect(export_address)))
+		return IFD_ERROR_NOT_CONNECTED;
+
+	for (n = 0; n < num_exports; n++) {
+		ria = exports[n].ria;
+		ria->sock = sock;
+		ria->channel = -1;
+		ria->chunk = RIA_CHUNK_LEGACY;
+		ria->window = ria->unacked = 0;
+		ria_ring_clear(&ria->data);
+	}
+
+	if (mux) {
+		/* A proxy that doesn't know about multiplexing
+		 * rejects the command, or sends back an empty reply */
+		rc = ria_command(exports[0].ria, RIA_MGR_MUX, NULL, 0,
+				 &ok, 1, -1);
+		if (rc < 0 && rc != IFD_ERROR_INVALID_CMD) {
+			ct_socket_free(sock);
+			return rc;
+		}
+		if (rc < 1) {
+			ct_error("Proxy can't multiplex devices, "
+				 "please export one device per process");
+			exit(1);
+		}
+		for (n = 0; n < num_exports; n++)
+			exports[n].ria->channel = n;
+	}
+
+	for (n = 0; n < num_exports; n++) {
+		if (exports[n].gone)
+			continue;
+		if ((rc = ria_register_device(&exports[n])) < 0) {
+			ct_error("Unable to register device: %s",
+				 ct_strerror(rc));
+			ct_socket_free(sock);
+			return rc;
+		}
+	}
+
+	sock->process = ria_export_process;
+	sock->close = ria_export_close;
+	ct_mainloop_add_socket(sock);
+	export_sock = sock;
+	return 0;
+}
+
+int ria_export_start(const char *address)
+{
+	int rc;
+
+	export_address = address;
+	if ((rc = ria_export_connect()) < 0)
+		exit(1);
+	return 0;
+}
+
+/*
+ * Lost the connection to the proxy. Keep trying to get it
+ * back, backing off up to a minute between attempts. The
+ * attempts are made from the main loop, through the poll
+ * hook of a socket that stands in for the connection, so
+ * that the exported devices are still looked after while
+ * we wait.
+ */
+static struct timeval reconnect_at;
+static unsigned int reconnect_wait;
+
+static int ria_poll_reconnect(ct_socket_t * sock, struct pollfd *pfd)
+{
+	struct timeval now;
+
+	/* Nothing to poll, but always take part, or the main
+	 * loop may find nothing to wait for and quit. With a
+	 * poll hook around, it wakes up every second. */
+	pfd->fd = -1;
+	pfd->events = 0;
+
+	/* Once connected, the main loop frees us */
+	if (export_sock != NULL) {
+		sock->fd = -1;
+		return 1;
+	}
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, &reconnect_at, <))
+		return 1;
+
+	if (ria_export_connect() < 0) {
+		ifd_debug(1, "retrying in %u seconds", reconnect_wait);
+		reconnect_at = now;
+		reconnect_at.tv_sec += reconnect_wait;
+		if ((reconnect_wait *= 2) > RIA_RECONNECT_MAX)
+			reconnect_wait = RIA_RECONNECT_MAX;
+		return 1;
+	}
+
+	ifd_debug(1, "reconnected to %s", export_address);
+	sock->fd = -1;
+	return 1;
+}
+
+static void ria_export_close(ct_socket_t * sock)
+{
+	ct_socket_t *timer;
+
+	if (sock != export_sock)
+		return;
+	export_sock = NULL;
+
+	ct_error("Network connection closed, reconnecting");
+	if (!(timer = ct_socket_new(0))) {
+		ct_error("out of memory");
+		exit(1);
+	}
+	timer->fd = 0x7FFFFFFF;
+	timer->poll = ria_poll_reconnect;
+	timer->recv = NULL;
+	timer->send = NULL;
+	ct_mainloop_add_socket(timer);
+
+	gettimeofday(&reconnect_at, NULL);
+	reconnect_wait = RIA_RECONNECT_MIN;
+}
+
+static int ria_export_process(ct_socket_t * sock, header_t * hdr,
+			      ct_buf_t * args, ct_buf_t * resp)
+{
+	ria_export_t *ep;
+	unsigned char channel;
+	int rc;
+
+	if (num_exports == 1)
+		return exports[0].process(exports[0].ria, hdr, args, resp);
+
+	/* Replies to our registrations */
+	if (hdr->dest != 0) {
+		if (hdr->error)
+			ct_error("Unable to register device: %s",
+				 ct_strerror(hdr->error));
+		hdr->xid = 0;
+		return 0;
+	}
+
+	if (ct_buf_get(args, &channel, 1) < 0)
+		return IFD_ERROR_INVALID_MSG;
+	if (channel >= num_exports || exports[channel].gone)
+		return IFD_ERROR_UNKNOWN_DEVICE;
+	ep = &exports[channel];
+
+	ct_buf_putc(resp, channel);
+	rc = ep->process(ep->ria, hdr, args, resp);
+	if (hdr->xid == 0)
+		return 0;
+
+	/* The socket layer would drop the response data along
+	 * with the channel number in case of an error, so send
+	 * the reply ourselves */
+	if (rc < 0) {
+		ct_buf_clear(resp);
+		ct_buf_putc(resp, channel);
+		hdr->error = rc;
+	} else {
+		hdr->error = 0;
+	}
+	hdr->dest = 1;
+	rc = ct_socket_put_packet(sock, hdr, resp);
+	hdr->xid = 0;
+	return rc;
+}
+
+/*
+ * A device went away. If it's the only one, we're done;
+ * otherwise tell the proxy and carry on with the others.
+ */
+static int ria_export_detach(ria_client_t * ria)
+{
+	ria_export_t *ep = NULL;
+	unsigned int n, left = 0;
+
+	for (n = 0; n < num_exports; n++) {
+		if (exports[n].ria == ria)
+			ep = &exports[n];
+		else if (!exports[n].gone)
+			left++;
+	}
+	if (ep == NULL || left == 0 || ria->channel < 0) {
+		ifd_debug(1, "Device detached, exiting");
+		exit(0);
+	}
+
+	ifd_debug(1, "Device %s detached, unregistering", ep->name);
+	ep->gone = 1;
+	if (ep->process == ria_devsock_process)
+		ifd_device_close((ifd_device_t *) ria->user_data);
+	else
+		ifd_close((ifd_reader_t *) ria->user_data);
+	ria->user_data = NULL;
+	ria_send(ria, RIA_MGR_UNREGISTER, NULL, 0);
+	return -1;
+}
+
+static int ria_devsock_process(ria_client_t * ria, header_t * hdr,
 			       ct_buf_t * args, ct_buf_t * resp)
 {
-	ria_client_t *ria = (ria_client_t *) sock->user_data;
 	ifd_device_t *dev = (ifd_device_t *) ria->user_data;
 	unsigned char cmd;
 	int rc, count;
 
-	ria_print_packet(sock, 2, "ria_devsock_process", hdr, args);
+	ria_print_packet(ria->sock, 2, "ria_devsock_process", hdr, args);
 
 	/* Unexpected reply on this socket - simply drop */
 	if (hdr->dest != 0) {
@@ -114,8 +421,11 @@ static int ria_devsock_process(ct_socket_t * sock, header_t * hdr,
 		return rc;
 
 	switch (cmd) {
+	case RIA_RESET_DEVICE:
+		return ifd_device_reset(dev);
 	case RIA_FLUSH_DEVICE:
 		ifd_device_flush(dev);
+		ria_ring_clear(&ria->data);
 		return 0;
 	case RIA_SEND_BREAK:
 		{
@@ -165,14 +475,34 @@ static int ria_devsock_process(ct_socket_t * sock, header_t * hdr,
 			return 0;
 		}
 
+	case RIA_STREAM_CONFIG:
+		{
+			ria_stream_conf_t conf;
+			unsigned int chunk, window;
+
+			if ((rc = ct_buf_get(args, &conf, sizeof(conf))) < 0)
+				return rc;
+			chunk = ntohl(conf.chunk);
+			window = ntohl(conf.window);
+			if (chunk > RIA_CHUNK_MAX)
+				chunk = RIA_CHUNK_MAX;
+			if (window > ria->data.size)
+				window = ria->data.size;
+			if (chunk == 0 || window < chunk)
+				return IFD_ERROR_INVALID_ARG;
+			ria->chunk = chunk;
+			ria->window = window;
+			ifd_debug(1, "stream mode, chunk %u window %u",
+				  chunk, window);
+			conf.chunk = htonl(chunk);
+			conf.window = htonl(window);
+			return ct_buf_put(resp, &conf, sizeof(conf));
+		}
+
 	case RIA_DATA:
 		hdr->xid = 0;	/* no reponse */
 		count = ct_buf_avail(args);
-		rc = ct_buf_put(&ria->data, ct_buf_head(args), count);
-		if (rc < 0) {
-			ct_buf_compact(&ria->data);
-			rc = ct_buf_put(&ria->data, ct_buf_head(args), count);
-		}
+		rc = ria_ring_put(&ria->data, ct_buf_head(args), count);
 		if (rc < 0)
 			ifd_debug(1, "unable to queue %u bytes for device",
 				  count);
@@ -184,50 +514,177 @@ static int ria_devsock_process(ct_socket_t * sock, header_t * hdr,
 
 }
 
-static void ria_devsock_close(ct_socket_t * sock)
+static int ria_rdrsock_process(ria_client_t * ria, header_t * hdr,
+			       ct_buf_t * args, ct_buf_t * resp)
 {
-	ct_error("Network connection closed, exiting\n");
-	exit(0);
+	ifd_reader_t *reader = (ifd_reader_t *) ria->user_data;
+	unsigned char buffer[1 + RIA_APDU_MAX];
+	unsigned char cmd, slot;
+	int rc;
+
+	ria_print_packet(ria->sock, 2, "ria_rdrsock_process", hdr, args);
+
+	/* Unexpected reply on this socket - simply drop */
+	if (hdr->dest != 0) {
+		hdr->xid = 0;
+		return 0;
+	}
+
+	if ((rc = ct_buf_get(args, &cmd, 1)) < 0)
+		return rc;
+
+	if (cmd == RIA_READER_INFO) {
+		ria_reader_info_t info;
+
+		memset(&info, 0, sizeof(info));
+		strncpy(info.name, reader->name, sizeof(info.name) - 1);
+		info.nslots = reader->nslots;
+		return ct_buf_put(resp, &info, sizeof(info));
+	}
+
+	if ((rc = ct_buf_get(args, &slot, 1)) < 0)
+		return rc;
+	if (slot >= reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+
+	ifd_before_command(reader);
+
+	switch (cmd) {
+	case RIA_CARD_STATUS:
+		{
+			int status;
+			uint32_t val;
+
+			if ((rc = ifd_card_status(reader, slot, &status)) < 0)
+				break;
+			val = htonl(status);
+			rc = ct_buf_put(resp, &val, sizeof(val));
+			break;
+		}
+	case RIA_CARD_RESET:
+		{
+			ifd_protocol_t *proto;
+
+			rc = ifd_card_reset(reader, slot,
+					    buffer + 1, sizeof(buffer) - 1);
+			if (rc < 0)
+				break;
+			/* Tell the peer which protocol we picked, so
+			 * it doesn't have to come back and ask for it */
+			proto = reader->slot[slot].proto;
+			buffer[0] = proto ? proto->ops->id : RIA_PROTOCOL_NONE;
+			rc = ct_buf_put(resp, buffer, rc + 1);
+			break;
+		}
+	case RIA_CARD_SET_PROTOCOL:
+		{
+			uint32_t val;
+
+			if ((rc = ct_buf_get(args, &val, sizeof(val))) < 0)
+				break;
+			rc = ifd_set_protocol(reader, slot, (int32_t) ntohl(val));
+			break;
+		}
+	case RIA_CARD_TRANSACT:
+		rc = ifd_card_command(reader, slot,
+				      ct_buf_head(args), ct_buf_avail(args),
+				      buffer, RIA_APDU_MAX);
+		if (rc == IFD_ERROR_BUFFER_TOO_SMALL)
+			ct_error("response exceeds the limit of %u bytes",
+				 (unsigned int)RIA_APDU_MAX);
+		if (rc < 0)
+			break;
+		rc = ct_buf_put(resp, buffer, rc);
+		break;
+	default:
+		ct_error("Unexpected command 0x02%x\n", cmd);
+		rc = IFD_ERROR_INVALID_CMD;
+	}
+
+	ifd_after_command(reader);
+	return rc < 0 ? rc : 0;
+}
+
+/*
+ * Read from the device. In stream mode, keep reading whatever
+ * else is already there, so that it goes out as one packet.
+ */
+static int ria_read_device(ria_client_t * ria, ifd_device_t * dev,
+			   unsigned char *buffer)
+{
+	size_t size = ria->window ? ria->chunk : 512;
+	struct pollfd pfd;
+	int n, count = 0;
+
+	do {
+		n = read(dev->fd, buffer + count, size - count);
+		if (n < 0) {
+			if (count)
+				break;
+			ct_error("error reading from device: %m");
+			return -1;
+		}
+		if (n == 0)
+			break;
+		count += n;
+
+		pfd.fd = dev->fd;
+		pfd.events = POLLIN;
+	} while (ria->window && count < size && poll(&pfd, 1, 0) == 1);
+
+	return count;
 }
 
 static int ria_poll_device(ct_socket_t * sock, struct pollfd *pfd)
 {
-	unsigned char buffer[512];
+	unsigned char buffer[RIA_CHUNK_MAX];
 	ria_client_t *ria = (ria_client_t *) sock->user_data;
 	ifd_device_t *dev = (ifd_device_t *) ria->user_data;
+	struct iovec iov[2];
+	unsigned int niov;
+	uint32_t acked;
 	int n, rc;
 
+	/* If we lose the network connection, the device stays;
+	 * the data in flight is lost anyway, so don't let send
+	 * errors take the device down. */
 	pfd->fd = dev->fd;
-	if (pfd->revents & POLLIN) {
-		n = read(dev->fd, buffer, sizeof(buffer));
-		if (n < 0) {
-			ct_error("error reading from device: %m");
-			return -1;
+	if (pfd->revents & (POLLIN | POLLHUP)) {
+		if ((n = ria_read_device(ria, dev, buffer)) < 0)
+			return ria_export_detach(ria);
+		if (n == 0 && (pfd->revents & POLLHUP)) {
+			ct_error("%s: line hung up", dev->name);
+			return ria_export_detach(ria);
 		}
 
 		ifd_debug(2, "read%s", ct_hexdump(buffer, n));
-		if ((rc = ria_send(ria, RIA_DATA, buffer, n)) < 0)
-			return rc;
+		if (n && (rc = ria_send(ria, RIA_DATA, buffer, n)) < 0)
+			ifd_debug(1, "unable to send data: %s",
+				  ct_strerror(rc));
 	}
 	if (pfd->revents & POLLOUT) {
-		n = write(dev->fd, ct_buf_head(&ria->data),
-			  ct_buf_avail(&ria->data));
+		niov = ria_ring_iov(&ria->data, iov);
+		n = writev(dev->fd, iov, niov);
 		if (n < 0) {
 			ct_error("error writing to device: %m");
-			return -1;
+			return ria_export_detach(ria);
 		}
 
-		ifd_debug(2, "wrote%s", ct_hexdump(ct_buf_head(&ria->data), n));
-		ct_buf_get(&ria->data, NULL, n);
-	}
+		ifd_debug(2, "wrote %d bytes", n);
+		ria_ring_get(&ria->data, NULL, n);
 
-	if (ifd_device_poll_presence(dev, pfd) == 0) {
-		ifd_debug(1, "Device detached, exiting");
-		exit(0);
+		/* Give the peer its window back */
+		if (ria->window && n) {
+			acked = htonl(n);
+			ria_send(ria, RIA_DATA_ACK, &acked, sizeof(acked));
+		}
 	}
 
+	if (ifd_device_poll_presence(dev, pfd) == 0)
+		return ria_export_detach(ria);
+
 	pfd->events |= POLLIN;
-	if (ct_buf_avail(&ria->data))
+	if (ria_ring_avail(&ria->data))
 		pfd->events |= POLLOUT;
 
 	if (1 /* hotplug */ )
@@ -236,8 +693,24 @@ static int ria_poll_device(ct_socket_t * sock, struct pollfd *pfd)
 	return 1;
 }
 
+static int ria_poll_reader(ct_socket_t * sock, struct pollfd *pfd)
+{
+	ria_client_t *ria = (ria_client_t *) sock->user_data;
+	ifd_reader_t *reader = (ifd_reader_t *) ria->user_data;
+
+	if (ifd_device_poll_presence(reader->device, pfd) == 0)
+		return ria_export_detach(ria);
+
+	return 1;
+}
+
 static void ria_close_device(ct_socket_t * sock)
 {
+	ria_client_t *ria = (ria_client_t *) sock->user_data;
+
+	/* Device was detached */
+	if (ria->user_data == NULL)
+		return;
 	ct_error("Dispatcher requests that device is closed, abort");
 	exit(1);
 }
@@ -27,17 +27,55 @@
 #include "internal.h"
 #include "ria.h"
 
-typedef struct ria_peer {
-	struct ria_peer *next;
-	struct ria_peer *prev;
+typedef struct ria_peer ria_peer_t;
+typedef struct ria_export ria_export_t;
+
+struct ria_peer {
+	ria_peer_t *next;
+	ria_peer_t *prev;
 	ct_socket_t *sock;
-	struct ria_peer *peer;
+	char address[RIA_NAME_MAX];
+
+	/* Device side: what was registered over this connection.
+	 * Unless it is multiplexed, that's one device in slot 0. */
+	int mux;
+	ria_export_t **exports;
+	unsigned int nexports;
+
+	/* Application side: the device we claimed, or
+	 * are queued for */
+	ria_export_t *claim;
+	int waiting;
+	uint32_t claim_xid;
+	ria_peer_t *next_waiter;
+};
+
+/* What went through the proxy for one device */
+typedef struct ria_stats {
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long queued;	/* not written straight away */
+} ria_stats_t;
+
+struct ria_export {
+	ria_export_t *next_handle;
+	ria_export_t *next_name;
+	ria_peer_t *owner;
+	int channel;
+	ria_peer_t *claimant;
+	ria_peer_t *waiters;
 	ria_device_t device;
-} ria_peer_t;
+	ria_stats_t to_dev;
+	ria_stats_t to_app;
+};
+
+#define RIA_HASH_SIZE	64
 
 static unsigned int dev_handle = 1;
 
 static ria_peer_t clients = { &clients, &clients };
+static ria_export_t *by_handle[RIA_HASH_SIZE];
+static ria_export_t *by_name[RIA_HASH_SIZE];
 
 static int ria_svc_accept(ct_socket_t *);
 static int ria_svc_app_handler(ct_socket_t *, header_t *,
@@ -47,8 +85,14 @@ static int ria_svc_dev_handler(ct_socket_t *, header_t *,
 static void ria_svc_app_close(ct_socket_t *);
 static void ria_svc_dev_close(ct_socket_t *);
 static ria_peer_t *ria_peer_new(ct_socket_t *);
-static void ria_peer_free(ria_peer_t *, int);
-static ria_peer_t *ria_find_device(const char *, size_t);
+static void ria_peer_free(ria_peer_t *);
+static ria_export_t *ria_find_device(const char *, size_t);
+static int ria_export_new(ria_peer_t *, ria_device_t *, int);
+static void ria_export_free(ria_export_t *);
+static void ria_claim_release(ria_peer_t *);
+static int ria_svc_forward(ct_socket_t *, header_t *, int, ct_buf_t *,
+			   ria_stats_t *);
+static void ria_print_stats(ria_export_t *);
 static void ria_svc_link(ria_peer_t *);
 static void ria_svc_unlink(ria_peer_t *);
 
@@ -88,15 +132,13 @@ static int ria_svc_accept(ct_socket_t * listener)
 		return 0;
 
 	clnt = ria_peer_new(sock);
-	rc = ct_socket_getpeername(sock,
-				   clnt->device.address,
-				   sizeof(clnt->device.address));
+	rc = ct_socket_getpeername(sock, clnt->address, sizeof(clnt->address));
 	if (rc < 0) {
-		ria_peer_free(clnt, 0);
+		ria_peer_free(clnt);
 		return rc;
 	}
 
-	ifd_debug(1, "New connection from %s", clnt->device.address);
+	ifd_debug(1, "New connection from %s", clnt->address);
 	sock->user_data = clnt;
 	sock->process = listener->process;
 	sock->close = listener->close;
@@ -107,17 +149,22 @@ static void ria_svc_app_close(ct_socket_t * sock)
 {
 	ria_peer_t *clnt = (ria_peer_t *) sock->user_data;
 
-	ifd_debug(1, "Application on %s closed connection",
-		  clnt->device.address);
-	ria_peer_free((ria_peer_t *) sock->user_data, 0);
+	ifd_debug(1, "Application on %s closed connection", clnt->address);
+	ria_claim_release(clnt);
+	ria_peer_free(clnt);
 }
 
 static void ria_svc_dev_close(ct_socket_t * sock)
 {
 	ria_peer_t *clnt = (ria_peer_t *) sock->user_data;
+	unsigned int n;
 
-	ifd_debug(1, "Device on %s closed connection", clnt->device.address);
-	ria_peer_free((ria_peer_t *) sock->user_data, 1);
+	ifd_debug(1, "Device on %s closed connection", clnt->address);
+	for (n = 0; clnt->exports && n < (clnt->mux ? RIA_MUX_MAX : 1); n++) {
+		if (clnt->exports[n])
+			ria_export_free(clnt->exports[n]);
+	}
+	ria_peer_free(clnt);
 }
 
 /*
@@ -128,7 +175,10 @@ static int ria_svc_app_handler(ct_socket_t * sock, header_t * hdr,
 			       ct_buf_t * args, ct_buf_t * resp)
 {
 	unsigned char cmd;
-	ria_peer_t *clnt, *peer;
+	ria_peer_t *clnt, *peer, **wp;
+	ria_export_t *exp;
+	unsigned int n, skip;
+	uint32_t start;
 	int rc;
 
 	clnt = (ria_peer_t *) sock->user_data;
@@ -139,40 +189,66 @@ static int ria_svc_app_handler(ct_socket_t * sock, header_t * hdr,
 
 	switch (cmd) {
 	case RIA_MGR_LIST:
+		ifd_debug(1, "%s requests a device listing", clnt->address);
+		skip = 0;
+		if (ct_buf_get(args, &start, sizeof(start)) >= 0)
+			skip = ntohl(start);
 		peer = &clients;
-		ifd_debug(1, "%s requests a device listing",
-			  clnt->device.address);
 		while ((peer = peer->next) != &clients) {
-			if (peer->device.name[0] != '\0')
-				ct_buf_put(resp, &peer->device,
-					   sizeof(peer->device));
+			if (peer->exports == NULL)
+				continue;
+			for (n = 0; n < (peer->mux ? RIA_MUX_MAX : 1); n++) {
+				if (!(exp = peer->exports[n]))
+					continue;
+				if (skip) {
+					skip--;
+					continue;
+				}
+				if (ct_buf_avail(resp) ==
+				    RIA_LIST_MAX * sizeof(exp->device))
+					return 0;
+				ct_buf_put(resp, &exp->device,
+					   sizeof(exp->device));
+			}
 		}
 		return 0;
 
 	case RIA_MGR_INFO:
-		peer =
-		    ria_find_device((const char *)ct_buf_head(args),
-				    ct_buf_avail(args));
-		if (peer == NULL)
+		exp = ria_find_device((const char *)ct_buf_head(args),
+				      ct_buf_avail(args));
+		if (exp == NULL)
 			return IFD_ERROR_UNKNOWN_DEVICE;
-		ct_buf_put(resp, &peer->device, sizeof(peer->device));
+		ct_buf_put(resp, &exp->device, sizeof(exp->device));
 		return 0;
 
 	case RIA_MGR_CLAIM:
-		peer =
-		    ria_find_device((const char *)ct_buf_head(args),
-				    ct_buf_avail(args));
-		if (peer == NULL)
+		exp = ria_find_device((const char *)ct_buf_head(args),
+				      ct_buf_avail(args));
+		if (exp == NULL)
 			return IFD_ERROR_UNKNOWN_DEVICE;
-		if (peer->peer)
-			return IFD_ERROR_DEVICE_BUSY;
-		ifd_debug(1, "%s claimed %s device %s/%s",
-			  clnt->device.address,
-			  peer->device.type,
-			  peer->device.address, peer->device.name);
-		ct_buf_put(resp, &peer->device, sizeof(peer->device));
-		clnt->peer = peer;
-		peer->peer = clnt;
+		if (clnt->claim)
+			return IFD_ERROR_INVALID_ARG;
+		clnt->claim = exp;
+
+		if (exp->claimant == NULL) {
+			ifd_debug(1, "%s claimed %s device %s/%s",
+				  clnt->address, exp->device.type,
+				  exp->device.address, exp->device.name);
+			exp->claimant = clnt;
+			ct_buf_put(resp, &exp->device, sizeof(exp->device));
+			return 0;
+		}
+
+		/* Someone else has it. Queue the claim, and answer
+		 * it when the device is handed over to us. */
+		ifd_debug(1, "%s queued for %s device %s/%s",
+			  clnt->address, exp->device.type,
+			  exp->device.address, exp->device.name);
+		clnt->waiting = 1;
+		clnt->claim_xid = hdr->xid;
+		for (wp = &exp->waiters; *wp; wp = &(*wp)->next_waiter) ;
+		*wp = clnt;
+		hdr->xid = 0;
 		return 0;
 	}
 
@@ -180,12 +256,13 @@ static int ria_svc_app_handler(ct_socket_t * sock, header_t * hdr,
 		return IFD_ERROR_INVALID_CMD;
 
 	/* All subsequent commands require a device */
-	if ((peer = clnt->peer) == NULL)
+	if ((exp = clnt->claim) == NULL || clnt->waiting)
 		return IFD_ERROR_NOT_CONNECTED;
 
 	/* Push back the command byte */
 	ct_buf_push(args, &cmd, 1);
-	rc = ct_socket_put_packet(peer->sock, hdr, args);
+	rc = ria_svc_forward(exp->owner->sock, hdr, exp->channel, args,
+			     &exp->to_dev);
 
 	/* Tell the caller not to send a response */
 	hdr->xid = 0;
@@ -198,12 +275,19 @@ static int ria_svc_app_handler(ct_socket_t * sock, header_t * hdr,
 static int ria_svc_dev_handler(ct_socket_t * sock, header_t * hdr,
 			       ct_buf_t * args, ct_buf_t * resp)
 {
-	unsigned char cmd;
+	unsigned char cmd, channel = 0;
 	ria_peer_t *clnt, *peer;
 	ria_device_t devinfo;
+	ria_export_t *exp;
 	int rc;
 
 	clnt = (ria_peer_t *) sock->user_data;
+
+	/* On a multiplexed connection, find the device first */
+	if (clnt->mux && ct_buf_get(args, &channel, 1) < 0)
+		return IFD_ERROR_INVALID_MSG;
+	exp = clnt->exports ? clnt->exports[channel] : NULL;
+
 	ria_print_packet(sock, 2, "dev <<", hdr, args);
 
 	/* bounce response to peer right away */
@@ -214,26 +298,37 @@ static int ria_svc_dev_handler(ct_socket_t * sock, header_t * hdr,
 		return IFD_ERROR_INVALID_MSG;
 
 	switch (cmd) {
+	case RIA_MGR_MUX:
+		if (clnt->exports)
+			return IFD_ERROR_INVALID_ARG;
+		clnt->exports = (ria_export_t **)
+		    calloc(RIA_MUX_MAX, sizeof(ria_export_t *));
+		if (clnt->exports == NULL)
+			return IFD_ERROR_NO_MEMORY;
+		clnt->mux = 1;
+		ifd_debug(1, "%s multiplexes devices", clnt->address);
+		return ct_buf_putc(resp, 1);
+
 	case RIA_MGR_REGISTER:
-		if (clnt->device.name[0])
+		if (exp)
 			return IFD_ERROR_INVALID_ARG;
 		if ((rc = ct_buf_get(args, &devinfo, sizeof(devinfo))) < 0)
 			return IFD_ERROR_INVALID_ARG;
 		if (devinfo.type[0] == '\0')
 			return IFD_ERROR_INVALID_ARG;
-		/* For security reasons, don't allow the handle counter
-		 * to wrap around. */
-		if (dev_handle == 0)
-			return IFD_ERROR_GENERIC;
-
-		memcpy(&devinfo.address, clnt->device.address, RIA_NAME_MAX);
-		clnt->device = devinfo;
-		snprintf(clnt->device.handle, RIA_NAME_MAX,
-			 "%s%u", clnt->device.type, dev_handle++);
-		ifd_debug(1,
-			  "%s registered new %s device , handle '%s', name `%s'",
-			  clnt->device.address, clnt->device.type,
-			  clnt->device.handle, clnt->device.name);
+		if ((rc = ria_export_new(clnt, &devinfo,
+					 clnt->mux ? channel : -1)) < 0)
+			return rc;
+		if (clnt->mux)
+			ct_buf_putc(resp, channel);
+		return 0;
+
+	case RIA_MGR_UNREGISTER:
+		if (exp == NULL)
+			return IFD_ERROR_UNKNOWN_DEVICE;
+		ria_export_free(exp);
+		if (clnt->mux)
+			ct_buf_putc(resp, channel);
 		return 0;
 	}
 
@@ -244,16 +339,195 @@ static int ria_svc_dev_handler(ct_socket_t * sock, header_t * hdr,
 	ct_buf_push(args, &cmd, 1);
 
       bounce_to_peer:
-	if ((peer = clnt->peer) == NULL)
-		return IFD_ERROR_NOT_CONNECTED;
-
-	rc = ct_socket_put_packet(peer->sock, hdr, args);
+	/* Nobody listening; drop it */
+	rc = 0;
+	if (exp != NULL && (peer = exp->claimant) != NULL)
+		rc = ria_svc_forward(peer->sock, hdr, -1, args, &exp->to_app);
 
 	/* Tell the caller not to send a response */
 	hdr->xid = 0;
 	return rc;
 }
 
+/*
+ * Pass a packet on to the other side, adding the
+ * channel number for multiplexed device connections.
+ * The payload goes straight from the receive buffer
+ * to the peer; we only touch the header.
+ */
+static int ria_svc_forward(ct_socket_t * sock, header_t * hdr, int channel,
+			   ct_buf_t * args, ria_stats_t * stats)
+{
+	unsigned char prefix = channel;
+	int rc;
+
+	rc = ct_socket_forward_packet(sock, hdr, &prefix,
+				      channel < 0 ? 0 : 1, args);
+	if (rc < 0)
+		return rc;
+
+	stats->packets++;
+	stats->bytes += hdr->count;
+	if (rc == 0)
+		stats->queued++;
+	return 0;
+}
+
+static void ria_print_stats(ria_export_t * exp)
+{
+	ifd_debug(1, "%s: %lu packets/%lu bytes to device (%lu queued), "
+		  "%lu packets/%lu bytes to application (%lu queued)",
+		  exp->device.handle,
+		  exp->to_dev.packets, exp->to_dev.bytes, exp->to_dev.queued,
+		  exp->to_app.packets, exp->to_app.bytes, exp->to_app.queued);
+}
+
+/*
+ * Device registry
+ */
+static unsigned int ria_hash(const char *name, size_t len)
+{
+	unsigned int h = 0;
+
+	while (len-- && *name)
+		h = h * 31 + (unsigned char)*name++;
+	return h % RIA_HASH_SIZE;
+}
+
+static int ria_export_new(ria_peer_t * clnt, ria_device_t * devinfo,
+			  int channel)
+{
+	ria_export_t *exp;
+	unsigned int h;
+
+	/* For security reasons, don't allow the handle counter
+	 * to wrap around. */
+	if (dev_handle == 0)
+		return IFD_ERROR_GENERIC;
+
+	if (clnt->exports == NULL) {
+		clnt->exports = (ria_export_t **)
+		    calloc(1, sizeof(ria_export_t *));
+		if (clnt->exports == NULL)
+			return IFD_ERROR_NO_MEMORY;
+	}
+
+	if (!(exp = (ria_export_t *) calloc(1, sizeof(*exp)))) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+	exp->owner = clnt;
+	exp->channel = channel;
+	exp->device = *devinfo;
+	exp->device.name[RIA_NAME_MAX - 1] = '\0';
+	exp->device.type[sizeof(exp->device.type) - 1] = '\0';
+	memcpy(exp->device.address, clnt->address, RIA_NAME_MAX);
+	snprintf(exp->device.handle, RIA_NAME_MAX,
+		 "%s%u", exp->device.type, dev_handle++);
+
+	h = ria_hash(exp->device.handle, RIA_NAME_MAX);
+	exp->next_handle = by_handle[h];
+	by_handle[h] = exp;
+	h = ria_hash(exp->device.name, RIA_NAME_MAX);
+	exp->next_name = by_name[h];
+	by_name[h] = exp;
+
+	clnt->exports[channel < 0 ? 0 : channel] = exp;
+	clnt->nexports++;
+
+	ifd_debug(1, "%s registered new %s device , handle '%s', name `%s'",
+		  exp->device.address, exp->device.type,
+		  exp->device.handle, exp->device.name);
+	return 0;
+}
+
+static void ria_export_free(ria_export_t * exp)
+{
+	ria_peer_t *clnt = exp->owner, *peer;
+	ria_export_t **ep;
+	header_t hdr;
+
+	ifd_debug(1, "Removing device `%s' on %s",
+		  exp->device.name, exp->device.address);
+	ria_print_stats(exp);
+
+	for (ep = &by_handle[ria_hash(exp->device.handle, RIA_NAME_MAX)];
+	     *ep != exp; ep = &(*ep)->next_handle) ;
+	*ep = exp->next_handle;
+	for (ep = &by_name[ria_hash(exp->device.name, RIA_NAME_MAX)];
+	     *ep != exp; ep = &(*ep)->next_name) ;
+	*ep = exp->next_name;
+
+	clnt->exports[exp->channel < 0 ? 0 : exp->channel] = NULL;
+	clnt->nexports--;
+
+	/* The application using the device gets EOF */
+	if ((peer = exp->claimant) != NULL) {
+		peer->claim = NULL;
+		shutdown(peer->sock->fd, SHUT_RD);
+	}
+
+	/* Those waiting for it are told it's gone */
+	while ((peer = exp->waiters) != NULL) {
+		exp->waiters = peer->next_waiter;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.xid = peer->claim_xid;
+		hdr.dest = 1;
+		hdr.error = IFD_ERROR_UNKNOWN_DEVICE;
+		ct_socket_put_packet(peer->sock, &hdr, NULL);
+		peer->claim = NULL;
+		peer->waiting = 0;
+		peer->next_waiter = NULL;
+	}
+
+	memset(exp, 0, sizeof(*exp));
+	free(exp);
+}
+
+/*
+ * Application lets go of its device (or gives up waiting
+ * for it). Hand the device over to whoever is next in line.
+ */
+static void ria_claim_release(ria_peer_t * clnt)
+{
+	ria_export_t *exp;
+	ria_peer_t **wp, *next;
+	header_t hdr;
+	ct_buf_t data;
+
+	if ((exp = clnt->claim) == NULL)
+		return;
+	clnt->claim = NULL;
+
+	if (clnt->waiting) {
+		for (wp = &exp->waiters; *wp != clnt;
+		     wp = &(*wp)->next_waiter) ;
+		*wp = clnt->next_waiter;
+		clnt->waiting = 0;
+		return;
+	}
+
+	exp->claimant = NULL;
+	ria_print_stats(exp);
+	if ((next = exp->waiters) == NULL)
+		return;
+	exp->waiters = next->next_waiter;
+	next->next_waiter = NULL;
+	next->waiting = 0;
+	exp->claimant = next;
+
+	ifd_debug(1, "%s device %s/%s handed over to %s",
+		  exp->device.type, exp->device.address,
+		  exp->device.name, next->address);
+
+	/* This is the answer to its claim */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.xid = next->claim_xid;
+	hdr.dest = 1;
+	ct_buf_set(&data, &exp->device, sizeof(exp->device));
+	ct_socket_put_packet(next->sock, &hdr, &data);
+}
+
 static ria_peer_t *ria_peer_new(ct_socket_t * sock)
 {
 	ria_peer_t *clnt;
@@ -269,19 +543,11 @@ static ria_peer_t *ria_peer_new(ct_socket_t * sock)
 	return clnt;
 }
 
-static void ria_peer_free(ria_peer_t * clnt, int detach_peer)
+static void ria_peer_free(ria_peer_t * clnt)
 {
-	ria_peer_t *peer;
-
-	if ((peer = clnt->peer) != NULL) {
-		if (detach_peer)
-			shutdown(peer->sock->fd, SHUT_RD);
-		peer->peer = NULL;
-	}
-	if (clnt->device.name[0])
-		ifd_debug(1, "Removing device `%s' on %s",
-			  clnt->device.name, clnt->device.address);
 	ria_svc_unlink(clnt);
+	if (clnt->exports)
+		free(clnt->exports);
 	memset(clnt, 0, sizeof(*clnt));
 	free(clnt);
 }
@@ -297,23 +563,25 @@ static void ria_svc_link(ria_peer_t * clnt)
 	clients.prev = clnt;
 }
 
-static ria_peer_t *ria_find_device(const char *handle, size_t len)
+static ria_export_t *ria_find_device(const char *handle, size_t len)
 {
-	ria_peer_t *peer;
+	ria_export_t *exp;
 
 	ifd_debug(2, "handle=%*.*s", (int)len, (int)len, handle);
 
 	if (len == 0 || len > RIA_NAME_MAX - 1)
 		return NULL;
 
-	peer = &clients;
-	while ((peer = peer->next) != &clients) {
-		if (!memcmp(peer->device.handle, handle, len)
-		    && peer->device.handle[len] == '\0')
-			return peer;
-		if (!memcmp(peer->device.name, handle, len)
-		    && peer->device.name[len] == '\0')
-			return peer;
+	for (exp = by_handle[ria_hash(handle, len)]; exp;
+	     exp = exp->next_handle) {
+		if (!memcmp(exp->device.handle, handle, len)
+		    && exp->device.handle[len] == '\0')
+			return exp;
+	}
+	for (exp = by_name[ria_hash(handle, len)]; exp; exp = exp->next_name) {
+		if (!memcmp(exp->device.name, handle, len)
+		    && exp->device.name[len] == '\0')
+			return exp;
 	}
 
 	return NULL;
@@ -27,15 +27,29 @@
 #include "ria.h"
 
 #define RIA_RESPONSE	255	/* pseudo command code */
-#define RIA_QUEUE_LEN	256
-#define RIA_SEND_CHUNK	128
 #define RIA_DEFAULT_TIMEOUT	4000
 
 static void ifd_remote_close(ifd_device_t *);
 
-ria_client_t *ria_connect(const char *address)
+ria_client_t *ria_client_new(void)
 {
 	ria_client_t *clnt;
+
+	clnt = (ria_client_t *) calloc(1, sizeof(*clnt) + RIA_WINDOW_MAX);
+	if (!clnt) {
+		ct_error("out of memory");
+		return NULL;
+	}
+	ria_ring_init(&clnt->data, (clnt + 1), RIA_WINDOW_MAX);
+	clnt->chunk = RIA_CHUNK_LEGACY;
+	clnt->channel = -1;
+
+	return clnt;
+}
+
+ct_socket_t *ria_socket_connect(const char *address)
+{
+	ct_socket_t *sock;
 	char path[PATH_MAX];
 	int rc;
 
@@ -43,21 +57,38 @@ ria_client_t *ria_connect(const char *address)
 		return NULL;
 	}
 
-	if (!ct_format_path(path, PATH_MAX, address)) {
+	/* Network addresses (such as the device port, which
+	 * defaults to ":6666") are used as they are; anything
+	 * else names a socket in the OpenCT socket directory */
+	if (strchr(address, ':') != NULL) {
+		strncpy(path, address, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+	} else if (!ct_format_path(path, PATH_MAX, address)) {
 		return NULL;
 	}
 
-	clnt = (ria_client_t *) calloc(1, sizeof(*clnt) + RIA_QUEUE_LEN);
-	if (!clnt) {
+	if (!(sock = ct_socket_new(CT_SOCKET_BUFSIZ))) {
 		ct_error("out of memory");
 		return NULL;
 	}
-	ct_buf_init(&clnt->data, (clnt + 1), RIA_QUEUE_LEN);
-
-	clnt->sock = ct_socket_new(1024);
-	if ((rc = ct_socket_connect(clnt->sock, path)) < 0) {
+	if ((rc = ct_socket_connect(sock, path)) < 0) {
 		ct_error("Failed to connect to RIA server \"%s\": %s",
 			 path, ct_strerror(rc));
+		ct_socket_free(sock);
+		return NULL;
+	}
+
+	return sock;
+}
+
+ria_client_t *ria_connect(const char *address)
+{
+	ria_client_t *clnt;
+
+	if (!(clnt = ria_client_new()))
+		return NULL;
+
+	if (!(clnt->sock = ria_socket_connect(address))) {
 		ria_free(clnt);
 		return NULL;
 	}
@@ -72,17 +103,99 @@ void ria_free(ria_client_t * clnt)
 	free(clnt);
 }
 
+/*
+ * Data queue
+ */
+void ria_ring_init(ria_ring_t * ring, void *base, size_t size)
+{
+	ring->base = (unsigned char *)base;
+	ring->size = size;
+	ring->head = ring->count = 0;
+}
+
+void ria_ring_clear(ria_ring_t * ring)
+{
+	ring->head = ring->count = 0;
+}
+
+int ria_ring_put(ria_ring_t * ring, const void *buf, size_t len)
+{
+	size_t tail, n;
+
+	if (len > ring->size - ring->count)
+		return -1;
+	tail = (ring->head + ring->count) % ring->size;
+	if ((n = ring->size - tail) > len)
+		n = len;
+	memcpy(ring->base + tail, buf, n);
+	memcpy(ring->base, (const unsigned char *)buf + n, len - n);
+	ring->count += len;
+	return len;
+}
+
+/*
+ * Remove up to len bytes from the queue. If buf is NULL,
+ * just drop them (e.g. after they were written out using
+ * ria_ring_iov)
+ */
+size_t ria_ring_get(ria_ring_t * ring, void *buf, size_t len)
+{
+	size_t n;
+
+	if (len > ring->count)
+		len = ring->count;
+	if (buf) {
+		if ((n = ring->size - ring->head) > len)
+			n = len;
+		memcpy(buf, ring->base + ring->head, n);
+		memcpy((unsigned char *)buf + n, ring->base, len - n);
+	}
+	ring->head = (ring->head + len) % ring->size;
+	ring->count -= len;
+	if (ring->count == 0)
+		ring->head = 0;
+	return len;
+}
+
+/*
+ * Describe the queued data for writev; returns the
+ * number of iovecs used (0, 1 or 2)
+ */
+unsigned int ria_ring_iov(ria_ring_t * ring, struct iovec *iov)
+{
+	size_t n;
+
+	if (ring->count == 0)
+		return 0;
+	if ((n = ring->size - ring->head) >= ring->count) {
+		iov[0].iov_base = ring->base + ring->head;
+		iov[0].iov_len = ring->count;
+		return 1;
+	}
+	iov[0].iov_base = ring->base + ring->head;
+	iov[0].iov_len = n;
+	iov[1].iov_base = ring->base;
+	iov[1].iov_len = ring->count - n;
+	return 2;
+}
+
 int ria_send(ria_client_t * clnt, unsigned char cmd, const void *arg_buf,
 	     size_t arg_len)
 {
-	unsigned char buffer[512];
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
 	ct_buf_t args;
 	header_t header;
 	int rc;
 
 	ct_buf_init(&args, buffer, sizeof(buffer));
+	if (clnt->channel >= 0)
+		ct_buf_putc(&args, clnt->channel);
 	ct_buf_putc(&args, cmd);
-	ct_buf_put(&args, arg_buf, arg_len);
+	if (ct_buf_put(&args, arg_buf, arg_len) < 0) {
+		ct_error("ria_send: %u bytes don't fit into a packet",
+			 (unsigned int)arg_len);
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	}
 
 	clnt->xid++;
 	if (clnt->xid == 0)
@@ -153,11 +266,27 @@ static int ria_recv(ria_client_t * clnt, unsigned char expect, uint32_t xid,
 
 		count = ct_buf_avail(&resp);
 		if (cmd == RIA_DATA) {
-			ct_buf_put(&clnt->data, ct_buf_head(&resp), count);
+			if (ria_ring_put(&clnt->data, ct_buf_head(&resp),
+					 count) < 0)
+				ifd_debug(1, "unable to queue %u bytes of data",
+					  count);
 			if (expect == RIA_DATA)
 				return count;
 			continue;
 		}
+		if (cmd == RIA_DATA_ACK) {
+			uint32_t acked;
+
+			if (ct_buf_get(&resp, &acked, sizeof(acked)) < 0)
+				continue;
+			acked = ntohl(acked);
+			if (acked > clnt->unacked)
+				acked = clnt->unacked;
+			clnt->unacked -= acked;
+			if (expect == RIA_DATA_ACK)
+				return acked;
+			continue;
+		}
 
 		if (header.xid == xid && cmd == expect) {
 			if (header.error < 0)
@@ -192,6 +321,36 @@ static int ria_claim_device(ria_client_t * clnt, const char *name,
 			   info, sizeof(*info), -1);
 }
 
+/*
+ * Agree on chunk and window size with the exporting side.
+ * If it doesn't understand us, stay with the old behavior.
+ */
+static void ria_stream_setup(ria_client_t * clnt)
+{
+	ria_stream_conf_t conf;
+	int rc;
+
+	conf.chunk = htonl(RIA_CHUNK_MAX);
+	conf.window = htonl(RIA_WINDOW_MAX);
+	rc = ria_command(clnt, RIA_STREAM_CONFIG, &conf, sizeof(conf),
+			 &conf, sizeof(conf), -1);
+	if (rc < (int)sizeof(conf) || ntohl(conf.chunk) == 0) {
+		ifd_debug(1, "peer doesn't do stream mode");
+		return;
+	}
+
+	clnt->chunk = ntohl(conf.chunk);
+	if (clnt->chunk > RIA_CHUNK_MAX)
+		clnt->chunk = RIA_CHUNK_MAX;
+	clnt->window = ntohl(conf.window);
+	if (clnt->window > RIA_WINDOW_MAX)
+		clnt->window = RIA_WINDOW_MAX;
+	if (clnt->window && clnt->window < clnt->chunk)
+		clnt->chunk = clnt->window;
+	ifd_debug(1, "stream mode, chunk %u window %u",
+		  clnt->chunk, clnt->window);
+}
+
 /*
  * Reset remote device
  */
@@ -271,7 +430,8 @@ static void ifd_remote_flush(ifd_device_t * dev)
 		return;
 
 	ria_command(clnt, RIA_FLUSH_DEVICE, NULL, 0, NULL, 0, -1);
-	ct_buf_clear(&clnt->data);
+	ria_ring_clear(&clnt->data);
+	clnt->unacked = 0;
 }
 
 static void ifd_remote_send_break(ifd_device_t * dev, unsigned int usec)
@@ -284,7 +444,7 @@ static void ifd_remote_send_break(ifd_device_t * dev, unsigned int usec)
 		return;
 	wait = htonl(usec);
 	ria_command(clnt, RIA_SEND_BREAK, &wait, sizeof(wait), NULL, 0, -1);
-	ct_buf_clear(&clnt->data);
+	ria_ring_clear(&clnt->data);
 }
 
 static int ifd_remote_send(ifd_device_t * dev, const unsigned char *buffer,
@@ -299,19 +459,38 @@ static int ifd_remote_send(ifd_device_t * dev, const unsigned char *buffer,
 		return IFD_ERROR_DEVICE_DISCONNECTED;
 
 	while (count < len) {
-		if ((n = len - count) > RIA_SEND_CHUNK)
-			n = RIA_SEND_CHUNK;
-		if ((rc = ria_send(clnt, RIA_DATA, buffer, n)) < 0) {
-			if (rc == IFD_ERROR_NOT_CONNECTED) {
-				ifd_remote_close(dev);
-				return IFD_ERROR_DEVICE_DISCONNECTED;
-			}
-			return rc;
+		if ((n = len - count) > clnt->chunk)
+			n = clnt->chunk;
+
+		/* Don't overrun the peer's queue; wait until it
+		 * has written enough to the device */
+		while (clnt->window && clnt->unacked + n > clnt->window) {
+			rc = ria_recv(clnt, RIA_DATA_ACK, 0, NULL, 0,
+				      dev->timeout);
+			if (rc < 0)
+				goto failed;
 		}
+
+		if ((rc = ria_send(clnt, RIA_DATA, buffer + count, n)) < 0)
+			goto failed;
+		if (clnt->window)
+			clnt->unacked += n;
 		count += n;
 	}
 
+	/* The main loop would only get around to this after
+	 * the next poll; we know the peer is waiting. */
+	if ((rc = ct_socket_flsbuf(clnt->sock, 1)) < 0)
+		goto failed;
+
 	return count;
+
+      failed:
+	if (rc == IFD_ERROR_NOT_CONNECTED) {
+		ifd_remote_close(dev);
+		return IFD_ERROR_DEVICE_DISCONNECTED;
+	}
+	return rc;
 }
 
 static int ifd_remote_recv(ifd_device_t * dev, unsigned char *buffer,
@@ -331,10 +510,10 @@ static int ifd_remote_recv(ifd_device_t * dev, unsigned char *buffer,
 		long wait;
 
 		/* See if there's any data queued */
-		if ((n = ct_buf_avail(&clnt->data)) != 0) {
+		if ((n = ria_ring_avail(&clnt->data)) != 0) {
 			if (n > len)
 				n = len;
-			ct_buf_get(&clnt->data, buffer, n);
+			ria_ring_get(&clnt->data, buffer, n);
 			if (ct_config.debug >= 9)
 				ifd_debug(9, "got %s", ct_hexdump(buffer, n));
 			buffer += n;
@@ -422,6 +601,10 @@ ifd_device_t *ifd_open_remote(const char *ident)
 		type = IFD_DEVICE_TYPE_SERIAL;
 	} else if (!strcmp(devinfo.type, "usb")) {
 		type = IFD_DEVICE_TYPE_USB;
+	} else if (!strcmp(devinfo.type, "reader")) {
+		/* The driver runs on the exporting side; only
+		 * the remote reader driver can talk to this */
+		type = IFD_DEVICE_TYPE_OTHER;
 	} else {
 		ct_error("Unknown device type \"%s\"", devinfo.type);
 		ria_free(clnt);
@@ -444,7 +627,11 @@ ifd_device_t *ifd_open_remote(const char *ident)
 	dev->type = type;
 	dev->user_data = clnt;
 
-	if ((rc = ifd_device_reset(dev)) < 0) {
+	if (type != IFD_DEVICE_TYPE_OTHER)
+		ria_stream_setup(clnt);
+
+	if (type != IFD_DEVICE_TYPE_OTHER
+	    && (rc = ifd_device_reset(dev)) < 0) {
 		ct_error("Failed to reset device: %s", ct_strerror(rc));
 		ifd_device_close(dev);
 		return NULL;
@@ -492,6 +679,12 @@ void ria_print_packet(ct_socket_t * sock, int level, const char *func,
 		case RIA_MGR_REGISTER:
 			msg = "REGISTER";
 			break;
+		case RIA_MGR_MUX:
+			msg = "MUX";
+			break;
+		case RIA_MGR_UNREGISTER:
+			msg = "UNREGISTER";
+			break;
 		case RIA_RESET_DEVICE:
 			msg = "RESET_DEVICE";
 			break;
@@ -507,9 +700,30 @@ void ria_print_packet(ct_socket_t * sock, int level, const char *func,
 		case RIA_SERIAL_SET_CONFIG:
 			msg = "SERIAL_SET_CONFIG";
 			break;
+		case RIA_STREAM_CONFIG:
+			msg = "STREAM_CONFIG";
+			break;
+		case RIA_READER_INFO:
+			msg = "READER_INFO";
+			break;
+		case RIA_CARD_STATUS:
+			msg = "CARD_STATUS";
+			break;
+		case RIA_CARD_RESET:
+			msg = "CARD_RESET";
+			break;
+		case RIA_CARD_SET_PROTOCOL:
+			msg = "CARD_SET_PROTOCOL";
+			break;
+		case RIA_CARD_TRANSACT:
+			msg = "CARD_TRANSACT";
+			break;
 		case RIA_DATA:
 			msg = "DATA";
 			break;
+		case RIA_DATA_ACK:
+			msg = "DATA_ACK";
+			break;
 		default:
 			snprintf(buffer, sizeof(buffer), "CALL%u", cmd);
 			msg = buffer;
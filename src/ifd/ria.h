@@ -7,13 +7,50 @@
 #ifndef IFD_REMOTE_H
 #define IFD_REMOTE_H
 
+#include <sys/uio.h>
+
+/*
+ * RIA_DATA stream parameters. Peers that don't know about
+ * RIA_STREAM_CONFIG get the old 128 byte chunks and no
+ * flow control.
+ */
+#define RIA_CHUNK_LEGACY	128
+#define RIA_CHUNK_MAX		2048
+#define RIA_WINDOW_MAX		8192
+
+/*
+ * Largest command or response APDU of a RIA_CARD_TRANSACT. It
+ * has to fit into one packet, along with the header and the
+ * channel, command and slot bytes.
+ */
+#define RIA_APDU_MAX		(CT_SOCKET_BUFSIZ - sizeof(header_t) - 3)
+
+/* Byte queue; data wraps around rather than being
+ * moved to the front of the buffer */
+typedef struct ria_ring {
+	unsigned char *base;
+	size_t size, head, count;
+} ria_ring_t;
+
 typedef struct ria_client {
 	/* Socket for communication with ifdproxy */
 	ct_socket_t *sock;
 	uint32_t xid;
 
 	/* queue for buffering data */
-	ct_buf_t data;
+	ria_ring_t data;
+
+	/* RIA_DATA stream parameters. A window of 0
+	 * means the peer doesn't do flow control; else
+	 * unacked is what we sent and it hasn't written
+	 * to the device yet. */
+	unsigned int chunk;
+	unsigned int window;
+	unsigned int unacked;
+
+	/* On a multiplexed connection, every packet
+	 * starts with the channel number; else -1 */
+	int channel;
 
 	/* application data */
 	void *user_data;
@@ -37,12 +74,27 @@ typedef struct ria_serial_conf {
 	uint8_t rts;
 } ria_serial_conf_t;
 
+typedef struct ria_stream_conf {
+	uint32_t chunk;		/* largest RIA_DATA payload */
+	uint32_t window;	/* bytes the receiver will queue */
+} ria_stream_conf_t;
+
+typedef struct ria_reader_info {
+	char name[2 * RIA_NAME_MAX];
+	uint8_t nslots;
+} ria_reader_info_t;
+
+/* Slot protocol reported by RIA_CARD_RESET when none was selected */
+#define RIA_PROTOCOL_NONE	0xFF
+
 enum {
 	/* These are for the manager only */
 	RIA_MGR_LIST = 0x00,
 	RIA_MGR_INFO,
 	RIA_MGR_CLAIM,
 	RIA_MGR_REGISTER,
+	RIA_MGR_MUX,		/* channel numbers follow on this connection */
+	RIA_MGR_UNREGISTER,
 
 	__RIA_PEER_CMD_BASE = 0x10,
 	RIA_RESET_DEVICE = 0x10,
@@ -50,19 +102,47 @@ enum {
 	RIA_SEND_BREAK,
 	RIA_SERIAL_GET_CONFIG,
 	RIA_SERIAL_SET_CONFIG,
+	RIA_STREAM_CONFIG,
 
-	RIA_DATA = 0x80
+	/* These are for readers exported at the command level;
+	 * all but RIA_READER_INFO take the slot number as their
+	 * first argument byte */
+	RIA_READER_INFO = 0x20,
+	RIA_CARD_STATUS,
+	RIA_CARD_RESET,
+	RIA_CARD_SET_PROTOCOL,
+	RIA_CARD_TRANSACT,
+
+	RIA_DATA = 0x80,
+	RIA_DATA_ACK		/* bytes written to the device */
 };
 
+/* Largest number of devices one exporter can register */
+#define RIA_MUX_MAX	256
+
+/* Most devices returned by one RIA_MGR_LIST; the argument
+ * is the (network order) index of the first one wanted */
+#define RIA_LIST_MAX	32
+
+extern ria_client_t *ria_client_new(void);
+extern ct_socket_t *ria_socket_connect(const char *);
 extern ria_client_t *ria_connect(const char *);
 extern void ria_free(ria_client_t *);
 extern int ria_send(ria_client_t *, unsigned char, const void *, size_t);
 extern int ria_command(ria_client_t *, unsigned char,
 		       const void *, size_t, void *, size_t, long timeout);
 
+extern void ria_ring_init(ria_ring_t *, void *, size_t);
+extern int ria_ring_put(ria_ring_t *, const void *, size_t);
+extern size_t ria_ring_get(ria_ring_t *, void *, size_t);
+extern unsigned int ria_ring_iov(ria_ring_t *, struct iovec *);
+extern void ria_ring_clear(ria_ring_t *);
+#define ria_ring_avail(r)	((r)->count)
+
 extern int ria_svc_listen(const char *, int);
-extern ria_client_t *ria_export_device(const char *, const char *);
-extern int ria_register_device(ria_client_t *, const char *);
+extern int ria_export_device(const char *, const char *);
+extern int ria_export_reader(const char *, const char *, const char *);
+extern int ria_export_start(const char *);
 extern void ria_print_packet(ct_socket_t *, int,
 			     const char *, header_t *, ct_buf_t *);
 
@@ -9,12 +9,37 @@
 #include <sys/select.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <errno.h>
 #include <string.h>
 
+/*
+ * Serial devices keep a receive buffer. Whatever the tty has to
+ * offer is read in a single call and handed out to the caller from
+ * here; with parity checking on, the PARMRK escapes (FF 00 x for a
+ * parity error, FF FF for a literal FF) are decoded from the buffer
+ * as well, rather than reading the line byte by byte.
+ */
+#define SERIAL_RBUF_SIZE	512
+
+typedef struct ifd_serial {
+	ifd_device_t base;
+
+	/* termios read tuning, from the config file */
+	unsigned int vmin, vtime;
+
+	/* Modem lines signalling card events, and the
+	 * watcher reporting changes on them */
+	int lines;
+	ifd_serial_watch_t *watch;
+
+	unsigned int head, count;
+	unsigned char rbuf[SERIAL_RBUF_SIZE];
+} ifd_serial_t;
+
 static unsigned int termios_to_speed(unsigned int bits);
 static unsigned int speed_to_termios(unsigned int speed);
 
@@ -109,6 +134,7 @@ static int ifd_serial_get_params(ifd_device_t * dev,
 static int ifd_serial_set_params(ifd_device_t * dev,
 				 const ifd_device_params_t * params)
 {
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
 	unsigned int speed;
 	int control, ocontrol;
 	struct termios t;
@@ -179,6 +205,8 @@ static int ifd_serial_set_params(ifd_device_t * dev,
 	t.c_cflag |= HUPCL | CREAD | CLOCAL;
 	t.c_oflag = 0;
 	t.c_lflag = 0;
+	t.c_cc[VMIN] = sp->vmin;
+	t.c_cc[VTIME] = sp->vtime;
 
 	if (tcsetattr(dev->fd, TCSANOW, &t) < 0) {
 		ct_error("%s: tcsetattr: %m", dev->name);
@@ -212,7 +240,10 @@ static int ifd_serial_set_params(ifd_device_t * dev,
  */
 static void ifd_serial_flush(ifd_device_t * dev)
 {
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+
 	tcflush(dev->fd, TCIFLUSH);
+	sp->head = sp->count = 0;
 }
 
 /*
@@ -247,19 +278,121 @@ static int ifd_serial_send(ifd_device_t * dev, const unsigned char *buffer,
 	return total;
 }
 
+/*
+ * Read whatever is available into the receive buffer
+ */
+static int ifd_serial_fill(ifd_serial_t * sp)
+{
+	ifd_device_t *dev = &sp->base;
+	unsigned int tail, space;
+	struct iovec iov[2];
+	int n, cnt = 1;
+
+	tail = (sp->head + sp->count) % SERIAL_RBUF_SIZE;
+	space = SERIAL_RBUF_SIZE - sp->count;
+
+	iov[0].iov_base = sp->rbuf + tail;
+	iov[0].iov_len = space;
+	if (tail + space > SERIAL_RBUF_SIZE) {
+		iov[0].iov_len = SERIAL_RBUF_SIZE - tail;
+		iov[1].iov_base = sp->rbuf;
+		iov[1].iov_len = space - iov[0].iov_len;
+		cnt = 2;
+	}
+
+	n = readv(dev->fd, iov, cnt);
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		ct_error("%s: failed to read from device: %m", dev->name);
+		return -1;
+	}
+	sp->count += n;
+	return n;
+}
+
+/*
+ * Hand out up to len bytes from the receive buffer, decoding
+ * parity markers on the way. An escape sequence that has not
+ * been received completely is left in the buffer.
+ */
+static int ifd_serial_decode(ifd_serial_t * sp, unsigned char *buffer,
+			     size_t len)
+{
+	ifd_device_t *dev = &sp->base;
+	int check_parity = dev->settings.serial.check_parity;
+	unsigned char *p, c;
+	size_t n = 0, run;
+
+	while (n < len && sp->count) {
+		/* Longest contiguous stretch we may copy */
+		run = SERIAL_RBUF_SIZE - sp->head;
+		if (run > sp->count)
+			run = sp->count;
+		if (run > len - n)
+			run = len - n;
+
+		if (check_parity
+		    && (p = memchr(sp->rbuf + sp->head, 0xFF, run)) != NULL)
+			run = p - (sp->rbuf + sp->head);
+
+		if (run) {
+			memcpy(buffer + n, sp->rbuf + sp->head, run);
+			sp->head = (sp->head + run) % SERIAL_RBUF_SIZE;
+			sp->count -= run;
+			n += run;
+			continue;
+		}
+
+		/* We're looking at an FF with parity checking on */
+		if (sp->count < 2)
+			break;
+		c = sp->rbuf[(sp->head + 1) % SERIAL_RBUF_SIZE];
+		if (c == 0x00) {
+			if (sp->count < 3)
+				break;
+			sp->head = (sp->head + 3) % SERIAL_RBUF_SIZE;
+			sp->count -= 3;
+			ct_error("%s: parity error on input", dev->name);
+			return -1;
+		}
+		if (c != 0xFF) {
+			ifd_debug(1, "%s: unexpected character pair FF %02x",
+				  dev->name, c);
+		}
+		sp->head = (sp->head + 2) % SERIAL_RBUF_SIZE;
+		sp->count -= 2;
+		buffer[n++] = c;
+	}
+
+	if (sp->count == 0)
+		sp->head = 0;
+	return n;
+}
+
 static int ifd_serial_recv(ifd_device_t * dev, unsigned char *buffer,
 			   size_t len, long timeout)
 {
-	size_t total = len, to_read;
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+	size_t total = len;
 	struct timeval begin;
-	int n, last_ff = 0;
+	int n;
 
 	gettimeofday(&begin, NULL);
 
-	while (len) {
+	while (1) {
 		struct pollfd pfd;
 		long wait;
 
+		if ((n = ifd_serial_decode(sp, buffer, len)) < 0)
+			return -1;
+		if (n && ct_config.debug >= 9)
+			ifd_debug(9, "serial recv:%s", ct_hexdump(buffer, n));
+		buffer += n;
+		len -= n;
+		if (len == 0)
+			break;
+
 		if ((wait = timeout - ifd_time_elapsed(&begin)) < 0)
 			goto timeout;
 
@@ -274,39 +407,8 @@ static int ifd_serial_recv(ifd_device_t * dev, unsigned char *buffer,
 		if (n == 0)
 			continue;
 
-		to_read = len;
-		if (dev->settings.serial.check_parity)
-			to_read = 1;
-
-		n = read(dev->fd, buffer, to_read);
-		if (n < 0) {
-			ct_error("%s: failed to read from device: %m",
-				 dev->name);
+		if (ifd_serial_fill(sp) < 0)
 			return -1;
-		}
-		if (ct_config.debug >= 9)
-			ifd_debug(9, "serial recv:%s", ct_hexdump(buffer, n));
-		/* Check for parity errors and 0xFF */
-		if (dev->settings.serial.check_parity) {
-			if (last_ff) {
-				if (buffer[0] == 0x00) {
-					ct_error("%s: parity error on input",
-						 dev->name);
-					return -1;
-				}
-				if (buffer[0] != 0xFF) {
-					ifd_debug(1,
-						  "%s: unexpected character pair FF %02x",
-						  dev->name, buffer[0]);
-				}
-				last_ff = 0;
-			} else if (buffer[0] == 0xFF) {
-				last_ff = 1;
-				continue;
-			}
-		}
-		buffer += n;
-		len -= n;
 	}
 
 	return total;
@@ -355,11 +457,107 @@ int ifd_serial_get_cts(ifd_device_t * dev)
 	return (status & TIOCM_CTS) ? 1 : 0;
 }
 
+/*
+ * Map IFD_SERIAL_LINE_* to modem control bits
+ */
+static int ifd_serial_lines_to_tiocm(int lines)
+{
+	int bits = 0;
+
+	if (lines & IFD_SERIAL_LINE_CTS)
+		bits |= TIOCM_CTS;
+	if (lines & IFD_SERIAL_LINE_DSR)
+		bits |= TIOCM_DSR;
+	if (lines & IFD_SERIAL_LINE_CD)
+		bits |= TIOCM_CD;
+	if (lines & IFD_SERIAL_LINE_RI)
+		bits |= TIOCM_RI;
+	return bits;
+}
+
+/*
+ * Declare which modem lines the reader uses to signal card
+ * insertion and removal. Once set, the device has an event fd
+ * that becomes readable whenever one of these lines changes.
+ */
+int ifd_serial_watch_lines(ifd_device_t * dev, int lines)
+{
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+
+	if (dev->type != IFD_DEVICE_TYPE_SERIAL)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	if (sp->watch && sp->lines != lines) {
+		ifd_sysdep_serial_unwatch(sp->watch);
+		sp->watch = NULL;
+	}
+	sp->lines = lines;
+	return 0;
+}
+
+/*
+ * Acknowledge a line change event. Returns the current state of
+ * the watched lines as IFD_SERIAL_LINE_* bits.
+ */
+int ifd_serial_line_event(ifd_device_t * dev)
+{
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+	int rc, status, lines = 0;
+
+	if (dev->type != IFD_DEVICE_TYPE_SERIAL || !sp->watch)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	if ((rc = ifd_sysdep_serial_watch_ack(sp->watch)) < 0) {
+		ct_error("%s: modem line events no longer available",
+			 dev->name);
+		ifd_sysdep_serial_unwatch(sp->watch);
+		sp->watch = NULL;
+		return rc;
+	}
+
+	if (ioctl(dev->fd, TIOCMGET, &status) < 0) {
+		ct_error("%s: ioctl(TIOCMGET) failed: %m", dev->name);
+		return -1;
+	}
+	if (status & TIOCM_CTS)
+		lines |= IFD_SERIAL_LINE_CTS;
+	if (status & TIOCM_DSR)
+		lines |= IFD_SERIAL_LINE_DSR;
+	if (status & TIOCM_CD)
+		lines |= IFD_SERIAL_LINE_CD;
+	if (status & TIOCM_RI)
+		lines |= IFD_SERIAL_LINE_RI;
+	return lines & sp->lines;
+}
+
+static int ifd_serial_get_eventfd(ifd_device_t * dev, short *events)
+{
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+	int fd;
+
+	if (!sp->lines)
+		return -1;
+
+	fd = ifd_sysdep_serial_watch(dev,
+				     ifd_serial_lines_to_tiocm(sp->lines),
+				     &sp->watch);
+	if (fd < 0)
+		return -1;
+
+	*events = POLLIN;
+	return fd;
+}
+
 /*
  * Close the device
  */
 static void ifd_serial_close(ifd_device_t * dev)
 {
+	ifd_serial_t *sp = (ifd_serial_t *) dev;
+
+	if (sp->watch)
+		ifd_sysdep_serial_unwatch(sp->watch);
+	sp->watch = NULL;
 	if (dev->fd >= 0)
 		close(dev->fd);
 	dev->fd = -1;
@@ -374,6 +572,8 @@ ifd_device_t *ifd_open_serial(const char *name)
 {
 	ifd_device_params_t params;
 	ifd_device_t *dev;
+	ifd_serial_t *sp;
+	unsigned int low_latency = 1;
 	int fd;
 
 	if ((fd = open(name, O_RDWR | O_NDELAY)) < 0) {
@@ -392,12 +592,33 @@ ifd_device_t *ifd_open_serial(const char *name)
 	ifd_serial_ops.send = ifd_serial_send;
 	ifd_serial_ops.recv = ifd_serial_recv;
 	ifd_serial_ops.close = ifd_serial_close;
+	ifd_serial_ops.get_eventfd = ifd_serial_get_eventfd;
 
-	dev = ifd_device_new(name, &ifd_serial_ops, sizeof(*dev));
+	dev = ifd_device_new(name, &ifd_serial_ops, sizeof(*sp));
+	if (!dev) {
+		close(fd);
+		return NULL;
+	}
 	dev->timeout = 1000;	/* acceptable? */
 	dev->type = IFD_DEVICE_TYPE_SERIAL;
 	dev->fd = fd;
 
+	/* We always poll before reading, so by default a read
+	 * returns whatever has arrived so far */
+	sp = (ifd_serial_t *) dev;
+	sp->vmin = 1;
+	sp->vtime = 0;
+	ifd_conf_get_integer("ifdhandler.serial_vmin", &sp->vmin);
+	ifd_conf_get_integer("ifdhandler.serial_vtime", &sp->vtime);
+	if (sp->vmin > 255)
+		sp->vmin = 255;
+	if (sp->vtime > 255)
+		sp->vtime = 255;
+
+	ifd_conf_get_bool("ifdhandler.serial_low_latency", &low_latency);
+	if (low_latency && ifd_sysdep_serial_low_latency(dev) < 0)
+		ifd_debug(1, "%s: unable to set low latency mode", name);
+
 	memset(&params, 0, sizeof(params));
 	params.serial.speed = 9600;
 	params.serial.bits = 8;
@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <linux/serial.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdint.h>
 #ifdef ENABLE_LIBUSB
 #include <usb.h>
 #endif
@@ -198,6 +202,10 @@ int ifd_sysdep_usb_control(ifd_device_t * dev, unsigned int requesttype,
 int ifd_sysdep_usb_set_configuration(ifd_device_t * dev, int config)
 {
 	if (ioctl(dev->fd, USBDEVFS_SETCONFIGURATION, &config) < 0) {
+		if (errno == EBUSY) {
+			ifd_debug(1, "usb configuration is busy");
+			return IFD_ERROR_DEVICE_BUSY;
+		}
 		ct_error("usb_setconfig failed: %m");
 		return IFD_ERROR_COMM_ERROR;
 	}
@@ -220,6 +228,11 @@ int ifd_sysdep_usb_set_interface(ifd_device_t * dev, int ifc, int alt)
 int ifd_sysdep_usb_claim_interface(ifd_device_t * dev, int interface)
 {
 	if (ioctl(dev->fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+		if (errno == EBUSY) {
+			/* someone else has it; the caller may retry */
+			ifd_debug(1, "usb interface %d is busy", interface);
+			return IFD_ERROR_DEVICE_BUSY;
+		}
 		ct_error("usb_claiminterface failed: %m");
 		return IFD_ERROR_COMM_ERROR;
 	}
@@ -244,24 +257,316 @@ int ifd_sysdep_usb_reset(ifd_device_t * dev)
 	return 0;
 }
 
+/*
+ * Asynchronous URBs
+ *
+ * Every URB we submit carries a pointer to its ifd_usb_urb in
+ * usercontext, so that whoever reaps it - a synchronous bulk
+ * transfer waiting for its own URB, or the event handler called
+ * from the main loop - can hand it to its owner. Nothing that
+ * comes out of REAPURB is ever dropped on the floor.
+ */
+struct ifd_usb_urb {
+	struct usbdevfs_urb urb;
+	int pending;
+	int result;		/* actual length, or IFD_ERROR_* */
+	ifd_usb_urb_complete_t *complete;
+	void *user_data;
+};
+
+static int usb_urb_submit(ifd_device_t * dev, struct ifd_usb_urb *u,
+			  int type, int endpoint, void *buffer, size_t len)
+{
+	ifd_debug(6, "submit urb %p", &u->urb);
+	memset(&u->urb, 0, sizeof(u->urb));
+	u->urb.type = type;
+	u->urb.endpoint = endpoint;
+	u->urb.buffer = buffer;
+	u->urb.buffer_length = len;
+	u->urb.usercontext = u;
+	u->result = 0;
+	if (ioctl(dev->fd, USBDEVFS_SUBMITURB, &u->urb) < 0) {
+		ct_error("usb_submiturb failed: %m");
+		return errno == ENODEV ? IFD_ERROR_DEVICE_DISCONNECTED :
+		    IFD_ERROR_COMM_ERROR;
+	}
+	u->pending = 1;
+	return 0;
+}
+
+/*
+ * Reap all completed URBs without blocking, and pass
+ * them on. Returns the number of URBs reaped.
+ */
+static int usb_urb_reap(ifd_device_t * dev)
+{
+	struct usbdevfs_urb *purb;
+	struct ifd_usb_urb *u;
+	int count = 0;
+
+	while (1) {
+		purb = NULL;
+		if (ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &purb) < 0) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == ENODEV)
+				return IFD_ERROR_DEVICE_DISCONNECTED;
+			ct_error("usb_reapurb failed: %m");
+			return IFD_ERROR_COMM_ERROR;
+		}
+
+		u = (struct ifd_usb_urb *)purb->usercontext;
+		if (u == NULL || &u->urb != purb) {
+			ifd_debug(2, "reaped unknown usb urb %p", purb);
+			continue;
+		}
+
+		ifd_debug(6, "reaped urb %p status=%d len=%d", purb,
+			  purb->status, purb->actual_length);
+
+		switch (purb->status) {
+		case 0:
+			u->result = purb->actual_length;
+			break;
+		case -ENOENT:
+		case -ECONNRESET:
+			u->result = IFD_ERROR_USER_ABORT;
+			break;
+		case -ETIMEDOUT:
+			u->result = IFD_ERROR_TIMEOUT;
+			break;
+		case -ENODEV:
+		case -ESHUTDOWN:
+			u->result = IFD_ERROR_DEVICE_DISCONNECTED;
+			break;
+		default:
+			u->result = IFD_ERROR_COMM_ERROR;
+			break;
+		}
+		u->pending = 0;
+		count++;
+
+		/* The callback may free the URB */
+		if (u->complete)
+			u->complete(dev, u, u->result, u->user_data);
+	}
+
+	return count;
+}
+
+static int usb_urb_wait(ifd_device_t * dev, struct ifd_usb_urb *u,
+			long timeout)
+{
+	struct timeval begin;
+	struct pollfd pfd;
+	long wait;
+	int rc;
+
+	gettimeofday(&begin, NULL);
+	while (1) {
+		if ((rc = usb_urb_reap(dev)) < 0)
+			return rc;
+		if (!u->pending)
+			return u->result;
+
+		if ((wait = timeout - ifd_time_elapsed(&begin)) <= 0)
+			return IFD_ERROR_TIMEOUT;
+
+		pfd.fd = dev->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+			ct_error("usb poll failed: %m");
+			return IFD_ERROR_COMM_ERROR;
+		}
+	}
+}
+
+static int usb_urb_cancel(ifd_device_t * dev, struct ifd_usb_urb *u)
+{
+	int rc;
+
+	if (!u->pending)
+		return 0;
+
+	/* EINVAL means the URB completed in the meantime;
+	 * either way it is now waiting to be reaped */
+	if (ioctl(dev->fd, USBDEVFS_DISCARDURB, &u->urb) < 0
+	    && errno != EINVAL) {
+		ct_error("usb_discardurb failed: %m");
+		return IFD_ERROR_COMM_ERROR;
+	}
+
+	rc = usb_urb_wait(dev, u, 1000);
+	if (u->pending) {
+		ct_error("usb: discarded urb %p not returned", &u->urb);
+		return rc < 0 ? rc : IFD_ERROR_COMM_ERROR;
+	}
+	return 0;
+}
+
+int ifd_sysdep_usb_submit(ifd_device_t * dev, int type, int endpoint,
+			  void *buffer, size_t len,
+			  ifd_usb_urb_complete_t * complete, void *user_data,
+			  ifd_usb_urb_t ** urbret)
+{
+	struct ifd_usb_urb *u;
+	int rc;
+
+	if (!(u = (struct ifd_usb_urb *)calloc(1, sizeof(*u)))) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+
+	u->complete = complete;
+	u->user_data = user_data;
+	if ((rc = usb_urb_submit(dev, u, type, endpoint, buffer, len)) < 0) {
+		free(u);
+		return rc;
+	}
+
+	*urbret = u;
+	return 0;
+}
+
+int ifd_sysdep_usb_resubmit(ifd_device_t * dev, ifd_usb_urb_t * u)
+{
+	if (u->pending)
+		return IFD_ERROR_GENERIC;
+	return usb_urb_submit(dev, u, u->urb.type, u->urb.endpoint,
+			      u->urb.buffer, u->urb.buffer_length);
+}
+
+int ifd_sysdep_usb_reap(ifd_device_t * dev)
+{
+	return usb_urb_reap(dev);
+}
+
+int ifd_sysdep_usb_wait(ifd_device_t * dev, ifd_usb_urb_t * u, long timeout)
+{
+	return usb_urb_wait(dev, u, timeout);
+}
+
+int ifd_sysdep_usb_cancel(ifd_device_t * dev, ifd_usb_urb_t * u)
+{
+	return usb_urb_cancel(dev, u);
+}
+
+/*
+ * Completion handler for URBs the kernel wouldn't give back when
+ * their owner was done with them; they are freed when they
+ * finally turn up in a reap.
+ */
+static void usb_urb_orphaned(ifd_device_t * dev, ifd_usb_urb_t * u,
+			     int result, void *user_data)
+{
+	ifd_debug(2, "reaped orphaned urb %p", &u->urb);
+	free(u);
+}
+
+void ifd_sysdep_usb_free_urb(ifd_device_t * dev, ifd_usb_urb_t * u)
+{
+	if (u->pending && usb_urb_cancel(dev, u) < 0) {
+		u->complete = usb_urb_orphaned;
+		return;
+	}
+	free(u);
+}
+
 /*
  * USB bulk transfer
+ *
+ * This goes through an URB rather than USBDEVFS_BULK, so that
+ * completions of other URBs (interrupt notifications, other
+ * outstanding transfers) are dispatched while we wait, and
+ * the transfer can be cancelled on timeout. The URB and the
+ * data it transfers live on the heap, so that if the kernel
+ * refuses to give it back, it can be left to the reaper rather
+ * than scribble over the caller's buffer later.
+ *
+ * Every APDU comes through here, so the URB and its buffer are
+ * kept with the device and reused. The buffer grows to the
+ * largest transfer asked for - for CCID, that's the bulk-in of
+ * maxmsg bytes - and is only given up when its URB is orphaned.
  */
+struct usb_bulk {
+	struct ifd_usb_urb urb;	/* must come first, see usb_urb_orphaned */
+	size_t bufsize;
+	int busy;
+};
+
+static struct usb_bulk *usb_bulk_get(ifd_device_t * dev, size_t len)
+{
+	struct usb_bulk *b = (struct usb_bulk *)dev->sysdep_data;
+
+	if (b && !b->busy && b->bufsize >= len) {
+		b->busy = 1;
+		return b;
+	}
+	if (b && !b->busy) {
+		free(b);
+		dev->sysdep_data = b = NULL;
+	}
+
+	if (!(b = (struct usb_bulk *)calloc(1, sizeof(*b) + len))) {
+		ct_error("out of memory");
+		return NULL;
+	}
+	b->bufsize = len;
+	b->busy = 1;
+	/* A transfer started from within another one gets its
+	 * own URB, which goes away when it's done */
+	if (dev->sysdep_data == NULL)
+		dev->sysdep_data = b;
+	return b;
+}
+
+static void usb_bulk_put(ifd_device_t * dev, struct usb_bulk *b)
+{
+	if (b == dev->sysdep_data)
+		b->busy = 0;
+	else
+		free(b);
+}
+
 int ifd_sysdep_usb_bulk(ifd_device_t * dev, int ep, void *buffer, size_t len,
 			long timeout)
 {
-	struct usbdevfs_bulktransfer bulk;
+	struct usb_bulk *b;
+	struct ifd_usb_urb *u;
 	int rc;
 
-	bulk.ep = ep;
-	bulk.data = buffer;
-	bulk.len = len;
-	bulk.timeout = timeout;
-	if ((rc = ioctl(dev->fd, USBDEVFS_BULK, &bulk)) < 0) {
-		ct_error("usb_bulk failed: %m");
-		return IFD_ERROR_COMM_ERROR;
+	if (!(b = usb_bulk_get(dev, len)))
+		return IFD_ERROR_NO_MEMORY;
+	u = &b->urb;
+	u->complete = NULL;
+	if (!(ep & 0x80))
+		memcpy(b + 1, buffer, len);
+
+	rc = usb_urb_submit(dev, u, USBDEVFS_URB_TYPE_BULK, ep, b + 1, len);
+	if (rc < 0) {
+		usb_bulk_put(dev, b);
+		return rc;
+	}
+
+	rc = usb_urb_wait(dev, u, timeout);
+	if (u->pending) {
+		if (usb_urb_cancel(dev, u) < 0) {
+			ct_error("usb_bulk: unable to cancel transfer");
+			if (b == dev->sysdep_data)
+				dev->sysdep_data = NULL;
+			u->complete = usb_urb_orphaned;
+			return rc < 0 ? rc : IFD_ERROR_COMM_ERROR;
+		}
+		/* It may have completed before we got to cancel it */
+		if (u->result >= 0)
+			rc = u->result;
 	}
+	if (rc < 0 && rc != IFD_ERROR_TIMEOUT)
+		ct_error("usb_bulk failed: %s", ct_strerror(rc));
 
+	if (rc > 0 && (ep & 0x80))
+		memcpy(buffer, b + 1, rc);
+	usb_bulk_put(dev, b);
 	return rc;
 }
 
@@ -269,43 +574,54 @@ int ifd_sysdep_usb_bulk(ifd_device_t * dev, int ep, void *buffer, size_t len,
  * USB URB capture
  */
 struct ifd_usb_capture {
-	struct usbdevfs_urb urb;
+	struct ifd_usb_urb urb;
 	int type;
 	int endpoint;
 	size_t maxpacket;
+	size_t bufsize;		/* allocated after the struct */
 };
 
-static int usb_submit_urb(int fd, struct ifd_usb_capture *cap)
+/*
+ * Drivers polling the interrupt pipe begin and end a capture
+ * for every status check; the last one ended is kept for reuse.
+ */
+static ifd_usb_capture_t *capture_cache;
+
+static int usb_submit_urb(ifd_device_t * dev, struct ifd_usb_capture *cap)
 {
-	/* Fill in the URB details */
-	ifd_debug(6, "submit urb %p", &cap->urb);
-	memset(&cap->urb, 0, sizeof(cap->urb));
-	cap->urb.type = cap->type;
-	cap->urb.endpoint = cap->endpoint;
-	cap->urb.buffer = (caddr_t) (cap + 1);
-	cap->urb.buffer_length = cap->maxpacket;
-	return ioctl(fd, USBDEVFS_SUBMITURB, &cap->urb);
+	return usb_urb_submit(dev, &cap->urb, cap->type, cap->endpoint,
+			      (caddr_t) (cap + 1), cap->maxpacket);
 }
 
 int ifd_sysdep_usb_begin_capture(ifd_device_t * dev, int type, int endpoint,
 				 size_t maxpacket, ifd_usb_capture_t ** capret)
 {
 	ifd_usb_capture_t *cap;
+	int rc;
 
-	cap = (ifd_usb_capture_t *) calloc(1, sizeof(*cap) + maxpacket);
-	if (!cap) {
-		ct_error("out of memory");
-		return IFD_ERROR_NO_MEMORY;
+	if (capture_cache && capture_cache->bufsize >= maxpacket) {
+		size_t bufsize = capture_cache->bufsize;
+
+		cap = capture_cache;
+		capture_cache = NULL;
+		memset(cap, 0, sizeof(*cap));
+		cap->bufsize = bufsize;
+	} else {
+		cap = (ifd_usb_capture_t *) calloc(1, sizeof(*cap) + maxpacket);
+		if (!cap) {
+			ct_error("out of memory");
+			return IFD_ERROR_NO_MEMORY;
+		}
+		cap->bufsize = maxpacket;
 	}
 
 	cap->type = type;
 	cap->endpoint = endpoint;
 	cap->maxpacket = maxpacket;
 
-	if (usb_submit_urb(dev->fd, cap) < 0) {
-		ct_error("usb_submiturb failed: %m");
-		ifd_sysdep_usb_end_capture(dev, cap);
-		return IFD_ERROR_COMM_ERROR;
+	if ((rc = usb_submit_urb(dev, cap)) < 0) {
+		free(cap);
+		return rc;
 	}
 
 	*capret = cap;
@@ -315,42 +631,34 @@ int ifd_sysdep_usb_begin_capture(ifd_device_t * dev, int type, int endpoint,
 int ifd_sysdep_usb_capture_event(ifd_device_t * dev, ifd_usb_capture_t * cap,
 			   void *buffer, size_t len)
 {
-	struct usbdevfs_urb *purb;
 	size_t copied = 0;
-	int rc = 0;
-
-	purb = NULL;
-	rc = ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &purb);
-	if (rc < 0) {
-		if (errno == EAGAIN)
-			return 0;
-		ct_error("usb_reapurb failed: %m");
-		return IFD_ERROR_COMM_ERROR;
-	}
+	int rc;
 
-	if (purb != &cap->urb) {
-		ifd_debug(2, "reaped usb urb %p", purb);
+	/* Our URB may already have been reaped while
+	 * waiting for something else */
+	if (cap->urb.pending && (rc = usb_urb_reap(dev)) < 0)
+		return rc;
+	if (cap->urb.pending)
 		return 0;
-	}
 
-	if (purb->status == -1) {
+	if (cap->urb.result < 0) {
+		if (cap->urb.result == IFD_ERROR_DEVICE_DISCONNECTED)
+			return cap->urb.result;
+		/* Try again */
+		usb_submit_urb(dev, cap);
 		return IFD_ERROR_COMM_ERROR;
 	}
 
-	if (purb->actual_length) {
-		ifd_debug(6, "usb reapurb: len=%u",
-			  purb->actual_length);
-		if ((copied = purb->actual_length) > len)
+	if (cap->urb.result) {
+		ifd_debug(6, "usb reapurb: len=%u", cap->urb.result);
+		if ((copied = cap->urb.result) > len)
 			copied = len;
 		if (copied && buffer)
-			memcpy(buffer, purb->buffer, copied);
-	}
-	else {
-		usleep(10000);
+			memcpy(buffer, cap + 1, copied);
 	}
 
 	/* Re-submit URB */
-	usb_submit_urb(dev->fd, cap);
+	usb_submit_urb(dev, cap);
 
 	return copied;
 }
@@ -359,54 +667,55 @@ int ifd_sysdep_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap,
 			   void *buffer, size_t len, long timeout)
 {
 	struct timeval begin;
-	size_t copied;
-	int rc = 0;
+	int rc;
 
 	/* Loop until we've reaped the response to the
 	 * URB we sent */
-	copied = 0;
 	gettimeofday(&begin, NULL);
-	do {
-		struct pollfd pfd;
+	while (1) {
 		long wait;
 
 		if ((wait = timeout - ifd_time_elapsed(&begin)) <= 0)
 			return IFD_ERROR_TIMEOUT;
 
-		pfd.fd = dev->fd;
-		pfd.events = POLLOUT;
-		if (poll(&pfd, 1, wait) != 1)
-			continue;
+		rc = usb_urb_wait(dev, &cap->urb, wait);
+		if (rc == IFD_ERROR_TIMEOUT)
+			return rc;
 
 		rc = ifd_sysdep_usb_capture_event(dev, cap, buffer, len);
-		if (rc < 0) {
+		if (rc != 0)
 			return rc;
-		}
-		copied = (size_t)rc;
-	} while (!copied);
-
-	return copied;
+	}
 }
 
 int ifd_sysdep_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 {
-	int rc = 0;
+	int rc;
 
-	if (ioctl(dev->fd, USBDEVFS_DISCARDURB, &cap->urb) < 0
-	    && errno != EINVAL) {
-		ct_error("usb_discardurb failed: %m");
-		rc = IFD_ERROR_COMM_ERROR;
+	/* A discarded URB goes to the queue of completed
+	 * requests. We must reap it before freeing it, or the
+	 * next REAPURB would hand us freed memory. */
+	rc = usb_urb_cancel(dev, &cap->urb);
+	if (cap->urb.pending)
+		return rc;
+	if (capture_cache == NULL || capture_cache->bufsize < cap->bufsize) {
+		free(capture_cache);
+		capture_cache = cap;
+	} else {
+		free(cap);
 	}
-	/* Discarding an URB will place it in the queue of completed
-	 * request, with urb->status == -1. So if we don't reap this
-	 * URB now, the next call to REAPURB will return this one,
-	 * clobbering random memory.
-	 */
-	(void)ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &cap->urb);
-	free(cap);
 	return rc;
 }
 
+void ifd_sysdep_usb_close(ifd_device_t * dev)
+{
+	struct usb_bulk *b = (struct usb_bulk *)dev->sysdep_data;
+
+	if (b && !b->busy)
+		free(b);
+	dev->sysdep_data = NULL;
+}
+
 int ifd_sysdep_usb_open(const char *device)
 {
 	struct usbdevfs_disconnectsignal ds;
@@ -451,6 +760,147 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Get the descriptors the kernel read at enumeration time from
+ * sysfs, which finds the device for us by its char dev number
+ */
+int ifd_sysdep_usb_get_descriptors(ifd_device_t * dev, unsigned char *buf,
+				   size_t size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	size_t total = 0;
+	int fd, n = 0;
+
+	if (fstat(dev->fd, &st) < 0 || !S_ISCHR(st.st_mode))
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/descriptors",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	while (total < size) {
+		n = read(fd, buf + total, size - total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	close(fd);
+
+	if (n < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+	return total;
+}
+
+/*
+ * Ask the serial driver to push received characters to the
+ * tty immediately, rather than batching them up for a few ms
+ */
+int ifd_sysdep_serial_low_latency(ifd_device_t * dev)
+{
+	struct serial_struct ss;
+
+	if (ioctl(dev->fd, TIOCGSERIAL, &ss) < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+	if (ss.flags & ASYNC_LOW_LATENCY)
+		return 0;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(dev->fd, TIOCSSERIAL, &ss) < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+	return 0;
+}
+
+/*
+ * Modem line changes are waited for with TIOCMIWAIT, which can
+ * only block. A helper thread sits in it and bumps an eventfd
+ * the mainloop polls on.
+ */
+struct ifd_serial_watch {
+	int fd;
+	int bits;
+	int efd;
+	volatile int failed;
+	pthread_t thread;
+};
+
+static void *serial_watch_thread(void *arg)
+{
+	ifd_serial_watch_t *watch = (ifd_serial_watch_t *) arg;
+	uint64_t one = 1;
+	int rc;
+
+	/* unwatch cancels us. ioctl isn't a cancellation point in
+	 * glibc, so asynchronous cancellation is allowed for the
+	 * wait itself, but nowhere near the write or the flag */
+	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+
+	while (1) {
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+		rc = ioctl(watch->fd, TIOCMIWAIT, watch->bits) < 0 ? errno : 0;
+		pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+		pthread_testcancel();
+
+		if (rc) {
+			if (rc == EINTR)
+				continue;
+			watch->failed = 1;
+		}
+		if (write(watch->efd, &one, sizeof(one)) < 0 || watch->failed)
+			break;
+	}
+	return NULL;
+}
+
+int ifd_sysdep_serial_watch(ifd_device_t * dev, int bits,
+			    ifd_serial_watch_t ** watchp)
+{
+	ifd_serial_watch_t *watch;
+
+	if ((watch = *watchp) != NULL)
+		return watch->efd;
+
+	if (!(watch = (ifd_serial_watch_t *) calloc(1, sizeof(*watch)))) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+	watch->fd = dev->fd;
+	watch->bits = bits;
+	if ((watch->efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		ct_error("%s: eventfd: %m", dev->name);
+		free(watch);
+		return IFD_ERROR_NOT_SUPPORTED;
+	}
+	if (pthread_create(&watch->thread, NULL, serial_watch_thread, watch)) {
+		ct_error("%s: unable to start line watcher", dev->name);
+		close(watch->efd);
+		free(watch);
+		return IFD_ERROR_NOT_SUPPORTED;
+	}
+
+	*watchp = watch;
+	return watch->efd;
+}
+
+int ifd_sysdep_serial_watch_ack(ifd_serial_watch_t * watch)
+{
+	uint64_t count;
+
+	if (read(watch->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return IFD_ERROR_GENERIC;
+	return watch->failed ? IFD_ERROR_NOT_SUPPORTED : 0;
+}
+
+void ifd_sysdep_serial_unwatch(ifd_serial_watch_t * watch)
+{
+	pthread_cancel(watch->thread);
+	pthread_join(watch->thread, NULL);
+	close(watch->efd);
+	free(watch);
+}
+
 #ifndef ENABLE_LIBUSB
 static int read_number (const char *read_format, const char *format, ...) {
 	va_list args;
@@ -512,6 +512,45 @@ int ifd_sysdep_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 	return 0;
 }
 
+/*
+ * Asynchronous URBs - not implemented on this platform
+ */
+int ifd_sysdep_usb_submit(ifd_device_t * dev, int type, int endpoint,
+			  void *buffer, size_t len,
+			  ifd_usb_urb_complete_t * complete, void *user_data,
+			  ifd_usb_urb_t ** urbret)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+int ifd_sysdep_usb_resubmit(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+int ifd_sysdep_usb_reap(ifd_device_t * dev)
+{
+	return 0;
+}
+
+int ifd_sysdep_usb_wait(ifd_device_t * dev, ifd_usb_urb_t * urb, long timeout)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+int ifd_sysdep_usb_cancel(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+void ifd_sysdep_usb_free_urb(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+}
+
+void ifd_sysdep_usb_close(ifd_device_t * dev)
+{
+}
+
 int ifd_sysdep_usb_open(const char *device)
 {
 	return open(device, O_RDWR);
@@ -523,6 +562,39 @@ int ifd_sysdep_usb_reset(ifd_device_t * dev)
 	return -1;
 }
 
+/*
+ * Get the descriptors cached by the system
+ */
+int ifd_sysdep_usb_get_descriptors(ifd_device_t * dev, unsigned char *buf,
+				   size_t size)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+/*
+ * Ask the serial driver to push received characters to the
+ * tty immediately
+ */
+int ifd_sysdep_serial_low_latency(ifd_device_t * dev)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+int ifd_sysdep_serial_watch(ifd_device_t * dev, int bits,
+			    ifd_serial_watch_t ** watchp)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+int ifd_sysdep_serial_watch_ack(ifd_serial_watch_t * watch)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+void ifd_sysdep_serial_unwatch(ifd_serial_watch_t * watch)
+{
+}
+
 /*
  * Scan the /dev/usb directory to see if there is any control pipe matching:
  *
@@ -336,18 +336,54 @@ static int ifd_usb_parse_configuration(struct ifd_usb_config_descriptor *config,
 	return size;
 }
 
+/*
+ * The kernel keeps the descriptors it read when the device was
+ * enumerated: the device descriptor, followed by all configuration
+ * descriptors in full. Where the platform lets us at that copy, we
+ * use it rather than going out on the bus again.
+ *
+ * Returns the length of the blob, or 0 if it isn't available.
+ */
+#define IFD_USB_DESCRIPTORS_MAX	8192
+
+static int ifd_usb_cached_descriptors(ifd_device_t * dev,
+				      unsigned char **bufp)
+{
+	unsigned char *buf;
+	int n;
+
+	if (!(buf = (unsigned char *)malloc(IFD_USB_DESCRIPTORS_MAX)))
+		return 0;
+
+	n = ifd_sysdep_usb_get_descriptors(dev, buf, IFD_USB_DESCRIPTORS_MAX);
+	/* A full buffer may well be truncated */
+	if (n < IFD_USB_DT_DEVICE_SIZE || n >= IFD_USB_DESCRIPTORS_MAX
+	    || buf[1] != IFD_USB_DT_DEVICE) {
+		free(buf);
+		return 0;
+	}
+
+	*bufp = buf;
+	return n;
+}
+
 int ifd_usb_get_device(ifd_device_t * dev, struct ifd_usb_device_descriptor *d)
 {
-	unsigned char devd[18];
+	unsigned char devd[18], *cache;
 	int r;
 
-	/* 0x6  == USB_REQ_GET_DESCRIPTOR
-	 * 0x1  == USB_DT_DEVICE
-	 */
-	r = ifd_usb_control(dev, 0x80, 0x6, 0x100, 0, devd, 18, 10000);
-	if (r <= 0) {
-		ct_error("cannot get descriptors");
-		return 1;
+	if (ifd_usb_cached_descriptors(dev, &cache) > 0) {
+		memcpy(devd, cache, sizeof(devd));
+		free(cache);
+	} else {
+		/* 0x6  == USB_REQ_GET_DESCRIPTOR
+		 * 0x1  == USB_DT_DEVICE
+		 */
+		r = ifd_usb_control(dev, 0x80, 0x6, 0x100, 0, devd, 18, 10000);
+		if (r <= 0) {
+			ct_error("cannot get descriptors");
+			return 1;
+		}
 	}
 	memcpy(d, devd, sizeof(devd));
 	d->bcdUSB = devd[3] << 8 | devd[2];
@@ -358,6 +394,26 @@ int ifd_usb_get_device(ifd_device_t * dev, struct ifd_usb_device_descriptor *d)
 	return 0;
 }
 
+/*
+ * Find configuration n in the cached descriptors and parse it
+ */
+static int ifd_usb_get_cached_config(unsigned char *cache, int size, int n,
+				     struct ifd_usb_config_descriptor *ret)
+{
+	unsigned int off = cache[0], len;
+	int i;
+
+	for (i = 0; off + IFD_USB_DT_CONFIG_SIZE <= size; i++, off += len) {
+		len = cache[off + 3] << 8 | cache[off + 2];
+		if (cache[off + 1] != IFD_USB_DT_CONFIG
+		    || len < IFD_USB_DT_CONFIG_SIZE || off + len > size)
+			break;
+		if (i == n)
+			return ifd_usb_parse_configuration(ret, cache + off);
+	}
+	return -1;
+}
+
 int ifd_usb_get_config(ifd_device_t * dev, int n,
 		       struct ifd_usb_config_descriptor *ret)
 {
@@ -366,6 +422,15 @@ int ifd_usb_get_config(ifd_device_t * dev, int n,
 	int r;
 	memset(ret, 0, sizeof(struct ifd_usb_config_descriptor));
 
+	if ((r = ifd_usb_cached_descriptors(dev, &b)) > 0) {
+		r = ifd_usb_get_cached_config(b, r, n, ret);
+		free(b);
+		if (r >= 0)
+			return 0;
+		ifd_usb_free_configuration(ret);
+		memset(ret, 0, sizeof(struct ifd_usb_config_descriptor));
+	}
+
 	/* 0x6  == USB_REQ_GET_DESCRIPTOR
 	 * 0x2  == USB_DT_CONFIG
 	 */
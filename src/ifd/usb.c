@@ -115,12 +115,80 @@ int ifd_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 	return ifd_sysdep_usb_end_capture(dev, cap);
 }
 
+/*
+ * Asynchronous transfers
+ *
+ * ifd_usb_submit queues a transfer and returns at once. When the
+ * URB completes, the callback (if any) is invoked from whatever
+ * reaps it next: ifd_usb_reap, ifd_usb_wait, a synchronous
+ * transfer, or an interrupt capture driven by the main loop
+ * through the device's event fd. The callback is given the
+ * actual length or an IFD_ERROR_* code, and may requeue the same
+ * URB and buffer with ifd_usb_resubmit. The URB must be released
+ * with ifd_usb_free_urb, which cancels it if it is still pending.
+ */
+int ifd_usb_submit(ifd_device_t * dev, int type, int endpoint,
+		   void *buffer, size_t len,
+		   ifd_usb_urb_complete_t * complete, void *user_data,
+		   ifd_usb_urb_t ** urbret)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return -1;
+
+	if (ct_config.debug >= 4) {
+		ifd_debug(4, "usb submit type=%d ep=x%02x len=%u",
+			  type, endpoint, len);
+		if (len && !(endpoint & 0x80))
+			ifd_debug(4, "send %s", ct_hexdump(buffer, len));
+	}
+	return ifd_sysdep_usb_submit(dev, type, endpoint, buffer, len,
+				     complete, user_data, urbret);
+}
+
+int ifd_usb_resubmit(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return -1;
+	return ifd_sysdep_usb_resubmit(dev, urb);
+}
+
+int ifd_usb_reap(ifd_device_t * dev)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return -1;
+	return ifd_sysdep_usb_reap(dev);
+}
+
+int ifd_usb_wait(ifd_device_t * dev, ifd_usb_urb_t * urb, long timeout)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return -1;
+	return ifd_sysdep_usb_wait(dev, urb, timeout);
+}
+
+int ifd_usb_cancel(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+	ifd_debug(5, "called.");
+
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return -1;
+	return ifd_sysdep_usb_cancel(dev, urb);
+}
+
+void ifd_usb_free_urb(ifd_device_t * dev, ifd_usb_urb_t * urb)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB || urb == NULL)
+		return;
+	ifd_sysdep_usb_free_urb(dev, urb);
+}
+
 /*
  * Set usb params (for now, endpoint for transceive)
  */
 static int usb_set_params(ifd_device_t * dev,
 			  const ifd_device_params_t * params)
 {
+	int rc;
 
 	ifd_debug(1, "called. config x%02x ifc x%02x eps x%02x/x%02x",
 		  params->usb.configuration, params->usb.interface,
@@ -138,12 +206,14 @@ static int usb_set_params(ifd_device_t * dev,
 						 dev->settings.usb.interface);
 
 	if (params->usb.configuration != -1
-	    && ifd_sysdep_usb_set_configuration(dev, params->usb.configuration))
-		return -1;
+	    && (rc = ifd_sysdep_usb_set_configuration(dev,
+					params->usb.configuration)) != 0)
+		return rc < 0 ? rc : -1;
 
 	if (params->usb.interface != -1) {
-		if (ifd_sysdep_usb_claim_interface(dev, params->usb.interface))
-			return -1;
+		if ((rc = ifd_sysdep_usb_claim_interface(dev,
+						params->usb.interface)) != 0)
+			return rc < 0 ? rc : -1;
 		if (params->usb.altsetting != -1
 		    && ifd_sysdep_usb_set_interface(dev,
 						    params->usb.interface,
@@ -208,6 +278,11 @@ static int usb_get_eventfd(ifd_device_t * dev, short *events)
 	return rc;
 }
 
+static void usb_close(ifd_device_t * dev)
+{
+	ifd_sysdep_usb_close(dev);
+}
+
 static struct ifd_device_ops ifd_usb_ops;
 
 /*
@@ -229,6 +304,7 @@ ifd_device_t *ifd_open_usb(const char *device)
 	ifd_usb_ops.recv = usb_recv;
 	ifd_usb_ops.reset = usb_reset;
 	ifd_usb_ops.get_eventfd = usb_get_eventfd;
+	ifd_usb_ops.close = usb_close;
 
 	dev = ifd_device_new(device, &ifd_usb_ops, sizeof(*dev));
 	dev->type = IFD_DEVICE_TYPE_USB;
@@ -79,6 +79,44 @@ long ifd_time_elapsed(struct timeval *then)
 	return delta.tv_sec * 1000 + (delta.tv_usec / 1000);
 }
 
+/*
+ * Wait for a device to become ready.
+ *
+ * The probe is called right away, and then again after pauses
+ * that start out at a few microseconds and double with each
+ * attempt, up to IFD_WAIT_MAX_DELAY. A device that is ready
+ * quickly doesn't pay for a fixed sleep, and a slow one isn't
+ * hammered with requests.
+ *
+ * The probe returns 0 while the device is not ready, a positive
+ * value once it is, and a negative error code if something went
+ * wrong; that value is returned. If the device isn't ready
+ * after timeout msec, IFD_ERROR_TIMEOUT is returned.
+ */
+#define IFD_WAIT_MIN_DELAY	10	/* usec */
+#define IFD_WAIT_MAX_DELAY	5000	/* usec; also the most we oversleep */
+
+int ifd_wait_until(int (*probe) (void *), void *arg, long timeout)
+{
+	struct timeval begin;
+	unsigned long delay = IFD_WAIT_MIN_DELAY;
+	long left;
+	int rc;
+
+	gettimeofday(&begin, NULL);
+	while (1) {
+		if ((rc = probe(arg)) != 0)
+			return rc;
+		if ((left = timeout - ifd_time_elapsed(&begin)) <= 0)
+			return IFD_ERROR_TIMEOUT;
+		if (delay > left * 1000UL)
+			delay = left * 1000UL;
+		usleep(delay);
+		if ((delay *= 2) > IFD_WAIT_MAX_DELAY)
+			delay = IFD_WAIT_MAX_DELAY;
+	}
+}
+
 /*
  * Spawn an ifdhandler
  */
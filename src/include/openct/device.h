@@ -52,6 +52,12 @@ enum {
 };
 #define IFD_SERIAL_PARITY_TOGGLE(n)	((n)? ((n) ^ 3) : 0)
 
+/* Modem status lines, for ifd_serial_watch_lines */
+#define IFD_SERIAL_LINE_CTS	0x01
+#define IFD_SERIAL_LINE_DSR	0x02
+#define IFD_SERIAL_LINE_CD	0x04
+#define IFD_SERIAL_LINE_RI	0x08
+
 #define IFD_MAX_DEVID_PARTS	5
 typedef struct ifd_devid {
 	int		type;
@@ -71,6 +77,9 @@ enum {
 	IFD_USB_URB_TYPE_BULK = 3
 };
 typedef struct ifd_usb_capture ifd_usb_capture_t;
+typedef struct ifd_usb_urb ifd_usb_urb_t;
+typedef void ifd_usb_urb_complete_t(ifd_device_t *, ifd_usb_urb_t *,
+				    int result, void *);
 
 extern ifd_device_t *	ifd_device_open(const char *);
 extern void		ifd_device_close(ifd_device_t *);
@@ -118,11 +127,24 @@ extern int		ifd_usb_capture(ifd_device_t *,
 				long timeout);
 extern int		ifd_usb_end_capture(ifd_device_t *,
 				ifd_usb_capture_t *);
+extern int		ifd_usb_submit(ifd_device_t *,
+				int type, int endpoint,
+				void *buffer, size_t len,
+				ifd_usb_urb_complete_t *, void *user_data,
+				ifd_usb_urb_t **);
+extern int		ifd_usb_resubmit(ifd_device_t *, ifd_usb_urb_t *);
+extern int		ifd_usb_reap(ifd_device_t *);
+extern int		ifd_usb_wait(ifd_device_t *, ifd_usb_urb_t *,
+				long timeout);
+extern int		ifd_usb_cancel(ifd_device_t *, ifd_usb_urb_t *);
+extern void		ifd_usb_free_urb(ifd_device_t *, ifd_usb_urb_t *);
 
 extern void		ifd_serial_send_break(ifd_device_t *, unsigned int usec);
 extern int		ifd_serial_get_cts(ifd_device_t *);
 extern int		ifd_serial_get_dsr(ifd_device_t *);
 extern int		ifd_serial_get_dtr(ifd_device_t *);
+extern int		ifd_serial_watch_lines(ifd_device_t *, int lines);
+extern int		ifd_serial_line_event(ifd_device_t *);
 
 #ifdef __cplusplus
 }
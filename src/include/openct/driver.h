@@ -372,6 +372,18 @@ struct ifd_driver_ops {
 	 * should be freed, return an error.
 	 */
 	int (*error) (ifd_reader_t *);
+
+	/**
+	 * Abort the command in progress on a slot.
+	 *
+	 * Called once the client has given up on a command and the
+	 * driver returned IFD_ERROR_USER_ABORT from it, to get the
+	 * reader back into a usable state. May be NULL; the card is
+	 * then reset instead.
+	 *
+	 * @return Error code <0 if failure, 0 if success.
+	 */
+	int (*abort) (ifd_reader_t *, int slot);
 };
 
 extern void		ifd_driver_register(const char *,
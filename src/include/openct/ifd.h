@@ -71,16 +71,24 @@ typedef struct ifd_reader {
 
 	/* In case the IFD needs to keep state */
 	void *			driver_data;
+
+	/* Set by the server; tells drivers waiting on a slow
+	 * card whether the client has given up on the command */
+	int			(*check_abort)(struct ifd_reader *);
 } ifd_reader_t;
 
 #define IFD_READER_ACTIVE	0x0001
 #define IFD_READER_HOTPLUG	0x0002
 #define IFD_READER_DISPLAY	0x0100
 #define IFD_READER_KEYPAD	0x0200
+#define IFD_READER_CONCURRENT	0x0400	/* commands for several slots
+					 * may be in progress at once */
 
 enum {
 	IFD_PROTOCOL_RECV_TIMEOUT = 0x0000,
 	IFD_PROTOCOL_BLOCK_ORIENTED,
+	IFD_PROTOCOL_RESET_REQUIRED,	/* read-only: protocol gave up */
+	IFD_PROTOCOL_WRITE_VERIFY,	/* sync ICCs: read back every page */
 
 	/* T=0 specific parameters */
 	__IFD_PROTOCOL_T0_PARAM_BASE = IFD_PROTOCOL_T0 << 16,
@@ -93,7 +101,21 @@ enum {
 	IFD_PROTOCOL_T1_IFSC,
 	IFD_PROTOCOL_T1_IFSD,
 	IFD_PROTOCOL_T1_STATE,
-	IFD_PROTOCOL_T1_MORE
+	IFD_PROTOCOL_T1_MORE,
+	/* T=1 error recovery counters (read-only) */
+	IFD_PROTOCOL_T1_STAT_ERRORS,
+	IFD_PROTOCOL_T1_STAT_NAKS,
+	IFD_PROTOCOL_T1_STAT_RETRANSMITS,
+	IFD_PROTOCOL_T1_STAT_RESYNCS,
+	IFD_PROTOCOL_T1_STAT_FAILURES,
+
+	/* T=CL specific parameters */
+	__IFD_PROTOCOL_TCL_PARAM_BASE = IFD_PROTOCOL_TCL << 16,
+	IFD_PROTOCOL_TCL_FSC,
+	IFD_PROTOCOL_TCL_FSD,
+	IFD_PROTOCOL_TCL_FWI,
+	IFD_PROTOCOL_TCL_CID,		/* -1: no CID */
+	IFD_PROTOCOL_TCL_CRC		/* frames include CRC_A */
 };
 
 enum {
@@ -154,6 +176,9 @@ extern int			ifd_card_perform_verify(ifd_reader_t *reader,
 					const char *message,
 					const unsigned char *data, size_t data_len,
 					unsigned char *resp, size_t resp_len);
+extern int			ifd_card_abort(ifd_reader_t *reader,
+					unsigned int slot);
+extern int			ifd_check_abort(ifd_reader_t *reader);
 extern int			ifd_card_read_memory(ifd_reader_t *,
 					unsigned int, unsigned short,
 					unsigned char *, size_t);
@@ -22,7 +22,8 @@ typedef struct ct_info {
 	unsigned int	ct_slots;
 	unsigned int	ct_card[OPENCT_MAX_SLOTS];
 	unsigned 	ct_display : 1,
-			ct_keypad  : 1;
+			ct_keypad  : 1,
+			ct_powered : OPENCT_MAX_SLOTS;	/* bit per slot */
 	pid_t		ct_pid;
 } ct_info_t;
 
@@ -56,6 +57,15 @@ enum {
 	IFD_PIN_ENCODING_ASCII
 };
 
+/*
+ * How to verify writes to synchronous ICC memory
+ */
+enum {
+	IFD_MEMORY_VERIFY_PAGE,		/* read back every page */
+	IFD_MEMORY_VERIFY_NONE,
+	IFD_MEMORY_VERIFY_CHECKSUM	/* CRC over the whole range */
+};
+
 extern int		ct_status(const ct_info_t **);
 
 extern int		ct_reader_info(unsigned int, ct_info_t *);
@@ -63,6 +73,9 @@ extern ct_handle *	ct_reader_connect(unsigned int);
 extern void		ct_reader_disconnect(ct_handle *);
 extern int		ct_reader_status(ct_handle *, ct_info_t *);
 extern int		ct_card_status(ct_handle *h, unsigned int slot, int *status);
+extern int		ct_card_abort(ct_handle *h, unsigned int slot,
+				unsigned int xid);
+extern unsigned int	ct_reader_last_xid(ct_handle *h);
 extern int 		ct_card_set_protocol(ct_handle *h, unsigned int slot,
 				 unsigned int protocol);
 extern int		ct_card_reset(ct_handle *h, unsigned int slot,
@@ -90,6 +103,21 @@ extern int		ct_card_read_memory(ct_handle *, unsigned int slot,
 extern int		ct_card_write_memory(ct_handle *, unsigned int slot,
 				unsigned short address,
 				const void *send_buf, size_t send_len);
+extern int		ct_card_read_memory_stream(ct_handle *,
+				unsigned int slot, unsigned short address,
+				void *recv_buf, size_t recv_len);
+extern int		ct_card_write_memory_stream(ct_handle *,
+				unsigned int slot, unsigned short address,
+				const void *send_buf, size_t send_len,
+				int verify);
+extern int		ct_card_memory_checksum(ct_handle *,
+				unsigned int slot, unsigned short address,
+				size_t len, unsigned int *crc);
+
+/* The CRC ct_card_memory_checksum returns (ISO 3309) */
+#define CT_CRC16_INIT	0xFFFF
+extern unsigned short	ct_crc16_update(unsigned short crc,
+				const void *data, size_t len);
 
 extern int		ct_status_destroy(void);
 extern int		ct_status_clear(unsigned int, const char *);
@@ -32,9 +32,11 @@ extern "C" {
 #define CT_CMD_MEMORY_READ	0x16
 #define CT_CMD_MEMORY_WRITE	0x17
 #define CT_CMD_INPUT		0x18
+#define CT_CMD_MEMORY_CHECKSUM	0x19	/* CRC over sync ICC memory */
 #define CT_CMD_TRANSACT_OLD	0x20	/* transceive APDU */
 #define CT_CMD_TRANSACT		0x21	/* transceive APDU */
 #define CT_CMD_SET_PROTOCOL	0x22
+#define CT_CMD_ABORT		0x23	/* give up on a request in progress */
 
 #define CT_UNIT_ICC1		0x00
 #define CT_UNIT_ICC2		0x01
@@ -62,9 +64,20 @@ extern "C" {
 #define CT_TAG_DATA		0x86
 #define CT_TAG_COUNT		0x87
 #define CT_TAG_PROTOCOL		0x88
+#define CT_TAG_VERIFY		0x89
+#define CT_TAG_CHECKSUM		0x8A
+#define CT_TAG_XID		0x8B	/* xid of the request to abort */
 
 #define __CT_TAG_LARGE		0x40
 
+/*
+ * Largest chunk of synchronous ICC memory moved by a single
+ * CT_CMD_MEMORY_READ/WRITE, leaving room for message overhead.
+ * This is a multiple of the 256 byte page size, so that page
+ * aligned transfers stay page aligned.
+ */
+#define CT_MEMORY_CHUNK		2048
+
 #ifdef __cplusplus
 }
 #endif
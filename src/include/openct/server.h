@@ -16,6 +16,8 @@ extern "C" {
 extern void	ct_mainloop_add_socket(ct_socket_t *);
 extern void	ct_mainloop(void);
 extern void	ct_mainloop_leave(void);
+extern int	ct_mainloop_foreach(int (*)(ct_socket_t *, void *),
+				void *);
 
 #ifdef __cplusplus
 }
@@ -50,6 +50,8 @@ typedef struct ct_socket {
 
 	pid_t		client_id;
 	uid_t		client_uid;
+
+	uint32_t	xid;		/* of the last call */
 } ct_socket_t;
 
 #define CT_SOCKET_BUFSIZ 4096
@@ -66,6 +68,9 @@ extern int		ct_socket_flsbuf(ct_socket_t *, int);
 extern int		ct_socket_filbuf(ct_socket_t *, long);
 extern int		ct_socket_put_packet(ct_socket_t *,
 				header_t *, ct_buf_t *);
+extern int		ct_socket_forward_packet(ct_socket_t *,
+				header_t *, const void *, size_t,
+				ct_buf_t *);
 extern int		ct_socket_puts(ct_socket_t *, const char *);
 extern int		ct_socket_get_packet(ct_socket_t *,
 				header_t *, ct_buf_t *);
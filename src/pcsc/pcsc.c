@@ -1,7 +1,10 @@
 /*
- * PC/SC Lite IFD front-end for libopenctapi
+ * PC/SC Lite IFD front-end for libopenct
  *
- * Mapping of CT-API / CT-BCS interface to the IFD Handler 2.0.
+ * Mapping of the IFD Handler 2.0 to libopenct calls. Every slot of a
+ * reader has a connection to ifdhandler of its own, so that slots can
+ * be used in parallel. IFDHControl takes CT-BCS commands, which are
+ * passed on to a CT-API terminal for the whole reader.
  * Getting/Setting IFD/Protocol/ICC parameters other than the ATR is not
  * supported. IFDH_MAX_READERS simultaneous readers are supported.
  *
@@ -16,9 +19,12 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
@@ -34,6 +40,7 @@
 #include <pcsclite.h>
 #endif
 #include <openct/openct.h>
+#include <openct/ifd.h>
 #include "ctapi.h"		/* XXX: <openct/ctapi.h>? */
 #define IFDHANDLERv2
 #include "ifdhandler.h"
@@ -42,49 +49,160 @@
 #define IFDH_MAX_READERS	OPENCT_MAX_READERS
 
 /* Maximum number of slots per reader handled */
-#define IFDH_MAX_SLOTS		1	/* XXX: OPENCT_MAX_SLOTS? */
+#define IFDH_MAX_SLOTS		OPENCT_MAX_SLOTS
+
+#ifndef TAG_IFD_SLOT_THREAD_SAFE
+#define TAG_IFD_SLOT_THREAD_SAFE	0x0FAC
+#endif
 
 typedef struct {
 	DEVICE_CAPABILITIES device_capabilities;
 	ICC_STATE icc_state;
 	DWORD ATR_Length;
 	PROTOCOL_OPTIONS protocol_options;
+	ct_handle *h;
+	int sync;		/* synchronous (memory) card */
 } IFDH_Context;
 
 /* Matrix that stores conext information of all slots and readers */
-static IFDH_Context *ifdh_context[IFDH_MAX_READERS][IFDH_MAX_SLOTS] = {
-	{NULL},
-	{NULL},
-	{NULL},
-	{NULL},
-};
-
-/* Mutexes for all readers */
+static IFDH_Context *ifdh_context[IFDH_MAX_READERS][IFDH_MAX_SLOTS];
+
+/* Number of slots opened on each reader, 0 if it's closed */
+static unsigned short ifdh_slots[IFDH_MAX_READERS];
+
+/* OpenCT reader number behind each terminal, to find its
+ * record in the status file */
+static unsigned short ifdh_reader[IFDH_MAX_READERS];
+
+/*
+ * The reader mutex covers opening and closing a reader and
+ * its CT-API terminal, the slot mutex covers the slot's
+ * context and connection.
+ * A slot's mutex is held for the whole of a command, but
+ * commands for other slots don't have to wait for it.
+ */
 #ifdef HAVE_PTHREAD
-static pthread_mutex_t ifdh_context_mutex[IFDH_MAX_READERS] = {
-	PTHREAD_MUTEX_INITIALIZER,
-	PTHREAD_MUTEX_INITIALIZER,
-	PTHREAD_MUTEX_INITIALIZER,
-	PTHREAD_MUTEX_INITIALIZER
-};
+static pthread_mutex_t ifdh_reader_mutex[IFDH_MAX_READERS];
+static pthread_mutex_t ifdh_slot_mutex[IFDH_MAX_READERS][IFDH_MAX_SLOTS];
+static pthread_once_t ifdh_mutex_once = PTHREAD_ONCE_INIT;
+
+static void ifdh_init_mutexes(void)
+{
+	unsigned int n, slot;
+
+	for (n = 0; n < IFDH_MAX_READERS; n++) {
+		pthread_mutex_init(&ifdh_reader_mutex[n], NULL);
+		for (slot = 0; slot < IFDH_MAX_SLOTS; slot++)
+			pthread_mutex_init(&ifdh_slot_mutex[n][slot], NULL);
+	}
+}
 #endif
 
+static void ifdh_lock_reader(unsigned short reader)
+{
+#ifdef HAVE_PTHREAD
+	pthread_once(&ifdh_mutex_once, ifdh_init_mutexes);
+	pthread_mutex_lock(&ifdh_reader_mutex[reader]);
+#endif
+}
+
+static void ifdh_unlock_reader(unsigned short reader)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ifdh_reader_mutex[reader]);
+#endif
+}
+
+/*
+ * Lock a slot and return its context, or NULL if the
+ * slot isn't open. The slot is locked either way.
+ */
+static IFDH_Context *ifdh_lock_slot(unsigned short reader, unsigned short slot)
+{
+#ifdef HAVE_PTHREAD
+	pthread_once(&ifdh_mutex_once, ifdh_init_mutexes);
+	pthread_mutex_lock(&ifdh_slot_mutex[reader][slot]);
+#endif
+	return ifdh_context[reader][slot];
+}
+
+static void ifdh_unlock_slot(unsigned short reader, unsigned short slot)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ifdh_slot_mutex[reader][slot]);
+#endif
+}
+
+/*
+ * Close all slots of a reader. Called with the reader locked.
+ */
+static void ifdh_close_reader(unsigned short reader)
+{
+	unsigned short slot;
+	IFDH_Context *ctx;
+
+	if (ifdh_slots[reader] == 0)
+		return;
+	for (slot = 0; slot < ifdh_slots[reader]; slot++) {
+		if ((ctx = ifdh_lock_slot(reader, slot)) != NULL) {
+			ct_reader_disconnect(ctx->h);
+			free(ctx);
+			ifdh_context[reader][slot] = NULL;
+		}
+		ifdh_unlock_slot(reader, slot);
+	}
+	CT_close(reader);
+	ifdh_slots[reader] = 0;
+}
+
+/*
+ * Connect each slot of a reader. Called with the reader
+ * locked. The CT-API terminal holds the reader lock, and
+ * passes on IFDHControl's CT-BCS commands.
+ */
+static RESPONSECODE ifdh_open_reader(unsigned short reader, unsigned short pn)
+{
+	ct_info_t info;
+	unsigned short slot, nslots;
+	IFDH_Context *ctx;
+
+	if (ct_reader_info(pn, &info) < 0 || info.ct_slots == 0)
+		return IFD_COMMUNICATION_ERROR;
+	nslots = info.ct_slots;
+	if (nslots > IFDH_MAX_SLOTS)
+		nslots = IFDH_MAX_SLOTS;
+
+	if (CT_init(reader, pn) != OK)
+		return IFD_COMMUNICATION_ERROR;
+
+	ifdh_reader[reader] = pn;
+	ifdh_slots[reader] = nslots;
+	for (slot = 0; slot < nslots; slot++) {
+		ctx = (IFDH_Context *) calloc(1, sizeof(IFDH_Context));
+		if (ctx == NULL || !(ctx->h = ct_reader_connect(pn))) {
+			free(ctx);
+			ifdh_close_reader(reader);
+			return IFD_COMMUNICATION_ERROR;
+		}
+		ifdh_lock_slot(reader, slot);
+		ifdh_context[reader][slot] = ctx;
+		ifdh_unlock_slot(reader, slot);
+	}
+	return IFD_SUCCESS;
+}
+
 /* PC/SC Lite hotplugging base channel */
 #define HOTPLUG_BASE_PORT	0x200000
 
 RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 {
-	char ret;
-	unsigned short ctn, pn, slot;
+	unsigned short reader, pn;
 	RESPONSECODE rv;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
-	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-	if (ifdh_context[ctn][slot] == NULL) {
+	ifdh_lock_reader(reader);
+	if (ifdh_slots[reader] == 0) {
 		if (Channel >= HOTPLUG_BASE_PORT) {
 			Channel -= HOTPLUG_BASE_PORT;
 		}
@@ -94,30 +212,13 @@ RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 		} else {
 			pn = Channel;
 		}
-		ret = CT_init(ctn, pn);
-
-		if (ret == OK) {
-			/* Initialize context of the all slots in this reader */
-			for (slot = 0; slot < IFDH_MAX_SLOTS; slot++) {
-				ifdh_context[ctn][slot] = (IFDH_Context *)
-				    malloc(sizeof(IFDH_Context));
-
-				if (ifdh_context[ctn][slot] != NULL)
-					memset(ifdh_context[ctn][slot], 0,
-					       sizeof(IFDH_Context));
-			}
-			rv = IFD_SUCCESS;
-		} else {
-			rv = IFD_COMMUNICATION_ERROR;
-		}
+		rv = ifdh_open_reader(reader, pn);
 	} else {
 		/* Assume that IFDHCreateChannel is being called for another
 		   already initialized slot in this same reader, and return Success */
 		rv = IFD_SUCCESS;
 	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
+	ifdh_unlock_reader(reader);
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHCreateChannel(Lun=0x%X, Channel=0x%X)=%d",
 	       Lun, Channel, rv);
@@ -127,62 +228,50 @@ RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 
 RESPONSECODE IFDHCloseChannel(DWORD Lun)
 {
-	char ret;
-	unsigned short ctn, slot;
-	RESPONSECODE rv;
-
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
-	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+	unsigned short reader;
 
-	ret = CT_close(ctn);
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 
-	if (ret == OK) {
-#ifdef HAVE_PTHREAD
-		pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-		/* Free context of the all slots in this reader */
-		for (slot = 0; slot < IFDH_MAX_SLOTS; slot++) {
-			if (ifdh_context[ctn][slot] != NULL) {
-				free(ifdh_context[ctn][slot]);
-				ifdh_context[ctn][slot] = NULL;
-			}
-		}
-#ifdef HAVE_PTHREAD
-		pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
-		rv = IFD_SUCCESS;
-	} else {
-		rv = IFD_COMMUNICATION_ERROR;
-	}
+	/* pcscd closes each slot of a reader in turn; the
+	 * first call closes them all, the rest are no-ops */
+	ifdh_lock_reader(reader);
+	ifdh_close_reader(reader);
+	ifdh_unlock_reader(reader);
 #ifdef DEBUG_IFDH
-	syslog(LOG_INFO, "IFDH: IFDHCloseChannel(Lun=0x%X)=%d", Lun, rv);
+	syslog(LOG_INFO, "IFDH: IFDHCloseChannel(Lun=0x%X)=%d", Lun,
+	       IFD_SUCCESS);
 #endif
-	return rv;
+	return IFD_SUCCESS;
 }
 
 RESPONSECODE
 IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 {
-	unsigned short ctn, slot;
+	unsigned short reader, slot;
+	IFDH_Context *ctx;
 	RESPONSECODE rv;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
 
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
 	switch (Tag) {
 	case TAG_IFD_ATR:
-		(*Length) = ifdh_context[ctn][slot]->ATR_Length;
-		memcpy(Value, ifdh_context[ctn][slot]->icc_state.ATR,
-		       (*Length));
-		rv = IFD_SUCCESS;
+		if ((ctx = ifdh_lock_slot(reader, slot)) != NULL) {
+			(*Length) = ctx->ATR_Length;
+			memcpy(Value, ctx->icc_state.ATR, (*Length));
+			rv = IFD_SUCCESS;
+		} else {
+			(*Length) = 0;
+			rv = IFD_ICC_NOT_PRESENT;
+		}
+		ifdh_unlock_slot(reader, slot);
 		break;
 
 	case TAG_IFD_SLOTS_NUMBER:
+		ifdh_lock_reader(reader);
 		(*Length) = 1;
-		(*Value) = IFDH_MAX_SLOTS;
+		(*Value) = ifdh_slots[reader] ? ifdh_slots[reader] : 1;
+		ifdh_unlock_reader(reader);
 		rv = IFD_SUCCESS;
 		break;
 
@@ -192,13 +281,18 @@ IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 		rv = IFD_SUCCESS;
 		break;
 
+#ifdef HAVE_PTHREAD
+	case TAG_IFD_SLOT_THREAD_SAFE:
+		(*Length) = 1;
+		(*Value) = 1;
+		rv = IFD_SUCCESS;
+		break;
+#endif
+
 	default:
 		(*Length) = 0;
 		rv = IFD_ERROR_TAG;
 	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHGetCapabilities (Lun=0x%X, Tag=0x%X)=%d",
 	       Lun, Tag, rv);
@@ -222,36 +316,23 @@ RESPONSECODE
 IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 			  UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
 {
-	char ret;
-	unsigned short ctn, slot, lc, lr;
-	UCHAR cmd[10], rsp[256], sad, dad;
+	unsigned short reader, slot;
+	IFDH_Context *ctx;
 	RESPONSECODE rv;
+	int proto;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
 
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-	if (ifdh_context[ctn][slot] != NULL) {
-		cmd[0] = CTBCS_CLA_2;
-		cmd[1] = CTBCS_INS_SET_INTERFACE_PARAM;
-		cmd[2] = (UCHAR) (slot + 1);
-		cmd[3] = 0x00;
-		cmd[4] = 0x03;
-		cmd[5] = CTBCS_TAG_TPP;
-		cmd[6] = 0x01;
-		cmd[7] = Protocol & 0xFF;
-
-		lc = 8;
-
-		dad = 0x01;
-		sad = 0x02;
-		lr = 256;
-
-		ret = CT_data(ctn, &dad, &sad, lc, cmd, &lr, rsp);
+	if (Protocol == SCARD_PROTOCOL_T0)
+		proto = IFD_PROTOCOL_T0;
+	else if (Protocol == SCARD_PROTOCOL_T1)
+		proto = IFD_PROTOCOL_T1;
+	else
+		return IFD_PROTOCOL_NOT_SUPPORTED;
 
-		if (ret == OK) {
+	if ((ctx = ifdh_lock_slot(reader, slot)) != NULL) {
+		if (ct_card_set_protocol(ctx->h, slot, proto) >= 0) {
 			rv = IFD_SUCCESS;
 		} else {
 			rv = IFD_ERROR_PTS_FAILURE;
@@ -259,9 +340,7 @@ IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 	} else {
 		rv = IFD_ICC_NOT_PRESENT;
 	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
+	ifdh_unlock_slot(reader, slot);
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO,
 	       "IFDH: IFDHSetProtocolParameters (Lun=0x%X, Protocol=%d, Flags=0x%02X, PTS1=0x%02X, PTS2=0x%02X, PTS3=0x%02X)=%d",
@@ -272,105 +351,50 @@ IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 
 RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 {
-	char ret;
-	unsigned short ctn, slot, lc, lr;
-	UCHAR cmd[5], rsp[256], sad, dad;
+	unsigned short reader, slot;
+	unsigned char atr[MAX_ATR_SIZE];
+	IFDH_Context *ctx;
 	RESPONSECODE rv;
+	int rc;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
 
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-	if (ifdh_context[ctn][slot] != NULL) {
-		if (Action == IFD_POWER_UP) {
-			cmd[0] = CTBCS_CLA;
-			cmd[1] = CTBCS_INS_REQUEST_ICC;
-			cmd[2] = (UCHAR) (slot + 1);
-			cmd[3] = CTBCS_P2_REQUEST_GET_ATR;
-			cmd[4] = 0x00;
-
-			dad = 0x01;
-			sad = 0x02;
-			lr = 256;
-			lc = 5;
-
-			ret = CT_data(ctn, &dad, &sad, 5, cmd, &lr, rsp);
-
-			if ((ret == OK) && (lr >= 2)) {
-				ifdh_context[ctn][slot]->ATR_Length =
-				    (DWORD) lr - 2;
-				memcpy(ifdh_context[ctn][slot]->icc_state.ATR,
-				       rsp, lr - 2);
-
-				(*AtrLength) = (DWORD) lr - 2;
-				memcpy(Atr, rsp, lr - 2);
-
-				rv = IFD_SUCCESS;
-			} else {
-				rv = IFD_COMMUNICATION_ERROR;
-			}
-		} else if (Action == IFD_POWER_DOWN) {
-			cmd[0] = CTBCS_CLA;
-			cmd[1] = CTBCS_INS_EJECT_ICC;
-			cmd[2] = (UCHAR) (slot + 1);
-			cmd[3] = 0x00;
-			cmd[4] = 0x00;
-
-			dad = 0x01;
-			sad = 0x02;
-			lr = 256;
-			lc = 5;
+	if ((ctx = ifdh_lock_slot(reader, slot)) != NULL) {
+		if (Action == IFD_POWER_UP || Action == IFD_RESET) {
+			rc = ct_card_reset(ctx->h, slot, atr, sizeof(atr));
 
-			ret = CT_data(ctn, &dad, &sad, 5, cmd, &lr, rsp);
+			if (rc >= 0) {
+				/* Same test as CT-API's: synchronous
+				 * cards have a 4 byte ATR */
+				ctx->sync = (rc == 4);
+				ctx->ATR_Length = (DWORD) rc;
+				memcpy(ctx->icc_state.ATR, atr, rc);
 
-			if (ret == OK) {
-				ifdh_context[ctn][slot]->ATR_Length = 0;
-				memset(ifdh_context[ctn][slot]->icc_state.ATR,
-				       0, MAX_ATR_SIZE);
+				(*AtrLength) = (DWORD) rc;
+				memcpy(Atr, atr, rc);
 
-				(*AtrLength) = 0;
 				rv = IFD_SUCCESS;
+			} else if (Action == IFD_RESET) {
+				rv = IFD_ERROR_POWER_ACTION;
 			} else {
 				rv = IFD_COMMUNICATION_ERROR;
 			}
-		} else if (Action == IFD_RESET) {
-			cmd[0] = CTBCS_CLA;
-			cmd[1] = CTBCS_INS_RESET;
-			cmd[2] = (UCHAR) (slot + 1);
-			cmd[3] = CTBCS_P2_RESET_GET_ATR;
-			cmd[4] = 0x00;
-
-			dad = 0x01;
-			sad = 0x02;
-			lr = 256;
-			lc = 5;
-
-			ret = CT_data(ctn, &dad, &sad, 5, cmd, &lr, rsp);
-
-			if ((ret == OK) && (lr >= 2)) {
-				ifdh_context[ctn][slot]->ATR_Length =
-				    (DWORD) lr - 2;
-				memcpy(ifdh_context[ctn][slot]->icc_state.ATR,
-				       rsp, lr - 2);
-
-				(*AtrLength) = (DWORD) lr - 2;
-				memcpy(Atr, rsp, lr - 2);
+		} else if (Action == IFD_POWER_DOWN) {
+			/* OpenCT can't power down a card; all
+			 * we can do is forget the ATR */
+			ctx->ATR_Length = 0;
+			memset(ctx->icc_state.ATR, 0, MAX_ATR_SIZE);
 
-				rv = IFD_SUCCESS;
-			} else {
-				rv = IFD_ERROR_POWER_ACTION;
-			}
+			(*AtrLength) = 0;
+			rv = IFD_SUCCESS;
 		} else {
 			rv = IFD_NOT_SUPPORTED;
 		}
 	} else {
 		rv = IFD_ICC_NOT_PRESENT;
 	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
+	ifdh_unlock_slot(reader, slot);
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHPowerICC (Lun=0x%X, Action=0x%X)=%d", Lun,
 	       Action, rv);
@@ -378,50 +402,79 @@ RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 	return rv;
 }
 
+/*
+ * Synchronous cards can't do APDUs. As CT-API does,
+ * map READ BINARY to a memory read and pretend the
+ * KVK application has been selected.
+ */
+static int ifdh_transact_sync(IFDH_Context * ctx, unsigned short slot,
+			      PUCHAR TxBuffer, DWORD TxLength,
+			      PUCHAR RxBuffer, DWORD RxLength)
+{
+	static const unsigned char select_kvk[11] =
+	    { 0x00, 0xa4, 0x04, 0x00, 0x06, 0xd2, 0x80, 0x00, 0x00, 0x01,
+		0x01
+	};
+	unsigned int le;
+	int rc;
+
+	if (TxLength == 11 && !memcmp(TxBuffer, select_kvk, 11)) {
+		rc = 0;
+	} else if (TxLength >= 5 && TxBuffer[0] == 0x00
+		   && TxBuffer[1] == 0xb0) {
+		le = (TxLength == 5 && TxBuffer[4]) ? TxBuffer[4] : 256;
+		if (le + 2 > RxLength)
+			return -1;
+		rc = ct_card_read_memory(ctx->h, slot,
+					 (TxBuffer[2] << 8) | TxBuffer[3],
+					 RxBuffer, le);
+		if (rc < 0)
+			return rc;
+	} else {
+		return ct_card_transact(ctx->h, slot, TxBuffer, TxLength,
+					RxBuffer, RxLength);
+	}
+
+	if (rc + 2 > (int)RxLength)
+		return -1;
+	RxBuffer[rc++] = 0x90;
+	RxBuffer[rc++] = 0x00;
+	return rc;
+}
+
 RESPONSECODE
 IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 		  PUCHAR TxBuffer, DWORD TxLength,
 		  PUCHAR RxBuffer, PDWORD RxLength, PSCARD_IO_HEADER RecvPci)
 {
-	char ret;
-	unsigned short ctn, slot, lc, lr;
-	UCHAR sad, dad;
+	unsigned short reader, slot;
+	IFDH_Context *ctx;
 	RESPONSECODE rv;
+	int rc;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
 
-	if (TxLength > USHRT_MAX) {
-		(*RxLength) = 0;
-		return IFD_PROTOCOL_NOT_SUPPORTED;
-	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-	if (ifdh_context[ctn][slot] != NULL) {
-#ifdef HAVE_PTHREAD
-		pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
-		dad = (UCHAR) ((slot == 0) ? 0x00 : slot + 1);
-		sad = 0x02;
-		lr = (*RxLength > USHRT_MAX) ? USHRT_MAX : (unsigned short)(*RxLength);
-		lc = (unsigned short)TxLength;
-
-		ret = CT_data(ctn, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
+	if ((ctx = ifdh_lock_slot(reader, slot)) != NULL) {
+		if (ctx->sync)
+			rc = ifdh_transact_sync(ctx, slot, TxBuffer, TxLength,
+						RxBuffer, *RxLength);
+		else
+			rc = ct_card_transact(ctx->h, slot, TxBuffer, TxLength,
+					      RxBuffer, *RxLength);
 
-		if (ret == OK) {
-			(*RxLength) = lr;
+		if (rc >= 0) {
+			(*RxLength) = rc;
 			rv = IFD_SUCCESS;
 		} else {
 			(*RxLength) = 0;
 			rv = IFD_COMMUNICATION_ERROR;
 		}
 	} else {
-#ifdef HAVE_PTHREAD
-		pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
+		(*RxLength) = 0;
 		rv = IFD_ICC_NOT_PRESENT;
 	}
+	ifdh_unlock_slot(reader, slot);
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHTransmitToICC (Lun=0x%X, Tx=%u, Rx=%u)=%d",
 	       Lun, TxLength, (*RxLength), rv);
@@ -436,30 +489,24 @@ IFDHControl(DWORD Lun, PUCHAR TxBuffer,
 	    DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength)
 {
 	char ret;
-	unsigned short ctn, slot, lc, lr;
+	unsigned short reader, lc, lr;
 	UCHAR sad, dad;
 	RESPONSECODE rv;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
-	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 
 	if (TxLength > USHRT_MAX) {
 		(*RxLength) = 0;
 		return IFD_PROTOCOL_NOT_SUPPORTED;
 	}
-#ifdef HAVE_PTHREAD
-	pthread_mutex_lock(&ifdh_context_mutex[ctn]);
-#endif
-	if (ifdh_context[ctn][slot] != NULL) {
-#ifdef HAVE_PTHREAD
-		pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
+	ifdh_lock_reader(reader);
+	if (ifdh_slots[reader] != 0) {
 		dad = 0x01;
 		sad = 0x02;
 		lr = (*RxLength > USHRT_MAX) ? USHRT_MAX : (unsigned short)(*RxLength);
 		lc = (unsigned short)TxLength;
 
-		ret = CT_data(ctn, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
+		ret = CT_data(reader, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
 
 		if (ret == OK) {
 			(*RxLength) = lr;
@@ -469,11 +516,9 @@ IFDHControl(DWORD Lun, PUCHAR TxBuffer,
 			rv = IFD_COMMUNICATION_ERROR;
 		}
 	} else {
-#ifdef HAVE_PTHREAD
-		pthread_mutex_unlock(&ifdh_context_mutex[ctn]);
-#endif
 		rv = IFD_ICC_NOT_PRESENT;
 	}
+	ifdh_unlock_reader(reader);
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHControl (Lun=0x%X, Tx=%u, Rx=%u)=%d", Lun,
 	       TxLength, (*RxLength), rv);
@@ -492,42 +537,66 @@ RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 
 #endif
 
+/*
+ * Card presence from the status record ifdhandler keeps in
+ * shared memory. That's updated whenever ifdhandler polls the
+ * reader, so asking the reader ourselves wouldn't tell us
+ * anything new. Returns -1 if the record can't be trusted
+ * because its ifdhandler has gone away.
+ */
+static int ifdh_status_presence(unsigned short reader, unsigned short slot)
+{
+	const ct_info_t *info;
+	IFDH_Context *ctx;
+	int num;
+
+	if ((num = ct_status(&info)) < 0 || ifdh_reader[reader] >= num)
+		return -1;
+	info += ifdh_reader[reader];
+
+	if (info->ct_pid == 0 || slot >= info->ct_slots
+	    || (kill(info->ct_pid, 0) < 0 && errno == ESRCH))
+		return -1;
+
+	if (info->ct_card[slot] && (info->ct_powered & (1 << slot)))
+		return IFD_ICC_PRESENT;
+
+	/* Removed, or reset behind our back; the ATR we
+	 * remember is no good anymore */
+	if ((ctx = ifdh_lock_slot(reader, slot)) != NULL && ctx->ATR_Length) {
+		ctx->ATR_Length = 0;
+		memset(ctx->icc_state.ATR, 0, MAX_ATR_SIZE);
+	}
+	ifdh_unlock_slot(reader, slot);
+	return info->ct_card[slot] ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT;
+}
+
 RESPONSECODE IFDHICCPresence(DWORD Lun)
 {
-	char ret;
-	unsigned short ctn, slot, lc, lr;
-	UCHAR cmd[5], rsp[256], sad, dad;
+	unsigned short reader, slot;
+	IFDH_Context *ctx;
 	RESPONSECODE rv;
+	int status;
 
-	ctn = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
+	reader = ((unsigned short)(Lun >> 16)) % IFDH_MAX_READERS;
 	slot = ((unsigned short)(Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
 
-	cmd[0] = CTBCS_CLA;
-	cmd[1] = CTBCS_INS_STATUS;
-	cmd[2] = CTBCS_UNIT_CT;
-	cmd[3] = CTBCS_P2_STATUS_ICC;
-	cmd[4] = 0x00;
-
-	dad = 0x01;
-	sad = 0x02;
-	lc = 5;
-	lr = 256;
-
-	ret = CT_data(ctn, &dad, &sad, lc, cmd, &lr, rsp);
+	if ((status = ifdh_status_presence(reader, slot)) >= 0) {
+		rv = status;
+		goto out;
+	}
 
-	if (ret == OK) {
-		if (slot < lr - 2) {
-			if (rsp[slot] == CTBCS_DATA_STATUS_NOCARD) {
-				rv = IFD_ICC_NOT_PRESENT;
-			} else {
-				rv = IFD_ICC_PRESENT;
-			}
-		} else {
-			rv = IFD_ICC_NOT_PRESENT;
-		}
-	} else {
+	if ((ctx = ifdh_lock_slot(reader, slot)) == NULL) {
+		rv = IFD_COMMUNICATION_ERROR;
+	} else if (ct_card_status(ctx->h, slot, &status) < 0) {
 		rv = IFD_COMMUNICATION_ERROR;
+	} else if (status & IFD_CARD_PRESENT) {
+		rv = IFD_ICC_PRESENT;
+	} else {
+		rv = IFD_ICC_NOT_PRESENT;
 	}
+	ifdh_unlock_slot(reader, slot);
+      out:
 #ifdef DEBUG_IFDH
 	syslog(LOG_INFO, "IFDH: IFDHICCPresence (Lun=0x%X)=%d", Lun, rv);
 #endif
@@ -0,0 +1,129 @@
+/*
+ * Checksum throughput: bit-wise and byte-wise references vs.
+ * the code in libifd. Not run by "make check"; run it by hand:
+ *
+ *	./csum-bench [frame-size [iterations]]
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static unsigned char ref_lrc(const uint8_t * in, size_t len)
+{
+	unsigned char lrc = 0;
+
+	while (len--)
+		lrc ^= *in++;
+	return lrc;
+}
+
+static unsigned short ref_crc(const uint8_t * in, size_t len)
+{
+	unsigned short v = CSUM_CRC_INIT;
+	int bit;
+
+	while (len--) {
+		v ^= *in++;
+		for (bit = 0; bit < 8; bit++)
+			v = (v & 1) ? (v >> 1) ^ 0x8408 : v >> 1;
+	}
+	return v;
+}
+
+/* The byte-wise table lookup libifd used before slicing-by-8 */
+static unsigned short crc_table[256];
+
+static void crc_table_init(void)
+{
+	unsigned int i, bit;
+	unsigned short v;
+
+	for (i = 0; i < 256; i++) {
+		v = i;
+		for (bit = 0; bit < 8; bit++)
+			v = (v & 1) ? (v >> 1) ^ 0x8408 : v >> 1;
+		crc_table[i] = v;
+	}
+}
+
+static unsigned short byte_crc(const uint8_t * in, size_t len)
+{
+	unsigned short v = CSUM_CRC_INIT;
+
+	while (len--)
+		v = ((v >> 8) & 0xFF) ^ crc_table[(v ^ *in++) & 0xFF];
+	return v;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *name, double elapsed, unsigned int size,
+		   unsigned long count)
+{
+	printf("%-10s %8.1f ns/frame %8.1f MB/s\n", name,
+	       elapsed * 1e9 / count, size * (double)count / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int size = 259, n;
+	unsigned long count = 1000000, i;
+	volatile unsigned int sink = 0;
+	uint8_t *buf;
+	unsigned char rc[2];
+	double t;
+
+	if (argc > 1)
+		size = atoi(argv[1]);
+	if (argc > 2)
+		count = atol(argv[2]);
+	if ((buf = malloc(size)) == NULL)
+		return 1;
+	for (n = 0; n < size; n++)
+		buf[n] = n * 7;
+
+	printf("%u byte frames, %lu iterations\n", size, count);
+
+	t = now();
+	for (i = 0; i < count; i++)
+		sink += ref_lrc(buf, size);
+	report("lrc ref", now() - t, size, count);
+
+	t = now();
+	for (i = 0; i < count; i++) {
+		csum_lrc_compute(buf, size, rc);
+		sink += rc[0];
+	}
+	report("lrc", now() - t, size, count);
+
+	t = now();
+	for (i = 0; i < count; i++)
+		sink += ref_crc(buf, size);
+	report("crc ref", now() - t, size, count);
+
+	crc_table_init();
+	if (byte_crc(buf, size) != ref_crc(buf, size))
+		printf("byte-wise table is wrong\n");
+	t = now();
+	for (i = 0; i < count; i++)
+		sink += byte_crc(buf, size);
+	report("crc byte", now() - t, size, count);
+
+	t = now();
+	for (i = 0; i < count; i++) {
+		csum_crc_compute(buf, size, rc);
+		sink += rc[0];
+	}
+	report("crc", now() - t, size, count);
+
+	free(buf);
+	return 0;
+}
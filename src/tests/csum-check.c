@@ -0,0 +1,84 @@
+/*
+ * Check the table driven checksums against a plain
+ * bit-by-bit implementation
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned char ref_lrc(const uint8_t * in, size_t len)
+{
+	unsigned char lrc = 0;
+
+	while (len--)
+		lrc ^= *in++;
+	return lrc;
+}
+
+/* ISO 3309, reflected polynomial 0x8408 */
+static unsigned short ref_crc(const uint8_t * in, size_t len)
+{
+	unsigned short v = CSUM_CRC_INIT;
+	int bit;
+
+	while (len--) {
+		v ^= *in++;
+		for (bit = 0; bit < 8; bit++)
+			v = (v & 1) ? (v >> 1) ^ 0x8408 : v >> 1;
+	}
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t buf[600];
+	unsigned char rc[2];
+	unsigned short crc, ref;
+	unsigned int len, align, split, failed = 0;
+
+	srand(1);
+	for (len = 0; len < sizeof(buf); len++)
+		buf[len] = rand();
+
+	for (align = 0; align < 8; align++) {
+		for (len = 0; len <= 560; len++) {
+			const uint8_t *p = buf + align;
+
+			ref = ref_crc(p, len);
+			csum_crc_compute(p, len, rc);
+			if (rc[0] != (ref >> 8) || rc[1] != (ref & 0xFF)) {
+				printf("crc: len %u align %u\n", len, align);
+				failed++;
+			}
+			csum_lrc_compute(p, len, rc);
+			if (rc[0] != ref_lrc(p, len)) {
+				printf("lrc: len %u align %u\n", len, align);
+				failed++;
+			}
+
+			/* Fed in two pieces */
+			for (split = 0; split <= len; split += 7) {
+				crc = csum_crc_update(CSUM_CRC_INIT, p, split);
+				crc = csum_crc_update(crc, p + split,
+						      len - split);
+				if (crc != ref) {
+					printf("crc: len %u align %u split %u\n",
+					       len, align, split);
+					failed++;
+				}
+				if (csum_lrc_update(csum_lrc_update(0, p, split),
+						    p + split, len - split)
+				    != ref_lrc(p, len)) {
+					printf("lrc: len %u align %u split %u\n",
+					       len, align, split);
+					failed++;
+				}
+			}
+		}
+	}
+
+	if (failed)
+		printf("%u mismatches\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * CT-API from several threads at once. libopenct is replaced
+ * by stubs that answer every APDU with the slot number and
+ * 90 00, so all that is measured is CT-API itself. The threads
+ * share a set of terminals, sending commands to them and now
+ * and then closing and opening them again. A command must never
+ * reach a terminal that has been closed, overlap with another
+ * command to the same terminal, or come back with the answer
+ * meant for another slot.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <openct/openct.h>
+#include <openct/logging.h>
+#include <openct/error.h>
+#include "ctapi.h"
+
+#define THREADS		8
+#define CALLS		20000
+#define TERMINALS	32
+#define PORTS		3
+#define CARD_US		10	/* how long the card takes for an APDU */
+#define REOPEN		50	/* close and open a terminal every so often */
+
+/* Exit status telling automake that the test was skipped */
+#define SKIPPED		77
+
+#ifdef HAVE_PTHREAD
+#define ALIVE		0x7e57
+#define DEAD		0xdead
+
+struct stub_handle {
+	unsigned int magic;
+	unsigned int port;
+	unsigned int busy;
+};
+
+static unsigned int connects, disconnects, stale, overlaps;
+
+/*
+ * Just enough of libopenct for ctapi.c
+ */
+int ct_reader_info(unsigned int reader, ct_info_t * info)
+{
+	memset(info, 0, sizeof(*info));
+	info->ct_slots = 2;
+	return 0;
+}
+
+ct_handle *ct_reader_connect(unsigned int reader)
+{
+	struct stub_handle *h;
+
+	if (!(h = (struct stub_handle *)calloc(1, sizeof(*h))))
+		return NULL;
+	h->magic = ALIVE;
+	h->port = reader;
+	__sync_fetch_and_add(&connects, 1);
+	return (ct_handle *) h;
+}
+
+void ct_reader_disconnect(ct_handle * h)
+{
+	struct stub_handle *sh = (struct stub_handle *)h;
+
+	if (sh->magic != ALIVE)
+		__sync_fetch_and_add(&stale, 1);
+	sh->magic = DEAD;
+	__sync_fetch_and_add(&disconnects, 1);
+	free(sh);
+}
+
+int ct_card_lock(ct_handle * h, unsigned int slot, int type,
+		 ct_lock_handle * lock)
+{
+	*lock = 0;
+	return 0;
+}
+
+int ct_card_unlock(ct_handle * h, unsigned int slot, ct_lock_handle lock)
+{
+	return 0;
+}
+
+int ct_card_transact(ct_handle * h, unsigned int slot,
+		     const void *apdu, size_t apdu_len,
+		     void *recv_buf, size_t recv_len)
+{
+	struct stub_handle *sh = (struct stub_handle *)h;
+	unsigned char *resp = (unsigned char *)recv_buf;
+
+	if (sh->magic != ALIVE)
+		__sync_fetch_and_add(&stale, 1);
+	/* A terminal's commands must come one at a time */
+	if (__sync_fetch_and_add(&sh->busy, 1))
+		__sync_fetch_and_add(&overlaps, 1);
+	/* The card takes its time, as cards do */
+	usleep(CARD_US);
+	__sync_fetch_and_sub(&sh->busy, 1);
+	if (sh->magic != ALIVE)
+		__sync_fetch_and_add(&stale, 1);
+	if (recv_len < 3)
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	resp[0] = slot;
+	resp[1] = 0x90;
+	resp[2] = 0x00;
+	return 3;
+}
+
+int ct_card_reset(ct_handle * h, unsigned int slot, void *atr, size_t len)
+{
+	return 0;
+}
+
+int ct_card_status(ct_handle * h, unsigned int slot, int *status)
+{
+	*status = 0;
+	return 0;
+}
+
+int ct_card_set_protocol(ct_handle * h, unsigned int slot,
+			 unsigned int protocol)
+{
+	return 0;
+}
+
+int ct_card_read_memory(ct_handle * h, unsigned int slot,
+			unsigned short address, void *recv_buf,
+			size_t recv_len)
+{
+	return 0;
+}
+
+void ct_error(const char *fmt, ...)
+{
+}
+
+void ct_debug(const char *fmt, ...)
+{
+}
+
+const char *ct_hexdump(const void *data, size_t len)
+{
+	return "";
+}
+
+static unsigned int answered, wrong;
+
+static void *worker(void *arg)
+{
+	unsigned char cmd[5] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+	unsigned char rsp[16], dad, sad;
+	unsigned short ctn, lr;
+	unsigned int id = *(unsigned int *)arg, n;
+
+	for (n = 0; n < CALLS; n++) {
+		ctn = (id * 7 + n) % TERMINALS;
+		if (n % REOPEN == 0) {
+			CT_close(ctn);
+			CT_init(ctn, ctn % PORTS);
+		}
+		/* Alternate between the two slots */
+		dad = (n & 1) ? CTAPI_DAD_ICC1 : CTAPI_DAD_ICC2;
+		sad = CTAPI_DAD_HOST;
+		lr = sizeof(rsp);
+		/* Another thread may have closed the terminal */
+		if (CT_data(ctn, &dad, &sad, sizeof(cmd), cmd, &lr, rsp) != OK)
+			continue;
+		__sync_fetch_and_add(&answered, 1);
+		if (lr != 3 || rsp[0] != (n & 1 ? 0 : 1) || rsp[1] != 0x90)
+			__sync_fetch_and_add(&wrong, 1);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[THREADS];
+	unsigned int id[THREADS], n;
+	struct timeval begin, end;
+	double wall;
+
+	for (n = 0; n < TERMINALS; n++)
+		CT_init(n, n % PORTS);
+
+	gettimeofday(&begin, NULL);
+	for (n = 0; n < THREADS; n++) {
+		id[n] = n;
+		if (pthread_create(&tid[n], NULL, worker, &id[n]) != 0) {
+			printf("FAIL threads: pthread_create\n");
+			return 1;
+		}
+	}
+	for (n = 0; n < THREADS; n++)
+		pthread_join(tid[n], NULL);
+	gettimeofday(&end, NULL);
+	wall = (end.tv_sec - begin.tv_sec)
+	    + (end.tv_usec - begin.tv_usec) / 1e6;
+
+	for (n = 0; n < TERMINALS; n++)
+		CT_close(n);
+
+	if (answered == 0 || wrong || stale || overlaps) {
+		printf("FAIL threads: %u answers, %u wrong, %u calls on "
+		       "closed readers, %u overlapping\n", answered, wrong,
+		       stale, overlaps);
+		return 1;
+	}
+	printf("ok   threads: %u threads, %u calls each, %u answered, "
+	       "%.0f calls/s\n", THREADS, CALLS, answered,
+	       THREADS * CALLS / wall);
+
+	if (connects != disconnects) {
+		printf("FAIL close: %u connects, %u disconnects\n",
+		       connects, disconnects);
+		return 1;
+	}
+	printf("ok   close: every reader connected was disconnected\n");
+	return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+	printf("skip threads: no thread support\n");
+	return SKIPPED;
+}
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Packet forwarding as done by the RIA server: copying the
+ * payload behind the channel byte and queueing it, as it used
+ * to, vs. ct_socket_forward_packet. A child process drains the
+ * other end of the connection. Not run by "make check"; run it
+ * by hand:
+ *
+ *	./fwd-bench [payload-size [packets]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openct/buffer.h>
+#include <openct/socket.h>
+
+static void drain(int fd)
+{
+	char buf[65536];
+
+	while (read(fd, buf, sizeof(buf)) > 0) ;
+	_exit(0);
+}
+
+/* The old way: build the packet anew, then queue and flush it */
+static int copy_packet(ct_socket_t * sock, header_t * hdr,
+		       unsigned char channel, ct_buf_t * data)
+{
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
+	ct_buf_t pkt;
+	int rc;
+
+	ct_buf_init(&pkt, buffer, sizeof(buffer));
+	ct_buf_putc(&pkt, channel);
+	ct_buf_put(&pkt, ct_buf_head(data), ct_buf_avail(data));
+	if ((rc = ct_socket_put_packet(sock, hdr, &pkt)) < 0)
+		return rc;
+	return ct_socket_flsbuf(sock, 1);
+}
+
+static int forward_packet(ct_socket_t * sock, header_t * hdr,
+			  unsigned char channel, ct_buf_t * data)
+{
+	int rc;
+
+	if ((rc = ct_socket_forward_packet(sock, hdr, &channel, 1, data)) < 0)
+		return rc;
+	/* Flush what had to be queued, as the mainloop would */
+	if (rc == 0 && ct_buf_avail(&sock->sbuf))
+		return ct_socket_flsbuf(sock, 1);
+	return 0;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static double wall_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int run(const char *name,
+	       int (*send) (ct_socket_t *, header_t *, unsigned char,
+			    ct_buf_t *), unsigned int size,
+	       unsigned long count)
+{
+	unsigned char payload[CT_SOCKET_BUFSIZ];
+	ct_socket_t *sock;
+	header_t hdr;
+	ct_buf_t data;
+	double wall, cpu;
+	unsigned long i;
+	int sv[2], status;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		drain(sv[1]);
+	}
+	close(sv[1]);
+
+	if (!(sock = ct_socket_new(CT_SOCKET_BUFSIZ)))
+		return 1;
+	sock->fd = sv[0];
+	memset(payload, 0x5A, size);
+
+	wall = wall_time();
+	cpu = cpu_time();
+	for (i = 0; i < count; i++) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.xid = i + 1;
+		ct_buf_set(&data, payload, size);
+		if (send(sock, &hdr, 3, &data) < 0) {
+			printf("%s: send failed\n", name);
+			break;
+		}
+	}
+	wall = wall_time() - wall;
+	cpu = cpu_time() - cpu;
+
+	ct_socket_free(sock);
+	waitpid(pid, &status, 0);
+
+	printf("%-8s %8.0f packets/s %8.2f us cpu/packet %8.1f MB/s\n",
+	       name, count / wall, cpu * 1e6 / count,
+	       size * (double)count / wall / 1e6);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int size = 1024;
+	unsigned long count = 200000;
+
+	if (argc > 1)
+		size = atoi(argv[1]);
+	if (argc > 2)
+		count = atol(argv[2]);
+	if (size > CT_SOCKET_BUFSIZ - sizeof(header_t) - 1) {
+		fprintf(stderr, "payload too large\n");
+		return 1;
+	}
+
+	printf("%u byte payloads, %lu packets\n", size, count);
+	if (run("copy", copy_packet, size, count)
+	    || run("forward", forward_packet, size, count))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * Load test for the PC/SC IFD handler, without pcscd. The handler
+ * is loaded the way pcscd loads it, and called the way pcscd calls
+ * it: a presence poll per slot every 400ms, and applications sending
+ * APDUs from as many threads as asked for. Not run by "make check";
+ * run it by hand against the readers OpenCT has configured (set
+ * OPENCT_SOCKETDIR to use a private openctd):
+ *
+ *	./ifdh-bench [-r reader | -d device] [-t threads] [-n calls]
+ *		[handler]
+ *
+ * The reader is opened with IFDHCreateChannel, or with
+ * IFDHCreateChannelByName if a device name is given. The handler
+ * defaults to the one in the build tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <ltdl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * The bits of pcsc-lite's ifdhandler.h we need; declared here so
+ * the harness builds without pcsc-lite
+ */
+typedef unsigned long DWORD;
+typedef DWORD *PDWORD;
+typedef unsigned char UCHAR;
+typedef UCHAR *PUCHAR;
+typedef char *LPSTR;
+typedef long RESPONSECODE;
+
+typedef struct _SCARD_IO_HEADER {
+	DWORD Protocol;
+	DWORD Length;
+} SCARD_IO_HEADER, *PSCARD_IO_HEADER;
+
+#define IFD_SUCCESS		0
+#define IFD_POWER_UP		500
+#define IFD_ICC_PRESENT		615
+#define TAG_IFD_SLOTS_NUMBER	0x0FAE
+#define MAX_ATR_SIZE		33
+
+static RESPONSECODE (*IFDHCreateChannelByName) (DWORD, LPSTR);
+static RESPONSECODE (*IFDHCreateChannel) (DWORD, DWORD);
+static RESPONSECODE (*IFDHCloseChannel) (DWORD);
+static RESPONSECODE (*IFDHGetCapabilities) (DWORD, DWORD, PDWORD, PUCHAR);
+static RESPONSECODE (*IFDHPowerICC) (DWORD, DWORD, PUCHAR, PDWORD);
+static RESPONSECODE (*IFDHTransmitToICC) (DWORD, SCARD_IO_HEADER, PUCHAR,
+					  DWORD, PUCHAR, PDWORD,
+					  PSCARD_IO_HEADER);
+static RESPONSECODE (*IFDHICCPresence) (DWORD);
+
+#define BENCH_MAX_SLOTS		16
+#define BENCH_POLL_INTERVAL	400000	/* usec, as pcscd polls */
+
+typedef struct bench_stats {
+	unsigned long *usec;
+	unsigned int count, errors;
+} bench_stats_t;
+
+typedef struct bench_thread {
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+	DWORD lun;
+	unsigned int calls;
+	bench_stats_t stats;
+} bench_thread_t;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static int bench_done;
+#endif
+
+static unsigned long bench_usec(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000UL
+	    + now.tv_usec - start->tv_usec;
+}
+
+static void bench_record(bench_stats_t * stats, struct timeval *start)
+{
+	stats->usec[stats->count++] = bench_usec(start);
+}
+
+static void *bench_transmit(void *arg)
+{
+	static const unsigned char select_mf[] = {
+		0x00, 0xA4, 0x00, 0x00, 0x02, 0x3F, 0x00
+	};
+	bench_thread_t *t = (bench_thread_t *) arg;
+	SCARD_IO_HEADER send_pci, recv_pci;
+	unsigned char res[258];
+	struct timeval start;
+	DWORD res_len;
+	unsigned int n;
+
+	memset(&send_pci, 0, sizeof(send_pci));
+	for (n = 0; n < t->calls; n++) {
+		res_len = sizeof(res);
+		gettimeofday(&start, NULL);
+		if (IFDHTransmitToICC(t->lun, send_pci,
+				      (PUCHAR) select_mf, sizeof(select_mf),
+				      res, &res_len, &recv_pci) != IFD_SUCCESS)
+			t->stats.errors++;
+		else
+			bench_record(&t->stats, &start);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_PTHREAD
+static void *bench_poll(void *arg)
+{
+	bench_thread_t *t = (bench_thread_t *) arg;
+	struct timeval start;
+	struct timespec until;
+
+	pthread_mutex_lock(&bench_mutex);
+	while (!bench_done && t->stats.count < t->calls) {
+		pthread_mutex_unlock(&bench_mutex);
+		gettimeofday(&start, NULL);
+		if (IFDHICCPresence(t->lun) != IFD_ICC_PRESENT)
+			t->stats.errors++;
+		else
+			bench_record(&t->stats, &start);
+
+		until.tv_sec = start.tv_sec;
+		until.tv_nsec = (start.tv_usec + BENCH_POLL_INTERVAL) * 1000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_mutex_lock(&bench_mutex);
+		if (!bench_done)
+			pthread_cond_timedwait(&bench_cond, &bench_mutex,
+					       &until);
+	}
+	pthread_mutex_unlock(&bench_mutex);
+	return NULL;
+}
+#endif
+
+static int bench_compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char *name, bench_thread_t * t,
+			 unsigned int count, unsigned long elapsed)
+{
+	bench_stats_t all;
+	unsigned int n;
+
+	memset(&all, 0, sizeof(all));
+	for (n = 0; n < count; n++) {
+		all.usec = (unsigned long *)realloc(all.usec,
+						    (all.count +
+						     t[n].stats.count + 1) *
+						    sizeof(*all.usec));
+		if (all.usec == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memcpy(all.usec + all.count, t[n].stats.usec,
+		       t[n].stats.count * sizeof(*all.usec));
+		all.count += t[n].stats.count;
+		all.errors += t[n].stats.errors;
+	}
+
+	printf("%-9s %7u calls, %u errors", name, all.count, all.errors);
+	if (all.count) {
+		qsort(all.usec, all.count, sizeof(*all.usec), bench_compare);
+		printf(", %.1f calls/s\n"
+		       "          usec: p50 %lu, p90 %lu, p99 %lu, max %lu",
+		       all.count * 1e6 / (elapsed ? elapsed : 1),
+		       all.usec[all.count / 2],
+		       all.usec[all.count * 9 / 10],
+		       all.usec[all.count * 99 / 100],
+		       all.usec[all.count - 1]);
+	}
+	printf("\n");
+	free(all.usec);
+}
+
+static void *bench_sym(lt_dlhandle handle, const char *name, int needed)
+{
+	void *sym;
+
+	if (!(sym = lt_dlsym(handle, name)) && needed) {
+		fprintf(stderr, "%s: %s\n", name, lt_dlerror());
+		exit(1);
+	}
+	return sym;
+}
+
+static int bench_alloc(bench_thread_t * t, unsigned int calls)
+{
+	t->calls = calls;
+	t->stats.usec = (unsigned long *)calloc(calls + 1,
+						 sizeof(*t->stats.usec));
+	return t->stats.usec ? 0 : -1;
+}
+
+static void usage(int exval)
+{
+	fprintf(stderr,
+		"usage: ifdh-bench [-r reader | -d device] [-t threads] "
+		"[-n calls] [handler]\n");
+	exit(exval);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = IFDH_BENCH_HANDLER, *device = NULL;
+	unsigned int reader = 0, threads = 4, calls = 1000;
+	bench_thread_t *workers, *pollers;
+	DWORD luns[BENCH_MAX_SLOTS], lun, len;
+	unsigned char atr[MAX_ATR_SIZE], nslots = 1;
+	unsigned int n, npresent = 0, polls;
+	struct timeval start;
+	unsigned long elapsed;
+	lt_dlhandle handle;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:hn:r:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'r':
+			reader = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage(c != 'h');
+		}
+	}
+	if (optind < argc - 1)
+		usage(1);
+	if (optind < argc)
+		path = argv[optind];
+#ifndef HAVE_PTHREAD
+	threads = 1;
+#endif
+	if (threads == 0)
+		threads = 1;
+
+	if (lt_dlinit() != 0 || !(handle = lt_dlopen(path))) {
+		fprintf(stderr, "%s: %s\n", path, lt_dlerror());
+		return 1;
+	}
+	if (device)
+		IFDHCreateChannelByName = (RESPONSECODE (*)(DWORD, LPSTR))
+		    bench_sym(handle, "IFDHCreateChannelByName", 1);
+	else
+		IFDHCreateChannel = (RESPONSECODE (*)(DWORD, DWORD))
+		    bench_sym(handle, "IFDHCreateChannel", 1);
+	IFDHCloseChannel = (RESPONSECODE (*)(DWORD))
+	    bench_sym(handle, "IFDHCloseChannel", 1);
+	IFDHGetCapabilities = (RESPONSECODE (*)(DWORD, DWORD, PDWORD, PUCHAR))
+	    bench_sym(handle, "IFDHGetCapabilities", 1);
+	IFDHPowerICC = (RESPONSECODE (*)(DWORD, DWORD, PUCHAR, PDWORD))
+	    bench_sym(handle, "IFDHPowerICC", 1);
+	IFDHTransmitToICC = (RESPONSECODE (*)(DWORD, SCARD_IO_HEADER, PUCHAR,
+					      DWORD, PUCHAR, PDWORD,
+					      PSCARD_IO_HEADER))
+	    bench_sym(handle, "IFDHTransmitToICC", 1);
+	IFDHICCPresence = (RESPONSECODE (*)(DWORD))
+	    bench_sym(handle, "IFDHICCPresence", 1);
+
+	/* Like pcscd, open the reader once, on its first slot */
+	lun = (DWORD) reader << 16;
+	gettimeofday(&start, NULL);
+	if (device)
+		c = IFDHCreateChannelByName(lun, (LPSTR) device);
+	else
+		c = IFDHCreateChannel(lun, reader);
+	if (c != IFD_SUCCESS) {
+		fprintf(stderr, "Unable to open reader\n");
+		return 1;
+	}
+	printf("open      %lu usec\n", bench_usec(&start));
+
+	len = 1;
+	if (IFDHGetCapabilities(lun, TAG_IFD_SLOTS_NUMBER, &len, &nslots)
+	    != IFD_SUCCESS || nslots == 0)
+		nslots = 1;
+	for (n = 0; n < nslots && n < BENCH_MAX_SLOTS; n++) {
+		if (IFDHICCPresence(lun | n) != IFD_ICC_PRESENT)
+			continue;
+		len = sizeof(atr);
+		gettimeofday(&start, NULL);
+		if (IFDHPowerICC(lun | n, IFD_POWER_UP, atr, &len)
+		    != IFD_SUCCESS) {
+			fprintf(stderr, "failed to power up slot %u\n", n);
+			continue;
+		}
+		printf("power up  slot %u, %lu usec\n", n, bench_usec(&start));
+		luns[npresent++] = lun | n;
+	}
+	if (npresent == 0) {
+		fprintf(stderr, "No card present\n");
+		return 1;
+	}
+
+	/* Enough room for the polls while the workers run;
+	 * the pollers stop early if there isn't */
+	polls = 1000;
+	workers = (bench_thread_t *) calloc(threads, sizeof(*workers));
+	pollers = (bench_thread_t *) calloc(npresent, sizeof(*pollers));
+	if (workers == NULL || pollers == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (n = 0; n < threads + npresent; n++) {
+		bench_thread_t *t;
+
+		if (n < threads) {
+			t = &workers[n];
+			t->lun = luns[n % npresent];
+			c = bench_alloc(t, calls);
+		} else {
+			t = &pollers[n - threads];
+			t->lun = luns[n - threads];
+			c = bench_alloc(t, polls);
+		}
+		if (c < 0) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+
+	printf("%u thread(s), %u calls each, %u slot(s)\n", threads, calls,
+	       npresent);
+	gettimeofday(&start, NULL);
+#ifdef HAVE_PTHREAD
+	for (n = 0; n < npresent; n++)
+		pthread_create(&pollers[n].thread, NULL, bench_poll,
+			       &pollers[n]);
+	for (n = 0; n < threads; n++)
+		pthread_create(&workers[n].thread, NULL, bench_transmit,
+			       &workers[n]);
+	for (n = 0; n < threads; n++)
+		pthread_join(workers[n].thread, NULL);
+	elapsed = bench_usec(&start);
+	pthread_mutex_lock(&bench_mutex);
+	bench_done = 1;
+	pthread_cond_broadcast(&bench_cond);
+	pthread_mutex_unlock(&bench_mutex);
+	for (n = 0; n < npresent; n++)
+		pthread_join(pollers[n].thread, NULL);
+#else
+	bench_transmit(&workers[0]);
+	elapsed = bench_usec(&start);
+#endif
+
+	bench_report("transmit", workers, threads, elapsed);
+	bench_report("presence", pollers, npresent, elapsed);
+
+	IFDHCloseChannel(lun);
+	for (n = 0; n < threads; n++)
+		free(workers[n].stats.usec);
+	for (n = 0; n < npresent; n++)
+		free(pollers[n].stats.usec);
+	free(workers);
+	free(pollers);
+	lt_dlclose(handle);
+	lt_dlexit();
+	return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Raw device data through the proxy: the old 128 byte RIA_DATA
+ * chunks vs. stream mode. A pty stands in for a serial reader,
+ * with a process echoing back whatever comes in; it is exported
+ * to a proxy on this host, and we send blocks of data to it and
+ * read them back. For the old way, a relay between the exporter
+ * and the proxy hides RIA_STREAM_CONFIG from the exporter, as an
+ * exporter that predates it would. Not run by "make check"; run
+ * it by hand:
+ *
+ *	./ria-bench [rounds]
+ */
+
+#include "internal.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+
+#include <openct/socket.h>
+#include <openct/path.h>
+#include <openct/server.h>
+#include "ria.h"
+
+static char dir[] = "/tmp/ria-bench.XXXXXX";
+static pid_t children[4];
+static unsigned int nchildren;
+static char *slave;
+
+/*
+ * A pty has no modem lines; pretend it does, so that the
+ * serial code can reset it
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (request == TIOCMGET) {
+		*(int *)arg = TIOCM_DTR | TIOCM_RTS | TIOCM_DSR | TIOCM_CTS;
+		return 0;
+	}
+	if (request == TIOCMSET)
+		return 0;
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+/*
+ * Run fn in a child process, and wait until it has set up
+ * its sockets. It writes to the pipe when it is ready.
+ */
+static int spawn(void (*fn) (int))
+{
+	char c;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		fn(fds[1]);
+		_exit(1);
+	}
+	close(fds[1]);
+	children[nchildren++] = pid;
+	if (read(fds[0], &c, 1) != 1) {
+		close(fds[0]);
+		return -1;
+	}
+	close(fds[0]);
+	return 0;
+}
+
+static void ready(int fd)
+{
+	if (write(fd, "", 1) != 1)
+		_exit(1);
+	close(fd);
+}
+
+/* Stop the last n children */
+static void reap(unsigned int n)
+{
+	while (n-- && nchildren) {
+		nchildren--;
+		kill(children[nchildren], SIGTERM);
+		waitpid(children[nchildren], NULL, 0);
+	}
+}
+
+static void sockpath(char *path, const char *name)
+{
+	ct_format_path(path, PATH_MAX, name);
+}
+
+static int unix_socket(const char *name, int do_listen)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	sockpath(sun.sun_path, name);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (do_listen) {
+		unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+		    || listen(fd, 1) < 0)
+			return -1;
+	} else if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		return -1;
+	}
+	return fd;
+}
+
+/* The card: whatever goes in comes back */
+static void run_echo(int fd)
+{
+	unsigned char buf[4096];
+	int master, n;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+	    || grantpt(master) < 0 || unlockpt(master) < 0
+	    || !(slave = ptsname(master)))
+		_exit(1);
+	/* Hold the line open between exporters */
+	if (open(slave, O_RDWR | O_NOCTTY) < 0)
+		_exit(1);
+	if (write(fd, slave, strlen(slave) + 1) < 0)
+		_exit(1);
+	close(fd);
+
+	while ((n = read(master, buf, sizeof(buf))) > 0) {
+		if (write(master, buf, n) != n)
+			break;
+	}
+	_exit(0);
+}
+
+static void run_server(int fd)
+{
+	char path[PATH_MAX];
+
+	sockpath(path, "proxy");
+	if (ria_svc_listen(path, 1) < 0)
+		_exit(1);
+	sockpath(path, "device");
+	if (ria_svc_listen(path, 0) < 0)
+		_exit(1);
+	ready(fd);
+	ct_mainloop();
+	_exit(0);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t count = 0;
+	int n;
+
+	while (count < len) {
+		if ((n = read(fd, (char *)buf + count, len - count)) <= 0)
+			return -1;
+		count += n;
+	}
+	return 0;
+}
+
+/*
+ * Pass on one packet from the proxy to the exporter. With
+ * old set, turn RIA_STREAM_CONFIG into a command the exporter
+ * doesn't know.
+ */
+static int relay_packet(int from, int to, int old)
+{
+	unsigned char buf[sizeof(header_t) + CT_SOCKET_BUFSIZ];
+	header_t *hdr = (header_t *) buf;
+	unsigned int count, len;
+
+	/* Local sockets carry the header in host byte order */
+	if (read_full(from, hdr, sizeof(*hdr)) < 0)
+		return -1;
+	if ((count = hdr->count) > CT_SOCKET_BUFSIZ
+	    || read_full(from, hdr + 1, count) < 0)
+		return -1;
+	if (old && hdr->dest == 0 && count
+	    && buf[sizeof(*hdr)] == RIA_STREAM_CONFIG)
+		buf[sizeof(*hdr)] = 0xFF;
+	len = sizeof(*hdr) + count;
+	return write(to, buf, len) == (int)len ? 0 : -1;
+}
+
+static int relay_bytes(int from, int to)
+{
+	unsigned char buf[65536];
+	int n;
+
+	if ((n = read(from, buf, sizeof(buf))) <= 0)
+		return -1;
+	return write(to, buf, n) == n ? 0 : -1;
+}
+
+static void run_relay(int fd, int old)
+{
+	struct pollfd pfd[2];
+	int lsn, peer, server;
+
+	if ((lsn = unix_socket("relay", 1)) < 0)
+		_exit(1);
+	ready(fd);
+	if ((peer = accept(lsn, NULL, NULL)) < 0
+	    || (server = unix_socket("device", 0)) < 0)
+		_exit(1);
+
+	pfd[0].fd = peer;
+	pfd[1].fd = server;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) > 0) {
+		if ((pfd[0].revents && relay_bytes(peer, server) < 0)
+		    || (pfd[1].revents && relay_packet(server, peer, old) < 0))
+			break;
+	}
+	_exit(0);
+}
+
+static void run_old_relay(int fd)
+{
+	run_relay(fd, 1);
+}
+
+static void run_new_relay(int fd)
+{
+	run_relay(fd, 0);
+}
+
+static void run_export(int fd)
+{
+	char device[PATH_MAX];
+
+	snprintf(device, sizeof(device), "serial:%s", slave);
+	ria_export_device("bench", device);
+	ria_export_start("relay");
+	ready(fd);
+	ct_mainloop();
+	_exit(0);
+}
+
+static void cleanup(void)
+{
+	const char *names[] = { "proxy", "device", "relay" };
+	char path[PATH_MAX];
+	unsigned int n;
+
+	reap(nchildren);
+	for (n = 0; n < 3; n++) {
+		sockpath(path, names[n]);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+static double wall_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const unsigned int sizes[] = { 16, 261, 1024, 4096 };
+
+#define NUM(a)	(sizeof(a) / sizeof((a)[0]))
+
+static int run(const char *name, void (*relay) (int), unsigned int rounds)
+{
+	static unsigned char out[8192], in[8192];
+	ifd_device_t *dev = NULL;
+	unsigned int i, n, tries;
+	double wall;
+	int rc = 0;
+
+	if (spawn(relay) < 0 || spawn(run_export) < 0) {
+		printf("%s: can't start the exporter\n", name);
+		return -1;
+	}
+	/* The exporter registers once it has connected */
+	for (tries = 0; tries < 50 && !dev; tries++) {
+		if (!(dev = ifd_device_open("remote:bench@proxy")))
+			usleep(100000);
+	}
+	if (!dev) {
+		printf("%s: can't open the exported device\n", name);
+		reap(2);
+		return -1;
+	}
+
+	for (i = 0; i < NUM(sizes) && rc == 0; i++) {
+		wall = wall_time();
+		for (n = 0; n < rounds; n++) {
+			memset(out, n, sizes[i]);
+			if (ifd_device_send(dev, out, sizes[i]) < 0
+			    || ifd_device_recv(dev, in, sizes[i], 5000) < 0
+			    || memcmp(in, out, sizes[i])) {
+				printf("%s: %u bytes: round %u failed\n", name,
+				       sizes[i], n);
+				rc = -1;
+				break;
+			}
+		}
+		wall = wall_time() - wall;
+		if (rc == 0)
+			printf("%-7s %5u bytes %8.2f ms/round %8.1f kB/s\n",
+			       name, sizes[i], wall * 1e3 / rounds,
+			       2 * sizes[i] * (double)rounds / wall / 1e3);
+	}
+
+	ifd_device_close(dev);
+	reap(2);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	static char name[PATH_MAX];
+	unsigned int rounds = 200;
+	int fds[2], rc;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (rounds == 0)
+		rounds = 1;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("OPENCT_SOCKETDIR", dir, 1);
+	ct_config.suppress_errors = 1;
+
+	/* The echo process tells us the name of the pty */
+	if (pipe(fds) < 0 || (children[nchildren] = fork()) < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (children[nchildren] == 0) {
+		close(fds[0]);
+		run_echo(fds[1]);
+	}
+	nchildren++;
+	close(fds[1]);
+	if (read(fds[0], name, sizeof(name) - 1) <= 0) {
+		printf("can't set up a pty\n");
+		cleanup();
+		return 1;
+	}
+	close(fds[0]);
+	slave = name;
+
+	if (spawn(run_server) < 0) {
+		printf("can't start the proxy\n");
+		cleanup();
+		return 1;
+	}
+
+	printf("%u rounds per size\n", rounds);
+	rc = run("legacy", run_old_relay, rounds);
+	if (rc == 0)
+		rc = run("stream", run_new_relay, rounds);
+
+	cleanup();
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * A reader exported at the command level, reached through the
+ * proxy over a link that delivers data late and in pieces.
+ * Checks that APDUs up to the link's limit get across in both
+ * directions, that larger ones fail cleanly without taking the
+ * connection down, and that the exporting side comes back when
+ * the link is lost.
+ *
+ * Everything runs on this host: the proxy server, a delay proxy
+ * between it and the exporting side, and the exporting side with
+ * a fake reader that answers each command with its bytes
+ * inverted, followed by 90 00.
+ */
+
+#include "internal.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <openct/socket.h>
+#include <openct/path.h>
+#include <openct/server.h>
+#include "ria.h"
+
+#define DELAY_PIECE	500	/* bytes the delay proxy passes on at once */
+#define DELAY_US	2000	/* and how long it waits before each piece */
+
+static char dir[] = "/tmp/ria-loop.XXXXXX";
+static pid_t children[3];
+static unsigned int nchildren;
+
+/*
+ * Fake reader on the exporting side
+ */
+static int fake_open(ifd_reader_t * reader, const char *device_name)
+{
+	ifd_device_t *dev;
+	static struct ifd_device_ops fake_device_ops;
+
+	if (!(dev = ifd_device_new(device_name, &fake_device_ops,
+				   sizeof(*dev))))
+		return -1;
+	dev->type = IFD_DEVICE_TYPE_OTHER;
+	reader->name = "fake";
+	reader->nslots = 1;
+	reader->device = dev;
+	return 0;
+}
+
+static int fake_card_status(ifd_reader_t * reader, int slot, int *status)
+{
+	*status = IFD_CARD_PRESENT;
+	return 0;
+}
+
+static int fake_set_protocol(ifd_reader_t * reader, int nslot, int proto)
+{
+	ifd_slot_t *slot = &reader->slot[nslot];
+
+	if (slot->proto)
+		return 0;
+	slot->proto = ifd_protocol_new(IFD_PROTOCOL_TRANSPARENT, reader,
+				       slot->dad);
+	return slot->proto ? 0 : IFD_ERROR_GENERIC;
+}
+
+static int fake_transparent(ifd_reader_t * reader, int dad,
+			    const void *sbuf, size_t slen, void *rbuf,
+			    size_t rlen)
+{
+	const unsigned char *cmd = (const unsigned char *)sbuf;
+	unsigned char *resp = (unsigned char *)rbuf;
+	size_t n;
+
+	if (slen + 2 > rlen)
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	for (n = 0; n < slen; n++)
+		resp[n] = ~cmd[n];
+	resp[slen] = 0x90;
+	resp[slen + 1] = 0x00;
+	return slen + 2;
+}
+
+static struct ifd_driver_ops fake_ops;
+
+/*
+ * Run fn in a child process, and wait until it has set up
+ * its sockets. It writes to the pipe when it is ready.
+ */
+static int spawn(void (*fn) (int))
+{
+	char c;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		fn(fds[1]);
+		_exit(1);
+	}
+	close(fds[1]);
+	children[nchildren++] = pid;
+	if (read(fds[0], &c, 1) != 1) {
+		close(fds[0]);
+		return -1;
+	}
+	close(fds[0]);
+	return 0;
+}
+
+static void ready(int fd)
+{
+	if (write(fd, "", 1) != 1)
+		_exit(1);
+	close(fd);
+}
+
+static void sockpath(char *path, const char *name)
+{
+	ct_format_path(path, PATH_MAX, name);
+}
+
+static void run_server(int fd)
+{
+	char path[PATH_MAX];
+
+	sockpath(path, "proxy");
+	if (ria_svc_listen(path, 1) < 0)
+		_exit(1);
+	sockpath(path, "device");
+	if (ria_svc_listen(path, 0) < 0)
+		_exit(1);
+	ready(fd);
+	ct_mainloop();
+	_exit(0);
+}
+
+static int unix_socket(const char *name, int do_listen)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	sockpath(sun.sun_path, name);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (do_listen) {
+		unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+		    || listen(fd, 1) < 0)
+			return -1;
+	} else if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		return -1;
+	}
+	return fd;
+}
+
+/* Pass on what came in, late and in small pieces */
+static int forward(int from, int to)
+{
+	unsigned char buf[65536];
+	int n, i, m;
+
+	if ((n = read(from, buf, sizeof(buf))) <= 0)
+		return -1;
+	for (i = 0; i < n; i += m) {
+		usleep(DELAY_US);
+		m = n - i < DELAY_PIECE ? n - i : DELAY_PIECE;
+		if (write(to, buf + i, m) != m)
+			return -1;
+	}
+	return 0;
+}
+
+static void run_delay(int fd)
+{
+	struct pollfd pfd[2];
+	int lsn, peer, server;
+
+	if ((lsn = unix_socket("delay", 1)) < 0)
+		_exit(1);
+	ready(fd);
+	if ((peer = accept(lsn, NULL, NULL)) < 0
+	    || (server = unix_socket("device", 0)) < 0)
+		_exit(1);
+
+	pfd[0].fd = peer;
+	pfd[1].fd = server;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) > 0) {
+		if ((pfd[0].revents && forward(peer, server) < 0)
+		    || (pfd[1].revents && forward(server, peer) < 0))
+			break;
+	}
+	_exit(0);
+}
+
+static void run_export(int fd)
+{
+	fake_ops.open = fake_open;
+	fake_ops.card_status = fake_card_status;
+	fake_ops.set_protocol = fake_set_protocol;
+	fake_ops.transparent = fake_transparent;
+	ifd_driver_register("fake", &fake_ops);
+
+	ria_export_reader("loop", "fake", "fake");
+	ria_export_start("delay");
+	ready(fd);
+	ct_mainloop();
+	_exit(0);
+}
+
+static void cleanup(void)
+{
+	const char *names[] = { "proxy", "device", "delay" };
+	char path[PATH_MAX];
+	unsigned int n;
+
+	for (n = 0; n < nchildren; n++) {
+		kill(children[n], SIGTERM);
+		waitpid(children[n], NULL, 0);
+	}
+	for (n = 0; n < 3; n++) {
+		sockpath(path, names[n]);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+static double elapsed_ms(struct timeval *begin)
+{
+	struct timeval now, delta;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, begin, &delta);
+	return delta.tv_sec * 1e3 + delta.tv_usec / 1e3;
+}
+
+static int failed;
+
+/*
+ * Send an APDU of the given size; it is expected to go
+ * through if ok is set, and to fail otherwise
+ */
+static void check(ifd_reader_t * reader, size_t len, int ok)
+{
+	static unsigned char apdu[2 * CT_SOCKET_BUFSIZ];
+	static unsigned char resp[2 * CT_SOCKET_BUFSIZ];
+	struct timeval begin;
+	unsigned int n;
+	int rc, good;
+
+	for (n = 0; n < len; n++)
+		apdu[n] = n * 7;
+	gettimeofday(&begin, NULL);
+	rc = ifd_card_command(reader, 0, apdu, len, resp, sizeof(resp));
+
+	if (ok) {
+		good = rc == (int)len + 2 && resp[len] == 0x90;
+		for (n = 0; good && n < len; n++)
+			good = resp[n] == (unsigned char)~apdu[n];
+	} else {
+		good = rc < 0;
+	}
+	printf("%s %4u byte command: rc=%d, %.1f ms\n",
+	       good ? "ok  " : "FAIL", (unsigned int)len, rc,
+	       elapsed_ms(&begin));
+	if (!good)
+		failed++;
+}
+
+/* The exporter registers once it has connected */
+static ifd_reader_t *open_reader(void)
+{
+	ifd_reader_t *reader = NULL;
+	unsigned int tries;
+
+	for (tries = 0; tries < 50 && !reader; tries++) {
+		if (!(reader = ifd_open("remote", "remote:loop@proxy")))
+			usleep(100000);
+	}
+	if (reader && ifd_set_protocol(reader, 0, IFD_PROTOCOL_T1) < 0) {
+		ifd_close(reader);
+		reader = NULL;
+	}
+	return reader;
+}
+
+int main(int argc, char **argv)
+{
+	ifd_reader_t *reader;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("OPENCT_SOCKETDIR", dir, 1);
+	ifd_protocol_register(&ifd_protocol_trans);
+	ifd_remote_register();
+
+	if (spawn(run_server) < 0 || spawn(run_delay) < 0
+	    || spawn(run_export) < 0) {
+		printf("FAIL setup: can't start proxy or exporter\n");
+		cleanup();
+		return 1;
+	}
+
+	if (!(reader = open_reader())) {
+		printf("FAIL setup: can't open the exported reader\n");
+		cleanup();
+		return 1;
+	}
+
+	check(reader, 5, 1);
+	check(reader, 261, 1);
+	check(reader, 600, 1);
+	check(reader, 2000, 1);
+	check(reader, RIA_APDU_MAX - 2, 1);
+
+	/* Response too large for the link */
+	check(reader, RIA_APDU_MAX - 1, 0);
+	/* Command too large for the link */
+	check(reader, RIA_APDU_MAX + 1, 0);
+	/* Neither took the connection down */
+	check(reader, 5, 1);
+
+	/* Cut the link; the exporter reconnects through the new
+	 * delay proxy, and registers the reader again */
+	kill(children[1], SIGTERM);
+	waitpid(children[1], NULL, 0);
+	children[1] = children[--nchildren];
+	ifd_close(reader);
+	if (spawn(run_delay) < 0 || !(reader = open_reader())) {
+		printf("FAIL reconnect: reader didn't come back\n");
+		cleanup();
+		return 1;
+	}
+	printf("ok   reconnect\n");
+	check(reader, 5, 1);
+
+	cleanup();
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Check the decoding of PARMRK escapes in the serial receive
+ * buffer. The reader end of a pty is opened as a serial device
+ * with parity checking on, and the streams a tty would deliver
+ * are written into the other end: FF FF for a literal FF, FF 00 x
+ * for a parity error. The escapes are placed in the middle of
+ * the data, across the wrap of the receive buffer, and across
+ * separate reads.
+ */
+
+#include "internal.h"
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+/* Size of the receive buffer, as in serial.c */
+#define RBUF_SIZE	512
+
+static ifd_device_t *dev;
+static int master;
+static unsigned int failed;
+
+static int put(const unsigned char *data, size_t len)
+{
+	if (write(master, data, len) != (ssize_t) len) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait until the tty has len bytes for us */
+static void arrived(int len)
+{
+	int avail, tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		if (ioctl(dev->fd, FIONREAD, &avail) < 0 || avail >= len)
+			return;
+		usleep(1000);
+	}
+}
+
+/*
+ * Write stream into the pty so that it lands k bytes before the
+ * receive buffer wraps, and check that it reads back as expect;
+ * with expect NULL, as a parity error. Filler bytes go ahead of
+ * it; all but the last are read off first.
+ */
+static void check(const char *name, unsigned int k,
+		  const unsigned char *stream, size_t slen,
+		  const unsigned char *expect, size_t elen)
+{
+	unsigned char buf[RBUF_SIZE + 64];
+	unsigned int fill = k ? RBUF_SIZE - k : 0;
+	int pad = fill ? 1 : 0, rc, good;
+
+	ifd_device_flush(dev);
+	memset(buf, 'a', fill);
+	memcpy(buf + fill, stream, slen);
+	if (put(buf, fill + slen) < 0) {
+		failed++;
+		return;
+	}
+	arrived(fill + slen);
+
+	if (fill && ifd_device_recv(dev, buf, fill - 1, 1000) != (int)fill - 1) {
+		printf("FAIL %s: can't skip %u filler bytes\n", name, fill - 1);
+		failed++;
+		return;
+	}
+
+	rc = ifd_device_recv(dev, buf, pad + (expect ? elen : slen), 200);
+	if (expect)
+		good = rc == pad + (int)elen
+		    && (!pad || buf[0] == 'a')
+		    && !memcmp(buf + pad, expect, elen);
+	else
+		good = rc < 0;
+	printf("%s %s, %u before the wrap: rc=%d\n", good ? "ok  " : "FAIL",
+	       name, k, rc);
+	if (!good)
+		failed++;
+}
+
+/* An escape whose second half comes in a later read */
+static void check_split(const char *name, const unsigned char *stream,
+			size_t first, size_t slen, const unsigned char *expect,
+			size_t elen)
+{
+	unsigned char buf[64];
+	size_t len = expect ? elen : slen;
+	int rc, good;
+
+	ifd_device_flush(dev);
+	if (put(stream, first) < 0) {
+		failed++;
+		return;
+	}
+	arrived(first);
+	/* Nothing complete to hand out yet */
+	rc = ifd_device_recv(dev, buf, len, 100);
+	good = rc == IFD_ERROR_TIMEOUT;
+
+	if (put(stream + first, slen - first) < 0) {
+		failed++;
+		return;
+	}
+	rc = ifd_device_recv(dev, buf, len, 1000);
+	if (expect)
+		good = good && rc == (int)elen && !memcmp(buf, expect, elen);
+	else
+		good = good && rc < 0;
+	printf("%s %s, split after %u: rc=%d\n", good ? "ok  " : "FAIL",
+	       name, (unsigned int)first, rc);
+	if (!good)
+		failed++;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned char ff_ff[] = { 0x01, 0xFF, 0xFF, 0x02 };
+	static const unsigned char ff[] = { 0x01, 0xFF, 0x02 };
+	static const unsigned char ff_00[] = { 0x01, 0xFF, 0x00, 0x55, 0x02 };
+	static const unsigned char ff_x[] = { 0x01, 0xFF, 0x33, 0x02 };
+	static const unsigned char x[] = { 0x01, 0x33, 0x02 };
+	struct termios t;
+	unsigned int k;
+	unsigned char c;
+	char *name;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+	    || grantpt(master) < 0 || unlockpt(master) < 0
+	    || !(name = ptsname(master))) {
+		perror("pty");
+		return 1;
+	}
+
+	/* A pty has no modem lines, so don't mind the complaints
+	 * about them */
+	ct_config.suppress_errors = 1;
+	if (!(dev = ifd_open_serial(name))) {
+		printf("FAIL open: can't open %s\n", name);
+		return 1;
+	}
+
+	/* Parity checking is on as far as the decoder is concerned.
+	 * We write the escapes ourselves, though; the pty must pass
+	 * them on as they are, not add its own */
+	tcgetattr(dev->fd, &t);
+	cfmakeraw(&t);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	tcsetattr(dev->fd, TCSANOW, &t);
+	dev->settings.serial.check_parity = 1;
+
+	check("FF FF", 0, ff_ff, sizeof(ff_ff), ff, sizeof(ff));
+	check("FF x", 0, ff_x, sizeof(ff_x), x, sizeof(x));
+
+	/* Move the escapes across the wrap, a byte at a time */
+	for (k = 1; k <= 4; k++) {
+		check("FF FF", k, ff_ff, sizeof(ff_ff), ff, sizeof(ff));
+		check("FF x", k, ff_x, sizeof(ff_x), x, sizeof(x));
+		check("FF 00 x", k, ff_00, sizeof(ff_00), NULL, 0);
+	}
+
+	/* What comes after a parity error is still there */
+	check("FF 00 x", 0, ff_00, sizeof(ff_00), NULL, 0);
+	if (ifd_device_recv(dev, &c, 1, 200) != 1 || c != 0x02) {
+		printf("FAIL data after the parity error\n");
+		failed++;
+	} else {
+		printf("ok   data after the parity error\n");
+	}
+
+	check_split("FF FF", ff_ff + 1, 1, 3, ff + 1, 2);
+	check_split("FF 00 x", ff_00 + 1, 1, 4, NULL, 0);
+	check_split("FF 00 x", ff_00 + 1, 2, 4, NULL, 0);
+
+	ifd_device_close(dev);
+	close(master);
+	return failed ? 1 : 0;
+}
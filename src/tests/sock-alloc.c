@@ -0,0 +1,303 @@
+/*
+ * Check that sockets are recycled instead of allocated anew,
+ * that the recycling holds up when used from several threads,
+ * and that APDUs going to a USB reader don't allocate either.
+ * The USB device is faked at the usbdevfs ioctl level.
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+#include <openct/socket.h>
+
+#define CYCLES		10000
+#define APDUS		1000
+#define WARMUP		10
+#define THREADS		8
+#define HELD		4
+
+/* Exit status telling automake that the test was skipped */
+#define SKIPPED		77
+
+#ifdef __GLIBC__
+/*
+ * Count the allocations made behind our back
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+
+static unsigned int allocs;
+
+void *malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&allocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+static int recycle(void)
+{
+	ct_socket_t *sock[2];
+	unsigned int n, before;
+
+	/* Fill the pool */
+	sock[0] = ct_socket_new(CT_SOCKET_BUFSIZ);
+	sock[1] = ct_socket_new(CT_SOCKET_BUFSIZ);
+	if (!sock[0] || !sock[1]) {
+		printf("FAIL recycle: out of memory\n");
+		return 1;
+	}
+	ct_socket_free(sock[0]);
+	ct_socket_free(sock[1]);
+
+	before = allocs;
+	for (n = 0; n < CYCLES; n++) {
+		sock[0] = ct_socket_new(CT_SOCKET_BUFSIZ);
+		sock[1] = ct_socket_new(CT_SOCKET_BUFSIZ);
+		ct_socket_free(sock[1]);
+		ct_socket_free(sock[0]);
+	}
+	if (allocs != before) {
+		printf("FAIL recycle: %u allocations in %u cycles\n",
+		       allocs - before, CYCLES);
+		return 1;
+	}
+	printf("ok   recycle: no allocations in %u cycles\n", CYCLES);
+	return 0;
+}
+#else
+static int recycle(void)
+{
+	printf("skip recycle: can't count allocations here\n");
+	return SKIPPED;
+}
+#endif
+
+#if defined(__GLIBC__) && defined(__linux__)
+/*
+ * Fake USB device: every URB completes as soon as it is
+ * submitted. Bulk-in transfers return 90 00.
+ */
+static int usb_fd = -1;
+static struct usbdevfs_urb *usb_done[4];
+static unsigned int usb_ndone;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct usbdevfs_urb *urb;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	/* Opening the device asks for a disconnect signal */
+	if (request == USBDEVFS_DISCSIGNAL)
+		usb_fd = fd;
+	if (fd != usb_fd)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	switch (request) {
+	case USBDEVFS_DISCSIGNAL:
+		return 0;
+	case USBDEVFS_SUBMITURB:
+		urb = (struct usbdevfs_urb *)arg;
+		if (usb_ndone == sizeof(usb_done) / sizeof(usb_done[0]))
+			break;
+		urb->status = 0;
+		urb->actual_length = urb->buffer_length;
+		if ((urb->endpoint & 0x80) && urb->buffer_length >= 2) {
+			memcpy(urb->buffer, "\x90\x00", 2);
+			urb->actual_length = 2;
+		}
+		usb_done[usb_ndone++] = urb;
+		return 0;
+	case USBDEVFS_REAPURBNDELAY:
+		if (usb_ndone == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		*(struct usbdevfs_urb **)arg = usb_done[0];
+		memmove(usb_done, usb_done + 1,
+			--usb_ndone * sizeof(usb_done[0]));
+		return 0;
+	case USBDEVFS_DISCARDURB:
+		errno = EINVAL;
+		return -1;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/*
+ * Fake reader driver, talking to the card through the
+ * USB device, as CCID readers do
+ */
+static int fake_transparent(ifd_reader_t * reader, int dad,
+			    const void *sbuf, size_t slen, void *rbuf,
+			    size_t rlen)
+{
+	int rc;
+
+	if ((rc = ifd_device_send(reader->device, sbuf, slen)) < 0)
+		return rc;
+	return ifd_device_recv(reader->device, rbuf, rlen, 1000);
+}
+
+static struct ifd_driver_ops fake_ops;
+static ifd_driver_t fake_driver = { "fake", &fake_ops };
+static ifd_reader_t fake_reader;
+
+static int apdus(void)
+{
+	unsigned char apdu[5] = { 0x00, 0xA4, 0x00, 0x00, 0x00 }, resp[258];
+	ifd_device_t *dev;
+	unsigned int n, before = 0;
+	int rc;
+
+	fake_ops.transparent = fake_transparent;
+	ifd_protocol_register(&ifd_protocol_trans);
+
+	if (!(dev = ifd_open_usb("/dev/null"))) {
+		printf("FAIL apdus: can't open fake USB device\n");
+		return 1;
+	}
+	dev->settings.usb.ep_o = 0x02;
+	dev->settings.usb.ep_i = 0x81;
+
+	fake_reader.driver = &fake_driver;
+	fake_reader.device = dev;
+	fake_reader.nslots = 1;
+	fake_reader.slot[0].proto =
+	    ifd_protocol_new(IFD_PROTOCOL_TRANSPARENT, &fake_reader, 0);
+	if (fake_reader.slot[0].proto == NULL) {
+		printf("FAIL apdus: can't create protocol\n");
+		return 1;
+	}
+
+	for (n = 0; n < WARMUP + APDUS; n++) {
+		if (n == WARMUP)
+			before = allocs;
+		rc = ifd_card_command(&fake_reader, 0, apdu, sizeof(apdu),
+				      resp, sizeof(resp));
+		if (rc != 2 || resp[0] != 0x90) {
+			printf("FAIL apdus: APDU %u returned %d\n", n, rc);
+			return 1;
+		}
+	}
+	if (allocs != before) {
+		printf("FAIL apdus: %u allocations in %u APDUs\n",
+		       allocs - before, APDUS);
+		return 1;
+	}
+	printf("ok   apdus: no allocations in %u APDUs\n", APDUS);
+
+	ifd_protocol_free(fake_reader.slot[0].proto);
+	ifd_device_close(dev);
+	return 0;
+}
+#else
+static int apdus(void)
+{
+	printf("skip apdus: can't count allocations here\n");
+	return SKIPPED;
+}
+#endif
+
+#ifdef HAVE_PTHREAD
+static unsigned int clashes;
+
+/*
+ * A socket that is handed out twice shows up as
+ * someone else's while we hold it
+ */
+static void *hammer(void *me)
+{
+	ct_socket_t *sock[HELD];
+	unsigned int n, i;
+
+	for (n = 0; n < CYCLES; n++) {
+		for (i = 0; i < HELD; i++) {
+			if (!(sock[i] = ct_socket_new(CT_SOCKET_BUFSIZ)))
+				return NULL;
+			if (sock[i]->user_data != NULL)
+				__sync_fetch_and_add(&clashes, 1);
+			sock[i]->user_data = me;
+		}
+		sched_yield();
+		for (i = 0; i < HELD; i++) {
+			if (sock[i]->user_data != me)
+				__sync_fetch_and_add(&clashes, 1);
+			sock[i]->user_data = NULL;
+			ct_socket_free(sock[i]);
+		}
+	}
+	return NULL;
+}
+
+static int threads(void)
+{
+	pthread_t tid[THREADS];
+	int id[THREADS];
+	unsigned int n;
+
+	for (n = 0; n < THREADS; n++) {
+		id[n] = n;
+		if (pthread_create(&tid[n], NULL, hammer, &id[n]) != 0) {
+			printf("FAIL threads: pthread_create\n");
+			return 1;
+		}
+	}
+	for (n = 0; n < THREADS; n++)
+		pthread_join(tid[n], NULL);
+
+	if (clashes) {
+		printf("FAIL threads: %u sockets handed out twice\n",
+		       clashes);
+		return 1;
+	}
+	printf("ok   threads: %u threads, %u cycles each\n", THREADS,
+	       CYCLES);
+	return 0;
+}
+#else
+static int threads(void)
+{
+	printf("skip threads: no thread support\n");
+	return SKIPPED;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	int r1, r2, r3;
+
+	r1 = recycle();
+	r2 = threads();
+	r3 = apdus();
+	if (r1 == 1 || r2 == 1 || r3 == 1)
+		return 1;
+	if (r1 == SKIPPED && r2 == SKIPPED && r3 == SKIPPED)
+		return SKIPPED;
+	return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * T=1 error recovery against a simulated ICC
+ *
+ * The ICC lives behind a fake reader driver. Blocks travelling
+ * in either direction can be corrupted on the way, to check that
+ * the protocol recovers with R-blocks and retransmissions alone,
+ * and falls back to S(RESYNCH) only when that fails.
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAD	0
+#define PCB	1
+#define LEN	2
+#define DATA	3
+
+#define T1_R_BLOCK	0x80
+#define T1_S_BLOCK	0xC0
+#define T1_MORE_BLOCKS	0x20
+#define T1_EDC_ERROR	0x01
+
+#define ICC_IFSD	32	/* the default, as T=1 starts out */
+
+/* Simulated ICC */
+static struct {
+	unsigned char ns, nr;
+	unsigned char reply[260];	/* block we're about to send */
+	unsigned int reply_len;
+	unsigned char last[260];	/* last block we sent */
+	unsigned int last_len;
+	unsigned char apdu[1024];	/* command received so far */
+	unsigned int apdu_len;
+	unsigned char resp[1024];	/* response still to be sent */
+	unsigned int resp_len, resp_pos;
+
+	/* Fault injection: corrupt the Nth block in each direction
+	 * (counting from 1); a bit mask, so several can be hit */
+	unsigned long bad_in, bad_out;
+	unsigned int count_in, count_out;
+	int always_bad;
+} icc;
+
+static unsigned int icc_block(unsigned char *block, unsigned char pcb,
+			      const unsigned char *data, unsigned int len)
+{
+	block[NAD] = 0;
+	block[PCB] = pcb;
+	block[LEN] = len;
+	memcpy(block + DATA, data, len);
+	return csum_lrc_compute(block, len + 3, block + len + 3) + len + 3;
+}
+
+static void icc_send(unsigned char pcb, const unsigned char *data,
+		     unsigned int len)
+{
+	icc.reply_len = icc_block(icc.reply, pcb, data, len);
+	memcpy(icc.last, icc.reply, icc.reply_len);
+	icc.last_len = icc.reply_len;
+}
+
+static void icc_repeat(void)
+{
+	memcpy(icc.reply, icc.last, icc.last_len);
+	icc.reply_len = icc.last_len;
+}
+
+/*
+ * Send the next piece of the response, chaining
+ * if it doesn't fit into one block
+ */
+static void icc_chain(void)
+{
+	unsigned int n = icc.resp_len - icc.resp_pos;
+	unsigned char pcb = icc.ns << 6;
+
+	if (n > ICC_IFSD) {
+		n = ICC_IFSD;
+		pcb |= T1_MORE_BLOCKS;
+	}
+	icc_send(pcb, icc.resp + icc.resp_pos, n);
+	icc.resp_pos += n;
+	icc.ns ^= 1;
+}
+
+/*
+ * The ICC's side of the protocol: answer whatever the
+ * terminal sent. The response APDU is the command with
+ * every byte inverted, followed by 90 00.
+ */
+static void icc_receive(const unsigned char *block, size_t len)
+{
+	unsigned char csum, pcb;
+	unsigned int n;
+
+	icc.count_in++;
+	if (len < 4 || block[LEN] + 4 != len
+	    || (csum_lrc_compute(block, len - 1, &csum), csum != block[len - 1])
+	    || icc.always_bad || (icc.bad_in & (1UL << (icc.count_in - 1)))) {
+		/* Ask for the block we expected */
+		icc_send(T1_R_BLOCK | (icc.nr << 4) | T1_EDC_ERROR, NULL, 0);
+		return;
+	}
+
+	pcb = block[PCB];
+	if ((pcb & 0xC0) == T1_S_BLOCK) {
+		if (pcb == T1_S_BLOCK) {	/* RESYNCH request */
+			icc.ns = icc.nr = 0;
+			icc.apdu_len = 0;
+			icc_send(T1_S_BLOCK | 0x20, NULL, 0);
+		}
+		return;
+	}
+
+	if ((pcb & 0xC0) == T1_R_BLOCK) {
+		/* An R-block asking for our next block acknowledges
+		 * an I-block of ours in a chain; anything else is a
+		 * request to repeat */
+		if (icc.resp_pos < icc.resp_len && ((pcb >> 4) & 1) == icc.ns)
+			icc_chain();
+		else
+			icc_repeat();
+		return;
+	}
+
+	/* I-block */
+	if (((pcb >> 6) & 1) != icc.nr) {
+		/* A repeat of something we already have */
+		icc_repeat();
+		return;
+	}
+	icc.nr ^= 1;
+	memcpy(icc.apdu + icc.apdu_len, block + DATA, block[LEN]);
+	icc.apdu_len += block[LEN];
+
+	if (pcb & T1_MORE_BLOCKS) {
+		icc_send(T1_R_BLOCK | (icc.nr << 4), NULL, 0);
+		return;
+	}
+
+	for (n = 0; n < icc.apdu_len; n++)
+		icc.resp[n] = ~icc.apdu[n];
+	icc.resp[n++] = 0x90;
+	icc.resp[n++] = 0x00;
+	icc.resp_len = n;
+	icc.resp_pos = 0;
+	icc.apdu_len = 0;
+	icc_chain();
+}
+
+/*
+ * Fake reader driver
+ */
+static int fake_send(ifd_reader_t * reader, unsigned int dad,
+		     const unsigned char *buffer, size_t len)
+{
+	icc_receive(buffer, len);
+	return len;
+}
+
+static int fake_recv(ifd_reader_t * reader, unsigned int dad,
+		     unsigned char *buffer, size_t len, long timeout)
+{
+	unsigned int n = icc.reply_len;
+
+	if (n > len)
+		n = len;
+	memcpy(buffer, icc.reply, n);
+
+	icc.count_out++;
+	if (icc.always_bad || (icc.bad_out & (1UL << (icc.count_out - 1))))
+		buffer[n - 1] ^= 0xFF;
+	return n;
+}
+
+static struct ifd_driver_ops fake_ops;
+static ifd_driver_t fake_driver = { "fake", &fake_ops };
+static struct ifd_device fake_device;
+static ifd_reader_t fake_reader;
+
+static int failed;
+
+static long t1_stat(ifd_protocol_t * p, int type)
+{
+	long value = -1;
+
+	ifd_protocol_get_parameter(p, type, &value);
+	return value;
+}
+
+/*
+ * Run one exchange and check the outcome
+ */
+static void check(const char *name, unsigned long bad_in,
+		  unsigned long bad_out, size_t apdu_len, int expect_resyncs)
+{
+	unsigned char apdu[300], resp[300];
+	ifd_protocol_t *p;
+	unsigned int n;
+	int rc, ok;
+
+	memset(&icc, 0, sizeof(icc));
+	icc.bad_in = bad_in;
+	icc.bad_out = bad_out;
+
+	p = ifd_protocol_new(IFD_PROTOCOL_T1, &fake_reader, 0);
+	if (p == NULL) {
+		printf("FAIL %s: can't create protocol\n", name);
+		failed++;
+		return;
+	}
+
+	for (n = 0; n < apdu_len; n++)
+		apdu[n] = n;
+	rc = ifd_protocol_transceive(p, 0, apdu, apdu_len, resp,
+				     sizeof(resp));
+
+	ok = rc == (int)apdu_len + 2
+	    && t1_stat(p, IFD_PROTOCOL_T1_STAT_RESYNCS) == expect_resyncs;
+	for (n = 0; ok && n < apdu_len; n++)
+		ok = resp[n] == (unsigned char)~apdu[n];
+	if (ok)
+		ok = resp[apdu_len] == 0x90 && resp[apdu_len + 1] == 0x00;
+
+	printf("%s %s: rc=%d errors=%ld naks=%ld retransmits=%ld "
+	       "resyncs=%ld\n", ok ? "ok  " : "FAIL", name, rc,
+	       t1_stat(p, IFD_PROTOCOL_T1_STAT_ERRORS),
+	       t1_stat(p, IFD_PROTOCOL_T1_STAT_NAKS),
+	       t1_stat(p, IFD_PROTOCOL_T1_STAT_RETRANSMITS),
+	       t1_stat(p, IFD_PROTOCOL_T1_STAT_RESYNCS));
+	if (!ok)
+		failed++;
+	ifd_protocol_free(p);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char apdu[5] = { 0x00, 0xA4, 0x00, 0x00, 0x00 }, resp[16];
+	ifd_protocol_t *p;
+	int rc;
+
+	fake_ops.send = fake_send;
+	fake_ops.recv = fake_recv;
+	fake_device.type = IFD_DEVICE_TYPE_OTHER;
+	fake_reader.driver = &fake_driver;
+	fake_reader.device = &fake_device;
+	ifd_protocol_register(&ifd_protocol_t1);
+
+	check("clean line", 0, 0, 5, 0);
+
+	/* Our I-block is corrupted, and so is the R-block the
+	 * ICC answers with. We NAK that; the ICC repeats its
+	 * R-block, and we have to repeat the I-block rather
+	 * than the NAK. */
+	check("lost I-block and R-block", 1 << 0, 1 << 0, 5, 0);
+
+	/* The response is corrupted once and NAKed */
+	check("corrupted response", 0, 1 << 0, 5, 0);
+
+	/* Chained command; the second block gets lost, and the
+	 * ICC's request to repeat it gets lost, too */
+	check("chained, lost second block", 1 << 1, 1 << 1, 100, 0);
+
+	/* The chained response loses a block, and our request
+	 * to repeat it gets lost, too */
+	check("chained response, lost block", 1 << 4, 1 << 5, 100, 0);
+
+	/* Three bad responses in a row exhaust the retries, and
+	 * resynchronization restarts the APDU */
+	check("too many errors", 0, 0xF, 5, 1);
+
+	/* Nothing gets through at all: give up, mark the
+	 * protocol dead */
+	memset(&icc, 0, sizeof(icc));
+	icc.always_bad = 1;
+	p = ifd_protocol_new(IFD_PROTOCOL_T1, &fake_reader, 0);
+	rc = ifd_protocol_transceive(p, 0, apdu, sizeof(apdu), resp,
+				     sizeof(resp));
+	if (rc >= 0 || t1_stat(p, IFD_PROTOCOL_RESET_REQUIRED) != 1) {
+		printf("FAIL dead line: rc=%d\n", rc);
+		failed++;
+	} else {
+		printf("ok   dead line: rc=%d resyncs=%ld\n", rc,
+		       t1_stat(p, IFD_PROTOCOL_T1_STAT_RESYNCS));
+	}
+	ifd_protocol_free(p);
+
+	return failed ? 1 : 0;
+}
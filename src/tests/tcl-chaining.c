@@ -0,0 +1,322 @@
+/*
+ * T=CL (ISO 14443-4) block chaining against a simulated PICC
+ *
+ * The PICC lives behind a fake reader driver. Its ATS announces a
+ * 16 byte frame size, so that any real APDU has to be chained,
+ * and it chains its responses as well. Replies can be dropped or
+ * corrupted on the way back to check recovery, and a PICC that
+ * keeps asking for more time must not keep us from giving up.
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define I_BLOCK		0x02
+#define R_BLOCK		0xA2
+#define S_BLOCK		0xC2
+#define CHAINING	0x10
+#define R_NAK		0x10
+#define S_WTX		0x30
+#define BN(pcb)		((pcb) & 0x01)
+
+#define PICC_FSD	16	/* frames we send are this big at most */
+#define CRC_A_INIT	0x6363
+
+/* TL, T0 (TA, TB, TC follow; FSCI 0 = 16 bytes), TA, TB (FWI 4),
+ * TC, and two historical bytes */
+static const unsigned char picc_ats[] = { 0x07, 0x70, 0x00, 0x40, 0x02,
+	0x12, 0x34 };
+
+/* Simulated PICC */
+static struct {
+	unsigned char bn;
+	unsigned char reply[64];
+	unsigned int reply_len;
+	unsigned char last[64];
+	unsigned int last_len;
+	unsigned char apdu[1024];
+	unsigned int apdu_len;
+	unsigned char resp[1024];
+	unsigned int resp_len, resp_pos;
+
+	unsigned int send_wtx;	/* WTX requests before answering */
+	int deselected;
+
+	/* Replies to drop or corrupt, counting from 1, as bit masks */
+	unsigned long drop, corrupt;
+	unsigned int count;
+} picc;
+
+static void picc_send(unsigned char pcb, const unsigned char *data,
+		      unsigned int len)
+{
+	unsigned short crc;
+
+	picc.reply[0] = pcb;
+	memcpy(picc.reply + 1, data, len);
+	len++;
+	crc = csum_crc_update(CRC_A_INIT, picc.reply, len);
+	picc.reply[len++] = crc & 0xFF;
+	picc.reply[len++] = crc >> 8;
+	picc.reply_len = len;
+	memcpy(picc.last, picc.reply, len);
+	picc.last_len = len;
+}
+
+static void picc_repeat(void)
+{
+	memcpy(picc.reply, picc.last, picc.last_len);
+	picc.reply_len = picc.last_len;
+}
+
+/*
+ * Send the next piece of the response
+ */
+static void picc_chain(void)
+{
+	unsigned int n = picc.resp_len - picc.resp_pos;
+	unsigned char pcb = I_BLOCK | picc.bn;
+
+	if (n > PICC_FSD - 3) {
+		n = PICC_FSD - 3;
+		pcb |= CHAINING;
+	}
+	picc_send(pcb, picc.resp + picc.resp_pos, n);
+	picc.resp_pos += n;
+}
+
+static void picc_wtx(void)
+{
+	unsigned char inf = 2;
+
+	picc.send_wtx--;
+	picc_send(S_BLOCK | S_WTX, &inf, 1);
+}
+
+/*
+ * The PICC's side of the protocol. The response APDU is the
+ * command with every byte inverted, followed by 90 00.
+ */
+static void picc_receive(const unsigned char *frame, size_t len)
+{
+	unsigned char pcb;
+	unsigned short crc;
+	unsigned int n;
+
+	picc.reply_len = 0;
+	if (len < 3)
+		return;
+	len -= 2;
+	crc = csum_crc_update(CRC_A_INIT, frame, len);
+	if (frame[len] != (crc & 0xFF) || frame[len + 1] != (crc >> 8))
+		return;		/* PICCs don't answer bad frames */
+
+	pcb = frame[0];
+	if ((pcb & 0xC0) == 0xC0) {
+		if ((pcb & 0x30) == 0) {
+			/* DESELECT */
+			picc.deselected = 1;
+			picc_send(S_BLOCK, NULL, 0);
+		} else if ((pcb & 0x30) == S_WTX) {
+			/* WTX confirmed; ask for more, or answer */
+			if (picc.send_wtx)
+				picc_wtx();
+			else
+				picc_chain();
+		}
+		return;
+	}
+
+	if ((pcb & 0xC0) == 0x80) {
+		/* R(ACK) for our current block asks for the next
+		 * block of our chain; anything else for a repeat */
+		if (!(pcb & R_NAK) && BN(pcb) != BN(picc.last[0])
+		    && picc.resp_pos < picc.resp_len) {
+			picc.bn ^= 1;
+			picc_chain();
+		} else
+			picc_repeat();
+		return;
+	}
+
+	/* I-block */
+	if (BN(pcb) != picc.bn) {
+		picc_repeat();
+		return;
+	}
+	memcpy(picc.apdu + picc.apdu_len, frame + 1, len - 1);
+	picc.apdu_len += len - 1;
+
+	if (pcb & CHAINING) {
+		picc_send(R_BLOCK | picc.bn, NULL, 0);
+		picc.bn ^= 1;
+		return;
+	}
+
+	for (n = 0; n < picc.apdu_len; n++)
+		picc.resp[n] = ~picc.apdu[n];
+	picc.resp[n++] = 0x90;
+	picc.resp[n++] = 0x00;
+	picc.resp_len = n;
+	picc.resp_pos = 0;
+	picc.apdu_len = 0;
+
+	if (picc.send_wtx) {
+		picc_wtx();
+		return;
+	}
+	picc_chain();
+}
+
+/*
+ * Fake reader driver
+ */
+static int fake_send(ifd_reader_t * reader, unsigned int dad,
+		     const unsigned char *buffer, size_t len)
+{
+	picc_receive(buffer, len);
+	return len;
+}
+
+static int fake_recv(ifd_reader_t * reader, unsigned int dad,
+		     unsigned char *buffer, size_t len, long timeout)
+{
+	unsigned int n = picc.reply_len, bit;
+
+	bit = 1UL << picc.count++;
+	if (n == 0 || (picc.drop & bit))
+		return IFD_ERROR_TIMEOUT;
+	if (n > len)
+		n = len;
+	memcpy(buffer, picc.reply, n);
+	if (picc.corrupt & bit)
+		buffer[n - 1] ^= 0xFF;
+	return n;
+}
+
+static struct ifd_driver_ops fake_ops;
+static ifd_driver_t fake_driver = { "fake", &fake_ops };
+static struct ifd_device fake_device;
+static ifd_reader_t fake_reader;
+
+static unsigned int abort_after;	/* frames until the client gives up */
+static int failed;
+
+static int fake_check_abort(ifd_reader_t * reader)
+{
+	return abort_after && picc.count >= abort_after;
+}
+
+static void check(const char *name, size_t apdu_len, int wtx,
+		  unsigned long drop, unsigned long corrupt)
+{
+	unsigned char apdu[300], resp[300];
+	ifd_protocol_t *p;
+	unsigned int n;
+	long fsc = 0;
+	int rc, ok;
+
+	memset(&picc, 0, sizeof(picc));
+	picc.send_wtx = wtx;
+	picc.drop = drop;
+	picc.corrupt = corrupt;
+
+	p = ifd_protocol_new(IFD_PROTOCOL_TCL, &fake_reader, 0);
+	if (p == NULL || tcl_parse_ats(p, picc_ats, sizeof(picc_ats)) < 0
+	    || ifd_protocol_set_parameter(p, IFD_PROTOCOL_TCL_CRC, 1) < 0) {
+		printf("FAIL %s: can't set up protocol\n", name);
+		failed++;
+		return;
+	}
+	ifd_protocol_get_parameter(p, IFD_PROTOCOL_TCL_FSC, &fsc);
+
+	for (n = 0; n < apdu_len; n++)
+		apdu[n] = n;
+	rc = ifd_protocol_transceive(p, 0, apdu, apdu_len, resp,
+				     sizeof(resp));
+
+	ok = fsc == 16 && rc == (int)apdu_len + 2;
+	for (n = 0; ok && n < apdu_len; n++)
+		ok = resp[n] == (unsigned char)~apdu[n];
+	if (ok)
+		ok = resp[apdu_len] == 0x90 && resp[apdu_len + 1] == 0x00;
+
+	/* Releasing the protocol must deselect the PICC */
+	ifd_protocol_free(p);
+	if (!picc.deselected)
+		ok = 0;
+
+	printf("%s %s: rc=%d, %u frames, %sdeselected\n",
+	       ok ? "ok  " : "FAIL", name, rc, picc.count,
+	       picc.deselected ? "" : "not ");
+	if (!ok)
+		failed++;
+}
+
+/*
+ * A PICC that asks for one WTX after another. The client gives
+ * up long before it would answer.
+ */
+static void check_abort(const char *name)
+{
+	unsigned char apdu[5] = { 0x00, 0xB0, 0x00, 0x00, 0x00 }, resp[300];
+	ifd_protocol_t *p;
+	int rc, ok;
+
+	memset(&picc, 0, sizeof(picc));
+	picc.send_wtx = 50;
+	abort_after = 10;
+
+	p = ifd_protocol_new(IFD_PROTOCOL_TCL, &fake_reader, 0);
+	if (p == NULL || tcl_parse_ats(p, picc_ats, sizeof(picc_ats)) < 0
+	    || ifd_protocol_set_parameter(p, IFD_PROTOCOL_TCL_CRC, 1) < 0) {
+		printf("FAIL %s: can't set up protocol\n", name);
+		failed++;
+		abort_after = 0;
+		return;
+	}
+
+	rc = ifd_protocol_transceive(p, 0, apdu, sizeof(apdu), resp,
+				     sizeof(resp));
+	ok = rc == IFD_ERROR_USER_ABORT && picc.count == abort_after;
+	ifd_protocol_free(p);
+	abort_after = 0;
+
+	printf("%s %s: rc=%d, %u frames\n", ok ? "ok  " : "FAIL", name, rc,
+	       picc.count);
+	if (!ok)
+		failed++;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned char zero[2] = { 0, 0 };
+	unsigned short crc;
+
+	fake_ops.send = fake_send;
+	fake_ops.recv = fake_recv;
+	fake_device.type = IFD_DEVICE_TYPE_OTHER;
+	fake_reader.driver = &fake_driver;
+	fake_reader.device = &fake_device;
+	fake_reader.check_abort = fake_check_abort;
+	ifd_protocol_register(&ifd_protocol_tcl);
+
+	/* ISO 14443-3 Annex B: CRC_A of 00 00 is A0 1E */
+	crc = csum_crc_update(CRC_A_INIT, zero, 2);
+	if ((crc & 0xFF) != 0xA0 || (crc >> 8) != 0x1E) {
+		printf("FAIL CRC_A: %04x\n", crc);
+		failed++;
+	}
+
+	check("single frame", 5, 0, 0, 0);
+	check("chained both ways", 40, 0, 0, 0);
+	check("chained, WTX", 40, 1, 0, 0);
+	check("chained, lost R(ACK)", 40, 0, 1 << 1, 0);
+	check("chained, corrupted response", 40, 0, 0, 1 << 4);
+	check("long chain", 250, 0, 1 << 7, 1 << 20);
+	check_abort("abort during WTX");
+
+	return failed ? 1 : 0;
+}
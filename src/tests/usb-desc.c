@@ -0,0 +1,364 @@
+/*
+ * Check that the descriptors the kernel keeps for a USB device
+ * parse to the same thing as those read from the device with
+ * control transfers, and that blobs we can't trust are passed
+ * over for the control transfers. The sysfs file and the device
+ * are faked at the open and usbdevfs ioctl level.
+ */
+
+#include "internal.h"
+#include "usb-descriptors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+/* Exit status telling automake that the test was skipped */
+#define SKIPPED		77
+
+#ifdef __linux__
+/*
+ * A CCID reader with two configurations, as read from
+ * /sys/bus/usb/devices/.../descriptors. The second one has
+ * a vendor interface with two alternate settings.
+ */
+static const unsigned char reader_desc[] = {
+	/* Device */
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08,
+	0xe6, 0x04, 0x16, 0x51, 0x02, 0x05, 0x01, 0x02,
+	0x03, 0x02,
+	/* Configuration 1 */
+	0x09, 0x02, 0x5d, 0x00, 0x01, 0x01, 0x00, 0xa0,
+	0x32,
+	0x09, 0x04, 0x00, 0x00, 0x03, 0x0b, 0x00, 0x00,
+	0x00,
+	/* CCID class descriptor */
+	0x36, 0x21, 0x00, 0x01, 0x00, 0x07, 0x03, 0x00,
+	0x00, 0x00, 0xa0, 0x0f, 0x00, 0x00, 0xa0, 0x0f,
+	0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00, 0x3c,
+	0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfe, 0x00,
+	0x04, 0x00, 0x0f, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xff, 0xff, 0x01, 0x01,
+	0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x82, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x83, 0x03, 0x08, 0x00, 0x10,
+	/* Configuration 2 */
+	0x09, 0x02, 0x3b, 0x00, 0x01, 0x02, 0x00, 0x80,
+	0x32,
+	0x09, 0x04, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00,
+	0x00,
+	0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x82, 0x02, 0x40, 0x00, 0x00,
+	0x09, 0x04, 0x00, 0x01, 0x02, 0xff, 0x00, 0x00,
+	0x00,
+	0x07, 0x05, 0x03, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x84, 0x02, 0x40, 0x00, 0x00,
+	0x04, 0x25, 0x01, 0x00,
+};
+
+#define DEVICE_LEN	18
+#define CONFIG1_LEN	0x5d
+#define CONFIG2_LEN	0x3b
+
+/*
+ * What the sysfs file holds; NULL if there is none
+ */
+static const unsigned char *blob;
+static size_t blob_len;
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	int mode, fds[2];
+
+	va_start(ap, flags);
+	mode = (flags & O_CREAT) ? va_arg(ap, int) : 0;
+	va_end(ap);
+
+	if (strncmp(path, "/sys/dev/char/", 14)
+	    || !strstr(path, "/descriptors"))
+		return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+
+	if (blob == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (pipe(fds) < 0)
+		return -1;
+	if (write(fds[1], blob, blob_len) != (ssize_t) blob_len) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	close(fds[1]);
+	return fds[0];
+}
+
+/*
+ * The device itself answers GET_DESCRIPTOR requests
+ */
+static int usb_fd = -1;
+static unsigned int controls;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct usbdevfs_ctrltransfer *ctrl;
+	const unsigned char *desc;
+	unsigned int len, n;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	/* Opening the device asks for a disconnect signal */
+	if (request == USBDEVFS_DISCSIGNAL)
+		usb_fd = fd;
+	if (fd != usb_fd)
+		return syscall(SYS_ioctl, fd, request, arg);
+	if (request != USBDEVFS_CONTROL)
+		return 0;
+
+	ctrl = (struct usbdevfs_ctrltransfer *)arg;
+	controls++;
+	if (ctrl->bRequestType != 0x80 || ctrl->bRequest != 0x06)
+		goto stall;
+
+	switch (ctrl->wValue >> 8) {
+	case IFD_USB_DT_DEVICE:
+		desc = reader_desc;
+		len = DEVICE_LEN;
+		break;
+	case IFD_USB_DT_CONFIG:
+		desc = reader_desc + DEVICE_LEN;
+		len = CONFIG1_LEN;
+		for (n = ctrl->wValue & 0xFF; n; n--) {
+			if (desc == reader_desc + DEVICE_LEN + CONFIG1_LEN)
+				goto stall;
+			desc += len;
+			len = CONFIG2_LEN;
+		}
+		break;
+	default:
+		goto stall;
+	}
+	if (len > ctrl->wLength)
+		len = ctrl->wLength;
+	memcpy(ctrl->data, desc, len);
+	return len;
+
+      stall:
+	errno = EPIPE;
+	return -1;
+}
+
+static unsigned int failed;
+
+#define DIFF(what, a, b) \
+	do { \
+		if ((a) != (b)) { \
+			printf("     %s: %d vs. %d\n", what, (int)(a), (int)(b)); \
+			return -1; \
+		} \
+	} while (0)
+
+static int compare_extra(const unsigned char *a, int alen,
+			 const unsigned char *b, int blen)
+{
+	DIFF("extra length", alen, blen);
+	if (alen > 0 && memcmp(a, b, alen)) {
+		printf("     extra descriptors differ\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int compare_altsetting(struct ifd_usb_interface_descriptor *a,
+			      struct ifd_usb_interface_descriptor *b)
+{
+	struct ifd_usb_endpoint_descriptor *ea, *eb;
+	int n;
+
+	DIFF("bInterfaceNumber", a->bInterfaceNumber, b->bInterfaceNumber);
+	DIFF("bAlternateSetting", a->bAlternateSetting,
+	     b->bAlternateSetting);
+	DIFF("bNumEndpoints", a->bNumEndpoints, b->bNumEndpoints);
+	DIFF("bInterfaceClass", a->bInterfaceClass, b->bInterfaceClass);
+	DIFF("bInterfaceSubClass", a->bInterfaceSubClass,
+	     b->bInterfaceSubClass);
+	DIFF("bInterfaceProtocol", a->bInterfaceProtocol,
+	     b->bInterfaceProtocol);
+	DIFF("iInterface", a->iInterface, b->iInterface);
+	if (compare_extra(a->extra, a->extralen, b->extra, b->extralen))
+		return -1;
+
+	for (n = 0; n < a->bNumEndpoints; n++) {
+		ea = &a->endpoint[n];
+		eb = &b->endpoint[n];
+		DIFF("bEndpointAddress", ea->bEndpointAddress,
+		     eb->bEndpointAddress);
+		DIFF("bmAttributes", ea->bmAttributes, eb->bmAttributes);
+		DIFF("wMaxPacketSize", ea->wMaxPacketSize, eb->wMaxPacketSize);
+		DIFF("bInterval", ea->bInterval, eb->bInterval);
+		if (compare_extra(ea->extra, ea->extralen, eb->extra,
+				  eb->extralen))
+			return -1;
+	}
+	return 0;
+}
+
+static int compare_config(struct ifd_usb_config_descriptor *a,
+			  struct ifd_usb_config_descriptor *b)
+{
+	int i, j;
+
+	DIFF("wTotalLength", a->wTotalLength, b->wTotalLength);
+	DIFF("bNumInterfaces", a->bNumInterfaces, b->bNumInterfaces);
+	DIFF("bConfigurationValue", a->bConfigurationValue,
+	     b->bConfigurationValue);
+	DIFF("bmAttributes", a->bmAttributes, b->bmAttributes);
+	DIFF("MaxPower", a->MaxPower, b->MaxPower);
+	if (compare_extra(a->extra, a->extralen, b->extra, b->extralen))
+		return -1;
+
+	for (i = 0; i < a->bNumInterfaces; i++) {
+		DIFF("num_altsetting", a->interface[i].num_altsetting,
+		     b->interface[i].num_altsetting);
+		for (j = 0; j < a->interface[i].num_altsetting; j++) {
+			if (compare_altsetting(&a->interface[i].altsetting[j],
+					       &b->interface[i].altsetting[j]))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* What the control transfers give us */
+static struct ifd_usb_device_descriptor ref_device;
+static struct ifd_usb_config_descriptor ref_config[2];
+
+static int reference(ifd_device_t * dev)
+{
+	int n;
+
+	blob = NULL;
+	if (ifd_usb_get_device(dev, &ref_device)) {
+		printf("FAIL reference: no device descriptor\n");
+		return -1;
+	}
+	for (n = 0; n < 2; n++) {
+		if (ifd_usb_get_config(dev, n, &ref_config[n])) {
+			printf("FAIL reference: no configuration %d\n", n);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Parse the descriptors with data in sysfs. cached tells
+ * which of device, config 1 and config 2 must come from
+ * there, without any control transfers.
+ */
+static void check(const char *name, const unsigned char *data, size_t len,
+		  ifd_device_t * dev, int cached[3])
+{
+	struct ifd_usb_device_descriptor d;
+	struct ifd_usb_config_descriptor c;
+	int n, good = 1;
+
+	blob = data;
+	blob_len = len;
+
+	controls = 0;
+	if (ifd_usb_get_device(dev, &d)
+	    || memcmp(&d, &ref_device, sizeof(d))) {
+		printf("     device descriptor differs\n");
+		good = 0;
+	} else if ((controls == 0) != cached[0]) {
+		printf("     device: %u control transfers\n", controls);
+		good = 0;
+	}
+
+	for (n = 0; n < 2; n++) {
+		controls = 0;
+		if (ifd_usb_get_config(dev, n, &c)) {
+			printf("     no configuration %d\n", n);
+			good = 0;
+			continue;
+		}
+		if (compare_config(&c, &ref_config[n]))
+			good = 0;
+		else if ((controls == 0) != cached[n + 1]) {
+			printf("     config %d: %u control transfers\n", n,
+			       controls);
+			good = 0;
+		}
+		ifd_usb_free_configuration(&c);
+	}
+
+	/* No such configuration, either way */
+	if (ifd_usb_get_config(dev, 2, &c) == 0) {
+		printf("     found configuration 2\n");
+		ifd_usb_free_configuration(&c);
+		good = 0;
+	}
+
+	printf("%s %s\n", good ? "ok  " : "FAIL", name);
+	if (!good)
+		failed++;
+}
+
+int main(int argc, char **argv)
+{
+	static int all[3] = { 1, 1, 1 }, first[3] = { 1, 1, 0 };
+	static int none[3] = { 0, 0, 0 };
+	unsigned char buf[sizeof(reader_desc)];
+	ifd_device_t *dev;
+
+	ct_config.suppress_errors = 1;
+	if (!(dev = ifd_open_usb("/dev/null"))) {
+		printf("FAIL open: can't open fake USB device\n");
+		return 1;
+	}
+	if (reference(dev) < 0)
+		return 1;
+
+	check("multi-config", reader_desc, sizeof(reader_desc), dev, all);
+
+	/* Cut off in the middle of the second configuration */
+	check("truncated", reader_desc, DEVICE_LEN + CONFIG1_LEN + 20, dev,
+	      first);
+	/* Cut off in the middle of the device descriptor */
+	check("truncated device", reader_desc, DEVICE_LEN - 2, dev, none);
+
+	/* Configurations first */
+	memcpy(buf, reader_desc + DEVICE_LEN, sizeof(buf) - DEVICE_LEN);
+	memcpy(buf + sizeof(buf) - DEVICE_LEN, reader_desc, DEVICE_LEN);
+	check("non-device-first", buf, sizeof(buf), dev, none);
+
+	/* Nothing in sysfs */
+	check("no blob", NULL, 0, dev, none);
+
+	ifd_usb_free_configuration(&ref_config[0]);
+	ifd_usb_free_configuration(&ref_config[1]);
+	ifd_device_close(dev);
+	return failed ? 1 : 0;
+}
+#else
+int main(int argc, char **argv)
+{
+	printf("skip: no usbdevfs here\n");
+	return SKIPPED;
+}
+#endif
@@ -0,0 +1,173 @@
+/*
+ * How long the token drivers take to notice that a token is
+ * ready: the fixed pauses and poll loops they used to have vs.
+ * ifd_wait_until. The token is simulated; it becomes ready a
+ * given time after the command. Not run by "make check"; run it
+ * by hand:
+ *
+ *	./wait-bench [repetitions]
+ */
+
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+typedef struct fake_token {
+	struct timeval ready;
+	unsigned int probes;
+} fake_token_t;
+
+static void token_start(fake_token_t * tok, long busy_us)
+{
+	gettimeofday(&tok->ready, NULL);
+	tok->ready.tv_usec += busy_us;
+	tok->ready.tv_sec += tok->ready.tv_usec / 1000000;
+	tok->ready.tv_usec %= 1000000;
+	tok->probes = 0;
+}
+
+/* What a status request would tell us */
+static int token_probe(void *arg)
+{
+	fake_token_t *tok = (fake_token_t *) arg;
+	struct timeval now;
+
+	tok->probes++;
+	gettimeofday(&now, NULL);
+	return timercmp(&now, &tok->ready, >=);
+}
+
+/* A read that blocks until the token answers */
+static void token_block(fake_token_t * tok)
+{
+	struct timeval now, delta;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, &tok->ready, <)) {
+		timersub(&tok->ready, &now, &delta);
+		usleep(delta.tv_sec * 1000000 + delta.tv_usec);
+	}
+	tok->probes++;
+}
+
+/* Probe, and sleep between probes */
+static void poll_every(fake_token_t * tok, long step_us)
+{
+	while (!token_probe(tok))
+		usleep(step_us);
+}
+
+/*
+ * What the drivers did before: egate slept 100ms before reset,
+ * after it, and before reading the ATR, and polled its busy
+ * status every 100us; eutron retried reads every 100ms; rutoken
+ * polled every 10ms; cyberjack slept 100ms before a read that
+ * would have blocked until the reply anyway.
+ */
+static void old_egate_reset(fake_token_t * tok)
+{
+	usleep(100000);
+	usleep(100000);
+	usleep(100000);
+	token_probe(tok);
+}
+
+static void old_egate_apdu(fake_token_t * tok)
+{
+	poll_every(tok, 100);
+}
+
+static void old_eutron(fake_token_t * tok)
+{
+	poll_every(tok, 100000);
+}
+
+static void old_rutoken(fake_token_t * tok)
+{
+	poll_every(tok, 10000);
+}
+
+static void old_cyberjack(fake_token_t * tok)
+{
+	usleep(100000);
+	token_block(tok);
+}
+
+/* What they do now */
+static void new_wait(fake_token_t * tok)
+{
+	ifd_wait_until(token_probe, tok, 10000);
+}
+
+static const struct scenario {
+	const char *name;
+	void (*old_wait) (fake_token_t *);
+	void (*new_wait) (fake_token_t *);
+} scenarios[] = {
+	{ "egate reset", old_egate_reset, new_wait },
+	{ "egate apdu", old_egate_apdu, new_wait },
+	{ "eutron", old_eutron, new_wait },
+	{ "rutoken", old_rutoken, new_wait },
+	{ "cyberjack", old_cyberjack, token_block },
+};
+
+static const long busy_times[] = { 100, 1000, 10000, 50000 };
+
+#define NUM(a)	(sizeof(a) / sizeof((a)[0]))
+
+static double elapsed_ms(struct timeval *begin)
+{
+	struct timeval now, delta;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, begin, &delta);
+	return delta.tv_sec * 1e3 + delta.tv_usec / 1e3;
+}
+
+static double measure(void (*wait) (fake_token_t *), long busy_us,
+		      unsigned int reps, unsigned int *probes)
+{
+	fake_token_t tok;
+	struct timeval begin;
+	double total = 0;
+	unsigned int n;
+
+	*probes = 0;
+	for (n = 0; n < reps; n++) {
+		token_start(&tok, busy_us);
+		gettimeofday(&begin, NULL);
+		wait(&tok);
+		total += elapsed_ms(&begin);
+		*probes += tok.probes;
+	}
+	*probes /= reps;
+	return total / reps;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int reps = 5, i, j, old_probes, new_probes;
+	double old_ms, new_ms;
+
+	if (argc > 1)
+		reps = atoi(argv[1]);
+	if (reps == 0)
+		reps = 1;
+
+	printf("%-12s %8s %10s %6s %10s %6s\n", "driver", "busy",
+	       "before", "probes", "after", "probes");
+	for (i = 0; i < NUM(scenarios); i++) {
+		for (j = 0; j < NUM(busy_times); j++) {
+			old_ms = measure(scenarios[i].old_wait,
+					 busy_times[j], reps, &old_probes);
+			new_ms = measure(scenarios[i].new_wait,
+					 busy_times[j], reps, &new_probes);
+			printf("%-12s %6.1fms %8.1fms %6u %8.1fms %6u\n",
+			       scenarios[i].name, busy_times[j] / 1000.0,
+			       old_ms, old_probes, new_ms, new_probes);
+		}
+	}
+	return 0;
+}
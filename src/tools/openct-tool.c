@@ -10,11 +10,15 @@
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
+#include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <openct/openct.h>
 #include <openct/logging.h>
 #include <openct/error.h>
@@ -24,6 +28,7 @@ static void version(void);
 static int do_reset(ct_handle *, unsigned char *, size_t);
 static void do_select_mf(ct_handle * reader);
 static void do_read_memory(ct_handle *, unsigned int, unsigned int);
+static int do_bench(ct_handle *, unsigned int, unsigned int);
 static void print_reader(ct_handle * h);
 static void print_reader_info(ct_info_t * info);
 static void print_atr(ct_handle *, unsigned char *, size_t);
@@ -42,6 +47,7 @@ enum {
 	CMD_ATR,
 	CMD_MF,
 	CMD_READ,
+	CMD_BENCH,
 	CMD_VERSION
 };
 
@@ -93,6 +99,8 @@ int main(int argc, char **argv)
 		opt_command = CMD_MF;
 	else if (!strcmp(cmd, "read"))
 		opt_command = CMD_READ;
+	else if (!strcmp(cmd, "bench"))
+		opt_command = CMD_BENCH;
 	else {
 		fprintf(stderr, "Unknown command \"%s\"\n", cmd);
 		usage(1);
@@ -151,6 +159,16 @@ int main(int argc, char **argv)
 	printf("Detected ");
 	print_reader(h);
 
+	if (opt_command == CMD_BENCH) {
+		unsigned int threads = 4, calls = 1000;
+
+		if (optind < argc)
+			threads = strtoul(argv[optind++], NULL, 0);
+		if (optind < argc)
+			calls = strtoul(argv[optind++], NULL, 0);
+		return do_bench(h, threads, calls);
+	}
+
 	if ((rc = ct_card_lock(h, opt_slot, IFD_LOCK_SHARED, &lock)) < 0) {
 		fprintf(stderr, "ct_card_lock: err=%d\n", rc);
 		exit(1);
@@ -207,7 +225,9 @@ static void usage(int exval)
 		" wait  wait for card to be inserted\n"
 		" rwait wait for reader to be attached\n"
 		" mf    try to select main folder of card\n"
-		" read  dump memory of synchronous card\n", OPENCT_CONF_PATH);
+		" read  dump memory of synchronous card\n"
+		" bench [threads [calls]] time APDUs and status polls\n",
+		OPENCT_CONF_PATH);
 	exit(exval);
 }
 
@@ -291,6 +311,261 @@ static void do_read_memory(ct_handle * h, unsigned int address,
 	dump(buffer, rc);
 }
 
+/*
+ * Benchmark the calls the PC/SC driver makes: every thread
+ * sends SELECT MF to the card in one of the reader's slots,
+ * round robin over the slots that have a card, while a
+ * thread per slot polls card status the way pcscd does.
+ */
+#define BENCH_POLL_INTERVAL	400000	/* usec */
+
+typedef struct bench_stats {
+	unsigned long *usec;
+	unsigned int count, size;
+	unsigned int errors;
+} bench_stats_t;
+
+typedef struct bench_thread {
+	ct_handle *h;
+	unsigned int slot;
+	unsigned int calls;
+	bench_stats_t stats;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+} bench_thread_t;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static int bench_done;
+#endif
+
+static unsigned long bench_usec(const struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000000UL
+	    + now.tv_usec - since->tv_usec;
+}
+
+static void bench_record(bench_stats_t * stats, const struct timeval *since)
+{
+	unsigned long *usec;
+
+	if (stats->count == stats->size) {
+		stats->size = stats->size ? 2 * stats->size : 1024;
+		usec = (unsigned long *)realloc(stats->usec,
+						stats->size * sizeof(*usec));
+		if (usec == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		stats->usec = usec;
+	}
+	stats->usec[stats->count++] = bench_usec(since);
+}
+
+static void *bench_transact(void *arg)
+{
+	bench_thread_t *t = (bench_thread_t *) arg;
+	unsigned char cmd[] =
+	    { 0x00, 0xA4, 0x00, 0x00, 0x02, 0x3f, 0x00, 0x00 };
+	unsigned char res[258];
+	struct timeval start;
+	unsigned int n;
+
+	for (n = 0; n < t->calls; n++) {
+		gettimeofday(&start, NULL);
+		if (ct_card_transact(t->h, t->slot, cmd, sizeof(cmd),
+				     res, sizeof(res)) < 0)
+			t->stats.errors++;
+		else
+			bench_record(&t->stats, &start);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_PTHREAD
+static void *bench_poll(void *arg)
+{
+	bench_thread_t *t = (bench_thread_t *) arg;
+	struct timeval start;
+	struct timespec until;
+	int status;
+
+	pthread_mutex_lock(&bench_mutex);
+	while (!bench_done) {
+		pthread_mutex_unlock(&bench_mutex);
+		gettimeofday(&start, NULL);
+		if (ct_card_status(t->h, t->slot, &status) < 0)
+			t->stats.errors++;
+		else
+			bench_record(&t->stats, &start);
+
+		until.tv_sec = start.tv_sec;
+		until.tv_nsec = (start.tv_usec + BENCH_POLL_INTERVAL) * 1000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_mutex_lock(&bench_mutex);
+		if (!bench_done)
+			pthread_cond_timedwait(&bench_cond, &bench_mutex,
+					       &until);
+	}
+	pthread_mutex_unlock(&bench_mutex);
+	return NULL;
+}
+#endif
+
+static int bench_compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char *name, bench_thread_t * t,
+			 unsigned int count, unsigned long elapsed)
+{
+	bench_stats_t all;
+	unsigned int n;
+
+	memset(&all, 0, sizeof(all));
+	for (n = 0; n < count; n++) {
+		all.usec = (unsigned long *)realloc(all.usec,
+						    (all.count +
+						     t[n].stats.count + 1) *
+						    sizeof(*all.usec));
+		if (all.usec == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memcpy(all.usec + all.count, t[n].stats.usec,
+		       t[n].stats.count * sizeof(*all.usec));
+		all.count += t[n].stats.count;
+		all.errors += t[n].stats.errors;
+	}
+
+	printf("%-8s %7u calls, %u errors", name, all.count, all.errors);
+	if (all.count) {
+		qsort(all.usec, all.count, sizeof(*all.usec), bench_compare);
+		printf(", %.1f calls/s\n"
+		       "         usec: p50 %lu, p90 %lu, p99 %lu, max %lu",
+		       all.count * 1e6 / (elapsed ? elapsed : 1),
+		       all.usec[all.count / 2],
+		       all.usec[all.count * 9 / 10],
+		       all.usec[all.count * 99 / 100],
+		       all.usec[all.count - 1]);
+	}
+	printf("\n");
+	free(all.usec);
+}
+
+static int do_bench(ct_handle * h, unsigned int threads, unsigned int calls)
+{
+	bench_thread_t *workers, *pollers;
+	unsigned int slots[OPENCT_MAX_SLOTS];
+	unsigned int n, nslots = 0;
+	unsigned char atr[64];
+	struct timeval start;
+	unsigned long elapsed;
+	ct_info_t info;
+	int status;
+
+	if (ct_reader_status(h, &info) < 0) {
+		fprintf(stderr, "ct_reader_status failed\n");
+		return 1;
+	}
+	for (n = 0; n < info.ct_slots && n < OPENCT_MAX_SLOTS; n++) {
+		if (ct_card_status(h, n, &status) < 0
+		    || !(status & IFD_CARD_PRESENT))
+			continue;
+		if (ct_card_reset(h, n, atr, sizeof(atr)) < 0) {
+			fprintf(stderr, "failed to reset card in slot %u\n",
+				n);
+			continue;
+		}
+		slots[nslots++] = n;
+	}
+	if (nslots == 0) {
+		fprintf(stderr, "No card present\n");
+		return 1;
+	}
+#ifndef HAVE_PTHREAD
+	threads = 1;
+#endif
+	if (threads == 0)
+		threads = 1;
+
+	workers = (bench_thread_t *) calloc(threads, sizeof(*workers));
+	pollers = (bench_thread_t *) calloc(nslots, sizeof(*pollers));
+	if (workers == NULL || pollers == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* Connect from this thread; libopenct's socket
+	 * handling isn't thread safe */
+	for (n = 0; n < threads + nslots; n++) {
+		bench_thread_t *t;
+
+		if (n < threads) {
+			t = &workers[n];
+			t->slot = slots[n % nslots];
+			t->calls = calls;
+		} else {
+			t = &pollers[n - threads];
+			t->slot = slots[n - threads];
+		}
+		if (!(t->h = ct_reader_connect(opt_reader))) {
+			fprintf(stderr, "Unable to connect to reader #%u\n",
+				opt_reader);
+			return 1;
+		}
+	}
+
+	printf("%u thread(s), %u calls each, %u slot(s)\n", threads, calls,
+	       nslots);
+	gettimeofday(&start, NULL);
+#ifdef HAVE_PTHREAD
+	for (n = 0; n < nslots; n++)
+		pthread_create(&pollers[n].thread, NULL, bench_poll,
+			       &pollers[n]);
+	for (n = 0; n < threads; n++)
+		pthread_create(&workers[n].thread, NULL, bench_transact,
+			       &workers[n]);
+	for (n = 0; n < threads; n++)
+		pthread_join(workers[n].thread, NULL);
+	elapsed = bench_usec(&start);
+	pthread_mutex_lock(&bench_mutex);
+	bench_done = 1;
+	pthread_cond_broadcast(&bench_cond);
+	pthread_mutex_unlock(&bench_mutex);
+	for (n = 0; n < nslots; n++)
+		pthread_join(pollers[n].thread, NULL);
+#else
+	bench_transact(&workers[0]);
+	elapsed = bench_usec(&start);
+#endif
+
+	bench_report("transact", workers, threads, elapsed);
+	bench_report("status", pollers, nslots, elapsed);
+
+	for (n = 0; n < threads; n++) {
+		ct_reader_disconnect(workers[n].h);
+		free(workers[n].stats.usec);
+	}
+	for (n = 0; n < nslots; n++) {
+		ct_reader_disconnect(pollers[n].h);
+		free(pollers[n].stats.usec);
+	}
+	free(workers);
+	free(pollers);
+	return 0;
+}
+
 static void print_reader(ct_handle * h)
 {
 	ct_info_t info;